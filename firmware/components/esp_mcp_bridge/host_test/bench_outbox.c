@@ -0,0 +1,281 @@
+/**
+ * @file bench_outbox.c
+ * @brief Host benchmark of the persistent outbox against a file standing in for flash
+ *
+ * Build and run on the development machine:
+ *
+ *   cc -O2 -I../src bench_outbox.c ../src/mcp_outbox.c -o bench_outbox
+ *   ./bench_outbox [messages] [in-flight] [sectors]
+ *
+ * Compares appending and acknowledging status messages through the flash
+ * log with the RAM-only copy the MQTT client makes anyway, and reports
+ * flash bytes and erases per message and the spread of erases across
+ * sectors. The file behaves like NOR flash: writes only clear bits, and a
+ * write that would set one is counted as an error. The run ends by cutting
+ * power at every write and erase of a short workload and checking that reopening
+ * keeps every acknowledged-or-not message exactly once and in order.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "mcp_outbox.h"
+
+#define SECTOR_SIZE 4096
+#define MAX_SECTORS 64
+#define ERASE_CYCLES 100000                     /**< Typical NOR endurance */
+
+typedef struct {
+    int fd;
+    uint64_t bytes_written;
+    uint32_t sector_erases[MAX_SECTORS];
+    uint32_t nor_violations;
+    long writes_left;                           /**< Power cut after this many writes (-1 = never) */
+} file_flash_t;
+
+static int flash_read(void *ctx, uint32_t offset, void *dst, size_t len) {
+    file_flash_t *flash = ctx;
+    return pread(flash->fd, dst, len, offset) == (ssize_t)len ? 0 : -1;
+}
+
+static int flash_write(void *ctx, uint32_t offset, const void *src, size_t len) {
+    file_flash_t *flash = ctx;
+    uint8_t old[SECTOR_SIZE];
+    const uint8_t *bytes = src;
+    if (len > sizeof(old) || pread(flash->fd, old, len, offset) != (ssize_t)len) {
+        return -1;
+    }
+
+    size_t programmed = len;
+    if (flash->writes_left == 0) {
+        return -1;
+    } else if (flash->writes_left > 0 && --flash->writes_left == 0) {
+        programmed = len / 2;                   // The cut lands in the middle of this write
+    }
+    for (size_t i = 0; i < programmed; i++) {
+        if ((old[i] & bytes[i]) != bytes[i]) {
+            flash->nor_violations++;
+        }
+        old[i] &= bytes[i];
+    }
+    flash->bytes_written += programmed;
+    return pwrite(flash->fd, old, programmed, offset) == (ssize_t)programmed && programmed == len ? 0 : -1;
+}
+
+static int flash_erase(void *ctx, uint32_t offset, size_t len) {
+    file_flash_t *flash = ctx;
+    uint8_t erased[SECTOR_SIZE];
+    memset(erased, 0xFF, sizeof(erased));
+    size_t erasing = SECTOR_SIZE;
+    if (flash->writes_left == 0) {
+        return -1;
+    } else if (flash->writes_left > 0 && --flash->writes_left == 0) {
+        erasing = SECTOR_SIZE / 2;
+    }
+    for (size_t pos = 0; pos < len; pos += SECTOR_SIZE) {
+        if (pwrite(flash->fd, erased, erasing, offset + pos) != (ssize_t)erasing || erasing != SECTOR_SIZE) {
+            return -1;
+        }
+        flash->sector_erases[(offset + pos) / SECTOR_SIZE]++;
+    }
+    return 0;
+}
+
+static int flash_open(file_flash_t *flash, const char *path, uint32_t sectors) {
+    memset(flash, 0, sizeof(*flash));
+    flash->writes_left = -1;
+    flash->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (flash->fd < 0) {
+        return -1;
+    }
+    flash_erase(flash, 0, sectors * SECTOR_SIZE);
+    memset(flash->sector_erases, 0, sizeof(flash->sector_erases));
+    return 0;
+}
+
+static mcp_outbox_storage_t flash_storage(file_flash_t *flash, uint32_t sectors) {
+    return (mcp_outbox_storage_t) {
+        .read = flash_read,
+        .write = flash_write,
+        .erase = flash_erase,
+        .sector_size = SECTOR_SIZE,
+        .sector_count = sectors,
+        .ctx = flash,
+    };
+}
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int make_message(char *buf, size_t size, long i) {
+    return snprintf(buf, size, "{\"device_id\":\"esp32_a1b2c3\",\"timestamp\":%ld,\"type\":\"error\","
+                    "\"error_type\":\"sensor_read\",\"message\":\"Sensor temperature_1 timed out\","
+                    "\"severity\":2}", 1760000000L + i);
+}
+
+/**
+ * @brief RAM-only baseline: the copy the MQTT client keeps until the PUBACK
+ */
+static double bench_ram(long messages, int in_flight) {
+    char message[256];
+    char **window = calloc(in_flight, sizeof(char *));
+    double start = now_s();
+    for (long i = 0; i < messages; i++) {
+        int len = make_message(message, sizeof(message), i);
+        free(window[i % in_flight]);
+        window[i % in_flight] = malloc(len);
+        memcpy(window[i % in_flight], message, len);
+    }
+    double elapsed = now_s() - start;
+    for (int i = 0; i < in_flight; i++) {
+        free(window[i]);
+    }
+    free(window);
+    return messages / elapsed;
+}
+
+static double bench_flash(long messages, int in_flight, uint32_t sectors, file_flash_t *flash) {
+    mcp_outbox_storage_t storage = flash_storage(flash, sectors);
+    mcp_outbox_t outbox;
+    if (mcp_outbox_open(&outbox, &storage, in_flight + 1, 512) != 0) {
+        return 0;
+    }
+
+    char message[256];
+    double start = now_s();
+    for (long i = 0; i < messages; i++) {
+        int len = make_message(message, sizeof(message), i);
+        if (mcp_outbox_append(&outbox, "devices/esp32_a1b2c3/error", message, len, 1) < 0) {
+            fprintf(stderr, "append %ld failed\n", i);
+            break;
+        }
+        if (outbox.count > in_flight) {
+            mcp_outbox_remove(&outbox, 0);
+        }
+    }
+    double elapsed = now_s() - start;
+    mcp_outbox_close(&outbox);
+    return messages / elapsed;
+}
+
+/**
+ * @brief Cut power at every write of a short workload and check what reopening recovers
+ */
+static int check_power_cuts(uint32_t sectors) {
+    const long messages = 200;
+    const int in_flight = 4;
+    int failures = 0;
+
+    for (long cut = 1; ; cut++) {
+        file_flash_t flash;
+        flash_open(&flash, "bench_outbox.bin", sectors);
+        mcp_outbox_storage_t storage = flash_storage(&flash, sectors);
+        mcp_outbox_t outbox;
+        mcp_outbox_open(&outbox, &storage, in_flight + 1, 512);
+
+        flash.writes_left = cut;
+        long acked = 0;
+        long appended = 0;
+        char message[256];
+        for (long i = 0; i < messages && flash.writes_left != 0; i++) {
+            int len = make_message(message, sizeof(message), i);
+            if (mcp_outbox_append(&outbox, "devices/esp32_a1b2c3/error", message, len, 1) < 0) {
+                break;
+            }
+            appended = i + 1;
+            if (outbox.count > in_flight && mcp_outbox_remove(&outbox, 0) == 0) {
+                acked++;
+            }
+        }
+        bool completed = flash.writes_left != 0;
+        mcp_outbox_close(&outbox);
+
+        // Reboot
+        flash.writes_left = -1;
+        mcp_outbox_open(&outbox, &storage, in_flight + 1, 512);
+        long expect = acked;
+        for (uint16_t i = 0; i < outbox.count; i++) {
+            const char *topic, *data;
+            size_t len;
+            if (mcp_outbox_load(&outbox, i, &topic, &data, &len) != 0) {
+                printf("cut at write %ld: pending message %u unreadable\n", cut, i);
+                failures++;
+                break;
+            }
+            // A message whose ack was being written may come back; nothing older may
+            if (i == 0 && expect > 0 && len == (size_t)make_message(message, sizeof(message), expect - 1) &&
+                memcmp(data, message, len) == 0) {
+                expect--;
+            }
+            if (len != (size_t)make_message(message, sizeof(message), expect) || memcmp(data, message, len) != 0) {
+                printf("cut at write %ld: pending message %u is not message %ld\n", cut, i, expect);
+                failures++;
+                break;
+            }
+            expect++;
+        }
+        if (expect < appended - 1 || expect > appended) {
+            printf("cut at write %ld: recovered up to %ld of %ld appended\n", cut, expect, appended);
+            failures++;
+        }
+        if (flash.nor_violations) {
+            printf("cut at write %ld: %u writes set bits\n", cut, flash.nor_violations);
+            failures++;
+        }
+        mcp_outbox_close(&outbox);
+        close(flash.fd);
+        if (completed) {
+            printf("power cut at each of %ld writes and erases: %s\n", cut - 1, failures ? "FAILED" : "all recovered");
+            break;
+        }
+    }
+    unlink("bench_outbox.bin");
+    return failures;
+}
+
+int main(int argc, char **argv) {
+    long messages = argc > 1 ? atol(argv[1]) : 200000;
+    int in_flight = argc > 2 ? atoi(argv[2]) : 8;
+    uint32_t sectors = argc > 3 ? (uint32_t)atoi(argv[3]) : 4;
+    if (sectors < 2 || sectors > MAX_SECTORS || in_flight < 1) {
+        fprintf(stderr, "usage: %s [messages] [in-flight] [sectors 2-%d]\n", argv[0], MAX_SECTORS);
+        return 1;
+    }
+
+    file_flash_t flash;
+    if (flash_open(&flash, "bench_outbox.bin", sectors) != 0) {
+        perror("bench_outbox.bin");
+        return 1;
+    }
+    double ram = bench_ram(messages, in_flight);
+    double persisted = bench_flash(messages, in_flight, sectors, &flash);
+    close(flash.fd);
+
+    uint32_t min_erases = UINT32_MAX, max_erases = 0;
+    uint64_t erases = 0;
+    for (uint32_t s = 0; s < sectors; s++) {
+        erases += flash.sector_erases[s];
+        min_erases = flash.sector_erases[s] < min_erases ? flash.sector_erases[s] : min_erases;
+        max_erases = flash.sector_erases[s] > max_erases ? flash.sector_erases[s] : max_erases;
+    }
+    double per_message = (double)erases / messages;
+
+    printf("%-22s%12s\n", "mode", "msg/s");
+    printf("%-22s%12.0f\n", "ram copy", ram);
+    printf("%-22s%12.0f\n", "flash log (file)", persisted);
+    printf("flash bytes/message   %12.1f\n", (double)flash.bytes_written / messages);
+    printf("erases/1000 messages  %12.2f (per sector %u..%u)\n", per_message * 1000, min_erases, max_erases);
+    printf("messages until worn   %12.0f (%u sectors x %d cycles)\n",
+           sectors * (double)ERASE_CYCLES / per_message, sectors, ERASE_CYCLES);
+    if (flash.nor_violations) {
+        printf("NOR violations        %12u\n", flash.nor_violations);
+    }
+
+    return check_power_cuts(sectors) || flash.nor_violations ? 1 : 0;
+}
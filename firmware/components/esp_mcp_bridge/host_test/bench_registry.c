@@ -0,0 +1,250 @@
+/**
+ * @file bench_registry.c
+ * @brief Host benchmark of the registry name index and poll schedule
+ *
+ * Build and run on the development machine:
+ *
+ *   cc -O2 -I../src bench_registry.c ../src/mcp_registry.c -o bench_registry
+ *   ./bench_registry [sensors]
+ *
+ * Registers 10, 100 and up to the given number of sensors (default 1000)
+ * with intervals from 1 s to 60 s, registered at staggered ticks, and runs
+ * ten simulated minutes of the sensor task's poll loop at a 100 Hz tick.
+ * For each size it reports the schedule cost per poll, the cost per
+ * publish (the poll plus formatting the topic and a JSON reading, as
+ * publish_sensor_reading() does before handing them to the transport) and
+ * the cost of a lookup by ID. It also reports the poll and lookup costs of
+ * the linked list the registry replaced, which scanned every sensor on each
+ * wakeup and walked the list for each lookup. The run fails if the schedule
+ * makes a different number of polls than the intervals call for, or polls
+ * out of due-time order.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "mcp_registry.h"
+
+#define TICK_HZ 100
+#define SIM_TICKS (10 * 60 * TICK_HZ)          /**< Ten simulated minutes */
+#define MIN_BENCH_S 0.2                         /**< Repeat each measurement at least this long */
+
+static const uint32_t periods_s[] = { 1, 2, 5, 10, 30, 60 };
+
+typedef struct {
+    char id[24];
+    uint32_t period;                            /**< Ticks */
+    uint32_t phase;                             /**< Tick of the first poll */
+    uint32_t next_due;
+} bench_sensor_t;
+
+static bench_sensor_t *sensors;
+static uint16_t sensor_count;
+static volatile uint32_t sink;                  /**< Keeps results alive under -O2 */
+
+static const char *sensor_id_at(uint16_t entry) {
+    return sensors[entry].id;
+}
+
+static uint32_t sensor_due_at(uint16_t entry) {
+    return sensors[entry].next_due;
+}
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void sensors_reset(void) {
+    for (uint16_t i = 0; i < sensor_count; i++) {
+        sensors[i].next_due = sensors[i].phase;
+    }
+}
+
+static uint64_t expected_polls(void) {
+    uint64_t polls = 0;
+    for (uint16_t i = 0; i < sensor_count; i++) {
+        polls += (SIM_TICKS - 1 - sensors[i].phase) / sensors[i].period + 1;
+    }
+    return polls;
+}
+
+/**
+ * @brief Poll loop of the sensor task: take the head while it is due, advance it, sift it down
+ *
+ * @param publish Also format the topic and reading of every poll
+ * @return Polls made, or 0 if one came out of due-time order
+ */
+static uint64_t run_schedule(mcp_schedule_t *schedule, bool publish) {
+    sensors_reset();
+    schedule->len = 0;
+    for (uint16_t i = 0; i < sensor_count; i++) {
+        mcp_schedule_push(schedule, i);
+    }
+
+    uint64_t polls = 0;
+    uint32_t last_due = 0;
+    for (;;) {
+        bench_sensor_t *sensor = &sensors[schedule->heap[0]];
+        if (sensor->next_due >= SIM_TICKS) {
+            return polls;
+        }
+        if (sensor->next_due < last_due) {
+            return 0;
+        }
+        last_due = sensor->next_due;
+        sink += sensor->id[0];
+        if (publish) {
+            char topic[128], message[256];
+            sink += snprintf(topic, sizeof(topic), "devices/%s/sensors/%s/data", "esp32_a1b2c3", sensor->id);
+            sink += snprintf(message, sizeof(message), "{\"device_id\":\"%s\",\"sensor_id\":\"%s\","
+                             "\"timestamp\":%u,\"value\":%.2f,\"seq\":%llu}", "esp32_a1b2c3", sensor->id,
+                             last_due, last_due * 0.01, (unsigned long long)polls);
+        }
+        sensor->next_due += sensor->period;
+        mcp_schedule_sift_down(schedule);
+        polls++;
+    }
+}
+
+/**
+ * @brief The replaced loop: find the earliest sensor, then scan all of them for the due ones
+ */
+static uint64_t run_linear(void) {
+    sensors_reset();
+
+    uint64_t polls = 0;
+    for (;;) {
+        uint32_t now = UINT32_MAX;
+        for (uint16_t i = 0; i < sensor_count; i++) {
+            now = sensors[i].next_due < now ? sensors[i].next_due : now;
+        }
+        if (now >= SIM_TICKS) {
+            return polls;
+        }
+        for (uint16_t i = 0; i < sensor_count; i++) {
+            if (sensors[i].next_due <= now) {
+                sink += sensors[i].id[0];
+                sensors[i].next_due += sensors[i].period;
+                polls++;
+            }
+        }
+    }
+}
+
+static int find_linear(const char *id) {
+    for (uint16_t i = 0; i < sensor_count; i++) {
+        if (strcmp(sensors[i].id, id) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Nanoseconds per lookup of every registered ID, in a shuffled order
+ */
+static double bench_lookups(const mcp_registry_index_t *index, const uint16_t *order) {
+    long lookups = 0;
+    double start = now_s(), elapsed;
+    do {
+        for (uint16_t i = 0; i < sensor_count; i++) {
+            const char *id = sensors[order[i]].id;
+            sink += index ? mcp_registry_index_find(index, id, sensor_id_at) : find_linear(id);
+        }
+        lookups += sensor_count;
+    } while ((elapsed = now_s() - start) < MIN_BENCH_S);
+    return elapsed * 1e9 / lookups;
+}
+
+/**
+ * @return 0 if the schedule made the expected polls in order
+ */
+static int bench_size(uint16_t count) {
+    sensor_count = count;
+    mcp_registry_index_t index;
+    mcp_schedule_t schedule = { .heap = calloc(count, sizeof(uint16_t)), .due_of = sensor_due_at };
+    uint16_t *order = malloc(count * sizeof(uint16_t));
+    if (!schedule.heap || !order || mcp_registry_index_init(&index, count) != 0) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    for (uint16_t i = 0; i < count; i++) {
+        snprintf(sensors[i].id, sizeof(sensors[i].id), "modbus_hr_%04u", i);
+        sensors[i].period = periods_s[i % (sizeof(periods_s) / sizeof(periods_s[0]))] * TICK_HZ;
+        sensors[i].phase = (i * 37u) % sensors[i].period;
+        mcp_registry_index_insert(&index, sensors[i].id, i);
+        order[i] = i;
+    }
+    for (uint16_t i = count - 1; i > 0; i--) {
+        uint16_t j = rand() % (i + 1), tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+
+    uint64_t expected = expected_polls();
+    uint64_t polls = 0, publishes = 0, linear_polls = 0;
+    long runs = 0, publish_runs = 0, linear_runs = 0;
+    double start = now_s(), elapsed;
+    do {
+        polls += run_schedule(&schedule, false);
+        runs++;
+    } while ((elapsed = now_s() - start) < MIN_BENCH_S);
+    double schedule_ns = elapsed * 1e9 / polls;
+
+    start = now_s();
+    do {
+        publishes += run_schedule(&schedule, true);
+        publish_runs++;
+    } while ((elapsed = now_s() - start) < MIN_BENCH_S);
+    double publish_ns = elapsed * 1e9 / publishes;
+
+    start = now_s();
+    do {
+        linear_polls += run_linear();
+        linear_runs++;
+    } while ((elapsed = now_s() - start) < MIN_BENCH_S);
+    double linear_ns = elapsed * 1e9 / linear_polls;
+
+    double lookup_ns = bench_lookups(&index, order);
+    double linear_lookup_ns = bench_lookups(NULL, order);
+    printf("%8u%10llu%12.1f%12.1f%12.1f%12.1f%12.1f\n", count, (unsigned long long)expected,
+           schedule_ns, publish_ns, linear_ns, lookup_ns, linear_lookup_ns);
+
+    int failed = polls != expected * runs || publishes != expected * publish_runs ||
+                 linear_polls != expected * linear_runs;
+    if (failed) {
+        printf("%u sensors: expected %llu polls per run, schedule made %llu\n", count,
+               (unsigned long long)expected, (unsigned long long)(polls / runs));
+    }
+    mcp_registry_index_free(&index);
+    free(schedule.heap);
+    free(order);
+    return failed;
+}
+
+int main(int argc, char **argv) {
+    long max_sensors = argc > 1 ? atol(argv[1]) : 1000;
+    if (max_sensors < 10 || max_sensors > 32767) {
+        fprintf(stderr, "usage: %s [sensors 10-32767]\n", argv[0]);
+        return 1;
+    }
+    sensors = calloc(max_sensors, sizeof(bench_sensor_t));
+    if (!sensors) {
+        return 1;
+    }
+
+    printf("ns per poll and per lookup by ID, %d simulated minutes\n", SIM_TICKS / TICK_HZ / 60);
+    printf("%8s%10s%12s%12s%12s%12s%12s\n", "sensors", "polls", "schedule", "publish", "list scan",
+           "index", "list walk");
+    int failures = 0;
+    for (long count = 10; count < max_sensors; count *= 10) {
+        failures += bench_size((uint16_t)count);
+    }
+    failures += bench_size((uint16_t)max_sensors);
+    free(sensors);
+    return failures ? 1 : 0;
+}
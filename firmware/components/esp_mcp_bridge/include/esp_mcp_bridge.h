@@ -14,10 +14,13 @@
 extern "C" {
 #endif
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include "esp_err.h"
+#include "freertos/FreeRTOS.h"
 #include "mcp_device.h"
+#include "mcp_transport.h"
 
 /**
  * @brief MCP Bridge specific error codes
@@ -70,10 +73,11 @@ typedef struct {
     const char *device_id;                      /**< Device ID (NULL to auto-generate) */
     uint32_t sensor_publish_interval_ms;        /**< Sensor publish interval (0 for default) */
     uint32_t command_timeout_ms;                /**< Command timeout in milliseconds */
-    bool enable_watchdog;                       /**< Enable watchdog timer */
-    bool enable_device_auth;                    /**< Enable device authentication */
+    bool enable_watchdog;                       /**< Subscribe bridge tasks to the task watchdog */
+    bool enable_device_auth;                    /**< Append an HMAC tag and replay counter to every published message */
     uint8_t log_level;                         /**< Log level (0-5) */
-    mcp_mqtt_qos_config_t qos_config;          /**< MQTT QoS configuration */
+    mcp_mqtt_qos_config_t qos_config;          /**< MQTT QoS configuration (all 0 for defaults) */
+    float sensor_deadband;                     /**< Skip readings closer than this to the last published value (0 = off) */
     mcp_tls_config_t tls_config;               /**< TLS/SSL configuration */
 } mcp_bridge_config_t;
 
@@ -86,11 +90,33 @@ typedef struct {
     uint32_t connection_failures;               /**< Number of connection failures */
     uint32_t sensor_read_errors;                /**< Number of sensor read errors */
     uint32_t actuator_errors;                   /**< Number of actuator control errors */
+    uint32_t isr_samples_dropped;               /**< Events lost because the ISR queue was full */
+    uint32_t rules_fired;                       /**< Actuator commands issued by local rules */
+    uint32_t log_dropped;                       /**< Deferred log records lost because the log queue was full */
     uint32_t uptime_seconds;                    /**< Device uptime in seconds */
     uint32_t wifi_reconnections;                /**< Number of WiFi reconnections */
     uint32_t mqtt_reconnections;                /**< Number of MQTT reconnections */
     uint32_t free_heap_size;                    /**< Current free heap size */
     uint32_t min_free_heap_size;                /**< Minimum free heap size since boot */
+    uint32_t largest_free_block;                /**< Largest allocatable block (fragmentation) */
+    uint32_t wifi_connect_attempts;             /**< WiFi association attempts */
+    uint32_t mqtt_connect_attempts;             /**< MQTT connection attempts */
+    uint32_t wifi_backoff_ms;                   /**< Delay of the pending WiFi retry (0 = none) */
+    uint32_t mqtt_backoff_ms;                   /**< Delay of the pending MQTT retry (0 = none) */
+    uint32_t wifi_last_outage_ms;               /**< Duration of the last WiFi outage */
+    uint32_t mqtt_last_outage_ms;               /**< Duration of the last MQTT outage */
+    uint32_t tls_full_handshakes;               /**< mqtts handshakes without a cached session */
+    uint32_t tls_resumed_handshakes;            /**< mqtts handshakes that offered the cached session */
+    uint32_t tls_full_handshake_ms;             /**< Duration of the last full handshake */
+    uint32_t tls_resumed_handshake_ms;          /**< Duration of the last resumed handshake */
+    uint32_t tls_full_handshake_heap;           /**< Approximate peak heap of the last full handshake */
+    uint32_t tls_resumed_handshake_heap;        /**< Approximate peak heap of the last resumed handshake */
+    uint32_t auth_counter;                      /**< Counter of the last authenticated message (0 = none) */
+    uint32_t outbox_pending;                    /**< Messages in the flash outbox awaiting acknowledgment */
+    uint32_t outbox_unpersisted;                /**< QoS 1 messages sent from RAM only (write budget spent or outbox full) */
+    uint32_t outbox_erases;                     /**< Flash outbox sector erases since boot */
+    uint32_t sensor_read_timeouts;              /**< Sensor reads abandoned at their deadline */
+    uint32_t sensor_breakers_open;              /**< Sensors whose circuit breaker is open now */
 } mcp_bridge_metrics_t;
 
 /**
@@ -102,7 +128,7 @@ typedef enum {
     MCP_EVENT_MQTT_CONNECTED,                   /**< MQTT connected */
     MCP_EVENT_MQTT_DISCONNECTED,                /**< MQTT disconnected */
     MCP_EVENT_COMMAND_RECEIVED,                 /**< Actuator command received */
-    MCP_EVENT_SENSOR_READ_ERROR,                /**< Sensor read error */
+    MCP_EVENT_SENSOR_READ_ERROR,                /**< Sensor circuit breaker opened or closed */
     MCP_EVENT_ACTUATOR_ERROR,                   /**< Actuator control error */
     MCP_EVENT_LOW_MEMORY,                       /**< Low memory warning */
     MCP_EVENT_TLS_ERROR,                        /**< TLS/SSL error */
@@ -158,6 +184,51 @@ typedef void (*mcp_event_handler_t)(const mcp_event_t *event, void *user_data);
  */
 typedef esp_err_t (*mcp_sensor_read_cb_t)(const char *sensor_id, float *value, void *user_data);
 
+/**
+ * @brief Maximum number of channels of a multi-channel sensor
+ */
+#define MCP_BRIDGE_MAX_SENSOR_CHANNELS 8
+
+/**
+ * @brief Channel of a multi-channel sensor
+ */
+typedef struct {
+    const char *name;                           /**< Channel name (e.g. "x", "co2") */
+    const char *unit;                           /**< Unit of measurement (can be NULL) */
+} mcp_sensor_channel_t;
+
+/**
+ * @brief Multi-channel sensor read callback type
+ * @param sensor_id Sensor identifier
+ * @param values Output array, one value per channel in registration order
+ * @param count Number of channels
+ * @param user_data User data passed during registration
+ * @return ESP_OK on success, error code on failure
+ */
+typedef esp_err_t (*mcp_sensor_read_multi_cb_t)(const char *sensor_id, float *values, 
+                                                size_t count, void *user_data);
+
+/**
+ * @brief Identifies one asynchronous read (see mcp_bridge_sensor_read_done)
+ */
+typedef uint32_t mcp_sensor_read_token_t;
+
+/**
+ * @brief Asynchronous sensor read start callback type
+ *
+ * Starts a read (a DS18B20 conversion, an ADC burst, a request to a remote
+ * node) and returns without waiting for it. Called with the bridge mutex
+ * held, so it must not block or call bridge APIs other than
+ * mcp_bridge_sensor_read_done().
+ *
+ * @param sensor_id Sensor identifier
+ * @param token Pass to mcp_bridge_sensor_read_done() with the result
+ * @param user_data User data passed during registration
+ * @return ESP_OK if the read was started, error code otherwise (a failed read)
+ */
+typedef esp_err_t (*mcp_sensor_read_start_cb_t)(const char *sensor_id, mcp_sensor_read_token_t token,
+                                                void *user_data);
+
 /**
  * @brief Actuator control callback type
  * @param actuator_id Actuator identifier
@@ -171,6 +242,64 @@ typedef esp_err_t (*mcp_actuator_control_cb_t)(const char *actuator_id,
                                                const void *value, 
                                                void *user_data);
 
+/**
+ * @brief Static sensor descriptor (see mcp_bridge_register_sensor_table)
+ *
+ * Build entries with MCP_SENSOR(), MCP_MULTI_SENSOR() or MCP_ASYNC_SENSOR()
+ * into a const array; the linker keeps it and its strings in flash. Exactly
+ * one callback is set.
+ */
+typedef struct {
+    const char *sensor_id;                      /**< Unique sensor identifier */
+    const char *type;                           /**< Sensor type */
+    const char *unit;                           /**< Unit of measurement (NULL for multi-channel) */
+    const mcp_sensor_channel_t *channels;       /**< Channels of a multi-channel sensor, else NULL */
+    uint8_t channel_count;                      /**< Number of channels (0 for single-value) */
+    mcp_sensor_metadata_t metadata;             /**< Sensor metadata */
+    mcp_sensor_read_cb_t read_cb;               /**< Read callback (single-value sensors) */
+    mcp_sensor_read_multi_cb_t read_multi_cb;   /**< Read callback (multi-channel sensors) */
+    mcp_sensor_read_start_cb_t read_start_cb;   /**< Start callback (asynchronous sensors) */
+    void *user_data;                            /**< User data passed to the callback */
+} mcp_sensor_desc_t;
+
+/**
+ * @brief Static actuator descriptor (see mcp_bridge_register_actuator_table)
+ */
+typedef struct {
+    const char *actuator_id;                    /**< Unique actuator identifier */
+    const char *type;                           /**< Actuator type */
+    mcp_actuator_metadata_t metadata;           /**< Actuator metadata */
+    mcp_actuator_control_cb_t control_cb;       /**< Control callback */
+    void *user_data;                            /**< User data passed to the callback */
+} mcp_actuator_desc_t;
+
+/**
+ * @brief Descriptor table entries; trailing arguments initialize the metadata
+ *
+ * @code
+ * static const mcp_sensor_channel_t accel_channels[] = {{"x", "g"}, {"y", "g"}, {"z", "g"}};
+ * static const mcp_sensor_desc_t sensors[] = {
+ *     MCP_SENSOR("temp_1", "temperature", "°C", read_temp, NULL, .update_interval_ms = 5000),
+ *     MCP_MULTI_SENSOR("accel_1", "accelerometer", accel_channels, read_accel, NULL),
+ * };
+ * mcp_bridge_register_sensor_table(sensors, MCP_TABLE_LEN(sensors));
+ * @endcode
+ */
+#define MCP_SENSOR(id, type_, unit_, read, user, ...) \
+    { .sensor_id = (id), .type = (type_), .unit = (unit_), .metadata = { __VA_ARGS__ }, \
+      .read_cb = (read), .user_data = (user) }
+#define MCP_MULTI_SENSOR(id, type_, channels_, read, user, ...) \
+    { .sensor_id = (id), .type = (type_), .channels = (channels_), \
+      .channel_count = sizeof(channels_) / sizeof((channels_)[0]), .metadata = { __VA_ARGS__ }, \
+      .read_multi_cb = (read), .user_data = (user) }
+#define MCP_ASYNC_SENSOR(id, type_, unit_, start, user, ...) \
+    { .sensor_id = (id), .type = (type_), .unit = (unit_), .metadata = { __VA_ARGS__ }, \
+      .read_start_cb = (start), .user_data = (user) }
+#define MCP_ACTUATOR(id, type_, control, user, ...) \
+    { .actuator_id = (id), .type = (type_), .metadata = { __VA_ARGS__ }, \
+      .control_cb = (control), .user_data = (user) }
+#define MCP_TABLE_LEN(table) (sizeof(table) / sizeof((table)[0]))
+
 /**
  * @brief Initialize the MCP Bridge with default configuration
  * @return ESP_OK on success, error code on failure
@@ -188,12 +317,22 @@ esp_err_t mcp_bridge_init(const mcp_bridge_config_t *config);
  * @brief Start the MCP Bridge
  * 
  * This function starts all bridge tasks and begins connection attempts.
- * Must be called after mcp_bridge_init().
+ * Must be called after mcp_bridge_init(). Returns without waiting for the
+ * network; readiness is reported through MCP_EVENT_WIFI_CONNECTED and
+ * MCP_EVENT_MQTT_CONNECTED, or use mcp_bridge_wait_connected().
  * 
  * @return ESP_OK on success, error code on failure
  */
 esp_err_t mcp_bridge_start(void);
 
+/**
+ * @brief Wait until the bridge is connected to the MQTT broker
+ * @param timeout_ms Maximum time to wait in milliseconds
+ * @return ESP_OK when connected, ESP_ERR_TIMEOUT on timeout, 
+ *         ESP_ERR_INVALID_STATE if the bridge is not started
+ */
+esp_err_t mcp_bridge_wait_connected(uint32_t timeout_ms);
+
 /**
  * @brief Stop the MCP Bridge
  * 
@@ -237,6 +376,71 @@ esp_err_t mcp_bridge_register_sensor(const char *sensor_id,
                                     mcp_sensor_read_cb_t read_cb,
                                     void *user_data);
 
+/**
+ * @brief Register a multi-channel sensor (accelerometer, IMU, multi-gas, ...)
+ * 
+ * All channels are read in one callback and published as one reading.
+ * Channel names and units are announced in the capabilities document.
+ * 
+ * @param sensor_id Unique sensor identifier
+ * @param type Sensor type (accelerometer, imu, etc.)
+ * @param channels Channel descriptions (copied)
+ * @param channel_count Number of channels (1 to MCP_BRIDGE_MAX_SENSOR_CHANNELS)
+ * @param metadata Additional sensor metadata (can be NULL)
+ * @param read_cb Callback function to read all channels
+ * @param user_data User data to pass to callback
+ * @return ESP_OK on success, error code on failure
+ */
+esp_err_t mcp_bridge_register_multi_sensor(const char *sensor_id,
+                                          const char *type,
+                                          const mcp_sensor_channel_t *channels,
+                                          size_t channel_count,
+                                          const mcp_sensor_metadata_t *metadata,
+                                          mcp_sensor_read_multi_cb_t read_cb,
+                                          void *user_data);
+
+/**
+ * @brief Register a sensor that is read asynchronously
+ *
+ * Each poll calls start_cb and the driver reports the value later with
+ * mcp_bridge_sensor_read_done(), so slow conversions overlap with other
+ * sensors instead of running one after the other. Sensors registered with
+ * a read_cb run it on the bridge's read task, one at a time.
+ *
+ * A read that has not completed after metadata->read_timeout_ms fails with
+ * ESP_ERR_TIMEOUT. After CONFIG_MCP_BRIDGE_SENSOR_BREAKER_THRESHOLD failed
+ * reads in a row the sensor's circuit breaker opens; this applies to every
+ * polled sensor.
+ *
+ * @param sensor_id Unique sensor identifier
+ * @param type Sensor type (temperature, humidity, etc.)
+ * @param unit Unit of measurement
+ * @param metadata Additional sensor metadata (can be NULL)
+ * @param start_cb Callback that starts a read
+ * @param user_data User data to pass to callback
+ * @return ESP_OK on success, error code on failure
+ */
+esp_err_t mcp_bridge_register_async_sensor(const char *sensor_id,
+                                          const char *type,
+                                          const char *unit,
+                                          const mcp_sensor_metadata_t *metadata,
+                                          mcp_sensor_read_start_cb_t start_cb,
+                                          void *user_data);
+
+/**
+ * @brief Report the result of an asynchronous read
+ *
+ * Callable from any task or esp_timer callback (not from an ISR), and from
+ * within start_cb when the value is at hand.
+ *
+ * @param token Token passed to start_cb
+ * @param result ESP_OK, or the error the read failed with
+ * @param value Sensor value (ignored unless result is ESP_OK)
+ * @return ESP_OK if accepted, ESP_ERR_INVALID_STATE if the read already
+ *         timed out or was reported, ESP_ERR_INVALID_ARG for a bad token
+ */
+esp_err_t mcp_bridge_sensor_read_done(mcp_sensor_read_token_t token, esp_err_t result, float value);
+
 /**
  * @brief Register an actuator
  * @param actuator_id Unique actuator identifier
@@ -252,6 +456,108 @@ esp_err_t mcp_bridge_register_actuator(const char *actuator_id,
                                       mcp_actuator_control_cb_t control_cb,
                                       void *user_data);
 
+/**
+ * @brief Register a fixed sensor set from a static descriptor table
+ *
+ * The registry points into the table instead of copying ids, types, units
+ * and channels, so registering costs no heap beyond the registry itself
+ * (allocated once, at CONFIG_MCP_BRIDGE_MAX_SENSORS entries) and one log
+ * line for the whole table. The table must stay valid while the bridge is
+ * initialized; a const array at file scope does. The whole table is
+ * checked before any entry is registered, so on failure none is.
+ *
+ * @param table Descriptor array (see MCP_SENSOR())
+ * @param count Number of entries (MCP_TABLE_LEN(table))
+ * @return ESP_OK on success, ESP_ERR_INVALID_ARG for an invalid entry,
+ *         ESP_ERR_INVALID_STATE for an ID already registered or repeated in
+ *         the table, ESP_ERR_NO_MEM if the table does not fit the registry
+ */
+esp_err_t mcp_bridge_register_sensor_table(const mcp_sensor_desc_t *table, size_t count);
+
+/**
+ * @brief Register a fixed actuator set from a static descriptor table
+ *
+ * Same as mcp_bridge_register_sensor_table() for actuators.
+ *
+ * @param table Descriptor array (see MCP_ACTUATOR())
+ * @param count Number of entries (MCP_TABLE_LEN(table))
+ * @return ESP_OK on success, error code on failure
+ */
+esp_err_t mcp_bridge_register_actuator_table(const mcp_actuator_desc_t *table, size_t count);
+
+/**
+ * @brief Register a child device published through this bridge (gateway mode)
+ *
+ * A child (BLE, ESP-NOW, RS-485 node, ...) gets its own device ID, topics
+ * and capabilities document, but shares the bridge's MQTT session: its
+ * readings are batched on devices/{gateway}/batch and its command topics are
+ * subscribed in bulk. Register children and their components before
+ * mcp_bridge_start().
+ *
+ * @param child_id Unique device ID of the child (no '/', '+' or '#')
+ * @param description Human-readable description (can be NULL)
+ * @return ESP_OK on success, error code on failure
+ */
+esp_err_t mcp_bridge_register_child(const char *child_id, const char *description);
+
+/**
+ * @brief Register a sensor of a child device
+ *
+ * With read_cb set the sensor is polled like a local one. With read_cb NULL
+ * it is push-only: the application reports values received from the child
+ * with mcp_bridge_publish_sensor_data(), and on-demand reads answer with the
+ * last reported value.
+ *
+ * @param child_id Child device ID (see mcp_bridge_register_child)
+ * @param sensor_id Unique sensor identifier (unique across all devices)
+ * @param type Sensor type (temperature, humidity, etc.)
+ * @param unit Unit of measurement
+ * @param metadata Additional sensor metadata (can be NULL)
+ * @param read_cb Callback function to read sensor value (NULL = push-only)
+ * @param user_data User data to pass to callback
+ * @return ESP_OK on success, ESP_ERR_NOT_FOUND for an unknown child
+ */
+esp_err_t mcp_bridge_register_child_sensor(const char *child_id,
+                                          const char *sensor_id,
+                                          const char *type,
+                                          const char *unit,
+                                          const mcp_sensor_metadata_t *metadata,
+                                          mcp_sensor_read_cb_t read_cb,
+                                          void *user_data);
+
+/**
+ * @brief Register an actuator of a child device
+ *
+ * Commands on devices/{child_id}/actuators/{type}/cmd are handed to
+ * control_cb, which forwards them over the child's own link.
+ *
+ * @param child_id Child device ID (see mcp_bridge_register_child)
+ * @param actuator_id Unique actuator identifier (unique across all devices)
+ * @param type Actuator type (led, relay, motor, etc.)
+ * @param metadata Additional actuator metadata (can be NULL)
+ * @param control_cb Callback function to control actuator
+ * @param user_data User data to pass to callback
+ * @return ESP_OK on success, ESP_ERR_NOT_FOUND for an unknown child
+ */
+esp_err_t mcp_bridge_register_child_actuator(const char *child_id,
+                                            const char *actuator_id,
+                                            const char *type,
+                                            const mcp_actuator_metadata_t *metadata,
+                                            mcp_actuator_control_cb_t control_cb,
+                                            void *user_data);
+
+/**
+ * @brief Report whether a child device is reachable over its own link
+ *
+ * Published as the child's retained status. Children start online; the
+ * server also treats them as offline while the gateway is.
+ *
+ * @param child_id Child device ID
+ * @param online Whether the child is reachable
+ * @return ESP_OK on success, error code on failure
+ */
+esp_err_t mcp_bridge_set_child_online(const char *child_id, bool online);
+
 /**
  * @brief Manually publish sensor data
  * 
@@ -263,6 +569,50 @@ esp_err_t mcp_bridge_register_actuator(const char *actuator_id,
  */
 esp_err_t mcp_bridge_publish_sensor_data(const char *sensor_id, float value);
 
+/**
+ * @brief Manually publish all channels of a multi-channel sensor
+ * @param sensor_id Sensor identifier
+ * @param values One value per channel in registration order
+ * @param count Number of values (must match the registered channel count)
+ * @return ESP_OK on success, error code on failure
+ */
+esp_err_t mcp_bridge_publish_multi_sensor_data(const char *sensor_id, const float *values, size_t count);
+
+/**
+ * @brief Handle for publishing a sensor from an ISR
+ */
+typedef uint16_t mcp_sensor_handle_t;
+
+/**
+ * @brief Look up the ISR handle of a registered sensor
+ * 
+ * Call once from task context after registration and keep the handle.
+ * Only single-value sensors can be published from an ISR.
+ * 
+ * @param sensor_id Sensor identifier
+ * @param handle Output: handle for mcp_bridge_publish_from_isr()
+ * @return ESP_OK on success, ESP_ERR_NOT_FOUND if the sensor is not registered,
+ *         ESP_ERR_NOT_SUPPORTED for multi-channel sensors
+ */
+esp_err_t mcp_bridge_get_sensor_handle(const char *sensor_id, mcp_sensor_handle_t *handle);
+
+/**
+ * @brief Publish a sensor value from an interrupt handler
+ * 
+ * ISR-safe: records the value and the time of the call into a fixed-size
+ * queue (CONFIG_MCP_BRIDGE_ISR_QUEUE_SIZE) without allocating or locking.
+ * A high-priority bridge task encodes and publishes it. Samples are dropped
+ * before mcp_bridge_start() and while MQTT is disconnected.
+ * 
+ * @param handle Handle from mcp_bridge_get_sensor_handle()
+ * @param value Sensor value
+ * @param higher_priority_task_woken Set to pdTRUE if a context switch is needed (may be NULL)
+ * @return ESP_OK if queued, ESP_ERR_NO_MEM if the queue is full (counted in
+ *         isr_samples_dropped), ESP_ERR_INVALID_STATE if not started
+ */
+esp_err_t mcp_bridge_publish_from_isr(mcp_sensor_handle_t handle, float value,
+                                      BaseType_t *higher_priority_task_woken);
+
 /**
  * @brief Publish multiple sensor readings in batch
  * 
@@ -334,8 +684,11 @@ esp_err_t mcp_bridge_reconnect(void);
 /**
  * @brief Update configuration at runtime
  * 
- * Updates bridge configuration without full restart.
- * Note: Some changes may require reconnection.
+ * Applies sensor_publish_interval_ms and qos_config (zero keeps the
+ * current value), sensor_deadband and log_level in one step without touching
+ * the WiFi or MQTT connection, and persists them to NVS. Connection
+ * settings are ignored. The server can push the same settings to
+ * devices/{device_id}/config; the device answers on .../config/ack.
  * 
  * @param config New configuration
  * @return ESP_OK on success, error code on failure
@@ -354,6 +707,20 @@ esp_err_t mcp_bridge_update_config(const mcp_bridge_config_t *config);
  */
 esp_err_t mcp_bridge_set_sensor_streaming(const char *sensor_id, bool enable, uint32_t interval_ms);
 
+/**
+ * @brief Provision the message authentication key
+ * 
+ * Stores the 32-byte HMAC-SHA256 key in NVS (key "auth_key") for
+ * enable_device_auth; the server must hold the same key for this device.
+ * Takes effect on the next mcp_bridge_start(). Not used when
+ * CONFIG_MCP_BRIDGE_AUTH_KEY_EFUSE is set.
+ * 
+ * @param key Key bytes
+ * @param key_len Must be 32
+ * @return ESP_OK on success, error code on failure
+ */
+esp_err_t mcp_bridge_set_auth_key(const uint8_t *key, size_t key_len);
+
 /**
  * @brief Reset bridge statistics
  * @return ESP_OK on success, error code on failure
@@ -34,10 +34,11 @@ typedef struct {
     float min_range;                    /**< Minimum measurable value */
     float max_range;                    /**< Maximum measurable value */
     float accuracy;                     /**< Accuracy/precision */
-    uint32_t update_interval_ms;        /**< Update interval in milliseconds */
+    uint32_t update_interval_ms;        /**< Poll interval in milliseconds (0 = bridge interval) */
     const char *description;            /**< Human-readable description */
     bool calibration_required;          /**< Whether calibration is required */
     uint32_t calibration_interval_s;    /**< Calibration interval in seconds */
+    uint32_t read_timeout_ms;           /**< Longest a read may take (0 = CONFIG_MCP_BRIDGE_SENSOR_READ_TIMEOUT_MS) */
 } mcp_sensor_metadata_t;
 
 /**
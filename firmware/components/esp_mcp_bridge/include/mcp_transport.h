@@ -0,0 +1,128 @@
+/**
+ * @file mcp_transport.h
+ * @brief Message transports for MCP Bridge
+ *
+ * Every message the bridge publishes belongs to a message class, and each
+ * class is sent through one transport. The built-in MQTT transport carries
+ * every class by default. It implements the same vtable, and the bridge
+ * publishes, subscribes and receives through it like any other transport;
+ * it only adds MQTT v5 properties on the way. A UDP/CoAP transport can take
+ * high-rate telemetry off the broker, and a loopback transport lets host
+ * tests and benchmarks run the publish path without a network. Commands
+ * from the server always arrive over MQTT; other transports may deliver
+ * messages to the bridge too.
+ */
+
+#ifndef MCP_TRANSPORT_H
+#define MCP_TRANSPORT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+
+/**
+ * @brief Message classes that can be routed to different transports
+ */
+typedef enum {
+    MCP_MESSAGE_CLASS_TELEMETRY = 0,            /**< Sensor readings, gateway batches, health records */
+    MCP_MESSAGE_CLASS_STATUS,                   /**< Status, capabilities, errors, acks and answers */
+    MCP_MESSAGE_CLASS_MAX
+} mcp_message_class_t;
+
+/**
+ * @brief Called for each message a transport receives
+ *
+ * @param topic Topic of the message (not NUL-terminated)
+ * @param data Payload (not NUL-terminated)
+ * @param arg Argument given to set_receive_cb
+ */
+typedef void (*mcp_transport_receive_cb_t)(const char *topic, int topic_len,
+                                           const char *data, int data_len, void *arg);
+
+/**
+ * @brief Transport vtable
+ *
+ * Only publish is required. MQTT stays the control channel and connects
+ * when WiFi is up. The bridge calls connect on the other transports at the
+ * start of every MQTT session, disconnect when it stops and destroy on
+ * deinit, and sends telemetry only while MQTT is up. It subscribes to its
+ * own topic tree ("devices/{device_id}/#") and installs its receive
+ * callback on transports that support it. Publish is called with the
+ * bridge's publish lock held, so a transport must not deliver messages
+ * back to the bridge from inside publish.
+ */
+typedef struct mcp_transport {
+    const char *name;
+    esp_err_t (*connect)(struct mcp_transport *transport);
+    void (*disconnect)(struct mcp_transport *transport);
+    /** @return >= 0 on success (message ID or 0), -1 on failure */
+    int (*publish)(struct mcp_transport *transport, const char *topic, const char *data, int len,
+                   int qos, bool retain, const char *content_type);
+    esp_err_t (*subscribe)(struct mcp_transport *transport, const char *topic_filter, int qos);
+    void (*set_receive_cb)(struct mcp_transport *transport, mcp_transport_receive_cb_t cb, void *arg);
+    void (*destroy)(struct mcp_transport *transport);
+    void *ctx;                                  /**< Backend state */
+} mcp_transport_t;
+
+/**
+ * @brief Route a message class through a transport
+ *
+ * The bridge takes ownership of the transport and destroys it on deinit
+ * or when it is replaced. Must be called while the bridge is stopped.
+ *
+ * @param message_class Message class
+ * @param transport Transport, or NULL for the built-in MQTT transport
+ * @return ESP_OK on success, error code on failure
+ */
+esp_err_t mcp_bridge_set_transport(mcp_message_class_t message_class, mcp_transport_t *transport);
+
+/**
+ * @brief Create a UDP transport sending CoAP non-confirmable POSTs
+ *
+ * The topic becomes the Uri-Path, the content type the Content-Format.
+ * Messages are fire-and-forget: QoS and retain are ignored and nothing is
+ * retransmitted. Payloads must fit one datagram.
+ *
+ * @param host Server host name or address
+ * @param port UDP port (5683 is the CoAP default)
+ * @return Transport, or NULL when out of memory
+ */
+mcp_transport_t *mcp_transport_udp_create(const char *host, uint16_t port);
+
+/**
+ * @brief Create an in-process loopback transport
+ *
+ * Every published message is handed to sent_cb in the publishing task,
+ * which makes the publish path measurable without a network. sent_cb must
+ * not call mcp_transport_loopback_inject().
+ * mcp_transport_loopback_inject() delivers a message to the bridge as if
+ * the server had sent it.
+ *
+ * @param sent_cb Called for every published message (NULL = count only)
+ * @param arg Argument for sent_cb
+ * @return Transport, or NULL when out of memory
+ */
+mcp_transport_t *mcp_transport_loopback_create(mcp_transport_receive_cb_t sent_cb, void *arg);
+
+/**
+ * @brief Deliver a message to whoever receives on a loopback transport
+ *
+ * @return ESP_OK, or ESP_ERR_INVALID_STATE if no receiver is installed
+ */
+esp_err_t mcp_transport_loopback_inject(mcp_transport_t *transport, const char *topic,
+                                        const char *data, int len);
+
+/**
+ * @brief Messages published through a loopback transport
+ */
+uint32_t mcp_transport_loopback_sent(const mcp_transport_t *transport);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MCP_TRANSPORT_H */
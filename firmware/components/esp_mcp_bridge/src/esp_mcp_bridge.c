@@ -12,7 +12,13 @@
 #include "esp_event.h"
 #include "esp_netif.h"
 #include "esp_system.h"
+#include "esp_timer.h"
+#include "esp_attr.h"
+#include "esp_heap_caps.h"
+#include "esp_task_wdt.h"
+#include "esp_netif_sntp.h"
 #include "nvs_flash.h"
+#include "nvs.h"
 #include "lwip/err.h"
 #include "lwip/sys.h"
 #include "mqtt_client.h"
@@ -22,7 +28,33 @@
 #include "freertos/queue.h"
 #include "freertos/event_groups.h"
 #include "cJSON.h"
+#include "mbedtls/sha256.h"
+#include "mbedtls/md.h"
+#include "mbedtls/platform_util.h"
+#include "esp_app_desc.h"
+#include "esp_ota_ops.h"
+#if CONFIG_MCP_BRIDGE_ENABLE_TLS
+#include "esp_tls.h"
+#include "esp_transport.h"
+#include "mbedtls/ssl_ciphersuites.h"
+#if CONFIG_MBEDTLS_CERTIFICATE_BUNDLE
+#include "esp_crt_bundle.h"
+#endif
+#include <sys/select.h>
+#endif
+#if CONFIG_MCP_BRIDGE_AUTH_KEY_EFUSE
+#include "esp_hmac.h"
+#include "esp_efuse.h"
+#endif
+#if CONFIG_MCP_BRIDGE_OUTBOX_PERSIST
+#include "esp_partition.h"
+#include "mcp_outbox.h"
+#endif
+#include "mcp_registry.h"
+#include <ctype.h>
+#include <stdlib.h>
 #include <string.h>
+#include <math.h>
 #include <time.h>
 #include <sys/time.h>
 
@@ -31,59 +63,378 @@ static const char *TAG = "MCP_BRIDGE";
 /* ==================== CONSTANTS ==================== */
 
 #define WIFI_CONNECTED_BIT BIT0
-#define WIFI_FAIL_BIT      BIT1
 #define MQTT_CONNECTED_BIT BIT0
 #define MQTT_FAIL_BIT      BIT1
 
 #define MCP_BRIDGE_DEVICE_ID_LEN 32
 #define MCP_BRIDGE_MAX_TOPIC_LEN 128
 #define MCP_BRIDGE_MAX_MESSAGE_LEN 1024
-#define MCP_BRIDGE_MAX_SENSORS 16
-#define MCP_BRIDGE_MAX_ACTUATORS 16
+#define MCP_BRIDGE_MAX_SENSORS CONFIG_MCP_BRIDGE_MAX_SENSORS
+#define MCP_BRIDGE_MAX_ACTUATORS CONFIG_MCP_BRIDGE_MAX_ACTUATORS
+#define MCP_BRIDGE_MAX_CHILDREN CONFIG_MCP_BRIDGE_MAX_CHILDREN
+#define MCP_BRIDGE_MAX_RULES CONFIG_MCP_BRIDGE_MAX_RULES
+#define MCP_BRIDGE_RULE_ID_LEN 24
+#define MCP_BRIDGE_PING_ID_LEN 40
+#define MCP_BRIDGE_OTA_COPY_BUF 1024    /**< Flash read size for delta copies and source checks */
+#define MCP_BRIDGE_OTA_OP_COPY 0x01
+#define MCP_BRIDGE_OTA_OP_INSERT 0x02
+#define MCP_BRIDGE_SUBSCRIBE_BATCH 16
 #define MCP_BRIDGE_COMMAND_QUEUE_SIZE 10
-#define MCP_BRIDGE_RECONNECT_DELAY_MS 5000
-#define MCP_BRIDGE_WATCHDOG_TIMEOUT_S 300
+#define MCP_BRIDGE_CONNECTION_STABLE_MS 60000
+#define MCP_BRIDGE_TASK_FEED_MS 1000
+#define MCP_BRIDGE_READ_TASKS_ABANDONED_MAX 4 /**< Hung read tasks (4 KB stack each) replaced at most */
+#define MCP_BRIDGE_HEALTH_TASKS 6
+#define MCP_BRIDGE_HEALTH_RECORD_LEN 1024
+#define MCP_BRIDGE_NVS_NAMESPACE "mcp_bridge"
+#define MCP_BRIDGE_CAPS_HASH_BYTES 8
+#define MCP_BRIDGE_CAPS_HASH_LEN (MCP_BRIDGE_CAPS_HASH_BYTES * 2 + 1)
+#define MCP_BRIDGE_MIN_PUBLISH_INTERVAL_MS 100
+#define MCP_BRIDGE_MAX_PUBLISH_INTERVAL_MS 86400000
+#define MCP_BRIDGE_CONFIG_ERROR_LEN 64
+#define MCP_BRIDGE_AUTH_KEY_LEN 32
+#define MCP_BRIDGE_AUTH_COUNTER_LEN 4
+#define MCP_BRIDGE_AUTH_TRAILER_LEN (MCP_BRIDGE_AUTH_COUNTER_LEN + CONFIG_MCP_BRIDGE_AUTH_TAG_LEN)
+
+// sensor_task notification bits
+#define SENSOR_NOTIFY_RESCHEDULE BIT0   /**< Make every sensor due now */
+#define SENSOR_NOTIFY_BATCH      BIT1   /**< A gateway batch was started */
+#define SENSOR_NOTIFY_READ_DONE  BIT2   /**< A read finished and is on the completion queue */
+
+// Content types carried in the MQTT v5 content-type property
+#define MCP_CONTENT_TYPE_JSON "application/json"
+#define MCP_CONTENT_TYPE_SENSOR_BINARY "application/x-mcp-sensor"
+#define MCP_SENSOR_BINARY_VERSION 3
+#define MCP_SENSOR_BINARY_LEN 23
+#define MCP_SENSOR_BINARY_FLAG_TIME_SYNCED 0x01
+#define MCP_SENSOR_BINARY_FLAG_ALIGNED 0x02
+#define MCP_CONTENT_TYPE_SENSOR_MULTI_BINARY "application/x-mcp-sensor-multi"
+#define MCP_SENSOR_MULTI_BINARY_VERSION 2
+#define MCP_SENSOR_MULTI_BINARY_HEADER_LEN 20
+
+#if CONFIG_MCP_BRIDGE_MQTT5
+#define MCP_BRIDGE_MQTT5_ENABLED 1
+#else
+#define MCP_BRIDGE_MQTT5_ENABLED 0
+#endif
 
 /* ==================== INTERNAL STRUCTURES ==================== */
 
+/**
+ * @brief MQTT v5 topic alias state for one topic
+ */
+typedef struct {
+    uint16_t alias;                 /**< Alias number (0 = no alias) */
+    uint32_t session;               /**< MQTT session the alias was mapped on (0 = never) */
+} mqtt_topic_alias_t;
+
+/**
+ * @brief Last successful association, cached in NVS for the fast connect path
+ */
+typedef struct {
+    uint8_t channel;
+    uint8_t bssid[6];
+    esp_netif_ip_info_t ip_info;
+} wifi_fast_cache_t;
+
+/**
+ * @brief Reconnect supervisor state for one link (WiFi or MQTT)
+ */
+typedef struct {
+    const char *name;
+    esp_timer_handle_t retry_timer; /**< One-shot timer for the next attempt */
+    uint32_t attempt;               /**< Failed attempts since the link was last stable */
+    uint32_t backoff_ms;            /**< Delay of the pending retry (0 = none) */
+    int64_t up_since_us;            /**< When the link came up (0 = down) */
+    int64_t down_since_us;          /**< When the current outage started (0 = none) */
+    uint32_t attempts;              /**< Connection attempts since boot */
+    uint32_t reconnections;         /**< Recoveries after an outage */
+    uint32_t last_outage_ms;        /**< Duration of the last completed outage */
+} conn_link_t;
+
+/**
+ * @brief MQTT v5 properties for a single publish (ignored on v3.1.1)
+ */
+typedef struct {
+    mqtt_topic_alias_t *alias;      /**< Topic alias to use/establish (NULL = none) */
+    uint32_t message_expiry_s;      /**< Message expiry interval (0 = none) */
+    const char *content_type;       /**< Content type (NULL = none) */
+} mqtt_publish_props_t;
+
 /**
  * @brief Registered sensor structure
  */
 typedef struct sensor_node {
-    char *sensor_id;
-    char *type;
-    char *unit;
+    const char *sensor_id;
+    const char *type;
+    const char *type_key;           /**< Type index key: type, or "child/type" on a child */
+    uint16_t device;                /**< Owner: 0 = gateway, n = children[n - 1] */
+    bool borrowed;                  /**< Strings and channels point into a static descriptor table */
+    const char *unit;
     mcp_sensor_metadata_t metadata;
     mcp_sensor_read_cb_t read_cb;
+    mcp_sensor_read_multi_cb_t read_multi_cb; /**< Set instead of read_cb for multi-channel sensors */
+    mcp_sensor_read_start_cb_t read_start_cb; /**< Set instead of read_cb for asynchronous sensors */
+    const mcp_sensor_channel_t *channels; /**< Channel names/units (NULL for single-value sensors) */
+    uint8_t channel_count;          /**< 1 for single-value sensors */
     void *user_data;
     uint32_t last_read_time;
-    float last_value;
-    struct sensor_node *next;
+    float last_value;               /**< Last reading (channel 0 of multi-channel sensors) */
+    float deadband;                 /**< Per-sensor deadband (< 0 = bridge default) */
+    float last_published;           /**< Last value actually sent */
+    float channel_published[MCP_BRIDGE_MAX_SENSOR_CHANNELS]; /**< All channels last sent (multi-channel sensors) */
+    bool published;                 /**< last_published is valid for this session */
+    mqtt_topic_alias_t topic_alias;
+    TickType_t next_due;            /**< Tick of the next scheduled poll */
+    int64_t slot_us;                /**< Wall-clock slot of that poll with aligned sampling (0 = none) */
+    uint8_t rule_start;             /**< First local rule on this sensor */
+    uint8_t rule_count;             /**< Local rules evaluated after each read */
+    uint16_t seq_owner;             /**< Sensor whose publish_seq numbers this one's data topic */
+    uint32_t publish_seq;           /**< Sequence of the last reading on the data topic, this boot */
+    
+    // Read in flight; the read_* fields below are guarded by read_lock
+    uint8_t read_state;             /**< sensor_read_state_t */
+    bool read_queued;               /**< An entry for this sensor is in read_queue */
+    uint16_t read_gen;              /**< Bumped by every read; results carrying an older one are dropped */
+    esp_err_t read_result;
+    int64_t read_started_us;        /**< When the read was queued, then when its callback started */
+    TaskHandle_t read_stuck_task;   /**< Abandoned read task still inside this sensor's callback */
+    int64_t read_done_us;
+    float read_values[MCP_BRIDGE_MAX_SENSOR_CHANNELS];
+    int64_t read_slot_us;           /**< Aligned slot the read was started for */
+    bool read_on_demand;            /**< Started for an on-demand read: not published */
+    
+    // Circuit breaker, guarded by the mutex
+    uint8_t breaker;                /**< sensor_breaker_t */
+    uint8_t read_failures;          /**< Consecutive failed reads */
+    uint8_t breaker_trips;          /**< Consecutive openings, sets the backoff */
+    esp_err_t read_error;           /**< Last failed read */
+    int64_t breaker_retry_us;       /**< When an open breaker lets a trial read through */
 } sensor_node_t;
 
+/**
+ * @brief Progress of a sensor read
+ */
+typedef enum {
+    SENSOR_READ_IDLE,
+    SENSOR_READ_QUEUED,             /**< Waiting for the read task */
+    SENSOR_READ_RUNNING,
+    SENSOR_READ_DONE,               /**< Result waiting on the completion queue */
+} sensor_read_state_t;
+
+/**
+ * @brief Circuit breaker state of a sensor
+ */
+typedef enum {
+    SENSOR_BREAKER_CLOSED,          /**< Polled normally */
+    SENSOR_BREAKER_OPEN,            /**< Not read until breaker_retry_us */
+    SENSOR_BREAKER_HALF_OPEN,       /**< Trial read in flight */
+} sensor_breaker_t;
+
 /**
  * @brief Registered actuator structure
  */
 typedef struct actuator_node {
-    char *actuator_id;
-    char *type;
+    const char *actuator_id;
+    const char *type;
+    const char *type_key;           /**< Type index key: type, or "child/type" on a child */
+    uint16_t device;                /**< Owner: 0 = gateway, n = children[n - 1] */
+    bool borrowed;                  /**< Strings point into a static descriptor table */
     mcp_actuator_metadata_t metadata;
     mcp_actuator_control_cb_t control_cb;
     void *user_data;
     char *last_status;
-    struct actuator_node *next;
 } actuator_node_t;
 
+/**
+ * @brief Child device published through this bridge (gateway mode)
+ */
+typedef struct {
+    char *device_id;
+    char *description;
+    bool online;                    /**< Reported by the application (mcp_bridge_set_child_online) */
+} child_node_t;
+
+/**
+ * @brief Command queue entry kind
+ */
+typedef enum {
+    MCP_COMMAND_ACTUATOR = 0,       /**< Actuator command from the server */
+    MCP_COMMAND_SESSION_START,      /**< MQTT connected: publish capabilities and status */
+    MCP_COMMAND_CAPABILITIES_GET,   /**< Server requested the full capabilities document */
+    MCP_COMMAND_CONFIG_SET,         /**< Server pushed a config document (payload) */
+    MCP_COMMAND_SENSOR_READ,        /**< Server wants a fresh reading now (read) */
+    MCP_COMMAND_RULES_SET,          /**< Server pushed a rule table (payload) */
+    MCP_COMMAND_OTA_START,          /**< Server announced a firmware update (payload) */
+    MCP_COMMAND_OTA_CHUNK,          /**< Piece of the update stream (payload, chunk) */
+} mcp_command_kind_t;
+
 /**
  * @brief MQTT command message
  */
 typedef struct {
-    char actuator_id[32];
-    char action[16];
-    char value[64];
+    mcp_command_kind_t kind;
+    uint16_t device;                /**< Addressed device: 0 = gateway, n = children[n - 1] */
+    union {
+        struct {
+            char actuator_type[32];
+            char action[16];
+            char value[64];
+            char rule[MCP_BRIDGE_RULE_ID_LEN]; /**< Local rule that issued it ("" = server) */
+            float reading;          /**< Value that fired the rule */
+        };
+        struct {
+            char sensor_type[32];
+            char request_id[48];
+        } read;                     /**< MCP_COMMAND_SENSOR_READ */
+        struct {
+            uint32_t offset;        /**< Position in the update stream */
+            uint32_t len;           /**< Data bytes after the 4-byte offset header */
+        } chunk;                    /**< MCP_COMMAND_OTA_CHUNK */
+    };
+    char *payload;                  /**< Heap copy of the message body (owned by the receiver) */
     uint32_t timestamp;
 } mcp_command_t;
 
+#if CONFIG_MCP_BRIDGE_OTA
+/**
+ * @brief Firmware update in progress
+ * 
+ * The update stream is either the full image or a delta against the
+ * running partition: COPY (u32 source offset, u32 length) and INSERT
+ * (u32 length, literal bytes) operations, little-endian. Operations may
+ * span chunks, so the parser state lives here.
+ */
+typedef struct {
+    bool active;
+    bool delta;
+    bool rewound;                   /**< Rewind already requested for the current gap */
+    esp_ota_handle_t handle;
+    const esp_partition_t *target;  /**< Partition being written */
+    const esp_partition_t *source;  /**< Running partition, source of delta copies */
+    char version[32];               /**< Version being installed */
+    uint32_t size;                  /**< Bytes in the update stream */
+    uint32_t received;              /**< Stream bytes applied, in order */
+    uint32_t source_size;
+    uint32_t image_size;
+    uint32_t written;               /**< Image bytes written so far */
+    uint8_t sha256[32];             /**< Expected digest of the new image */
+    mbedtls_sha256_context sha;     /**< Digest of the bytes written */
+    uint8_t *buffer;                /**< MCP_BRIDGE_OTA_COPY_BUF bytes for flash reads */
+    int64_t started_us;
+    uint8_t op;                     /**< Delta operation being parsed (0 = none) */
+    uint8_t args[8];
+    uint8_t args_len;
+    uint32_t insert_left;           /**< Literal bytes left in the current INSERT */
+} ota_state_t;
+#endif
+
+#if CONFIG_MCP_BRIDGE_ENABLE_TLS
+/**
+ * @brief mqtts transport over esp-tls
+ * 
+ * Replaces esp-mqtt's built-in SSL transport so the session of the last
+ * handshake can be offered again on reconnect (abbreviated handshake: no
+ * certificate chain, no ECDHE key exchange) and so handshakes can be timed.
+ */
+typedef struct {
+    esp_tls_cfg_t cfg;              /**< Built once from mcp_tls_config_t */
+    const char *alpn[5];            /**< NULL-terminated copy of the ALPN list */
+    esp_tls_t *tls;                 /**< Current connection (NULL = closed) */
+#if CONFIG_MCP_BRIDGE_TLS_SESSION_RESUME
+    esp_tls_client_session_t *session; /**< Session of the last handshake, offered on reconnect */
+#endif
+    uint32_t full_handshakes;
+    uint32_t resumed_handshakes;    /**< Handshakes that offered a cached session */
+    uint32_t full_handshake_ms;     /**< Duration of the last full handshake */
+    uint32_t resumed_handshake_ms;
+    uint32_t full_handshake_heap;   /**< Approximate peak heap of the last full handshake */
+    uint32_t resumed_handshake_heap;
+} tls_transport_t;
+#endif
+
+/**
+ * @brief Hot-path log messages, recorded by ID and formatted later
+ */
+typedef enum {
+    BLOG_MQTT_RECEIVED = 0,         /**< text: topic */
+    BLOG_COMMAND,                   /**< ref: actuator, text: action, value, rule */
+    BLOG_SENSOR_PUBLISHED,          /**< ref: sensor, value: channel 0 */
+    BLOG_EVENT_PUBLISHED,           /**< ref: sensor, num: us since the interrupt */
+    BLOG_EVENT_DROPPED,             /**< ref: sensor */
+    BLOG_SENSOR_READ,               /**< text: sensor type, num: esp_err_t, value: read time (us) */
+} blog_id_t;
+
+/**
+ * @brief Deferred log record: message ID plus raw arguments
+ * 
+ * Registry nodes are referenced, not copied; they never move or go away
+ * while the bridge is initialized.
+ */
+typedef struct {
+    uint8_t id;                     /**< blog_id_t */
+    uint8_t level;                  /**< esp_log_level_t */
+    uint32_t ts_ms;                 /**< esp_log_timestamp() when recorded */
+    const void *ref;
+    int32_t num;
+    float value;
+    char text[64];
+} blog_record_t;
+
+#define BLOG_ACTION_OFFSET 0
+#define BLOG_VALUE_OFFSET 16
+#define BLOG_RULE_OFFSET 40
+
+/**
+ * @brief CPU run time counters at the previous health record
+ */
+typedef struct {
+    uint32_t task_runtime[MCP_BRIDGE_HEALTH_TASKS];
+    uint32_t total_runtime;
+} health_cpu_t;
+
+/**
+ * @brief Sample handed over from an ISR; encoded and published by isr_publish_task
+ */
+typedef struct {
+    uint16_t sensor;                /**< Sensor handle (index into the sensor registry) */
+    float value;
+    int64_t sampled_us;             /**< esp_timer time of the event */
+} isr_sample_t;
+
+/**
+ * @brief Live-tunable settings, staged and validated before being applied
+ */
+typedef struct {
+    uint32_t version;
+    uint32_t sensor_publish_interval_ms;
+    mcp_mqtt_qos_config_t qos;
+    float sensor_deadband;
+    uint8_t log_level;
+    const cJSON *sensor_deadbands;  /**< Per sensor type overrides (borrowed, NULL = keep) */
+} live_config_t;
+
+/**
+ * @brief Compiled local rule: a threshold on one sensor channel driving one actuator
+ * 
+ * The rule turns active when the reading crosses the threshold and inactive
+ * once it is back past the threshold by the hysteresis, so a reading
+ * hovering around the threshold does not toggle the actuator.
+ */
+typedef struct {
+    char id[MCP_BRIDGE_RULE_ID_LEN];
+    uint16_t sensor;                /**< Sensor registry index */
+    uint16_t actuator;              /**< Actuator registry index */
+    uint8_t channel;                /**< Channel of a multi-channel sensor */
+    bool above;                     /**< ">": active above threshold, "<": below */
+    bool active;                    /**< Condition held at the last evaluation */
+    float threshold;
+    float hysteresis;
+    char action[16];                /**< Sent when the rule turns active */
+    char value[64];
+    char clear_action[16];          /**< Sent when it turns inactive ("" = nothing) */
+    char clear_value[64];
+} mcp_rule_t;
+
 /**
  * @brief Bridge context structure
  */
@@ -97,14 +448,54 @@ typedef struct {
     bool running;
     bool wifi_connected;
     bool mqtt_connected;
-    uint32_t wifi_retry_count;
-    uint32_t mqtt_retry_count;
-    
-    // Component lists
+    bool mqtt_started;
+    bool mqtt_subscribed;           /**< Every subscribe of the last mqtt_subscribe_all() was accepted */
+    bool subscriptions_stale;       /**< Registry gained command topics since then */
+    bool wifi_fast_path;
+    bool first_publish_done;
+    bool time_synced;
+    bool watchdog_armed;            /**< Bridge tasks are subscribed to the task watchdog */
+    
+    // Connection supervisor
+    conn_link_t wifi_link;
+    conn_link_t mqtt_link;
+    uint32_t jitter_state;
+    
+    // Component registries: contiguous arrays allocated at the configured
+    // capacity on first registration, so entries never move
     sensor_node_t *sensors;
     actuator_node_t *actuators;
-    uint8_t sensor_count;
-    uint8_t actuator_count;
+    uint16_t sensor_count;
+    uint16_t actuator_count;
+    mcp_registry_index_t sensor_ids;
+    mcp_registry_index_t sensor_types;   /**< First registered sensor of each type_key */
+    mcp_registry_index_t actuator_ids;
+    mcp_registry_index_t actuator_types; /**< First registered actuator of each type_key */
+    mcp_schedule_t sensor_schedule;      /**< Sensors with a read callback, by next_due */
+    
+    // Sensor reads: read callbacks run on the read task, every result comes back on read_done
+    QueueHandle_t read_queue;       /**< Sensors waiting for the read task */
+    QueueHandle_t read_done;        /**< Sensors whose read finished, for the sensor task */
+    portMUX_TYPE read_lock;         /**< Guards the read_* fields of every sensor and the waiter */
+    int32_t read_task_entry;        /**< Sensor whose callback the read task is in (-1 = none) */
+    uint32_t read_task_gen;         /**< Generation of the current read task; older ones exit */
+    uint16_t read_tasks_abandoned;  /**< Replaced read tasks still stuck in a callback */
+    uint16_t reads_in_flight;       /**< Sensors queued, running or done, guarded by the mutex */
+    SemaphoreHandle_t read_waiter_sem; /**< Given when the read an on-demand request waits for ends */
+    int32_t read_waiter;            /**< Sensor that on-demand request waits for (-1 = none) */
+    esp_err_t read_waiter_result;
+    float read_waiter_values[MCP_BRIDGE_MAX_SENSOR_CHANNELS];
+    
+    // Gateway mode: child devices and the batch their readings are collected in
+    child_node_t *children;
+    uint16_t child_count;
+    mcp_registry_index_t child_ids;
+    SemaphoreHandle_t batch_lock;
+    cJSON *batch;                   /**< Pending "readings" array (NULL = empty) */
+    uint16_t batch_len;
+    int64_t batch_deadline_us;      /**< When the pending batch must go out */
+    uint32_t batch_seq;             /**< Sequence of the last batch sent, this boot */
+    mqtt_topic_alias_t batch_alias;
     
     // Event handling
     mcp_event_handler_t event_handler;
@@ -112,21 +503,93 @@ typedef struct {
     
     // FreeRTOS objects
     TaskHandle_t sensor_task_handle;
+    TaskHandle_t read_task_handle;
     TaskHandle_t actuator_task_handle;
-    TaskHandle_t watchdog_task_handle;
+    TaskHandle_t isr_task_handle;
+    TaskHandle_t health_task_handle;
     SemaphoreHandle_t mutex;
     QueueHandle_t command_queue;
+    QueueHandle_t isr_queue;
+    QueueHandle_t log_queue;        /**< Deferred log records (NULL = log in place) */
     EventGroupHandle_t wifi_event_group;
     EventGroupHandle_t mqtt_event_group;
     
+    // WiFi station
+    esp_netif_t *sta_netif;
+    wifi_fast_cache_t wifi_cache;
+    
     // MQTT client
     esp_mqtt_client_handle_t mqtt_client;
+    esp_mqtt_client_config_t mqtt_cfg;
+    TaskHandle_t mqtt_task_handle;
+    SemaphoreHandle_t publish_lock;
+    uint32_t mqtt_session;
+    bool mqtt5_active;
+    uint16_t next_topic_alias;
+#if CONFIG_MCP_BRIDGE_ENABLE_TLS
+    tls_transport_t tls;            /**< Used when the broker URI is mqtts:// */
+#endif
+    
+    // Message authentication (enable_device_auth); signing state is guarded by publish_lock
+    bool auth_ready;
+#if !CONFIG_MCP_BRIDGE_AUTH_KEY_EFUSE
+    mbedtls_md_context_t auth_md;   /**< HMAC-SHA256 keyed once with the NVS key */
+#endif
+    uint32_t auth_counter;          /**< Counter of the last signed message */
+    uint32_t auth_counter_reserved; /**< Counters up to here are reserved in NVS */
+    uint8_t *auth_buf;              /**< Topic, payload, counter and tag of the message being signed */
+    size_t auth_buf_size;
+    
+    // Transport per message class; all but the built-in MQTT transport are owned by the bridge
+    mcp_transport_t *transports[MCP_MESSAGE_CLASS_MAX];
+    mcp_transport_t mqtt_transport; /**< MQTT as a transport, backed by mqtt_client */
+    mcp_transport_receive_cb_t mqtt_receive_cb;
+    void *mqtt_receive_arg;
+    const mqtt_publish_props_t *publish_props; /**< v5 properties of the publish in progress (publish_lock) */
+    
+#if CONFIG_MCP_BRIDGE_OUTBOX_PERSIST
+    // Flash outbox, opened once and kept across stop/start; guarded by outbox_lock
+    mcp_outbox_t outbox;
+    bool outbox_ready;
+    SemaphoreHandle_t outbox_lock;  /**< Taken before publish_lock, never after */
+    QueueHandle_t outbox_acks;      /**< Acknowledged msg_ids, negated for messages esp-mqtt gave up on */
+    uint32_t outbox_tokens;         /**< Flash writes left in the hourly budget */
+    int64_t outbox_refill_us;
+    uint32_t outbox_unpersisted;    /**< Messages sent from RAM only (budget spent or log full) */
+#endif
+    
+    // Capabilities cache (rebuilt only when the registry changes)
+    char *caps_document;
+    char caps_hash[MCP_BRIDGE_CAPS_HASH_LEN];
+    uint32_t caps_version;
+    bool caps_dirty;
+    bool caps_changed;
+    
+    // Live configuration (last applied server version, 0 = none)
+    uint32_t config_version;
+    
+    // Local rules, sorted by sensor so each read evaluates only its own
+    mcp_rule_t *rules;
+    uint8_t rule_count;
+    uint32_t rules_version;         /**< Last applied rule table version (0 = none) */
+    
+#if CONFIG_MCP_BRIDGE_OTA
+    ota_state_t ota;                /**< Owned by the actuator task */
+#endif
+    
+    uint32_t boot_epoch;            /**< Boot counter from NVS, sent with sequence numbers (0 = none) */
     
     // Statistics
     uint32_t messages_sent;
     uint32_t messages_received;
     uint32_t connection_failures;
     uint32_t sensor_read_errors;
+    uint32_t sensor_read_timeouts;
+    uint16_t sensor_breakers_open;
+    uint32_t actuator_errors;
+    uint32_t isr_samples_dropped;
+    uint32_t rules_fired;
+    uint32_t log_dropped;
     uint32_t boot_time;
     
 } mcp_bridge_context_t;
@@ -151,6 +614,70 @@ static uint32_t get_timestamp(void) {
     return esp_log_timestamp();
 }
 
+/**
+ * @brief Get the message timestamp in microseconds for a past instant
+ * 
+ * Unix epoch microseconds once SNTP has synchronized the clock, microseconds
+ * since boot before that.
+ * 
+ * @param sampled_us When the value was taken (esp_timer_get_time())
+ * @param synced Output: whether the value is epoch time
+ */
+static int64_t get_timestamp_us_at(int64_t sampled_us, bool *synced) {
+    *synced = g_bridge_ctx && g_bridge_ctx->time_synced;
+    if (!*synced) {
+        return sampled_us;
+    }
+    
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec - (esp_timer_get_time() - sampled_us);
+}
+
+/**
+ * @brief Get the message timestamp in microseconds for now
+ */
+static int64_t get_timestamp_us(bool *synced) {
+    return get_timestamp_us_at(esp_timer_get_time(), synced);
+}
+
+/**
+ * @brief Add timestamp fields to an outgoing JSON message
+ * 
+ * "timestamp" stays milliseconds since boot for older servers; "ts_us" and
+ * "time_synced" let the server use epoch time directly. A reading taken on
+ * an aligned slot carries the slot itself as "ts_us", flagged "aligned", so
+ * the same slot has the same timestamp on every device.
+ * 
+ * @param slot_us Aligned slot of the reading (epoch us), 0 for none
+ */
+static void json_add_timestamp_at(cJSON *json, int64_t sampled_us, int64_t slot_us) {
+    bool synced = true;
+    int64_t ts_us = slot_us ? slot_us : get_timestamp_us_at(sampled_us, &synced);
+    
+    cJSON_AddNumberToObject(json, "timestamp", (double)(sampled_us / 1000));
+    cJSON_AddNumberToObject(json, "ts_us", (double)ts_us);  // Exact: below 2^53 until year 2255
+    cJSON_AddBoolToObject(json, "time_synced", synced);
+    if (slot_us) {
+        cJSON_AddBoolToObject(json, "aligned", true);
+    }
+}
+
+/**
+ * @brief Add timestamp fields for the current time
+ */
+static void json_add_timestamp(cJSON *json) {
+    json_add_timestamp_at(json, esp_timer_get_time(), 0);
+}
+
+/**
+ * @brief Add the boot epoch and sequence number of a reading or batch
+ */
+static void json_add_sequence(cJSON *json, uint32_t seq) {
+    cJSON_AddNumberToObject(json, "boot", g_bridge_ctx->boot_epoch);
+    cJSON_AddNumberToObject(json, "seq", seq);
+}
+
 /**
  * @brief Send event to application
  */
@@ -168,11 +695,20 @@ static void send_event(mcp_event_type_t type, void *data) {
         case MCP_EVENT_COMMAND_RECEIVED:
             if (data) {
                 mcp_command_t *cmd = (mcp_command_t *)data;
-                event.data.command.actuator_id = cmd->actuator_id;
+                event.data.command.actuator_id = cmd->actuator_type;
                 event.data.command.action = cmd->action;
                 event.data.command.value = cmd->value;
             }
             break;
+        case MCP_EVENT_SENSOR_READ_ERROR:
+            if (data) {
+                const sensor_node_t *sensor = (const sensor_node_t *)data;
+                bool open = sensor->breaker == SENSOR_BREAKER_OPEN;
+                event.data.sensor_error.sensor_id = sensor->sensor_id;
+                event.data.sensor_error.error_code = open ? sensor->read_error : ESP_OK;
+                event.data.sensor_error.error_message = open ? "circuit open" : "circuit closed";
+            }
+            break;
         case MCP_EVENT_ERROR:
             // Error data would be passed in specific format
             break;
@@ -183,433 +719,4947 @@ static void send_event(mcp_event_type_t type, void *data) {
     g_bridge_ctx->event_handler(&event, g_bridge_ctx->event_handler_user_data);
 }
 
+/* ==================== REGISTRY ==================== */
+
+/*
+ * The name indexes and the poll schedule live in mcp_registry.c, which has
+ * no ESP-IDF dependencies so host_test/bench_registry.c can measure them.
+ */
+
+static const char* sensor_id_at(uint16_t entry) {
+    return g_bridge_ctx->sensors[entry].sensor_id;
+}
+
+static const char* sensor_type_at(uint16_t entry) {
+    return g_bridge_ctx->sensors[entry].type_key;
+}
+
+static const char* actuator_id_at(uint16_t entry) {
+    return g_bridge_ctx->actuators[entry].actuator_id;
+}
+
+static const char* actuator_type_at(uint16_t entry) {
+    return g_bridge_ctx->actuators[entry].type_key;
+}
+
+static const char* child_id_at(uint16_t entry) {
+    return g_bridge_ctx->children[entry].device_id;
+}
+
+static uint32_t sensor_due_at(uint16_t entry) {
+    return g_bridge_ctx->sensors[entry].next_due;
+}
+
 /**
- * @brief Find sensor by ID
+ * @brief Device ID that owns a component (0 = the gateway itself)
  */
-static sensor_node_t* find_sensor(const char *sensor_id) {
-    if (!g_bridge_ctx || !sensor_id) return NULL;
-    
-    sensor_node_t *node = g_bridge_ctx->sensors;
-    while (node) {
-        if (strcmp(node->sensor_id, sensor_id) == 0) {
-            return node;
-        }
-        node = node->next;
-    }
-    return NULL;
+static const char* device_id_of(uint16_t device) {
+    return device ? g_bridge_ctx->children[device - 1].device_id : g_bridge_ctx->device_id;
 }
 
 /**
- * @brief Find actuator by ID
+ * @brief Resolve the device ID of a topic to 0 (gateway) or a child number
+ * @return Device number, or -1 if the ID is neither
  */
-static actuator_node_t* find_actuator(const char *actuator_id) {
-    if (!g_bridge_ctx || !actuator_id) return NULL;
-    
-    actuator_node_t *node = g_bridge_ctx->actuators;
-    while (node) {
-        if (strcmp(node->actuator_id, actuator_id) == 0) {
-            return node;
-        }
-        node = node->next;
+static int device_lookup(const char *device_id) {
+    if (strcmp(device_id, g_bridge_ctx->device_id) == 0) {
+        return 0;
     }
-    return NULL;
+    int entry = mcp_registry_index_find(&g_bridge_ctx->child_ids, device_id, child_id_at);
+    return entry >= 0 ? entry + 1 : -1;
 }
 
-/* ==================== JSON MESSAGE FORMATTING ==================== */
+/**
+ * @brief Build the type index key of a component
+ * 
+ * Gateway components are keyed by type alone, so the type indexes keep
+ * working unchanged without children; child components are "child/type".
+ */
+static void type_key_format(char *key, size_t len, uint16_t device, const char *type) {
+    if (device) {
+        snprintf(key, len, "%s/%s", device_id_of(device), type);
+    } else {
+        snprintf(key, len, "%s", type);
+    }
+}
 
 /**
- * @brief Create sensor data JSON message
+ * @brief Allocate the sensor registry, its indexes and the poll schedule
  */
-static char* create_sensor_message(const char *sensor_id, const char *sensor_type, 
-                                  float value, const char *unit) {
-    cJSON *json = cJSON_CreateObject();
-    cJSON *value_obj = cJSON_CreateObject();
-    
-    cJSON_AddStringToObject(json, "device_id", g_bridge_ctx->device_id);
-    cJSON_AddNumberToObject(json, "timestamp", get_timestamp());
-    cJSON_AddStringToObject(json, "type", "sensor");
-    cJSON_AddStringToObject(json, "component", sensor_type);
-    cJSON_AddStringToObject(json, "action", "read");
-    
-    cJSON_AddNumberToObject(value_obj, "reading", value);
-    if (unit) {
-        cJSON_AddStringToObject(value_obj, "unit", unit);
+static esp_err_t sensor_registry_alloc(void) {
+    g_bridge_ctx->sensors = calloc(MCP_BRIDGE_MAX_SENSORS, sizeof(sensor_node_t));
+    g_bridge_ctx->sensor_schedule.heap = calloc(MCP_BRIDGE_MAX_SENSORS, sizeof(uint16_t));
+    g_bridge_ctx->sensor_schedule.due_of = sensor_due_at;
+    if (!g_bridge_ctx->sensors || !g_bridge_ctx->sensor_schedule.heap ||
+        mcp_registry_index_init(&g_bridge_ctx->sensor_ids, MCP_BRIDGE_MAX_SENSORS) != 0 ||
+        mcp_registry_index_init(&g_bridge_ctx->sensor_types, MCP_BRIDGE_MAX_SENSORS) != 0) {
+        free(g_bridge_ctx->sensors);
+        free(g_bridge_ctx->sensor_schedule.heap);
+        mcp_registry_index_free(&g_bridge_ctx->sensor_ids);
+        mcp_registry_index_free(&g_bridge_ctx->sensor_types);
+        g_bridge_ctx->sensors = NULL;
+        g_bridge_ctx->sensor_schedule.heap = NULL;
+        return ESP_ERR_NO_MEM;
     }
-    cJSON_AddNumberToObject(value_obj, "quality", 100); // Default quality
-    
-    cJSON_AddItemToObject(json, "value", value_obj);
-    
-    // Add system metrics
-    cJSON *metrics = cJSON_CreateObject();
-    cJSON_AddNumberToObject(metrics, "free_heap", esp_get_free_heap_size());
-    cJSON_AddNumberToObject(metrics, "uptime", get_timestamp() - g_bridge_ctx->boot_time);
-    cJSON_AddItemToObject(json, "metrics", metrics);
-    
-    char *json_string = cJSON_Print(json);
-    cJSON_Delete(json);
-    
-    return json_string;
+    return ESP_OK;
 }
 
 /**
- * @brief Create capabilities JSON message
+ * @brief Allocate the actuator registry and its index
  */
-static char* create_capabilities_message(void) {
-    cJSON *json = cJSON_CreateObject();
-    cJSON *sensors_array = cJSON_CreateArray();
-    cJSON *actuators_array = cJSON_CreateArray();
-    cJSON *metadata_obj = cJSON_CreateObject();
-    
-    cJSON_AddStringToObject(json, "device_id", g_bridge_ctx->device_id);
-    cJSON_AddStringToObject(json, "firmware_version", "1.0.0"); // Could be made configurable
-    
-    // Add sensors
-    sensor_node_t *sensor = g_bridge_ctx->sensors;
-    while (sensor) {
-        cJSON_AddItemToArray(sensors_array, cJSON_CreateString(sensor->type));
-        
-        // Add sensor metadata
-        cJSON *sensor_meta = cJSON_CreateObject();
-        if (sensor->unit) {
-            cJSON_AddStringToObject(sensor_meta, "unit", sensor->unit);
-        }
-        cJSON_AddNumberToObject(sensor_meta, "min_range", sensor->metadata.min_range);
-        cJSON_AddNumberToObject(sensor_meta, "max_range", sensor->metadata.max_range);
-        cJSON_AddNumberToObject(sensor_meta, "accuracy", sensor->metadata.accuracy);
-        if (sensor->metadata.description) {
-            cJSON_AddStringToObject(sensor_meta, "description", sensor->metadata.description);
-        }
-        
-        cJSON_AddItemToObject(metadata_obj, sensor->type, sensor_meta);
-        sensor = sensor->next;
+static esp_err_t actuator_registry_alloc(void) {
+    g_bridge_ctx->actuators = calloc(MCP_BRIDGE_MAX_ACTUATORS, sizeof(actuator_node_t));
+    if (!g_bridge_ctx->actuators ||
+        mcp_registry_index_init(&g_bridge_ctx->actuator_ids, MCP_BRIDGE_MAX_ACTUATORS) != 0 ||
+        mcp_registry_index_init(&g_bridge_ctx->actuator_types, MCP_BRIDGE_MAX_ACTUATORS) != 0) {
+        free(g_bridge_ctx->actuators);
+        mcp_registry_index_free(&g_bridge_ctx->actuator_ids);
+        mcp_registry_index_free(&g_bridge_ctx->actuator_types);
+        g_bridge_ctx->actuators = NULL;
+        return ESP_ERR_NO_MEM;
     }
-    
-    // Add actuators
-    actuator_node_t *actuator = g_bridge_ctx->actuators;
-    while (actuator) {
-        cJSON_AddItemToArray(actuators_array, cJSON_CreateString(actuator->type));
-        
-        // Add actuator metadata
-        cJSON *actuator_meta = cJSON_CreateObject();
-        if (actuator->metadata.value_type) {
-            cJSON_AddStringToObject(actuator_meta, "value_type", actuator->metadata.value_type);
-        }
-        if (actuator->metadata.description) {
-            cJSON_AddStringToObject(actuator_meta, "description", actuator->metadata.description);
-        }
-        
-        // Add supported actions
-        if (actuator->metadata.supported_actions) {
-            cJSON *actions_array = cJSON_CreateArray();
-            for (int i = 0; actuator->metadata.supported_actions[i] != NULL; i++) {
-                cJSON_AddItemToArray(actions_array, cJSON_CreateString(actuator->metadata.supported_actions[i]));
-            }
-            cJSON_AddItemToObject(actuator_meta, "supported_actions", actions_array);
-        }
-        
-        cJSON_AddItemToObject(metadata_obj, actuator->type, actuator_meta);
-        actuator = actuator->next;
+    return ESP_OK;
+}
+
+/**
+ * @brief Allocate the child device registry and its index
+ */
+static esp_err_t child_registry_alloc(void) {
+    g_bridge_ctx->children = calloc(MCP_BRIDGE_MAX_CHILDREN, sizeof(child_node_t));
+    if (!g_bridge_ctx->children ||
+        mcp_registry_index_init(&g_bridge_ctx->child_ids, MCP_BRIDGE_MAX_CHILDREN) != 0) {
+        free(g_bridge_ctx->children);
+        g_bridge_ctx->children = NULL;
+        return ESP_ERR_NO_MEM;
     }
-    
-    cJSON_AddItemToObject(json, "sensors", sensors_array);
-    cJSON_AddItemToObject(json, "actuators", actuators_array);
-    cJSON_AddItemToObject(json, "metadata", metadata_obj);
-    
-    char *json_string = cJSON_Print(json);
-    cJSON_Delete(json);
-    
-    return json_string;
+    return ESP_OK;
 }
 
-/* ==================== WIFI MANAGEMENT ==================== */
+/**
+ * @brief Free what a sensor entry owns (only its state if it came from a descriptor table)
+ */
+static void sensor_node_release(sensor_node_t *node) {
+    if (node->borrowed) {
+        return;
+    }
+    if (node->type_key != node->type) {
+        free((char *)node->type_key);
+    }
+    free((char *)node->sensor_id);
+    free((char *)node->type);
+    free((char *)node->unit);
+    for (uint8_t i = 0; node->channels && i < node->channel_count; i++) {
+        free((char *)node->channels[i].name);
+        free((char *)node->channels[i].unit);
+    }
+    free((mcp_sensor_channel_t *)node->channels);
+}
 
 /**
- * @brief WiFi event handler
+ * @brief Free what an actuator entry owns
  */
-static void wifi_event_handler(void* arg, esp_event_base_t event_base,
-                               int32_t event_id, void* event_data) {
-    if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START) {
-        esp_wifi_connect();
-    } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
-        if (g_bridge_ctx->wifi_retry_count < 10) {
-            esp_wifi_connect();
-            g_bridge_ctx->wifi_retry_count++;
-            ESP_LOGI(TAG, "Retrying WiFi connection (%d/10)", g_bridge_ctx->wifi_retry_count);
-        } else {
-            xEventGroupSetBits(g_bridge_ctx->wifi_event_group, WIFI_FAIL_BIT);
-            ESP_LOGE(TAG, "WiFi connection failed after 10 retries");
+static void actuator_node_release(actuator_node_t *node) {
+    if (!node->borrowed) {
+        if (node->type_key != node->type) {
+            free((char *)node->type_key);
         }
-        g_bridge_ctx->wifi_connected = false;
-        send_event(MCP_EVENT_WIFI_DISCONNECTED, NULL);
-    } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
-        ip_event_got_ip_t* event = (ip_event_got_ip_t*) event_data;
-        ESP_LOGI(TAG, "Got IP: " IPSTR, IP2STR(&event->ip_info.ip));
-        g_bridge_ctx->wifi_retry_count = 0;
-        g_bridge_ctx->wifi_connected = true;
-        xEventGroupSetBits(g_bridge_ctx->wifi_event_group, WIFI_CONNECTED_BIT);
-        send_event(MCP_EVENT_WIFI_CONNECTED, NULL);
+        free((char *)node->actuator_id);
+        free((char *)node->type);
     }
+    free(node->last_status);
 }
 
 /**
- * @brief Initialize WiFi
+ * @brief Find sensor by ID
  */
-static esp_err_t wifi_init_internal(const mcp_bridge_config_t *config) {
-    esp_err_t ret = nvs_flash_init();
-    if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
-        ESP_ERROR_CHECK(nvs_flash_erase());
-        ret = nvs_flash_init();
-    }
-    ESP_ERROR_CHECK(ret);
+static sensor_node_t* find_sensor(const char *sensor_id) {
+    if (!g_bridge_ctx || !sensor_id) return NULL;
     
-    ESP_ERROR_CHECK(esp_netif_init());
-    ESP_ERROR_CHECK(esp_event_loop_create_default());
-    esp_netif_create_default_wifi_sta();
+    int entry = mcp_registry_index_find(&g_bridge_ctx->sensor_ids, sensor_id, sensor_id_at);
+    return entry >= 0 ? &g_bridge_ctx->sensors[entry] : NULL;
+}
+
+/**
+ * @brief Find the first registered sensor of a type on a device
+ */
+static sensor_node_t* find_sensor_by_type(uint16_t device, const char *type) {
+    char key[MCP_BRIDGE_MAX_TOPIC_LEN];
+    type_key_format(key, sizeof(key), device, type);
+    int entry = mcp_registry_index_find(&g_bridge_ctx->sensor_types, key, sensor_type_at);
+    return entry >= 0 ? &g_bridge_ctx->sensors[entry] : NULL;
+}
+
+/**
+ * @brief Read all channels of a sensor into values
+ * 
+ * Callbacks are only run by the read task, outside the mutex. Push-only
+ * child sensors have no callback and answer with the last value the
+ * application reported.
+ */
+static esp_err_t sensor_read(sensor_node_t *sensor, float *values) {
+    if (!sensor->read_cb && !sensor->read_multi_cb) {
+        if (!sensor->last_read_time) {
+            return ESP_ERR_INVALID_STATE;
+        }
+        values[0] = sensor->last_value;
+        return ESP_OK;
+    }
+    if (sensor->read_multi_cb) {
+        return sensor->read_multi_cb(sensor->sensor_id, values, sensor->channel_count, sensor->user_data);
+    }
+    return sensor->read_cb(sensor->sensor_id, values, sensor->user_data);
+}
+
+/**
+ * @brief Check whether a reading is within the deadband of the last published one
+ * 
+ * A multi-channel reading is only suppressed if every channel is.
+ */
+static bool sensor_within_deadband(const sensor_node_t *sensor, const float *values) {
+    if (!sensor->published) {
+        return false;
+    }
+    
+    float deadband = sensor->deadband >= 0 ? sensor->deadband : g_bridge_ctx->config.sensor_deadband;
+    const float *last = sensor->channels ? sensor->channel_published : &sensor->last_published;
+    for (uint8_t i = 0; i < sensor->channel_count; i++) {
+        if (fabsf(values[i] - last[i]) >= deadband) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Find actuator by ID
+ */
+static actuator_node_t* find_actuator(const char *actuator_id) {
+    if (!g_bridge_ctx || !actuator_id) return NULL;
+    
+    int entry = mcp_registry_index_find(&g_bridge_ctx->actuator_ids, actuator_id, actuator_id_at);
+    return entry >= 0 ? &g_bridge_ctx->actuators[entry] : NULL;
+}
+
+/**
+ * @brief Find the first registered actuator of a type on a device
+ */
+static actuator_node_t* find_actuator_by_type(uint16_t device, const char *type) {
+    char key[MCP_BRIDGE_MAX_TOPIC_LEN];
+    type_key_format(key, sizeof(key), device, type);
+    int entry = mcp_registry_index_find(&g_bridge_ctx->actuator_types, key, actuator_type_at);
+    return entry >= 0 ? &g_bridge_ctx->actuators[entry] : NULL;
+}
+
+/**
+ * @brief Find a child device by ID
+ */
+static child_node_t* find_child(const char *child_id) {
+    int entry = mcp_registry_index_find(&g_bridge_ctx->child_ids, child_id, child_id_at);
+    return entry >= 0 ? &g_bridge_ctx->children[entry] : NULL;
+}
+
+/* ==================== DEFERRED LOGGING ==================== */
+
+// Same line layout as ESP_LOGx, without colors, stamped with the time of the record
+#define BLOG_WRITE(rec, fmt, ...) \
+    esp_log_write((esp_log_level_t)(rec)->level, TAG, "%c (%lu) %s: " fmt "\n", \
+                  "NEWIDV"[(rec)->level], (unsigned long)(rec)->ts_ms, TAG, ##__VA_ARGS__)
+
+/**
+ * @brief Whether a bridge message at this level passes config.log_level
+ * 
+ * Checked before a record is built, so a suppressed hot-path message costs
+ * one comparison.
+ */
+static inline bool blog_enabled(esp_log_level_t level) {
+    return level <= g_bridge_ctx->config.log_level;
+}
+
+/**
+ * @brief Copy a string argument into a slot of the record text
+ */
+static void blog_text(blog_record_t *rec, size_t offset, size_t len, const char *str, size_t str_len) {
+    if (str_len > len - 1) {
+        str_len = len - 1;
+    }
+    memcpy(rec->text + offset, str, str_len);
+    rec->text[offset + str_len] = '\0';
+}
+
+/**
+ * @brief Format one record
+ */
+static void blog_write(const blog_record_t *rec) {
+    const sensor_node_t *sensor = rec->ref;
+    const actuator_node_t *actuator = rec->ref;
+    
+    switch ((blog_id_t)rec->id) {
+        case BLOG_MQTT_RECEIVED:
+            BLOG_WRITE(rec, "MQTT message received: %s", rec->text);
+            break;
+        case BLOG_COMMAND:
+            BLOG_WRITE(rec, "Processing command for %s/%s: %s = %s%s%s", device_id_of(actuator->device),
+                      actuator->type, rec->text + BLOG_ACTION_OFFSET, rec->text + BLOG_VALUE_OFFSET,
+                      rec->text[BLOG_RULE_OFFSET] ? " by rule " : "", rec->text + BLOG_RULE_OFFSET);
+            break;
+        case BLOG_SENSOR_PUBLISHED:
+            BLOG_WRITE(rec, "Published sensor %s: %.2f %s (%u channels)", sensor->sensor_id, 
+                      rec->value, sensor->unit ? sensor->unit : "", sensor->channel_count);
+            break;
+        case BLOG_EVENT_PUBLISHED:
+            BLOG_WRITE(rec, "Event from %s published %ld us after the interrupt", 
+                      sensor->sensor_id, (long)rec->num);
+            break;
+        case BLOG_EVENT_DROPPED:
+            BLOG_WRITE(rec, "Dropping event from %s - MQTT not connected", sensor->sensor_id);
+            break;
+        case BLOG_SENSOR_READ:
+            BLOG_WRITE(rec, "On-demand read of %s: %s (%.0f us)", 
+                      rec->text, esp_err_to_name(rec->num), rec->value);
+            break;
+    }
+}
+
+/**
+ * @brief Record a hot-path message (caller checked blog_enabled)
+ * 
+ * Never formats or blocks: the record is queued for the health task, or
+ * dropped and counted when the queue is full.
+ */
+static void blog_record(blog_record_t *rec) {
+    rec->ts_ms = esp_log_timestamp();
+    if (!g_bridge_ctx->log_queue) {
+        blog_write(rec);
+    } else if (xQueueSend(g_bridge_ctx->log_queue, rec, 0) != pdTRUE) {
+        g_bridge_ctx->log_dropped++;
+    }
+}
+
+/**
+ * @brief Format every queued record (health task, and on stop)
+ */
+static void blog_drain(void) {
+    blog_record_t rec;
+    uint32_t dropped = g_bridge_ctx->log_dropped;
+    
+    while (g_bridge_ctx->log_queue && xQueueReceive(g_bridge_ctx->log_queue, &rec, 0) == pdTRUE) {
+        blog_write(&rec);
+    }
+    
+    static uint32_t reported;
+    if (dropped < reported) {
+        reported = 0;               // metrics were reset
+    }
+    if (dropped != reported) {
+        ESP_LOGW(TAG, "%lu log records dropped, queue full", (unsigned long)(dropped - reported));
+        reported = dropped;
+    }
+}
+
+/* ==================== SENSOR SCHEDULE ==================== */
+
+/**
+ * @brief Poll period of a sensor: its own update interval, else the bridge interval
+ */
+static uint32_t sensor_period_ms(const sensor_node_t *sensor) {
+    uint32_t ms = sensor->metadata.update_interval_ms ? 
+                  sensor->metadata.update_interval_ms : g_bridge_ctx->config.sensor_publish_interval_ms;
+    if (ms < MCP_BRIDGE_MIN_PUBLISH_INTERVAL_MS) {
+        ms = MCP_BRIDGE_MIN_PUBLISH_INTERVAL_MS;
+    }
+    return ms;
+}
+
+static TickType_t sensor_period(const sensor_node_t *sensor) {
+    return pdMS_TO_TICKS(sensor_period_ms(sensor));
+}
+
+/**
+ * @brief Make every sensor due at now (caller holds the mutex)
+ * 
+ * Equal keys are already a valid heap, so no reordering is needed. These
+ * polls are off any aligned slot; the ones after them are aligned again.
+ */
+static void schedule_reset(TickType_t now) {
+    for (uint16_t i = 0; i < g_bridge_ctx->sensor_schedule.len; i++) {
+        g_bridge_ctx->sensors[g_bridge_ctx->sensor_schedule.heap[i]].next_due = now;
+        g_bridge_ctx->sensors[g_bridge_ctx->sensor_schedule.heap[i]].slot_us = 0;
+    }
+}
+
+/**
+ * @brief Schedule the next poll of a sensor that was just polled (caller holds the mutex)
+ * 
+ * Keeps the sensor's cadence, but doesn't burst to catch up after a stall.
+ * With aligned sampling and a synchronized clock the poll goes to the next
+ * wall-clock multiple of the period instead; it fires within a tick of its
+ * slot. Slots missed during a stall are skipped.
+ */
+static void schedule_advance(sensor_node_t *sensor, TickType_t now) {
+    TickType_t period = sensor_period(sensor);
+    
+#if CONFIG_MCP_BRIDGE_ALIGNED_SAMPLING
+    if (g_bridge_ctx->time_synced) {
+        int64_t period_us = (int64_t)sensor_period_ms(sensor) * 1000;
+        struct timeval tv;
+        TickType_t tick = xTaskGetTickCount();
+        gettimeofday(&tv, NULL);
+        int64_t wall_us = (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+        
+        // An SNTP correction may put the clock back; never repeat a slot
+        int64_t slot_us = (wall_us / period_us + 1) * period_us;
+        if (slot_us <= sensor->slot_us) {
+            slot_us = sensor->slot_us + period_us;
+        }
+        sensor->slot_us = slot_us;
+        sensor->next_due = tick + (TickType_t)(((slot_us - wall_us) * configTICK_RATE_HZ + 999999) / 1000000);
+        return;
+    }
+    sensor->slot_us = 0;
+#endif
+    
+    sensor->next_due += period;
+    if ((int32_t)(sensor->next_due - now) <= 0) {
+        sensor->next_due = now + period;
+    }
+}
+
+/* ==================== MESSAGE AUTHENTICATION ==================== */
+
+/*
+ * With enable_device_auth every published payload gets a trailer:
+ *   payload, u32 counter (little-endian), tag[CONFIG_MCP_BRIDGE_AUTH_TAG_LEN]
+ * The tag is HMAC-SHA256(key, topic, 0x00, payload, counter), truncated. The
+ * counter grows with every publish and across reboots, so the server can
+ * reject replays; the topic is covered so a message cannot be replayed on
+ * another topic.
+ */
+
+/**
+ * @brief Reserve the next block of counter values in NVS
+ * 
+ * Counters up to the reserved value may be used without another flash
+ * write. After a reboot counting resumes at the reserved value, so no
+ * counter is ever used twice.
+ */
+static esp_err_t auth_counter_reserve(uint32_t from) {
+    uint32_t reserved = from > UINT32_MAX - CONFIG_MCP_BRIDGE_AUTH_COUNTER_BLOCK ? 
+                        UINT32_MAX : from + CONFIG_MCP_BRIDGE_AUTH_COUNTER_BLOCK;
+    nvs_handle_t nvs;
+    esp_err_t ret = nvs_open(MCP_BRIDGE_NVS_NAMESPACE, NVS_READWRITE, &nvs);
+    if (ret == ESP_OK) {
+        ret = nvs_set_u32(nvs, "auth_ctr", reserved);
+        if (ret == ESP_OK) {
+            ret = nvs_commit(nvs);
+        }
+        nvs_close(nvs);
+    }
+    if (ret == ESP_OK) {
+        g_bridge_ctx->auth_counter_reserved = reserved;
+    }
+    return ret;
+}
+
+/**
+ * @brief Load the key and the counter (once per init)
+ */
+static esp_err_t auth_init(void) {
+    if (g_bridge_ctx->auth_ready) {
+        return ESP_OK;
+    }
+    
+#if CONFIG_MCP_BRIDGE_AUTH_KEY_EFUSE
+    if (esp_efuse_get_key_purpose(EFUSE_BLK_KEY0 + CONFIG_MCP_BRIDGE_AUTH_EFUSE_KEY_ID) != 
+        ESP_EFUSE_KEY_PURPOSE_HMAC_UP) {
+        ESP_LOGE(TAG, "eFuse key block %d holds no HMAC_UP key", CONFIG_MCP_BRIDGE_AUTH_EFUSE_KEY_ID);
+        return ESP_ERR_NOT_FOUND;
+    }
+#endif
+    
+#if !CONFIG_MCP_BRIDGE_AUTH_KEY_EFUSE
+    uint8_t key[MCP_BRIDGE_AUTH_KEY_LEN];
+    size_t key_len = sizeof(key);
+#endif
+    uint32_t counter = 0;
+    nvs_handle_t nvs;
+    esp_err_t ret = nvs_open(MCP_BRIDGE_NVS_NAMESPACE, NVS_READONLY, &nvs);
+    if (ret == ESP_OK) {
+        nvs_get_u32(nvs, "auth_ctr", &counter);
+#if !CONFIG_MCP_BRIDGE_AUTH_KEY_EFUSE
+        ret = nvs_get_blob(nvs, "auth_key", key, &key_len);
+#endif
+        nvs_close(nvs);
+    }
+    
+#if !CONFIG_MCP_BRIDGE_AUTH_KEY_EFUSE
+    if (ret != ESP_OK || key_len != MCP_BRIDGE_AUTH_KEY_LEN) {
+        mbedtls_platform_zeroize(key, sizeof(key));
+        ESP_LOGE(TAG, "No message authentication key provisioned");
+        return ESP_ERR_NOT_FOUND;
+    }
+    
+    // Keyed once: each message then costs only the inner and outer hash
+    mbedtls_md_init(&g_bridge_ctx->auth_md);
+    ret = mbedtls_md_setup(&g_bridge_ctx->auth_md, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 1);
+    if (ret == 0) {
+        ret = mbedtls_md_hmac_starts(&g_bridge_ctx->auth_md, key, key_len);
+    }
+    mbedtls_platform_zeroize(key, sizeof(key));
+    if (ret != 0) {
+        mbedtls_md_free(&g_bridge_ctx->auth_md);
+        return ESP_FAIL;
+    }
+#endif
+    
+    if (counter == UINT32_MAX || auth_counter_reserve(counter) != ESP_OK) {
+        ESP_LOGE(TAG, "Message authentication counter unavailable");
+#if !CONFIG_MCP_BRIDGE_AUTH_KEY_EFUSE
+        mbedtls_md_free(&g_bridge_ctx->auth_md);
+#endif
+        return ESP_FAIL;
+    }
+    g_bridge_ctx->auth_counter = counter;
+    g_bridge_ctx->auth_ready = true;
+    ESP_LOGI(TAG, "Message authentication on, counter %lu", (unsigned long)counter);
+    return ESP_OK;
+}
+
+/**
+ * @brief Append the counter and tag to a payload (caller holds publish_lock)
+ * 
+ * @param len Payload length (0 = NUL-terminated string); updated to the signed length
+ * @return Signed payload, valid until the next publish, or NULL on failure
+ */
+static const char* auth_sign(const char *topic, const char *data, int *len) {
+    if (*len == 0 && data) {
+        *len = strlen(data);
+    }
+    
+    size_t topic_len = strlen(topic) + 1;
+    size_t signed_len = topic_len + *len + MCP_BRIDGE_AUTH_COUNTER_LEN;
+    if (signed_len + CONFIG_MCP_BRIDGE_AUTH_TAG_LEN > g_bridge_ctx->auth_buf_size) {
+        size_t size = signed_len + CONFIG_MCP_BRIDGE_AUTH_TAG_LEN;
+        uint8_t *buf = realloc(g_bridge_ctx->auth_buf, size);
+        if (!buf) {
+            return NULL;
+        }
+        g_bridge_ctx->auth_buf = buf;
+        g_bridge_ctx->auth_buf_size = size;
+    }
+    
+    // Rare flash write; a counter that cannot be made durable is never used
+    if (g_bridge_ctx->auth_counter >= g_bridge_ctx->auth_counter_reserved &&
+        (g_bridge_ctx->auth_counter == UINT32_MAX || 
+         auth_counter_reserve(g_bridge_ctx->auth_counter) != ESP_OK)) {
+        ESP_LOGE(TAG, "Message authentication counter exhausted or not persisted");
+        return NULL;
+    }
+    uint32_t counter = ++g_bridge_ctx->auth_counter;
+    
+    uint8_t *buf = g_bridge_ctx->auth_buf;
+    memcpy(buf, topic, topic_len);
+    memcpy(buf + topic_len, data, *len);
+    uint8_t *ctr = buf + topic_len + *len;
+    ctr[0] = counter & 0xff;
+    ctr[1] = (counter >> 8) & 0xff;
+    ctr[2] = (counter >> 16) & 0xff;
+    ctr[3] = counter >> 24;
+    
+    uint8_t mac[32];
+#if CONFIG_MCP_BRIDGE_AUTH_KEY_EFUSE
+    if (esp_hmac_calculate(HMAC_KEY0 + CONFIG_MCP_BRIDGE_AUTH_EFUSE_KEY_ID, buf, signed_len, mac) != ESP_OK) {
+        return NULL;
+    }
+#else
+    if (mbedtls_md_hmac_reset(&g_bridge_ctx->auth_md) != 0 ||
+        mbedtls_md_hmac_update(&g_bridge_ctx->auth_md, buf, signed_len) != 0 ||
+        mbedtls_md_hmac_finish(&g_bridge_ctx->auth_md, mac) != 0) {
+        return NULL;
+    }
+#endif
+    memcpy(buf + signed_len, mac, CONFIG_MCP_BRIDGE_AUTH_TAG_LEN);
+    
+    *len += MCP_BRIDGE_AUTH_TRAILER_LEN;
+    return (const char *)buf + topic_len;
+}
+
+/**
+ * @brief Release the key and signing buffer
+ */
+static void auth_deinit(void) {
+#if !CONFIG_MCP_BRIDGE_AUTH_KEY_EFUSE
+    if (g_bridge_ctx->auth_ready) {
+        mbedtls_md_free(&g_bridge_ctx->auth_md);
+    }
+#endif
+    free(g_bridge_ctx->auth_buf);
+    g_bridge_ctx->auth_buf = NULL;
+    g_bridge_ctx->auth_buf_size = 0;
+    g_bridge_ctx->auth_ready = false;
+}
+
+/* ==================== MQTT PUBLISH ==================== */
+
+/**
+ * @brief MQTT transport: publish, applying MQTT v5 properties when connected with v5
+ * 
+ * esp-mqtt keeps publish properties on the client until the next publish, so
+ * setting them and publishing must not interleave with other tasks; this is
+ * called with publish_lock held, like every transport publish. Properties
+ * other than the content type come from publish_props.
+ * 
+ * @return Message ID (>= 0) on success, -1 on failure
+ */
+static int mqtt_transport_publish(mcp_transport_t *transport, const char *topic, const char *data, int len,
+                                  int qos, bool retain, const char *content_type) {
+    const char *wire_topic = topic;
+#if MCP_BRIDGE_MQTT5_ENABLED
+    const mqtt_publish_props_t *props = g_bridge_ctx->publish_props;
+    mqtt_topic_alias_t *alias = NULL;
+    if (g_bridge_ctx->mqtt5_active && (props || content_type)) {
+        esp_mqtt5_publish_property_config_t property = {
+            .message_expiry_interval = props ? props->message_expiry_s : 0,
+            .content_type = content_type,
+            // The binary trailer makes signed JSON invalid UTF-8
+            .payload_format_indicator = content_type && !g_bridge_ctx->auth_ready &&
+                                        strcmp(content_type, MCP_CONTENT_TYPE_JSON) == 0,
+        };
+        // QoS 1/2 messages are resent as stored after a reconnect, where the
+        // alias is not mapped; only QoS 0 messages may use one
+        if (props && props->alias && props->alias->alias && qos == 0) {
+            alias = props->alias;
+            property.topic_alias = alias->alias;
+        }
+        
+        if (esp_mqtt5_client_set_publish_property(g_bridge_ctx->mqtt_client, &property) != ESP_OK && alias) {
+            // Alias is above the broker's Topic Alias Maximum, stop using it
+            ESP_LOGW(TAG, "Broker rejected topic alias %u for %s", alias->alias, topic);
+            alias->alias = 0;
+            alias = NULL;
+            property.topic_alias = 0;
+            esp_mqtt5_client_set_publish_property(g_bridge_ctx->mqtt_client, &property);
+        } else if (alias && alias->session == g_bridge_ctx->mqtt_session) {
+            // Alias already mapped on this connection, send an empty topic
+            wire_topic = "";
+        }
+    }
+#endif
+    
+    int msg_id = esp_mqtt_client_publish(g_bridge_ctx->mqtt_client, wire_topic, data, len, qos, retain);
+    
+#if MCP_BRIDGE_MQTT5_ENABLED
+    if (msg_id >= 0 && alias) {
+        alias->session = g_bridge_ctx->mqtt_session;
+    }
+#endif
+    return msg_id;
+}
+
+static esp_err_t mqtt_transport_subscribe(mcp_transport_t *transport, const char *topic_filter, int qos) {
+    return esp_mqtt_client_subscribe(g_bridge_ctx->mqtt_client, topic_filter, qos) >= 0 ? ESP_OK : ESP_FAIL;
+}
+
+static void mqtt_transport_set_receive_cb(mcp_transport_t *transport, mcp_transport_receive_cb_t cb, void *arg) {
+    g_bridge_ctx->mqtt_receive_cb = cb;
+    g_bridge_ctx->mqtt_receive_arg = arg;
+}
+
+/**
+ * @brief MQTT transport: start the client; it reconnects on its own from then on
+ */
+static esp_err_t mqtt_transport_connect(mcp_transport_t *transport) {
+    if (!g_bridge_ctx->mqtt_client) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (g_bridge_ctx->mqtt_started) {
+        return ESP_OK;
+    }
+    esp_err_t ret = esp_mqtt_client_start(g_bridge_ctx->mqtt_client);
+    g_bridge_ctx->mqtt_started = ret == ESP_OK;
+    return ret;
+}
+
+static void mqtt_transport_disconnect(mcp_transport_t *transport) {
+    if (g_bridge_ctx->mqtt_client && g_bridge_ctx->mqtt_started) {
+        esp_mqtt_client_stop(g_bridge_ctx->mqtt_client);
+        g_bridge_ctx->mqtt_started = false;
+    }
+}
+
+/**
+ * @brief Whether a message class goes through the built-in MQTT transport
+ */
+static bool transport_is_mqtt(mcp_message_class_t message_class) {
+    return g_bridge_ctx->transports[message_class] == &g_bridge_ctx->mqtt_transport;
+}
+
+/**
+ * @brief Sign a message and publish it through a transport
+ * 
+ * Publishes are serialized on publish_lock. The MQTT task holds the client
+ * lock while dispatching events and therefore never waits for publish_lock;
+ * bridge work triggered by MQTT events is queued to the actuator task
+ * instead. Messages are signed under the same lock, so authentication
+ * counters follow the publish order.
+ * 
+ * @param props MQTT v5 properties, or NULL for none; other transports only get the content type
+ * @return >= 0 on success (message ID for MQTT), -1 on failure
+ */
+static int transport_publish(mcp_transport_t *transport, const char *topic, const char *data, int len,
+                             int qos, int retain, const mqtt_publish_props_t *props) {
+    bool in_mqtt_task = xTaskGetCurrentTaskHandle() == g_bridge_ctx->mqtt_task_handle;
+    if (xSemaphoreTake(g_bridge_ctx->publish_lock, in_mqtt_task ? 0 : portMAX_DELAY) != pdTRUE) {
+        ESP_LOGW(TAG, "Publish to %s dropped, publish in progress on another task", topic);
+        return -1;
+    }
+    
+    if (len == 0) {
+        len = strlen(data);
+    }
+    if (g_bridge_ctx->auth_ready) {
+        data = auth_sign(topic, data, &len);
+        if (!data) {
+            xSemaphoreGive(g_bridge_ctx->publish_lock);
+            ESP_LOGW(TAG, "Publish to %s dropped, message could not be signed", topic);
+            return -1;
+        }
+    }
+    
+    g_bridge_ctx->publish_props = props;
+    int ret = transport->publish(transport, topic, data, len, qos, retain, props ? props->content_type : NULL);
+    g_bridge_ctx->publish_props = NULL;
+    xSemaphoreGive(g_bridge_ctx->publish_lock);
+    return ret;
+}
+
+/**
+ * @brief Publish over MQTT, whichever transport the message's class is routed to
+ * 
+ * For the flash outbox, whose messages are acknowledged by the broker.
+ * 
+ * @return Message ID (>= 0) on success, -1 on failure
+ */
+static int mqtt_publish(const char *topic, const char *data, int len, int qos, int retain,
+                        const mqtt_publish_props_t *props) {
+    return transport_publish(&g_bridge_ctx->mqtt_transport, topic, data, len, qos, retain, props);
+}
+
+/* ==================== PERSISTENT OUTBOX ==================== */
+
+/**
+ * @brief Whether a message is kept in the flash outbox until acknowledged
+ *
+ * Only QoS 1+ status and error messages sent over MQTT; retained messages
+ * are restated on every connect anyway.
+ */
+static bool outbox_persists(mcp_message_class_t message_class, int qos, int retain) {
+#if CONFIG_MCP_BRIDGE_OUTBOX_PERSIST
+    return g_bridge_ctx->outbox_ready && message_class == MCP_MESSAGE_CLASS_STATUS && qos > 0 && !retain &&
+           transport_is_mqtt(message_class);
+#else
+    return false;
+#endif
+}
+
+#if CONFIG_MCP_BRIDGE_OUTBOX_PERSIST
+#define MCP_BRIDGE_OUTBOX_TOKEN_US (3600LL * 1000000 / CONFIG_MCP_BRIDGE_OUTBOX_WRITES_PER_HOUR)
+
+static int outbox_flash_read(void *ctx, uint32_t offset, void *dst, size_t len) {
+    return esp_partition_read((const esp_partition_t *)ctx, offset, dst, len) == ESP_OK ? 0 : -1;
+}
+
+static int outbox_flash_write(void *ctx, uint32_t offset, const void *src, size_t len) {
+    return esp_partition_write((const esp_partition_t *)ctx, offset, src, len) == ESP_OK ? 0 : -1;
+}
+
+static int outbox_flash_erase(void *ctx, uint32_t offset, size_t len) {
+    return esp_partition_erase_range((const esp_partition_t *)ctx, offset, len) == ESP_OK ? 0 : -1;
+}
+
+/**
+ * @brief Open the outbox partition and load the messages left unacknowledged
+ *
+ * Runs on the first start only; the outbox stays open until deinit.
+ */
+static esp_err_t outbox_init(void) {
+    if (g_bridge_ctx->outbox_ready) {
+        return ESP_OK;
+    }
+
+    const esp_partition_t *partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY,
+                                                                CONFIG_MCP_BRIDGE_OUTBOX_PARTITION);
+    if (!partition) {
+        ESP_LOGW(TAG, "No \"%s\" partition, QoS 1 messages are kept in RAM only", CONFIG_MCP_BRIDGE_OUTBOX_PARTITION);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    if (!g_bridge_ctx->outbox_lock) {
+        g_bridge_ctx->outbox_lock = xSemaphoreCreateMutex();
+    }
+    if (!g_bridge_ctx->outbox_acks) {
+        g_bridge_ctx->outbox_acks = xQueueCreate(CONFIG_MCP_BRIDGE_OUTBOX_MAX_MESSAGES, sizeof(int));
+    }
+    if (!g_bridge_ctx->outbox_lock || !g_bridge_ctx->outbox_acks) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    mcp_outbox_storage_t storage = {
+        .read = outbox_flash_read,
+        .write = outbox_flash_write,
+        .erase = outbox_flash_erase,
+        .sector_size = partition->erase_size,
+        .sector_count = partition->size / partition->erase_size,
+        .ctx = (void *)partition,
+    };
+    if (mcp_outbox_open(&g_bridge_ctx->outbox, &storage, CONFIG_MCP_BRIDGE_OUTBOX_MAX_MESSAGES,
+                        MCP_BRIDGE_MAX_TOPIC_LEN + MCP_BRIDGE_MAX_MESSAGE_LEN) != 0) {
+        ESP_LOGE(TAG, "Failed to open the outbox in partition \"%s\"", partition->label);
+        return ESP_FAIL;
+    }
+
+    if (g_bridge_ctx->outbox.lost) {
+        ESP_LOGW(TAG, "Outbox held more than %d messages, dropped %lu",
+                 CONFIG_MCP_BRIDGE_OUTBOX_MAX_MESSAGES, (unsigned long)g_bridge_ctx->outbox.lost);
+    }
+    if (g_bridge_ctx->outbox.count) {
+        ESP_LOGI(TAG, "%u unacknowledged messages restored from flash", g_bridge_ctx->outbox.count);
+    }
+    g_bridge_ctx->outbox_tokens = CONFIG_MCP_BRIDGE_OUTBOX_MAX_MESSAGES;
+    g_bridge_ctx->outbox_refill_us = esp_timer_get_time();
+    g_bridge_ctx->outbox_ready = true;
+    return ESP_OK;
+}
+
+static void outbox_deinit(void) {
+    if (g_bridge_ctx->outbox_ready) {
+        mcp_outbox_close(&g_bridge_ctx->outbox);
+        g_bridge_ctx->outbox_ready = false;
+    }
+    if (g_bridge_ctx->outbox_lock) vSemaphoreDelete(g_bridge_ctx->outbox_lock);
+    if (g_bridge_ctx->outbox_acks) vQueueDelete(g_bridge_ctx->outbox_acks);
+}
+
+/**
+ * @brief Take one flash write from the hourly budget
+ */
+static bool outbox_take_token(void) {
+    int64_t now = esp_timer_get_time();
+    int64_t earned = (now - g_bridge_ctx->outbox_refill_us) / MCP_BRIDGE_OUTBOX_TOKEN_US;
+    if (earned > 0) {
+        g_bridge_ctx->outbox_refill_us += earned * MCP_BRIDGE_OUTBOX_TOKEN_US;
+        if (g_bridge_ctx->outbox_tokens + earned >= CONFIG_MCP_BRIDGE_OUTBOX_MAX_MESSAGES) {
+            g_bridge_ctx->outbox_tokens = CONFIG_MCP_BRIDGE_OUTBOX_MAX_MESSAGES;
+            g_bridge_ctx->outbox_refill_us = now;
+        } else {
+            g_bridge_ctx->outbox_tokens += earned;
+        }
+    }
+
+    if (g_bridge_ctx->outbox_tokens == 0) {
+        return false;
+    }
+    g_bridge_ctx->outbox_tokens--;
+    return true;
+}
+
+/**
+ * @brief Log a message to flash, then publish it if MQTT is connected
+ *
+ * A logged message that cannot be sent now waits for outbox_replay() rather
+ * than the RAM outbox of esp-mqtt, so it goes out once. Messages over the
+ * write budget or beyond the outbox size take the old RAM-only path.
+ *
+ * @return Message ID, 0 if the message waits in flash, -1 on failure
+ */
+static int outbox_publish(const char *topic, const char *data, int len, int qos) {
+    bool in_mqtt_task = xTaskGetCurrentTaskHandle() == g_bridge_ctx->mqtt_task_handle;
+    if (xSemaphoreTake(g_bridge_ctx->outbox_lock, in_mqtt_task ? 0 : portMAX_DELAY) != pdTRUE) {
+        return mqtt_publish(topic, data, len, qos, false, NULL);
+    }
+
+    if (len == 0) {
+        len = strlen(data);
+    }
+    int index = -1;
+    if (outbox_take_token()) {
+        index = mcp_outbox_append(&g_bridge_ctx->outbox, topic, data, len, qos);
+    }
+    if (index < 0) {
+        g_bridge_ctx->outbox_unpersisted++;
+    }
+
+    int msg_id = 0;
+    if (index < 0 || g_bridge_ctx->mqtt_connected) {
+        msg_id = mqtt_publish(topic, data, len, qos, false, NULL);
+        if (index >= 0) {
+            g_bridge_ctx->outbox.entries[index].msg_id = msg_id;
+            msg_id = msg_id < 0 ? 0 : msg_id;
+        }
+    }
+    xSemaphoreGive(g_bridge_ctx->outbox_lock);
+    return msg_id;
+}
+
+/**
+ * @brief Send the logged messages no MQTT client currently holds, oldest first
+ *
+ * Called when a session starts. Replays are signed again with fresh
+ * counters. Stops at the first failure so the order is kept.
+ */
+static void outbox_replay(void) {
+    if (!g_bridge_ctx->outbox_ready || !g_bridge_ctx->mqtt_connected) {
+        return;
+    }
+
+    uint16_t sent = 0;
+    xSemaphoreTake(g_bridge_ctx->outbox_lock, portMAX_DELAY);
+    for (uint16_t i = 0; i < g_bridge_ctx->outbox.count; i++) {
+        mcp_outbox_entry_t *entry = &g_bridge_ctx->outbox.entries[i];
+        if (entry->msg_id >= 0) {
+            continue;
+        }
+
+        const char *topic, *data;
+        size_t len;
+        if (mcp_outbox_load(&g_bridge_ctx->outbox, i, &topic, &data, &len) != 0) {
+            ESP_LOGW(TAG, "Outbox message %lu unreadable, dropped", (unsigned long)entry->seq);
+            mcp_outbox_remove(&g_bridge_ctx->outbox, i--);
+            continue;
+        }
+        entry->msg_id = mqtt_publish(topic, data, len, entry->qos, false, NULL);
+        if (entry->msg_id < 0) {
+            break;
+        }
+        sent++;
+    }
+    xSemaphoreGive(g_bridge_ctx->outbox_lock);
+
+    if (sent) {
+        ESP_LOGI(TAG, "Replayed %u unacknowledged messages from flash", sent);
+    }
+}
+
+/**
+ * @brief Apply the acknowledgments queued by the MQTT task
+ *
+ * Acknowledged messages are marked done in flash. Messages esp-mqtt dropped
+ * from its RAM outbox (expired) are sent again from flash.
+ */
+static void outbox_service(void) {
+    if (!g_bridge_ctx->outbox_ready) {
+        return;
+    }
+
+    int msg_id;
+    bool resend = false;
+    xSemaphoreTake(g_bridge_ctx->outbox_lock, portMAX_DELAY);
+    while (xQueueReceive(g_bridge_ctx->outbox_acks, &msg_id, 0) == pdTRUE) {
+        for (uint16_t i = 0; i < g_bridge_ctx->outbox.count; i++) {
+            mcp_outbox_entry_t *entry = &g_bridge_ctx->outbox.entries[i];
+            if (entry->msg_id != abs(msg_id)) {
+                continue;
+            }
+            if (msg_id > 0) {
+                mcp_outbox_remove(&g_bridge_ctx->outbox, i);
+            } else {
+                entry->msg_id = -1;
+                resend = true;
+            }
+            break;
+        }
+    }
+    xSemaphoreGive(g_bridge_ctx->outbox_lock);
+
+    if (resend) {
+        outbox_replay();
+    }
+}
+
+/**
+ * @brief Forget the msg_ids of a destroyed MQTT client
+ */
+static void outbox_release_client(void) {
+    if (!g_bridge_ctx->outbox_ready) {
+        return;
+    }
+
+    xSemaphoreTake(g_bridge_ctx->outbox_lock, portMAX_DELAY);
+    xQueueReset(g_bridge_ctx->outbox_acks);
+    for (uint16_t i = 0; i < g_bridge_ctx->outbox.count; i++) {
+        g_bridge_ctx->outbox.entries[i].msg_id = -1;
+    }
+    xSemaphoreGive(g_bridge_ctx->outbox_lock);
+}
+#endif
+
+/* ==================== MESSAGE ROUTING ==================== */
+
+/**
+ * @brief Publish a message through the transport of its class
+ * 
+ * QoS 1 status messages go through the flash outbox when it is enabled.
+ * 
+ * @return >= 0 on success, -1 on failure
+ */
+static int bridge_publish(mcp_message_class_t message_class, const char *topic, const char *data, int len,
+                          int qos, int retain, const mqtt_publish_props_t *props) {
+#if CONFIG_MCP_BRIDGE_OUTBOX_PERSIST
+    if (outbox_persists(message_class, qos, retain)) {
+        return outbox_publish(topic, data, len, qos);
+    }
+#endif
+    return transport_publish(g_bridge_ctx->transports[message_class], topic, data, len, qos, retain, props);
+}
+
+/* ==================== JSON MESSAGE FORMATTING ==================== */
+
+/**
+ * @brief Add a reading as the "value" object of a sensor message
+ * 
+ * Single-value sensors carry "reading" and "unit"; multi-channel sensors
+ * carry "readings" keyed by channel name (units are in the capabilities).
+ */
+static void json_add_sensor_value(cJSON *json, const sensor_node_t *sensor, const float *values) {
+    cJSON *value_obj = cJSON_AddObjectToObject(json, "value");
+    
+    if (sensor->channels) {
+        cJSON *readings = cJSON_AddObjectToObject(value_obj, "readings");
+        for (uint8_t i = 0; i < sensor->channel_count; i++) {
+            cJSON_AddNumberToObject(readings, sensor->channels[i].name, values[i]);
+        }
+    } else {
+        cJSON_AddNumberToObject(value_obj, "reading", values[0]);
+        if (sensor->unit) {
+            cJSON_AddStringToObject(value_obj, "unit", sensor->unit);
+        }
+    }
+    cJSON_AddNumberToObject(value_obj, "quality", 100); // Default quality
+}
+
+/**
+ * @brief Create sensor data JSON message
+ */
+static char* create_sensor_message(const sensor_node_t *sensor, const float *values, int64_t sampled_us,
+                                   int64_t slot_us, uint32_t seq) {
+    cJSON *json = cJSON_CreateObject();
+    
+    cJSON_AddStringToObject(json, "device_id", g_bridge_ctx->device_id);
+    json_add_timestamp_at(json, sampled_us, slot_us);
+    json_add_sequence(json, seq);
+    cJSON_AddStringToObject(json, "type", "sensor");
+    cJSON_AddStringToObject(json, "component", sensor->type);
+    cJSON_AddStringToObject(json, "action", "read");
+    
+    json_add_sensor_value(json, sensor, values);
+
+#if CONFIG_MCP_BRIDGE_SENSOR_MESSAGE_METRICS
+    // Heap and uptime go out in the health record; per reading only on request
+    cJSON *metrics = cJSON_CreateObject();
+    cJSON_AddNumberToObject(metrics, "free_heap", esp_get_free_heap_size());
+    cJSON_AddNumberToObject(metrics, "uptime", get_timestamp() - g_bridge_ctx->boot_time);
+    cJSON_AddItemToObject(json, "metrics", metrics);
+#endif
+
+    // Unformatted: whitespace is pure per-message overhead on high-rate topics
+    char *json_string = cJSON_PrintUnformatted(json);
+    cJSON_Delete(json);
+    
+    return json_string;
+}
+
+/**
+ * @brief Encode a sensor reading as a binary record
+ * 
+ * Layout (little-endian, 23 bytes): u8 version, f32 reading, i64 timestamp
+ * (us, see get_timestamp_us), u8 flags, u8 quality, u32 boot epoch, u32
+ * sequence. Device and sensor type come from the topic. An aligned reading
+ * carries its slot as the timestamp.
+ */
+static size_t encode_sensor_binary(uint8_t *buf, float value, uint8_t quality, int64_t sampled_us,
+                                   int64_t slot_us, uint32_t seq) {
+    bool synced = true;
+    int64_t ts_us = slot_us ? slot_us : get_timestamp_us_at(sampled_us, &synced);
+    
+    buf[0] = MCP_SENSOR_BINARY_VERSION;
+    memcpy(&buf[1], &value, sizeof(value));         // Xtensa/RISC-V ESP32 cores are little-endian
+    memcpy(&buf[5], &ts_us, sizeof(ts_us));
+    buf[13] = (synced ? MCP_SENSOR_BINARY_FLAG_TIME_SYNCED : 0) | (slot_us ? MCP_SENSOR_BINARY_FLAG_ALIGNED : 0);
+    buf[14] = quality;
+    memcpy(&buf[15], &g_bridge_ctx->boot_epoch, sizeof(uint32_t));
+    memcpy(&buf[19], &seq, sizeof(seq));
+    return MCP_SENSOR_BINARY_LEN;
+}
+
+/**
+ * @brief Encode a multi-channel reading as a binary record
+ * 
+ * Layout (little-endian, 20 + 4 * count bytes): u8 version, i64 timestamp
+ * (us), u8 flags, u8 quality, u8 count, u32 boot epoch, u32 sequence,
+ * f32 reading[count]. Channel names and units come from the capabilities
+ * document.
+ */
+static size_t encode_sensor_multi_binary(uint8_t *buf, const float *values, uint8_t count, 
+                                         uint8_t quality, int64_t sampled_us, int64_t slot_us, uint32_t seq) {
+    bool synced = true;
+    int64_t ts_us = slot_us ? slot_us : get_timestamp_us_at(sampled_us, &synced);
+    
+    buf[0] = MCP_SENSOR_MULTI_BINARY_VERSION;
+    memcpy(&buf[1], &ts_us, sizeof(ts_us));
+    buf[9] = (synced ? MCP_SENSOR_BINARY_FLAG_TIME_SYNCED : 0) | (slot_us ? MCP_SENSOR_BINARY_FLAG_ALIGNED : 0);
+    buf[10] = quality;
+    buf[11] = count;
+    memcpy(&buf[12], &g_bridge_ctx->boot_epoch, sizeof(uint32_t));
+    memcpy(&buf[16], &seq, sizeof(seq));
+    memcpy(&buf[MCP_SENSOR_MULTI_BINARY_HEADER_LEN], values, count * sizeof(float));
+    return MCP_SENSOR_MULTI_BINARY_HEADER_LEN + count * sizeof(float);
+}
+
+/* ==================== GATEWAY BATCH ==================== */
+
+/*
+ * Child devices have no connection of their own. Their readings are
+ * collected into one JSON document on devices/{gateway}/batch, each entry
+ * naming the child and component, and sent when the batch is full or its
+ * oldest reading has waited CONFIG_MCP_BRIDGE_GATEWAY_BATCH_MS. The sensor
+ * task owns the deadline. Each batch carries a sequence of its own, each
+ * entry the sequence of its child's sensor type.
+ */
+
+/**
+ * @brief Publish the pending batch (caller holds batch_lock)
+ */
+static esp_err_t gateway_batch_send(void) {
+    cJSON *readings = g_bridge_ctx->batch;
+    uint16_t count = g_bridge_ctx->batch_len;
+    g_bridge_ctx->batch = NULL;
+    g_bridge_ctx->batch_len = 0;
+    if (!readings) {
+        return ESP_OK;
+    }
+    
+    cJSON *json = cJSON_CreateObject();
+    if (!json) {
+        cJSON_Delete(readings);
+        return ESP_ERR_NO_MEM;
+    }
+    cJSON_AddStringToObject(json, "device_id", g_bridge_ctx->device_id);
+    json_add_timestamp(json);
+    json_add_sequence(json, ++g_bridge_ctx->batch_seq);
+    cJSON_AddItemToObject(json, "readings", readings);
+    
+    char *message = cJSON_PrintUnformatted(json);
+    cJSON_Delete(json);
+    if (!message) {
+        return ESP_ERR_NO_MEM;
+    }
+    
+    char topic[MCP_BRIDGE_MAX_TOPIC_LEN];
+    snprintf(topic, sizeof(topic), "devices/%s/batch", g_bridge_ctx->device_id);
+    
+    mqtt_publish_props_t props = {
+        .alias = &g_bridge_ctx->batch_alias,
+        .content_type = MCP_CONTENT_TYPE_JSON,
+    };
+#if MCP_BRIDGE_MQTT5_ENABLED
+    props.message_expiry_s = CONFIG_MCP_BRIDGE_SENSOR_MESSAGE_EXPIRY;
+#endif
+    int msg_id = bridge_publish(MCP_MESSAGE_CLASS_TELEMETRY, topic, message, 0, 
+                                g_bridge_ctx->config.qos_config.sensor_qos, 0, &props);
+    free(message);
+    
+    if (msg_id < 0) {
+        ESP_LOGW(TAG, "Failed to publish gateway batch, %u child readings lost", count);
+        return ESP_FAIL;
+    }
+    g_bridge_ctx->messages_sent++;
+    ESP_LOGD(TAG, "Published gateway batch of %u child readings", count);
+    return ESP_OK;
+}
+
+/**
+ * @brief Add a child reading to the pending batch, sending it once full
+ */
+static esp_err_t gateway_batch_add(const sensor_node_t *sensor, const float *values, int64_t sampled_us,
+                                   int64_t slot_us, uint32_t seq) {
+    cJSON *reading = cJSON_CreateObject();
+    if (!reading) {
+        return ESP_ERR_NO_MEM;
+    }
+    cJSON_AddStringToObject(reading, "device_id", device_id_of(sensor->device));
+    cJSON_AddStringToObject(reading, "component", sensor->type);
+    json_add_timestamp_at(reading, sampled_us, slot_us);
+    cJSON_AddNumberToObject(reading, "seq", seq);   // Boot epoch is the batch's
+    json_add_sensor_value(reading, sensor, values);
+    
+    esp_err_t ret = ESP_OK;
+    bool started = false;
+    
+    xSemaphoreTake(g_bridge_ctx->batch_lock, portMAX_DELAY);
+    if (!g_bridge_ctx->batch) {
+        g_bridge_ctx->batch = cJSON_CreateArray();
+        if (!g_bridge_ctx->batch) {
+            xSemaphoreGive(g_bridge_ctx->batch_lock);
+            cJSON_Delete(reading);
+            return ESP_ERR_NO_MEM;
+        }
+        g_bridge_ctx->batch_deadline_us = esp_timer_get_time() + 
+                                          (int64_t)CONFIG_MCP_BRIDGE_GATEWAY_BATCH_MS * 1000;
+        started = true;
+    }
+    cJSON_AddItemToArray(g_bridge_ctx->batch, reading);
+    g_bridge_ctx->batch_len++;
+    
+    if (g_bridge_ctx->batch_len >= CONFIG_MCP_BRIDGE_GATEWAY_BATCH_SIZE || 
+        CONFIG_MCP_BRIDGE_GATEWAY_BATCH_MS == 0) {
+        ret = gateway_batch_send();
+        started = false;
+    }
+    xSemaphoreGive(g_bridge_ctx->batch_lock);
+    
+    // Readings pushed from other tasks: let the sensor task pick up the new deadline
+    if (started && g_bridge_ctx->sensor_task_handle && 
+        xTaskGetCurrentTaskHandle() != g_bridge_ctx->sensor_task_handle) {
+        xTaskNotify(g_bridge_ctx->sensor_task_handle, SENSOR_NOTIFY_BATCH, eSetBits);
+    }
+    return ret;
+}
+
+/**
+ * @brief Send the pending batch if its delay is up
+ * @return Ticks until the pending batch is due (portMAX_DELAY if there is none)
+ */
+static TickType_t gateway_batch_service(void) {
+    TickType_t wait = portMAX_DELAY;
+    
+    xSemaphoreTake(g_bridge_ctx->batch_lock, portMAX_DELAY);
+    if (g_bridge_ctx->batch) {
+        int64_t left_us = g_bridge_ctx->batch_deadline_us - esp_timer_get_time();
+        if (left_us <= 0) {
+            gateway_batch_send();
+        } else {
+            wait = pdMS_TO_TICKS((uint32_t)(left_us / 1000)) + 1;
+        }
+    }
+    xSemaphoreGive(g_bridge_ctx->batch_lock);
+    return wait;
+}
+
+/* ==================== PUBLISHING ==================== */
+
+/**
+ * @brief Count this boot in NVS (once per boot)
+ * 
+ * Sequence numbers restart at 1 on every boot. The boot epoch tells the
+ * server which boot a sequence belongs to, so a reading delayed across a
+ * reset is not taken for a repeat of a new one.
+ */
+static void sequence_boot_init(void) {
+    if (g_bridge_ctx->boot_epoch) {
+        return;
+    }
+    
+    nvs_handle_t nvs;
+    if (nvs_open(MCP_BRIDGE_NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) {
+        ESP_LOGW(TAG, "NVS unavailable, readings carry no boot epoch");
+        return;
+    }
+    uint32_t boots = 0;
+    nvs_get_u32(nvs, "boot_epoch", &boots);
+    boots = boots == UINT32_MAX ? 1 : boots + 1;
+    if (nvs_set_u32(nvs, "boot_epoch", boots) == ESP_OK && nvs_commit(nvs) == ESP_OK) {
+        g_bridge_ctx->boot_epoch = boots;
+    }
+    nvs_close(nvs);
+}
+
+/**
+ * @brief Publish one reading on the sensor's data topic
+ * 
+ * On MQTT v5 the topic is sent as an alias after the first publish on a
+ * connection when sensor data goes out at QoS 0, and the reading carries a
+ * content type and message expiry. The reading is stamped with sampled_us
+ * (esp_timer time it was taken), or with slot_us when it was taken on an
+ * aligned slot (0 = not aligned). values holds one value per channel.
+ * Child readings go into the gateway batch instead. Every reading takes
+ * the next sequence number of its data topic before it is handed on, so
+ * one the outbox refuses shows up as a gap. Sensors of the same type share
+ * the topic and therefore one sequence.
+ */
+static esp_err_t publish_sensor_reading(sensor_node_t *sensor, const float *values, int64_t sampled_us,
+                                        int64_t slot_us) {
+    char topic[MCP_BRIDGE_MAX_TOPIC_LEN];
+    snprintf(topic, sizeof(topic), "devices/%s/sensors/%s/data", 
+            g_bridge_ctx->device_id, sensor->type);
+    
+    mqtt_publish_props_t props = {
+        .alias = &sensor->topic_alias,
+        .content_type = MCP_CONTENT_TYPE_JSON,
+    };
+#if MCP_BRIDGE_MQTT5_ENABLED
+    props.message_expiry_s = CONFIG_MCP_BRIDGE_SENSOR_MESSAGE_EXPIRY;
+#endif
+    
+    bool binary = false;
+#if CONFIG_MCP_BRIDGE_SENSOR_PAYLOAD_BINARY
+    // MQTT v5 or a transport of its own carries the content type
+    binary = g_bridge_ctx->mqtt5_active || !transport_is_mqtt(MCP_MESSAGE_CLASS_TELEMETRY);
+#endif
+    
+    // Applications may publish the sensor from their own task too
+    uint32_t seq = __atomic_add_fetch(&g_bridge_ctx->sensors[sensor->seq_owner].publish_seq, 1, __ATOMIC_RELAXED);
+    
+    int msg_id;
+    if (sensor->device) {
+        msg_id = gateway_batch_add(sensor, values, sampled_us, slot_us, seq) == ESP_OK ? 0 : -1;
+    } else if (binary && sensor->channels) {
+        uint8_t record[MCP_SENSOR_MULTI_BINARY_HEADER_LEN + MCP_BRIDGE_MAX_SENSOR_CHANNELS * sizeof(float)];
+        size_t len = encode_sensor_multi_binary(record, values, sensor->channel_count, 100, sampled_us, slot_us,
+                                                seq);
+        props.content_type = MCP_CONTENT_TYPE_SENSOR_MULTI_BINARY;
+        msg_id = bridge_publish(MCP_MESSAGE_CLASS_TELEMETRY, topic, (const char *)record, len, 
+                                g_bridge_ctx->config.qos_config.sensor_qos, 0, &props);
+    } else if (binary) {
+        uint8_t record[MCP_SENSOR_BINARY_LEN];
+        size_t len = encode_sensor_binary(record, values[0], 100, sampled_us, slot_us, seq);
+        props.content_type = MCP_CONTENT_TYPE_SENSOR_BINARY;
+        msg_id = bridge_publish(MCP_MESSAGE_CLASS_TELEMETRY, topic, (const char *)record, len, 
+                                g_bridge_ctx->config.qos_config.sensor_qos, 0, &props);
+    } else {
+        char *message = create_sensor_message(sensor, values, sampled_us, slot_us, seq);
+        if (!message) {
+            return ESP_ERR_NO_MEM;
+        }
+        msg_id = bridge_publish(MCP_MESSAGE_CLASS_TELEMETRY, topic, message, 0, 
+                                g_bridge_ctx->config.qos_config.sensor_qos, 0, &props);
+        free(message);
+    }
+    
+    if (msg_id < 0) {
+        return ESP_FAIL;
+    }
+    
+    if (!sensor->device) {
+        g_bridge_ctx->messages_sent++;  // Batches are counted when they go out
+    }
+    sensor->last_value = values[0];
+    sensor->last_published = values[0];
+    if (sensor->channels) {
+        memcpy(sensor->channel_published, values, sensor->channel_count * sizeof(float));
+    }
+    sensor->published = true;
+    sensor->last_read_time = get_timestamp();
+    
+    if (!g_bridge_ctx->first_publish_done) {
+        g_bridge_ctx->first_publish_done = true;
+        ESP_LOGI(TAG, "First sensor publish %lld ms after boot", (long long)(esp_timer_get_time() / 1000));
+    }
+    return ESP_OK;
+}
+
+/**
+ * @brief Create the capabilities JSON document of a device (without hash/version fields)
+ * 
+ * The gateway's document lists its children; a child's names its gateway.
+ */
+static cJSON* create_capabilities_json(uint16_t device) {
+    cJSON *json = cJSON_CreateObject();
+    cJSON *sensors_array = cJSON_CreateArray();
+    cJSON *actuators_array = cJSON_CreateArray();
+    cJSON *metadata_obj = cJSON_CreateObject();
+    
+    cJSON_AddStringToObject(json, "device_id", device_id_of(device));
+    cJSON_AddStringToObject(json, "firmware_version", esp_app_get_description()->version);
+    if (device) {
+        const child_node_t *child = &g_bridge_ctx->children[device - 1];
+        cJSON_AddStringToObject(json, "gateway", g_bridge_ctx->device_id);
+        if (child->description) {
+            cJSON_AddStringToObject(json, "description", child->description);
+        }
+    } else if (g_bridge_ctx->child_count > 0) {
+        cJSON *children_array = cJSON_AddArrayToObject(json, "children");
+        for (uint16_t c = 0; c < g_bridge_ctx->child_count; c++) {
+            cJSON_AddItemToArray(children_array, cJSON_CreateString(g_bridge_ctx->children[c].device_id));
+        }
+    }
+    
+    // Add sensors
+    for (uint16_t s = 0; s < g_bridge_ctx->sensor_count; s++) {
+        const sensor_node_t *sensor = &g_bridge_ctx->sensors[s];
+        if (sensor->device != device) {
+            continue;
+        }
+        cJSON_AddItemToArray(sensors_array, cJSON_CreateString(sensor->type));
+        
+        // Add sensor metadata
+        cJSON *sensor_meta = cJSON_CreateObject();
+        if (sensor->unit) {
+            cJSON_AddStringToObject(sensor_meta, "unit", sensor->unit);
+        }
+        cJSON_AddNumberToObject(sensor_meta, "min_range", sensor->metadata.min_range);
+        cJSON_AddNumberToObject(sensor_meta, "max_range", sensor->metadata.max_range);
+        cJSON_AddNumberToObject(sensor_meta, "accuracy", sensor->metadata.accuracy);
+        if (sensor->metadata.description) {
+            cJSON_AddStringToObject(sensor_meta, "description", sensor->metadata.description);
+        }
+        if (sensor->channels) {
+            cJSON *channels_array = cJSON_AddArrayToObject(sensor_meta, "channels");
+            for (uint8_t i = 0; i < sensor->channel_count; i++) {
+                cJSON *channel = cJSON_CreateObject();
+                cJSON_AddStringToObject(channel, "name", sensor->channels[i].name);
+                if (sensor->channels[i].unit) {
+                    cJSON_AddStringToObject(channel, "unit", sensor->channels[i].unit);
+                }
+                cJSON_AddItemToArray(channels_array, channel);
+            }
+        }
+        
+        cJSON_AddItemToObject(metadata_obj, sensor->type, sensor_meta);
+    }
+    
+    // Add actuators
+    for (uint16_t a = 0; a < g_bridge_ctx->actuator_count; a++) {
+        const actuator_node_t *actuator = &g_bridge_ctx->actuators[a];
+        if (actuator->device != device) {
+            continue;
+        }
+        cJSON_AddItemToArray(actuators_array, cJSON_CreateString(actuator->type));
+        
+        // Add actuator metadata
+        cJSON *actuator_meta = cJSON_CreateObject();
+        if (actuator->metadata.value_type) {
+            cJSON_AddStringToObject(actuator_meta, "value_type", actuator->metadata.value_type);
+        }
+        if (actuator->metadata.description) {
+            cJSON_AddStringToObject(actuator_meta, "description", actuator->metadata.description);
+        }
+        
+        // Add supported actions
+        if (actuator->metadata.supported_actions) {
+            cJSON *actions_array = cJSON_CreateArray();
+            for (int i = 0; actuator->metadata.supported_actions[i] != NULL; i++) {
+                cJSON_AddItemToArray(actions_array, cJSON_CreateString(actuator->metadata.supported_actions[i]));
+            }
+            cJSON_AddItemToObject(actuator_meta, "supported_actions", actions_array);
+        }
+        
+        cJSON_AddItemToObject(metadata_obj, actuator->type, actuator_meta);
+    }
+    
+    cJSON_AddItemToObject(json, "sensors", sensors_array);
+    cJSON_AddItemToObject(json, "actuators", actuators_array);
+    cJSON_AddItemToObject(json, "metadata", metadata_obj);
+    
+    return json;
+}
+
+/**
+ * @brief Hash a capabilities document into a short hex digest
+ */
+static void capabilities_hash(const char *document, char *out, size_t out_len) {
+    unsigned char digest[32];
+    mbedtls_sha256((const unsigned char *)document, strlen(document), digest, 0);
+    
+    for (int i = 0; i < MCP_BRIDGE_CAPS_HASH_BYTES && (size_t)(i * 2 + 2) < out_len; i++) {
+        snprintf(out + i * 2, out_len - i * 2, "%02x", digest[i]);
+    }
+}
+
+/**
+ * @brief Resolve the capabilities version against the hash stored in NVS
+ * 
+ * The version only moves forward when the content hash differs from the
+ * one recorded on a previous boot.
+ */
+static void capabilities_resolve_version(void) {
+    char stored_hash[MCP_BRIDGE_CAPS_HASH_LEN] = {0};
+    uint32_t stored_version = 0;
+    size_t len = sizeof(stored_hash);
+    nvs_handle_t nvs;
+    
+    if (nvs_open(MCP_BRIDGE_NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) {
+        ESP_LOGW(TAG, "NVS unavailable, capabilities version not persisted");
+        g_bridge_ctx->caps_version++;
+        g_bridge_ctx->caps_changed = true;
+        return;
+    }
+    
+    nvs_get_u32(nvs, "caps_ver", &stored_version);
+    if (nvs_get_str(nvs, "caps_hash", stored_hash, &len) == ESP_OK &&
+        strcmp(stored_hash, g_bridge_ctx->caps_hash) == 0) {
+        g_bridge_ctx->caps_version = stored_version;
+    } else {
+        g_bridge_ctx->caps_version = stored_version + 1;
+        g_bridge_ctx->caps_changed = true;
+        nvs_set_str(nvs, "caps_hash", g_bridge_ctx->caps_hash);
+        nvs_set_u32(nvs, "caps_ver", g_bridge_ctx->caps_version);
+        nvs_commit(nvs);
+    }
+    nvs_close(nvs);
+}
+
+/**
+ * @brief Rebuild the cached capabilities document if the registry changed
+ */
+static esp_err_t capabilities_refresh(void) {
+    if (g_bridge_ctx->caps_document && !g_bridge_ctx->caps_dirty) {
+        return ESP_OK;
+    }
+    
+    xSemaphoreTake(g_bridge_ctx->mutex, portMAX_DELAY);
+    cJSON *json = create_capabilities_json(0);
+    xSemaphoreGive(g_bridge_ctx->mutex);
+    if (!json) {
+        return ESP_ERR_NO_MEM;
+    }
+    
+    // Hash the content only, so the hash is stable across version bumps
+    char *content = cJSON_PrintUnformatted(json);
+    if (!content) {
+        cJSON_Delete(json);
+        return ESP_ERR_NO_MEM;
+    }
+    capabilities_hash(content, g_bridge_ctx->caps_hash, sizeof(g_bridge_ctx->caps_hash));
+    free(content);
+    
+    capabilities_resolve_version();
+    
+    cJSON_AddStringToObject(json, "caps_hash", g_bridge_ctx->caps_hash);
+    cJSON_AddNumberToObject(json, "caps_version", g_bridge_ctx->caps_version);
+    
+    char *document = cJSON_PrintUnformatted(json);
+    cJSON_Delete(json);
+    if (!document) {
+        return ESP_ERR_NO_MEM;
+    }
+    
+    free(g_bridge_ctx->caps_document);
+    g_bridge_ctx->caps_document = document;
+    g_bridge_ctx->caps_dirty = false;
+    
+    ESP_LOGI(TAG, "Capabilities hash %s (version %lu)", 
+            g_bridge_ctx->caps_hash, (unsigned long)g_bridge_ctx->caps_version);
+    return ESP_OK;
+}
+
+/**
+ * @brief Publish the full capabilities document (retained)
+ */
+static esp_err_t capabilities_publish_full(void) {
+    if (capabilities_refresh() != ESP_OK) {
+        return ESP_ERR_NO_MEM;
+    }
+    
+    char topic[MCP_BRIDGE_MAX_TOPIC_LEN];
+    snprintf(topic, sizeof(topic), "devices/%s/capabilities", g_bridge_ctx->device_id);
+    int msg_id = bridge_publish(MCP_MESSAGE_CLASS_STATUS, topic, g_bridge_ctx->caps_document, 0, 1, true, NULL);
+    if (msg_id < 0) {
+        return ESP_FAIL;
+    }
+    
+    g_bridge_ctx->messages_sent++;
+    g_bridge_ctx->caps_changed = false;
+    return ESP_OK;
+}
+
+/**
+ * @brief Publish the capabilities document of every child device (retained)
+ * 
+ * Child documents are small and only sent once per session, so they are
+ * built on demand rather than cached and hashed like the gateway's.
+ */
+static void capabilities_publish_children(void) {
+    for (uint16_t c = 0; c < g_bridge_ctx->child_count; c++) {
+        xSemaphoreTake(g_bridge_ctx->mutex, portMAX_DELAY);
+        cJSON *json = create_capabilities_json(c + 1);
+        xSemaphoreGive(g_bridge_ctx->mutex);
+        
+        char *document = json ? cJSON_PrintUnformatted(json) : NULL;
+        cJSON_Delete(json);
+        if (!document) {
+            ESP_LOGW(TAG, "Out of memory, capabilities of %s not published", child_id_at(c));
+            continue;
+        }
+        
+        char topic[MCP_BRIDGE_MAX_TOPIC_LEN];
+        snprintf(topic, sizeof(topic), "devices/%s/capabilities", child_id_at(c));
+        if (bridge_publish(MCP_MESSAGE_CLASS_STATUS, topic, document, 0, 1, true, NULL) >= 0) {
+            g_bridge_ctx->messages_sent++;
+        }
+        free(document);
+    }
+}
+
+/**
+ * @brief Publish the retained status of a child device
+ */
+static esp_err_t child_publish_status(uint16_t device, bool online) {
+    cJSON *json = cJSON_CreateObject();
+    if (!json) {
+        return ESP_ERR_NO_MEM;
+    }
+    cJSON_AddStringToObject(json, "value", online ? "online" : "offline");
+    cJSON_AddStringToObject(json, "gateway", g_bridge_ctx->device_id);
+    json_add_timestamp(json);
+    
+    char *message = cJSON_PrintUnformatted(json);
+    cJSON_Delete(json);
+    if (!message) {
+        return ESP_ERR_NO_MEM;
+    }
+    
+    char topic[MCP_BRIDGE_MAX_TOPIC_LEN];
+    snprintf(topic, sizeof(topic), "devices/%s/status", device_id_of(device));
+    int msg_id = bridge_publish(MCP_MESSAGE_CLASS_STATUS, topic, message, 0, g_bridge_ctx->config.qos_config.status_qos, true, NULL);
+    free(message);
+    
+    if (msg_id < 0) {
+        return ESP_FAIL;
+    }
+    g_bridge_ctx->messages_sent++;
+    return ESP_OK;
+}
+
+/**
+ * @brief Publish a compact capabilities announce (hash + version only)
+ */
+static esp_err_t capabilities_announce(void) {
+    if (capabilities_refresh() != ESP_OK) {
+        return ESP_ERR_NO_MEM;
+    }
+    
+    char topic[MCP_BRIDGE_MAX_TOPIC_LEN];
+    char message[128];
+    snprintf(topic, sizeof(topic), "devices/%s/capabilities/announce", g_bridge_ctx->device_id);
+    snprintf(message, sizeof(message), 
+            "{\"device_id\":\"%s\",\"caps_hash\":\"%s\",\"caps_version\":%lu}",
+            g_bridge_ctx->device_id, g_bridge_ctx->caps_hash, 
+            (unsigned long)g_bridge_ctx->caps_version);
+    
+    int msg_id = bridge_publish(MCP_MESSAGE_CLASS_STATUS, topic, message, 0, 1, false, NULL);
+    if (msg_id < 0) {
+        return ESP_FAIL;
+    }
+    
+    g_bridge_ctx->messages_sent++;
+    return ESP_OK;
+}
+
+/* ==================== CONNECTION SUPERVISOR ==================== */
+
+/*
+ * WiFi and MQTT retries are paced by one supervisor instead of retrying
+ * immediately (WiFi) or after esp-mqtt's fixed delay (MQTT). Each failed
+ * attempt doubles the backoff window up to CONFIG_MCP_BRIDGE_RECONNECT_MAX_MS
+ * and the retry fires at a random point inside it ("full jitter"), so a fleet
+ * that lost the same AP or broker spreads its reconnects out instead of
+ * arriving in lockstep. The supervisor never gives up.
+ */
+
+/**
+ * @brief Next value of the per-device jitter generator (xorshift32)
+ */
+static uint32_t jitter_next(void) {
+    uint32_t x = g_bridge_ctx->jitter_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    g_bridge_ctx->jitter_state = x;
+    return x;
+}
+
+/**
+ * @brief Seed the jitter generator from the device ID (FNV-1a)
+ *
+ * Seeding from the ID gives every device a different, reproducible sequence
+ * without depending on the hardware RNG, which is not fully seeded before the
+ * radio starts.
+ */
+static void jitter_seed(const char *device_id) {
+    uint32_t hash = 2166136261u;
+    for (const char *c = device_id; *c; c++) {
+        hash = (hash ^ (uint8_t)*c) * 16777619u;
+    }
+    g_bridge_ctx->jitter_state = hash ? hash : 1;
+}
+
+/**
+ * @brief Record that a link came up
+ */
+static void conn_link_up(conn_link_t *link) {
+    int64_t now = esp_timer_get_time();
+    
+    if (link->down_since_us) {
+        link->last_outage_ms = (uint32_t)((now - link->down_since_us) / 1000);
+        link->reconnections++;
+        ESP_LOGI(TAG, "%s reconnected after %lu ms (%lu attempts)", link->name,
+                (unsigned long)link->last_outage_ms, (unsigned long)link->attempt);
+    }
+    link->down_since_us = 0;
+    link->up_since_us = now;
+    link->backoff_ms = 0;
+    esp_timer_stop(link->retry_timer);
+}
+
+/**
+ * @brief Record that a link went down or a connection attempt failed
+ */
+static void conn_link_down(conn_link_t *link) {
+    int64_t now = esp_timer_get_time();
+    
+    if (link->up_since_us) {
+        // Only a connection that stayed up resets the backoff; a flapping link keeps backing off
+        if (now - link->up_since_us >= (int64_t)MCP_BRIDGE_CONNECTION_STABLE_MS * 1000) {
+            link->attempt = 0;
+        }
+        link->up_since_us = 0;
+        link->down_since_us = now;
+    }
+}
+
+/**
+ * @brief Arm the retry timer of a link with the next jittered backoff
+ */
+static void conn_schedule_retry(conn_link_t *link) {
+    if (!g_bridge_ctx->running || !link->retry_timer) {
+        return;
+    }
+    
+    uint32_t shift = link->attempt < 16 ? link->attempt : 16;
+    uint64_t window = (uint64_t)CONFIG_MCP_BRIDGE_RECONNECT_BASE_MS << shift;
+    if (window > CONFIG_MCP_BRIDGE_RECONNECT_MAX_MS) {
+        window = CONFIG_MCP_BRIDGE_RECONNECT_MAX_MS;
+    }
+    link->backoff_ms = jitter_next() % ((uint32_t)window + 1);
+    link->attempt++;
+    
+    esp_timer_stop(link->retry_timer);
+    esp_timer_start_once(link->retry_timer, (uint64_t)link->backoff_ms * 1000);
+    ESP_LOGI(TAG, "%s retry %lu in %lu ms", link->name,
+            (unsigned long)link->attempt, (unsigned long)link->backoff_ms);
+}
+
+/**
+ * @brief WiFi retry timer callback
+ */
+static void wifi_retry_timer_cb(void *arg) {
+    if (g_bridge_ctx && g_bridge_ctx->running && !g_bridge_ctx->wifi_connected) {
+        g_bridge_ctx->wifi_link.attempts++;
+        g_bridge_ctx->wifi_link.backoff_ms = 0;
+        esp_wifi_connect();
+    }
+}
+
+/**
+ * @brief MQTT retry timer callback
+ */
+static void mqtt_retry_timer_cb(void *arg) {
+    if (g_bridge_ctx && g_bridge_ctx->running && g_bridge_ctx->mqtt_client &&
+        g_bridge_ctx->wifi_connected && !g_bridge_ctx->mqtt_connected) {
+        g_bridge_ctx->mqtt_link.backoff_ms = 0;
+        // Cuts esp-mqtt's own (long) reconnect wait short; counted at MQTT_EVENT_BEFORE_CONNECT
+        esp_mqtt_client_reconnect(g_bridge_ctx->mqtt_client);
+    }
+}
+
+/**
+ * @brief Create the retry timers and seed the jitter generator
+ */
+static esp_err_t conn_supervisor_init(void) {
+    jitter_seed(g_bridge_ctx->device_id);
+    g_bridge_ctx->wifi_link.name = "WiFi";
+    g_bridge_ctx->mqtt_link.name = "MQTT";
+    
+    const esp_timer_create_args_t wifi_timer_args = {
+        .callback = wifi_retry_timer_cb,
+        .name = "mcp_wifi_retry"
+    };
+    const esp_timer_create_args_t mqtt_timer_args = {
+        .callback = mqtt_retry_timer_cb,
+        .name = "mcp_mqtt_retry"
+    };
+    if (!g_bridge_ctx->wifi_link.retry_timer &&
+        esp_timer_create(&wifi_timer_args, &g_bridge_ctx->wifi_link.retry_timer) != ESP_OK) {
+        return ESP_ERR_NO_MEM;
+    }
+    if (!g_bridge_ctx->mqtt_link.retry_timer &&
+        esp_timer_create(&mqtt_timer_args, &g_bridge_ctx->mqtt_link.retry_timer) != ESP_OK) {
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+/**
+ * @brief Cancel pending retries
+ */
+static void conn_supervisor_stop(void) {
+    conn_link_t *links[] = { &g_bridge_ctx->wifi_link, &g_bridge_ctx->mqtt_link };
+    for (size_t i = 0; i < sizeof(links) / sizeof(links[0]); i++) {
+        if (links[i]->retry_timer) {
+            esp_timer_stop(links[i]->retry_timer);
+        }
+        links[i]->backoff_ms = 0;
+    }
+}
+
+/**
+ * @brief Delete the retry timers
+ */
+static void conn_supervisor_deinit(void) {
+    conn_supervisor_stop();
+    if (g_bridge_ctx->wifi_link.retry_timer) {
+        esp_timer_delete(g_bridge_ctx->wifi_link.retry_timer);
+        g_bridge_ctx->wifi_link.retry_timer = NULL;
+    }
+    if (g_bridge_ctx->mqtt_link.retry_timer) {
+        esp_timer_delete(g_bridge_ctx->mqtt_link.retry_timer);
+        g_bridge_ctx->mqtt_link.retry_timer = NULL;
+    }
+}
+
+/* ==================== TIME SYNCHRONIZATION ==================== */
+
+#if CONFIG_MCP_BRIDGE_SNTP
+/**
+ * @brief SNTP sync notification; switches message timestamps to epoch time
+ */
+static void time_sync_cb(struct timeval *tv) {
+    if (g_bridge_ctx && !g_bridge_ctx->time_synced) {
+        ESP_LOGI(TAG, "Time synchronized via SNTP (%lld ms after boot)", 
+                (long long)(esp_timer_get_time() / 1000));
+    }
+    if (g_bridge_ctx) {
+        g_bridge_ctx->time_synced = true;
+    }
+}
+#endif
+
+/**
+ * @brief Start SNTP; the client polls in the background once the network is up
+ */
+static esp_err_t time_sync_start(void) {
+#if CONFIG_MCP_BRIDGE_SNTP
+    esp_sntp_config_t config = ESP_NETIF_SNTP_DEFAULT_CONFIG(CONFIG_MCP_BRIDGE_SNTP_SERVER);
+    config.sync_cb = time_sync_cb;
+    esp_err_t ret = esp_netif_sntp_init(&config);
+    if (ret != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to start SNTP: %s", esp_err_to_name(ret));
+    }
+    return ret;
+#else
+    return ESP_OK;
+#endif
+}
+
+/**
+ * @brief Stop SNTP
+ */
+static void time_sync_stop(void) {
+#if CONFIG_MCP_BRIDGE_SNTP
+    esp_netif_sntp_deinit();
+#endif
+}
+
+/* ==================== WIFI MANAGEMENT ==================== */
+
+/**
+ * @brief Initialize NVS (AP cache, capabilities version, live config)
+ */
+static esp_err_t nvs_init_internal(void) {
+    esp_err_t ret = nvs_flash_init();
+    if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
+        ESP_ERROR_CHECK(nvs_flash_erase());
+        ret = nvs_flash_init();
+    }
+    return ret;
+}
+
+/**
+ * @brief Load the cached association from NVS
+ */
+static bool wifi_cache_load(wifi_fast_cache_t *cache) {
+    nvs_handle_t nvs;
+    if (nvs_open(MCP_BRIDGE_NVS_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK) {
+        return false;
+    }
+    
+    size_t len = sizeof(*cache);
+    esp_err_t ret = nvs_get_blob(nvs, "wifi_fast", cache, &len);
+    nvs_close(nvs);
+    return ret == ESP_OK && len == sizeof(*cache) && cache->channel != 0;
+}
+
+/**
+ * @brief Store the current association in NVS (only written when it changed)
+ */
+static void wifi_cache_store(const esp_netif_ip_info_t *ip_info) {
+    wifi_ap_record_t ap;
+    if (esp_wifi_sta_get_ap_info(&ap) != ESP_OK) {
+        return;
+    }
+    
+    wifi_fast_cache_t cache = {
+        .channel = ap.primary,
+        .ip_info = *ip_info
+    };
+    memcpy(cache.bssid, ap.bssid, sizeof(cache.bssid));
+    if (memcmp(&cache, &g_bridge_ctx->wifi_cache, sizeof(cache)) == 0) {
+        return;
+    }
+    
+    nvs_handle_t nvs;
+    if (nvs_open(MCP_BRIDGE_NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) {
+        return;
+    }
+    if (nvs_set_blob(nvs, "wifi_fast", &cache, sizeof(cache)) == ESP_OK) {
+        nvs_commit(nvs);
+        g_bridge_ctx->wifi_cache = cache;
+        ESP_LOGI(TAG, "Cached AP on channel %u for fast connect", cache.channel);
+    }
+    nvs_close(nvs);
+}
+
+/**
+ * @brief Leave the fast connect path after the cached AP failed
+ * 
+ * Clears the cache and restores a full scan with DHCP for the next attempt.
+ */
+static void wifi_fast_path_abandon(void) {
+    ESP_LOGW(TAG, "Fast connect to cached AP failed, falling back to full scan");
+    g_bridge_ctx->wifi_fast_path = false;
+    memset(&g_bridge_ctx->wifi_cache, 0, sizeof(g_bridge_ctx->wifi_cache));
+    
+    nvs_handle_t nvs;
+    if (nvs_open(MCP_BRIDGE_NVS_NAMESPACE, NVS_READWRITE, &nvs) == ESP_OK) {
+        nvs_erase_key(nvs, "wifi_fast");
+        nvs_commit(nvs);
+        nvs_close(nvs);
+    }
+    
+    wifi_config_t wifi_config;
+    if (esp_wifi_get_config(WIFI_IF_STA, &wifi_config) == ESP_OK) {
+        wifi_config.sta.bssid_set = false;
+        wifi_config.sta.channel = 0;
+        wifi_config.sta.scan_method = WIFI_ALL_CHANNEL_SCAN;
+        esp_wifi_set_config(WIFI_IF_STA, &wifi_config);
+    }
+#if CONFIG_MCP_BRIDGE_FAST_CONNECT_REUSE_IP
+    esp_netif_dhcpc_start(g_bridge_ctx->sta_netif);
+#endif
+}
+
+/**
+ * @brief Start the MQTT client on first IP, or schedule a jittered reconnect afterwards
+ */
+static void mqtt_start_or_reconnect(void) {
+    if (!g_bridge_ctx->mqtt_client) {
+        return;
+    }
+    
+    if (!g_bridge_ctx->mqtt_started) {
+        if (g_bridge_ctx->mqtt_transport.connect(&g_bridge_ctx->mqtt_transport) != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to start MQTT client");
+        }
+    } else if (!g_bridge_ctx->mqtt_connected) {
+        // The whole site got its AP back at once; don't hit the broker in lockstep
+        conn_schedule_retry(&g_bridge_ctx->mqtt_link);
+    }
+}
+
+/**
+ * @brief WiFi event handler
+ */
+static void wifi_event_handler(void* arg, esp_event_base_t event_base,
+                               int32_t event_id, void* event_data) {
+    if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START) {
+        g_bridge_ctx->wifi_link.attempts++;
+        esp_wifi_connect();
+    } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
+        if (g_bridge_ctx->wifi_fast_path && !g_bridge_ctx->wifi_connected) {
+            // Retry the full scan right away; the cached AP was the problem, not the network
+            wifi_fast_path_abandon();
+            g_bridge_ctx->wifi_link.attempts++;
+            esp_wifi_connect();
+        } else {
+            conn_link_down(&g_bridge_ctx->wifi_link);
+            conn_schedule_retry(&g_bridge_ctx->wifi_link);
+        }
+        xEventGroupClearBits(g_bridge_ctx->wifi_event_group, WIFI_CONNECTED_BIT);
+        g_bridge_ctx->wifi_connected = false;
+        send_event(MCP_EVENT_WIFI_DISCONNECTED, NULL);
+    } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
+        ip_event_got_ip_t* event = (ip_event_got_ip_t*) event_data;
+        ESP_LOGI(TAG, "Got IP: " IPSTR " (%lld ms after boot)", 
+                IP2STR(&event->ip_info.ip), (long long)(esp_timer_get_time() / 1000));
+        conn_link_up(&g_bridge_ctx->wifi_link);
+        g_bridge_ctx->wifi_connected = true;
+        g_bridge_ctx->wifi_fast_path = false;
+#if CONFIG_MCP_BRIDGE_FAST_CONNECT
+        wifi_cache_store(&event->ip_info);
+#endif
+        xEventGroupSetBits(g_bridge_ctx->wifi_event_group, WIFI_CONNECTED_BIT);
+        send_event(MCP_EVENT_WIFI_CONNECTED, NULL);
+        mqtt_start_or_reconnect();
+    }
+}
+
+/**
+ * @brief Initialize WiFi
+ */
+static esp_err_t wifi_init_internal(const mcp_bridge_config_t *config) {
+    ESP_ERROR_CHECK(esp_netif_init());
+    ESP_ERROR_CHECK(esp_event_loop_create_default());
+    g_bridge_ctx->sta_netif = esp_netif_create_default_wifi_sta();
+    
+    wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
+    ESP_ERROR_CHECK(esp_wifi_init(&cfg));
+    
+    esp_event_handler_instance_t instance_any_id;
+    esp_event_handler_instance_t instance_got_ip;
+    ESP_ERROR_CHECK(esp_event_handler_instance_register(WIFI_EVENT,
+                                                        ESP_EVENT_ANY_ID,
+                                                        &wifi_event_handler,
+                                                        NULL,
+                                                        &instance_any_id));
+    ESP_ERROR_CHECK(esp_event_handler_instance_register(IP_EVENT,
+                                                        IP_EVENT_STA_GOT_IP,
+                                                        &wifi_event_handler,
+                                                        NULL,
+                                                        &instance_got_ip));
+    
+    wifi_config_t wifi_config = {
+        .sta = {
+            .threshold.authmode = WIFI_AUTH_WPA2_PSK,
+            .pmf_cfg = {
+                .capable = true,
+                .required = false
+            },
+        },
+    };
+    
+    // Copy SSID and password
+    strncpy((char*)wifi_config.sta.ssid, config->wifi_ssid, sizeof(wifi_config.sta.ssid) - 1);
+    strncpy((char*)wifi_config.sta.password, config->wifi_password, sizeof(wifi_config.sta.password) - 1);
+    
+#if CONFIG_MCP_BRIDGE_FAST_CONNECT
+    // Associate with the last known AP directly instead of scanning every channel
+    if (wifi_cache_load(&g_bridge_ctx->wifi_cache)) {
+        wifi_config.sta.channel = g_bridge_ctx->wifi_cache.channel;
+        memcpy(wifi_config.sta.bssid, g_bridge_ctx->wifi_cache.bssid, sizeof(wifi_config.sta.bssid));
+        wifi_config.sta.bssid_set = true;
+        wifi_config.sta.scan_method = WIFI_FAST_SCAN;
+        g_bridge_ctx->wifi_fast_path = true;
+        ESP_LOGI(TAG, "Fast connect: cached AP on channel %u", wifi_config.sta.channel);
+#if CONFIG_MCP_BRIDGE_FAST_CONNECT_REUSE_IP
+        if (g_bridge_ctx->wifi_cache.ip_info.ip.addr != 0) {
+            esp_netif_dhcpc_stop(g_bridge_ctx->sta_netif);
+            esp_netif_set_ip_info(g_bridge_ctx->sta_netif, &g_bridge_ctx->wifi_cache.ip_info);
+        }
+#endif
+    }
+#endif
+    
+    ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
+    ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_config));
+    ESP_ERROR_CHECK(esp_wifi_start());
+    
+    ESP_LOGI(TAG, "WiFi initialization finished");
+    
+    return ESP_OK;
+}
+
+/* ==================== TLS TRANSPORT ==================== */
+
+#if CONFIG_MCP_BRIDGE_ENABLE_TLS
+#if CONFIG_MCP_BRIDGE_TLS_ECDHE_SUITES
+/**
+ * ECDHE key exchange with AES-GCM: forward secrecy, and every step (ECC via
+ * the bignum accelerator, AES-GCM, SHA-256) runs on the crypto hardware.
+ * ECDSA first, since verifying an ECDSA chain is far cheaper than RSA.
+ */
+static const int s_tls_ciphersuites[] = {
+    MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_128_GCM_SHA256,
+    MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_256_GCM_SHA384,
+    MBEDTLS_TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256,
+    MBEDTLS_TLS_ECDHE_RSA_WITH_AES_256_GCM_SHA384,
+    0
+};
+#endif
+
+/**
+ * @brief Wait until the connection is readable or writable
+ * 
+ * @return >0 ready, 0 timeout, <0 error
+ */
+static int tls_transport_poll(esp_transport_handle_t t, int timeout_ms, bool write) {
+    tls_transport_t *tt = esp_transport_get_context_data(t);
+    int fd;
+    if (!tt->tls || esp_tls_get_conn_sockfd(tt->tls, &fd) != ESP_OK) {
+        return -1;
+    }
+    // Records already decrypted by mbedTLS do not show up on the socket
+    if (!write && esp_tls_get_bytes_avail(tt->tls) > 0) {
+        return 1;
+    }
+    
+    fd_set ready_set, error_set;
+    FD_ZERO(&ready_set);
+    FD_ZERO(&error_set);
+    FD_SET(fd, &ready_set);
+    FD_SET(fd, &error_set);
+    struct timeval tv = {
+        .tv_sec = timeout_ms / 1000,
+        .tv_usec = (timeout_ms % 1000) * 1000
+    };
+    int ret = select(fd + 1, write ? NULL : &ready_set, write ? &ready_set : NULL, &error_set, 
+                     timeout_ms < 0 ? NULL : &tv);
+    if (ret > 0 && FD_ISSET(fd, &error_set)) {
+        return -1;
+    }
+    return ret;
+}
+
+static int tls_transport_poll_read(esp_transport_handle_t t, int timeout_ms) {
+    return tls_transport_poll(t, timeout_ms, false);
+}
+
+static int tls_transport_poll_write(esp_transport_handle_t t, int timeout_ms) {
+    return tls_transport_poll(t, timeout_ms, true);
+}
+
+/**
+ * @brief Handshake with the broker, resuming the cached session when there is one
+ * 
+ * Runs in the MQTT task. A session the broker no longer accepts costs one
+ * full handshake; a failed handshake drops it so the retry starts clean.
+ */
+static int tls_transport_connect(esp_transport_handle_t t, const char *host, int port, int timeout_ms) {
+    tls_transport_t *tt = esp_transport_get_context_data(t);
+    tt->tls = esp_tls_init();
+    if (!tt->tls) {
+        return -1;
+    }
+    
+    bool resuming = false;
+#if CONFIG_MCP_BRIDGE_TLS_SESSION_RESUME
+    tt->cfg.client_session = tt->session;
+    resuming = tt->session != NULL;
+#endif
+    tt->cfg.timeout_ms = timeout_ms;
+    size_t heap_before = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+    size_t low_before = heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT);
+    int64_t start_us = esp_timer_get_time();
+    
+    if (esp_tls_conn_new_sync(host, strlen(host), port, &tt->cfg, tt->tls) != 1) {
+        ESP_LOGE(TAG, "TLS handshake with %s:%d failed%s", host, port, resuming ? " (resumed session dropped)" : "");
+        esp_tls_conn_destroy(tt->tls);
+        tt->tls = NULL;
+#if CONFIG_MCP_BRIDGE_TLS_SESSION_RESUME
+        if (tt->session) {
+            esp_tls_free_client_session(tt->session);
+            tt->session = NULL;
+        }
+#endif
+        send_event(MCP_EVENT_TLS_ERROR, NULL);
+        return -1;
+    }
+    
+    uint32_t duration_ms = (uint32_t)((esp_timer_get_time() - start_us) / 1000);
+    // The handshake's transient allocations only show if they set a new low-water mark;
+    // otherwise what the connection still holds is the best lower bound
+    size_t low_after = heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT);
+    size_t heap_after = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+    size_t floor = low_after < low_before ? low_after : heap_after;
+    uint32_t peak_heap = heap_before > floor ? (uint32_t)(heap_before - floor) : 0;
+    if (resuming) {
+        tt->resumed_handshakes++;
+        tt->resumed_handshake_ms = duration_ms;
+        tt->resumed_handshake_heap = peak_heap;
+    } else {
+        tt->full_handshakes++;
+        tt->full_handshake_ms = duration_ms;
+        tt->full_handshake_heap = peak_heap;
+    }
+    ESP_LOGI(TAG, "TLS %s handshake with %s:%d in %lu ms, ~%lu bytes heap", resuming ? "resumed" : "full",
+             host, port, (unsigned long)duration_ms, (unsigned long)peak_heap);
+    
+#if CONFIG_MCP_BRIDGE_TLS_SESSION_RESUME
+    // Keep the newest session (ID or ticket) for the next reconnect
+    esp_tls_client_session_t *session = esp_tls_get_client_session(tt->tls);
+    if (session) {
+        if (tt->session) {
+            esp_tls_free_client_session(tt->session);
+        }
+        tt->session = session;
+    }
+#endif
+    return 0;
+}
+
+static int tls_transport_read(esp_transport_handle_t t, char *buffer, int len, int timeout_ms) {
+    tls_transport_t *tt = esp_transport_get_context_data(t);
+    int ready = tls_transport_poll_read(t, timeout_ms);
+    if (ready <= 0) {
+        return ready == 0 ? ERR_TCP_TRANSPORT_CONNECTION_TIMEOUT : ERR_TCP_TRANSPORT_CONNECTION_FAILED;
+    }
+    ssize_t ret = esp_tls_conn_read(tt->tls, buffer, len);
+    if (ret == ESP_TLS_ERR_SSL_WANT_READ || ret == ESP_TLS_ERR_SSL_WANT_WRITE) {
+        return ERR_TCP_TRANSPORT_CONNECTION_TIMEOUT;
+    }
+    if (ret == 0) {
+        return ERR_TCP_TRANSPORT_CONNECTION_CLOSED_BY_FIN;
+    }
+    return ret < 0 ? ERR_TCP_TRANSPORT_CONNECTION_FAILED : (int)ret;
+}
+
+static int tls_transport_write(esp_transport_handle_t t, const char *buffer, int len, int timeout_ms) {
+    tls_transport_t *tt = esp_transport_get_context_data(t);
+    int ready = tls_transport_poll_write(t, timeout_ms);
+    if (ready <= 0) {
+        return ready == 0 ? ERR_TCP_TRANSPORT_CONNECTION_TIMEOUT : ERR_TCP_TRANSPORT_CONNECTION_FAILED;
+    }
+    ssize_t ret = esp_tls_conn_write(tt->tls, buffer, len);
+    if (ret == ESP_TLS_ERR_SSL_WANT_READ || ret == ESP_TLS_ERR_SSL_WANT_WRITE) {
+        return ERR_TCP_TRANSPORT_CONNECTION_TIMEOUT;
+    }
+    return ret < 0 ? ERR_TCP_TRANSPORT_CONNECTION_FAILED : (int)ret;
+}
+
+/**
+ * @brief Close the connection; the cached session outlives it
+ */
+static int tls_transport_close(esp_transport_handle_t t) {
+    tls_transport_t *tt = esp_transport_get_context_data(t);
+    if (tt->tls) {
+        esp_tls_conn_destroy(tt->tls);
+        tt->tls = NULL;
+    }
+    return 0;
+}
+
+/**
+ * @brief Build the esp-tls configuration and the transport handed to esp-mqtt
+ * 
+ * @return Transport, or NULL if the TLS settings cannot verify the broker
+ */
+static esp_transport_handle_t tls_transport_create(const mcp_tls_config_t *tls_config) {
+    tls_transport_t *tt = &g_bridge_ctx->tls;
+    int alpn_count = 0;
+    for (int i = 0; i < 4 && tls_config->alpn_protocols[i]; i++) {
+        tt->alpn[alpn_count++] = tls_config->alpn_protocols[i];
+    }
+    tt->alpn[alpn_count] = NULL;
+    
+    tt->cfg = (esp_tls_cfg_t) {
+        .alpn_protos = alpn_count ? tt->alpn : NULL,
+#if CONFIG_MCP_BRIDGE_TLS_ECDHE_SUITES
+        .ciphersuites_list = s_tls_ciphersuites,
+#endif
+    };
+    if (tls_config->ca_cert_pem) {
+        tt->cfg.cacert_buf = (const unsigned char *)tls_config->ca_cert_pem;
+        tt->cfg.cacert_bytes = strlen(tls_config->ca_cert_pem) + 1;
+    } else if (tls_config->skip_cert_verification) {
+        // Only works with CONFIG_ESP_TLS_INSECURE and CONFIG_ESP_TLS_SKIP_SERVER_CERT_VERIFY
+        ESP_LOGW(TAG, "Broker certificate is not verified");
+        tt->cfg.skip_common_name = true;
+    } else {
+#if CONFIG_MBEDTLS_CERTIFICATE_BUNDLE
+        tt->cfg.crt_bundle_attach = esp_crt_bundle_attach;
+#else
+        ESP_LOGE(TAG, "mqtts needs ca_cert_pem, the certificate bundle or skip_cert_verification");
+        return NULL;
+#endif
+    }
+    if (tls_config->client_cert_pem && tls_config->client_key_pem) {
+        tt->cfg.clientcert_buf = (const unsigned char *)tls_config->client_cert_pem;
+        tt->cfg.clientcert_bytes = strlen(tls_config->client_cert_pem) + 1;
+        tt->cfg.clientkey_buf = (const unsigned char *)tls_config->client_key_pem;
+        tt->cfg.clientkey_bytes = strlen(tls_config->client_key_pem) + 1;
+    }
+    
+    esp_transport_handle_t transport = esp_transport_init();
+    if (!transport) {
+        return NULL;
+    }
+    esp_transport_set_func(transport, tls_transport_connect, tls_transport_read, tls_transport_write,
+                           tls_transport_close, tls_transport_poll_read, tls_transport_poll_write,
+                           tls_transport_close);
+    esp_transport_set_default_port(transport, 8883);
+    esp_transport_set_context_data(transport, tt);
+    return transport;
+}
+#endif
+
+/* ==================== MQTT MANAGEMENT ==================== */
+
+/**
+ * @brief Subscribe to the command and read topics of every child device
+ * 
+ * Sent as multi-topic SUBSCRIBE packets of up to MCP_BRIDGE_SUBSCRIBE_BATCH
+ * filters, so a gateway with many children does not pay a round trip per
+ * topic and each packet stays well inside the MQTT buffer. Transports
+ * subscribe one filter at a time, so this goes to the MQTT client directly.
+ * 
+ * @return true if every SUBSCRIBE was sent
+ */
+static bool mqtt_subscribe_children(void) {
+    if (g_bridge_ctx->child_count == 0) {
+        return true;
+    }
+    
+    char (*filters)[MCP_BRIDGE_MAX_TOPIC_LEN] = malloc(MCP_BRIDGE_SUBSCRIBE_BATCH * MCP_BRIDGE_MAX_TOPIC_LEN);
+    if (!filters) {
+        ESP_LOGE(TAG, "Out of memory, child command topics not subscribed");
+        return false;
+    }
+    esp_mqtt_topic_t topics[MCP_BRIDGE_SUBSCRIBE_BATCH];
+    int count = 0;
+    bool sent = true;
+    
+    for (uint16_t c = 0; c < g_bridge_ctx->child_count; c++) {
+        snprintf(filters[count], MCP_BRIDGE_MAX_TOPIC_LEN, "devices/%s/actuators/+/cmd", child_id_at(c));
+        topics[count] = (esp_mqtt_topic_t) {
+            .filter = filters[count],
+            .qos = g_bridge_ctx->config.qos_config.actuator_qos
+        };
+        count++;
+        snprintf(filters[count], MCP_BRIDGE_MAX_TOPIC_LEN, "devices/%s/sensors/+/read", child_id_at(c));
+        topics[count] = (esp_mqtt_topic_t) { .filter = filters[count], .qos = 1 };
+        count++;
+        
+        if (count + 2 > MCP_BRIDGE_SUBSCRIBE_BATCH || c + 1 == g_bridge_ctx->child_count) {
+            if (esp_mqtt_client_subscribe_multiple(g_bridge_ctx->mqtt_client, topics, count) < 0) {
+                ESP_LOGW(TAG, "Failed to subscribe to %d child topics", count);
+                sent = false;
+            }
+            count = 0;
+        }
+    }
+    free(filters);
+    
+    ESP_LOGI(TAG, "Subscribed to command topics of %u child devices", g_bridge_ctx->child_count);
+    return sent;
+}
+
+/**
+ * @brief Subscribe to every topic the server sends to this device
+ * 
+ * A resumed session skips this only if every subscribe was sent and not
+ * refused (see MQTT_EVENT_SUBSCRIBED), and no command topic was added since.
+ */
+static void mqtt_subscribe_all(void) {
+    mcp_transport_t *mqtt = &g_bridge_ctx->mqtt_transport;
+    int failed = 0;
+    
+    // Registrations from here on may not be covered; they mark the set stale again
+    g_bridge_ctx->mqtt_subscribed = false;
+    g_bridge_ctx->subscriptions_stale = false;
+    
+    // Subscribe to actuator command topics
+    for (uint16_t i = 0; i < g_bridge_ctx->actuator_count; i++) {
+        if (g_bridge_ctx->actuators[i].device) {
+            continue;               // Covered by the child subscriptions
+        }
+        char topic[MCP_BRIDGE_MAX_TOPIC_LEN];
+        snprintf(topic, sizeof(topic), "devices/%s/actuators/%s/cmd", 
+                g_bridge_ctx->device_id, g_bridge_ctx->actuators[i].type);
+        failed += mqtt->subscribe(mqtt, topic, g_bridge_ctx->config.qos_config.actuator_qos) != ESP_OK;
+        ESP_LOGI(TAG, "Subscribed to %s", topic);
+    }
+    
+    // Server asks for the full document on a capabilities hash miss
+    char topic[MCP_BRIDGE_MAX_TOPIC_LEN];
+    snprintf(topic, sizeof(topic), "devices/%s/capabilities/get", g_bridge_ctx->device_id);
+    failed += mqtt->subscribe(mqtt, topic, 1) != ESP_OK;
+    
+    // On-demand reads for any registered sensor
+    snprintf(topic, sizeof(topic), "devices/%s/sensors/+/read", g_bridge_ctx->device_id);
+    failed += mqtt->subscribe(mqtt, topic, 1) != ESP_OK;
+    
+    // Live configuration; the server retains the latest document
+    snprintf(topic, sizeof(topic), "devices/%s/config", g_bridge_ctx->device_id);
+    failed += mqtt->subscribe(mqtt, topic, 1) != ESP_OK;
+    
+    // Local rule table, also retained
+    snprintf(topic, sizeof(topic), "devices/%s/rules", g_bridge_ctx->device_id);
+    failed += mqtt->subscribe(mqtt, topic, 1) != ESP_OK;
+    
+    // Latency probes; a lost ping is simply retried by the server
+    snprintf(topic, sizeof(topic), "devices/%s/ping", g_bridge_ctx->device_id);
+    failed += mqtt->subscribe(mqtt, topic, 0) != ESP_OK;
+    
+#if CONFIG_MCP_BRIDGE_OTA
+    // Firmware updates; chunks are acked one by one, so QoS 0 is enough for them
+    snprintf(topic, sizeof(topic), "devices/%s/ota", g_bridge_ctx->device_id);
+    failed += mqtt->subscribe(mqtt, topic, 1) != ESP_OK;
+    snprintf(topic, sizeof(topic), "devices/%s/ota/chunk", g_bridge_ctx->device_id);
+    failed += mqtt->subscribe(mqtt, topic, 0) != ESP_OK;
+#endif
+    
+    if (!mqtt_subscribe_children()) {
+        failed++;
+    }
+    if (failed) {
+        ESP_LOGW(TAG, "%d subscriptions failed, renewed on the next connect", failed);
+    }
+    g_bridge_ctx->mqtt_subscribed = failed == 0;
+}
+
+/**
+ * @brief Answer a latency probe from the MQTT task
+ * 
+ * Answered in place rather than through the command queue so the reported
+ * receive and transmit times bracket only this function. The server takes
+ * RTT from its own clock minus the time spent here, and the clock offset
+ * from all four timestamps once the device time is synchronized.
+ * 
+ * @param received_us esp_timer_get_time() when the message was dispatched
+ */
+static void mqtt_answer_ping(const char *data, int data_len, int64_t received_us) {
+    char payload[96];
+    int len = data_len < (int)sizeof(payload) - 1 ? data_len : (int)sizeof(payload) - 1;
+    memcpy(payload, data, len);
+    payload[len] = '\0';
+    
+    // The id is echoed into JSON unescaped, so only plain identifiers are accepted
+    char ping_id[MCP_BRIDGE_PING_ID_LEN + 1] = {0};
+    cJSON *json = cJSON_Parse(payload);
+    cJSON *id = cJSON_GetObjectItem(json, "ping_id");
+    if (cJSON_IsString(id) && strlen(id->valuestring) <= MCP_BRIDGE_PING_ID_LEN) {
+        strcpy(ping_id, id->valuestring);
+    }
+    cJSON_Delete(json);
+    for (const char *c = ping_id; *c; c++) {
+        if (!isalnum((unsigned char)*c) && *c != '_' && *c != '-') {
+            ping_id[0] = '\0';
+            break;
+        }
+    }
+    if (!ping_id[0]) {
+        ESP_LOGW(TAG, "Ping without a valid ping_id ignored");
+        return;
+    }
+    
+    bool synced;
+    int64_t rx_us = get_timestamp_us_at(received_us, &synced);
+    char pong[160];
+    char topic[MCP_BRIDGE_MAX_TOPIC_LEN];
+    snprintf(topic, sizeof(topic), "devices/%s/pong", g_bridge_ctx->device_id);
+    len = snprintf(pong, sizeof(pong), 
+                   "{\"ping_id\":\"%s\",\"rx_us\":%lld,\"tx_us\":%lld,\"time_synced\":%s}",
+                   ping_id, (long long)rx_us, (long long)get_timestamp_us(&synced), 
+                   synced ? "true" : "false");
+    if (bridge_publish(MCP_MESSAGE_CLASS_STATUS, topic, pong, len, 0, false, NULL) >= 0) {
+        g_bridge_ctx->messages_sent++;
+    }
+}
+
+#if CONFIG_MCP_BRIDGE_OTA
+/**
+ * @brief Hand an OTA announcement or chunk to the actuator task
+ * 
+ * Flash erases and writes take milliseconds, far too long for the MQTT
+ * task. A chunk that cannot be queued is dropped; the device asks the
+ * server to rewind when the next one arrives.
+ * 
+ * @param subtopic NULL for the announcement, "chunk" for stream data
+ */
+static void ota_queue_message(const char *subtopic, const char *data, int data_len) {
+    bool chunk = subtopic && strcmp(subtopic, "chunk") == 0;
+    if ((subtopic && !chunk) || (chunk && data_len < 4)) {
+        return;
+    }
+    
+    mcp_command_t cmd = {
+        .kind = chunk ? MCP_COMMAND_OTA_CHUNK : MCP_COMMAND_OTA_START,
+        .payload = chunk ? malloc(data_len) : strndup(data, data_len),
+        .timestamp = get_timestamp()
+    };
+    if (!cmd.payload) {
+        ESP_LOGW(TAG, "Out of memory, dropping OTA message");
+        return;
+    }
+    if (chunk) {
+        memcpy(cmd.payload, data, data_len);
+        const uint8_t *header = (const uint8_t *)cmd.payload;
+        cmd.chunk.offset = header[0] | header[1] << 8 | header[2] << 16 | (uint32_t)header[3] << 24;
+        cmd.chunk.len = data_len - 4;
+    }
+    if (xQueueSend(g_bridge_ctx->command_queue, &cmd, 0) != pdTRUE) {
+        free(cmd.payload);
+    }
+}
+#endif
+
+/**
+ * @brief Dispatch a message received on any transport
+ * 
+ * Runs in the MQTT task for MQTT and in the receiving task for other
+ * transports; all real work is queued to the actuator task.
+ */
+static void bridge_handle_message(const char *topic_data, int topic_len, const char *data, int data_len) {
+    int64_t received_us = esp_timer_get_time();
+    g_bridge_ctx->messages_received++;
+    if (blog_enabled(ESP_LOG_INFO)) {
+        blog_record_t rec = { .id = BLOG_MQTT_RECEIVED, .level = ESP_LOG_INFO };
+        blog_text(&rec, 0, sizeof(rec.text), topic_data, topic_len);
+        blog_record(&rec);
+    }
+    
+    // Parse topic to extract actuator type
+    char topic[MCP_BRIDGE_MAX_TOPIC_LEN];
+    if (topic_len >= (int)sizeof(topic)) {
+        return;
+    }
+    memcpy(topic, topic_data, topic_len);
+    topic[topic_len] = '\0';
+    
+    // Topic format: devices/{device_id}/actuators/{actuator_type}/cmd
+    //           or devices/{device_id}/capabilities/get
+    //           or devices/{device_id}/config
+    //           or devices/{device_id}/rules
+    //           or devices/{device_id}/ping
+    //           or devices/{device_id}/ota[/chunk]
+    //           or devices/{device_id}/sensors/{sensor_type}/read
+    // device_id is this bridge or one of its children (actuators and sensors only)
+    char *token = strtok(topic, "/");
+    if (token && strcmp(token, "devices") == 0) {
+        token = strtok(NULL, "/"); // device_id
+        int device = token ? device_lookup(token) : -1;
+        if (device < 0) {
+            return;
+        }
+        token = strtok(NULL, "/"); // "actuators", "capabilities", "config", "ota", "ping", "rules" or "sensors"
+        if (device == 0 && token && strcmp(token, "ping") == 0 && !strtok(NULL, "/")) {
+            mqtt_answer_ping(data, data_len, received_us);
+#if CONFIG_MCP_BRIDGE_OTA
+        } else if (device == 0 && token && strcmp(token, "ota") == 0) {
+            ota_queue_message(strtok(NULL, "/"), data, data_len);
+#endif
+        } else if (token && strcmp(token, "sensors") == 0) {
+            char *sensor_type = strtok(NULL, "/");
+            token = strtok(NULL, "/"); // "read"
+            if (!sensor_type || !token || strcmp(token, "read") != 0) {
+                return;
+            }
+            
+            mcp_command_t read_cmd = {
+                .kind = MCP_COMMAND_SENSOR_READ,
+                .device = device,
+                .timestamp = get_timestamp()
+            };
+            strncpy(read_cmd.read.sensor_type, sensor_type, sizeof(read_cmd.read.sensor_type) - 1);
+            
+            char payload[128];
+            int len = data_len < (int)sizeof(payload) - 1 ? data_len : (int)sizeof(payload) - 1;
+            memcpy(payload, data, len);
+            payload[len] = '\0';
+            cJSON *json = cJSON_Parse(payload);
+            cJSON *request_id = cJSON_GetObjectItem(json, "request_id");
+            if (cJSON_IsString(request_id)) {
+                strncpy(read_cmd.read.request_id, request_id->valuestring, 
+                       sizeof(read_cmd.read.request_id) - 1);
+            }
+            cJSON_Delete(json);
+            
+            // Someone is waiting on this one; let it overtake queued actuator commands
+            if (xQueueSendToFront(g_bridge_ctx->command_queue, &read_cmd, 0) != pdTRUE) {
+                ESP_LOGW(TAG, "Command queue full, dropping read of %s", sensor_type);
+            }
+        } else if (device == 0 && token && (strcmp(token, "config") == 0 || 
+                   strcmp(token, "rules") == 0) && !strtok(NULL, "/")) {
+            // Parsed and applied in the actuator task; the MQTT task must not block
+            mcp_command_t config_cmd = {
+                .kind = token[0] == 'r' ? MCP_COMMAND_RULES_SET : MCP_COMMAND_CONFIG_SET,
+                .payload = strndup(data, data_len),
+                .timestamp = get_timestamp()
+            };
+            if (!config_cmd.payload) {
+                ESP_LOGW(TAG, "Out of memory, dropping %s update", token);
+            } else if (xQueueSend(g_bridge_ctx->command_queue, &config_cmd, 0) != pdTRUE) {
+                ESP_LOGW(TAG, "Command queue full, dropping %s update", token);
+                free(config_cmd.payload);
+            }
+        } else if (device == 0 && token && strcmp(token, "capabilities") == 0) {
+            token = strtok(NULL, "/");
+            if (token && strcmp(token, "get") == 0) {
+                ESP_LOGI(TAG, "Capabilities requested by server");
+                mcp_command_t caps_cmd = {
+                    .kind = MCP_COMMAND_CAPABILITIES_GET,
+                    .timestamp = get_timestamp()
+                };
+                if (xQueueSend(g_bridge_ctx->command_queue, &caps_cmd, 0) != pdTRUE) {
+                    ESP_LOGW(TAG, "Command queue full, dropping capabilities request");
+                }
+            }
+        } else if (token && strcmp(token, "actuators") == 0) {
+            char *actuator_type = strtok(NULL, "/");
+            token = strtok(NULL, "/"); // "cmd"
+            
+            if (actuator_type && token && strcmp(token, "cmd") == 0) {
+                // Parse JSON payload
+                char payload[MCP_BRIDGE_MAX_MESSAGE_LEN];
+                int len = data_len < (int)sizeof(payload) - 1 ? data_len : (int)sizeof(payload) - 1;
+                memcpy(payload, data, len);
+                payload[len] = '\0';
+                
+                cJSON *json = cJSON_Parse(payload);
+                if (json) {
+                    cJSON *action_json = cJSON_GetObjectItem(json, "action");
+                    cJSON *value_json = cJSON_GetObjectItem(json, "value");
+                    
+                    if (action_json && cJSON_IsString(action_json)) {
+                        mcp_command_t cmd = {0};
+                        cmd.device = device;
+                        strncpy(cmd.actuator_type, actuator_type, sizeof(cmd.actuator_type) - 1);
+                        strncpy(cmd.action, action_json->valuestring, sizeof(cmd.action) - 1);
+                        
+                        if (value_json) {
+                            if (cJSON_IsString(value_json)) {
+                                strncpy(cmd.value, value_json->valuestring, sizeof(cmd.value) - 1);
+                            } else if (cJSON_IsNumber(value_json)) {
+                                snprintf(cmd.value, sizeof(cmd.value), "%.2f", value_json->valuedouble);
+                            } else if (cJSON_IsBool(value_json)) {
+                                strncpy(cmd.value, cJSON_IsTrue(value_json) ? "true" : "false", sizeof(cmd.value) - 1);
+                            }
+                        }
+                        cmd.timestamp = get_timestamp();
+                        
+                        // Queue command for processing
+                        if (xQueueSend(g_bridge_ctx->command_queue, &cmd, 0) != pdTRUE) {
+                            ESP_LOGW(TAG, "Command queue full, dropping command");
+                        }
+                        
+                        send_event(MCP_EVENT_COMMAND_RECEIVED, &cmd);
+                    }
+                    cJSON_Delete(json);
+                }
+            }
+        }
+    }
+}
+
+/* ==================== TRANSPORTS ==================== */
+
+static void transport_receive(const char *topic, int topic_len, const char *data, int data_len, void *arg) {
+    bridge_handle_message(topic, topic_len, data, data_len);
+}
+
+/**
+ * @brief Set up the built-in MQTT transport and route every message class through it
+ */
+static void transports_init(void) {
+    mcp_transport_t *mqtt = &g_bridge_ctx->mqtt_transport;
+    *mqtt = (mcp_transport_t) {
+        .name = "mqtt",
+        .connect = mqtt_transport_connect,
+        .disconnect = mqtt_transport_disconnect,
+        .publish = mqtt_transport_publish,
+        .subscribe = mqtt_transport_subscribe,
+        .set_receive_cb = mqtt_transport_set_receive_cb,
+    };
+    mqtt->set_receive_cb(mqtt, transport_receive, NULL);
+    for (int c = 0; c < MCP_MESSAGE_CLASS_MAX; c++) {
+        g_bridge_ctx->transports[c] = mqtt;
+    }
+}
+
+/**
+ * @brief Whether a transport is also routed for an earlier class (and handled there)
+ */
+static bool transport_seen_before(mcp_message_class_t message_class) {
+    for (int c = 0; c < (int)message_class; c++) {
+        if (g_bridge_ctx->transports[c] == g_bridge_ctx->transports[message_class]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Connect the other transports and listen on our topic tree
+ * 
+ * Called from the actuator task at the start of every MQTT session; DNS
+ * lookups may block. Connecting a connected transport is a no-op. MQTT
+ * itself follows the WiFi link and subscribes topic by topic.
+ */
+static void transports_connect(void) {
+    char topic[MCP_BRIDGE_MAX_TOPIC_LEN];
+    snprintf(topic, sizeof(topic), "devices/%s/#", g_bridge_ctx->device_id);
+    
+    for (int c = 0; c < MCP_MESSAGE_CLASS_MAX; c++) {
+        mcp_transport_t *transport = g_bridge_ctx->transports[c];
+        if (transport_is_mqtt(c) || transport_seen_before(c)) {
+            continue;
+        }
+        if (transport->connect && transport->connect(transport) != ESP_OK) {
+            ESP_LOGW(TAG, "Transport %s not connected, its messages are dropped", transport->name);
+            continue;
+        }
+        if (transport->set_receive_cb) {
+            transport->set_receive_cb(transport, transport_receive, NULL);
+        }
+        if (transport->subscribe) {
+            transport->subscribe(transport, topic, 1);
+        }
+    }
+}
+
+/**
+ * @brief Disconnect (stop) or destroy (deinit) every other transport once
+ */
+static void transports_release(bool destroy) {
+    for (int c = 0; c < MCP_MESSAGE_CLASS_MAX; c++) {
+        mcp_transport_t *transport = g_bridge_ctx->transports[c];
+        if (transport_is_mqtt(c) || transport_seen_before(c)) {
+            continue;
+        }
+        if (transport->disconnect) {
+            transport->disconnect(transport);
+        }
+        if (destroy && transport->destroy) {
+            transport->destroy(transport);
+        }
+    }
+    if (destroy) {
+        for (int c = 0; c < MCP_MESSAGE_CLASS_MAX; c++) {
+            g_bridge_ctx->transports[c] = &g_bridge_ctx->mqtt_transport;
+        }
+    }
+}
+
+/**
+ * @brief MQTT event handler
+ */
+static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_t event_id, void *event_data) {
+    esp_mqtt_event_handle_t event = event_data;
+    g_bridge_ctx->mqtt_task_handle = xTaskGetCurrentTaskHandle();
+    
+    switch ((esp_mqtt_event_id_t)event_id) {
+        case MQTT_EVENT_CONNECTED:
+#if MCP_BRIDGE_MQTT5_ENABLED
+            g_bridge_ctx->mqtt5_active = g_bridge_ctx->mqtt_cfg.session.protocol_ver == MQTT_PROTOCOL_V_5;
+#endif
+            ESP_LOGI(TAG, "MQTT connected (%s)", g_bridge_ctx->mqtt5_active ? "v5" : "v3.1.1");
+            // Topic aliases are per connection; a new session invalidates all of them
+            g_bridge_ctx->mqtt_session++;
+            g_bridge_ctx->mqtt_connected = true;
+            conn_link_up(&g_bridge_ctx->mqtt_link);
+            xEventGroupClearBits(g_bridge_ctx->mqtt_event_group, MQTT_FAIL_BIT);
+            xEventGroupSetBits(g_bridge_ctx->mqtt_event_group, MQTT_CONNECTED_BIT);
+            send_event(MCP_EVENT_MQTT_CONNECTED, NULL);
+            
+            // A resumed session still holds our subscriptions unless one failed or topics were added
+            if (event->session_present && g_bridge_ctx->mqtt_subscribed && 
+                !g_bridge_ctx->subscriptions_stale) {
+                ESP_LOGI(TAG, "MQTT session resumed, subscriptions kept by broker");
+            } else {
+                mqtt_subscribe_all();
+            }
+            
+            // Capabilities and online status are published from the actuator task
+            mcp_command_t session_cmd = {
+                .kind = MCP_COMMAND_SESSION_START,
+                .timestamp = get_timestamp()
+            };
+            if (xQueueSendToFront(g_bridge_ctx->command_queue, &session_cmd, 0) != pdTRUE) {
+                ESP_LOGW(TAG, "Command queue full, session start not queued");
+            }
+            break;
+            
+        case MQTT_EVENT_DISCONNECTED:
+            ESP_LOGW(TAG, "MQTT disconnected");
+            g_bridge_ctx->mqtt_connected = false;
+            xEventGroupClearBits(g_bridge_ctx->mqtt_event_group, MQTT_CONNECTED_BIT);
+            xEventGroupSetBits(g_bridge_ctx->mqtt_event_group, MQTT_FAIL_BIT);
+            send_event(MCP_EVENT_MQTT_DISCONNECTED, NULL);
+            
+            // Also raised for every failed connect attempt; without WiFi the IP event reschedules
+            conn_link_down(&g_bridge_ctx->mqtt_link);
+            if (g_bridge_ctx->wifi_connected) {
+                conn_schedule_retry(&g_bridge_ctx->mqtt_link);
+            }
+            break;
+            
+        case MQTT_EVENT_BEFORE_CONNECT:
+            g_bridge_ctx->mqtt_link.attempts++;
+            break;
+            
+        case MQTT_EVENT_SUBSCRIBED:
+            // The data holds the SUBACK return codes; 0x80 and up is a refusal
+            for (int i = 0; i < event->data_len; i++) {
+                if ((uint8_t)event->data[i] >= 0x80) {
+                    ESP_LOGW(TAG, "Broker refused a subscription (0x%02x), renewed on the next connect", 
+                            (uint8_t)event->data[i]);
+                    g_bridge_ctx->mqtt_subscribed = false;
+                    break;
+                }
+            }
+            break;
+            
+#if CONFIG_MCP_BRIDGE_OUTBOX_PERSIST
+        case MQTT_EVENT_PUBLISHED:
+        case MQTT_EVENT_DELETED:
+            // Matched against the flash outbox by the actuator task
+            if (g_bridge_ctx->outbox_ready) {
+                int msg_id = event_id == MQTT_EVENT_PUBLISHED ? event->msg_id : -event->msg_id;
+                xQueueSend(g_bridge_ctx->outbox_acks, &msg_id, 0);
+            }
+            break;
+#endif
+            
+        case MQTT_EVENT_DATA:
+            if (event->current_data_offset != 0 || event->data_len != event->total_data_len) {
+                // Messages larger than the MQTT buffer arrive in pieces; only the first has the topic
+                if (event->current_data_offset == 0) {
+                    ESP_LOGW(TAG, "Message on %.*s larger than the MQTT buffer, ignored", 
+                            event->topic_len, event->topic);
+                }
+            } else if (g_bridge_ctx->mqtt_receive_cb) {
+                g_bridge_ctx->mqtt_receive_cb(event->topic, event->topic_len, event->data, event->data_len,
+                                              g_bridge_ctx->mqtt_receive_arg);
+            }
+            break;
+            
+        case MQTT_EVENT_ERROR:
+            ESP_LOGE(TAG, "MQTT error occurred");
+            g_bridge_ctx->connection_failures++;
+#if MCP_BRIDGE_MQTT5_ENABLED
+            // Broker does not speak v5: fall back to v3.1.1 for the next attempt
+            if (event->error_handle && 
+                event->error_handle->error_type == MQTT_ERROR_TYPE_CONNECTION_REFUSED &&
+                g_bridge_ctx->mqtt_cfg.session.protocol_ver == MQTT_PROTOCOL_V_5 &&
+                (event->error_handle->connect_return_code == MQTT_CONNECTION_REFUSE_PROTOCOL ||
+                 event->error_handle->connect_return_code == MQTT5_UNSUPPORTED_PROTOCOL_VER)) {
+                ESP_LOGW(TAG, "Broker refused MQTT v5, falling back to v3.1.1");
+                g_bridge_ctx->mqtt_cfg.session.protocol_ver = MQTT_PROTOCOL_V_3_1_1;
+                g_bridge_ctx->mqtt5_active = false;
+                esp_mqtt_set_config(g_bridge_ctx->mqtt_client, &g_bridge_ctx->mqtt_cfg);
+            }
+#endif
+            break;
+            
+        default:
+            break;
+    }
+}
+
+/**
+ * @brief Initialize MQTT client
+ */
+static esp_err_t mqtt_init_internal(const mcp_bridge_config_t *config) {
+    // Kept in the context so the protocol fallback can re-apply it
+    esp_mqtt_client_config_t *mqtt_cfg = &g_bridge_ctx->mqtt_cfg;
+    *mqtt_cfg = (esp_mqtt_client_config_t) {
+        .broker.address.uri = config->mqtt_broker_uri,
+        .credentials.client_id = g_bridge_ctx->device_id,
+        .credentials.username = config->mqtt_username,
+        .credentials.authentication.password = config->mqtt_password,
+        .session.last_will = {
+            .topic = NULL, // Will be set below
+            .msg = "{\"value\":\"offline\"}",
+            .qos = 1,
+            .retain = true
+        }
+    };
+#if MCP_BRIDGE_MQTT5_ENABLED
+    mqtt_cfg->session.protocol_ver = MQTT_PROTOCOL_V_5;
+#endif
+#if CONFIG_MCP_BRIDGE_OTA
+    // A firmware chunk, its offset header and topic must arrive in one piece
+    mqtt_cfg->buffer.size = CONFIG_MCP_BRIDGE_OTA_CHUNK_SIZE + 128;
+#endif
+    // Reconnects are paced by the connection supervisor; esp-mqtt's own timer is only a fallback
+    mqtt_cfg->network.reconnect_timeout_ms = CONFIG_MCP_BRIDGE_RECONNECT_MAX_MS * 2;
+#if CONFIG_MCP_BRIDGE_MQTT_PERSISTENT_SESSION
+    // Client ID is stable per device, so the broker can resume the session
+    mqtt_cfg->session.disable_clean_session = true;
+#endif
+    
+    bool mqtts = strncmp(config->mqtt_broker_uri, "mqtts://", 8) == 0;
+    if (config->tls_config.enable_tls && !mqtts) {
+        ESP_LOGW(TAG, "TLS enabled but broker URI is not mqtts://, connecting without TLS");
+    }
+    if (mqtts) {
+#if CONFIG_MCP_BRIDGE_ENABLE_TLS
+        // esp-mqtt destroys the transport together with the client
+        mqtt_cfg->network.transport = tls_transport_create(&config->tls_config);
+        if (!mqtt_cfg->network.transport) {
+            return MCP_BRIDGE_ERR_TLS_FAILED;
+        }
+#else
+        ESP_LOGE(TAG, "mqtts:// broker URI but TLS support is disabled");
+        return MCP_BRIDGE_ERR_TLS_FAILED;
+#endif
+    }
+    
+    // Set last will topic
+    static char will_topic[MCP_BRIDGE_MAX_TOPIC_LEN];
+    snprintf(will_topic, sizeof(will_topic), "devices/%s/status", g_bridge_ctx->device_id);
+    mqtt_cfg->session.last_will.topic = will_topic;
+    
+    g_bridge_ctx->mqtt_client = esp_mqtt_client_init(mqtt_cfg);
+    if (!g_bridge_ctx->mqtt_client) {
+        ESP_LOGE(TAG, "Failed to initialize MQTT client");
+#if CONFIG_MCP_BRIDGE_ENABLE_TLS
+        if (mqtt_cfg->network.transport) {
+            esp_transport_destroy(mqtt_cfg->network.transport);
+        }
+#endif
+        return ESP_FAIL;
+    }
+    
+#if MCP_BRIDGE_MQTT5_ENABLED && CONFIG_MCP_BRIDGE_MQTT_PERSISTENT_SESSION
+    esp_mqtt5_connection_property_config_t connect_property = {
+        .session_expiry_interval = CONFIG_MCP_BRIDGE_MQTT_SESSION_EXPIRY
+    };
+    esp_mqtt5_client_set_connect_property(g_bridge_ctx->mqtt_client, &connect_property);
+#endif
+    
+    ESP_ERROR_CHECK(esp_mqtt_client_register_event(g_bridge_ctx->mqtt_client, ESP_EVENT_ANY_ID, mqtt_event_handler, NULL));
+    
+    // Started from the IP event handler once the network is up
+    return ESP_OK;
+}
+
+/* ==================== LIVE CONFIGURATION ==================== */
+
+/**
+ * @brief Stage the current settings as the starting point of an update
+ */
+static void config_stage_current(live_config_t *staged) {
+    *staged = (live_config_t) {
+        .version = g_bridge_ctx->config_version,
+        .sensor_publish_interval_ms = g_bridge_ctx->config.sensor_publish_interval_ms,
+        .qos = g_bridge_ctx->config.qos_config,
+        .sensor_deadband = g_bridge_ctx->config.sensor_deadband,
+        .log_level = g_bridge_ctx->config.log_level,
+    };
+}
+
+/**
+ * @brief Range-check staged settings
+ */
+static esp_err_t config_validate(const live_config_t *staged, char *err, size_t err_len) {
+    if (staged->sensor_publish_interval_ms < MCP_BRIDGE_MIN_PUBLISH_INTERVAL_MS ||
+        staged->sensor_publish_interval_ms > MCP_BRIDGE_MAX_PUBLISH_INTERVAL_MS) {
+        snprintf(err, err_len, "sensor_publish_interval_ms out of range");
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (staged->qos.sensor_qos > 2 || staged->qos.actuator_qos > 2 ||
+        staged->qos.status_qos > 2 || staged->qos.error_qos > 2) {
+        snprintf(err, err_len, "qos must be 0-2");
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (!(staged->sensor_deadband >= 0.0f)) {
+        snprintf(err, err_len, "deadband must be >= 0");
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (staged->log_level > ESP_LOG_VERBOSE) {
+        snprintf(err, err_len, "log_level must be 0-5");
+        return ESP_ERR_INVALID_ARG;
+    }
+    return ESP_OK;
+}
+
+/**
+ * @brief Read an optional number field, rejecting anything that is not a number
+ */
+static bool config_get_number(const cJSON *obj, const char *key, double *out, 
+                              char *err, size_t err_len) {
+    const cJSON *item = cJSON_GetObjectItem(obj, key);
+    if (!item) {
+        return true;
+    }
+    if (!cJSON_IsNumber(item) || item->valuedouble < 0) {
+        snprintf(err, err_len, "invalid %s", key);
+        return false;
+    }
+    *out = item->valuedouble;
+    return true;
+}
+
+/**
+ * @brief Stage a config document on top of the current settings
+ * 
+ * Fields that are absent keep their current value. Nothing is applied here,
+ * so a document with one bad field changes nothing. Caller holds the mutex.
+ */
+static esp_err_t config_parse(const cJSON *doc, live_config_t *staged, char *err, size_t err_len) {
+    config_stage_current(staged);
+    
+    double number = staged->version;
+    if (!config_get_number(doc, "version", &number, err, err_len)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    staged->version = (uint32_t)number;
+    
+    number = staged->sensor_publish_interval_ms;
+    if (!config_get_number(doc, "sensor_publish_interval_ms", &number, err, err_len)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    staged->sensor_publish_interval_ms = number > UINT32_MAX ? UINT32_MAX : (uint32_t)number;
+    
+    const cJSON *qos = cJSON_GetObjectItem(doc, "qos");
+    if (qos) {
+        struct { const char *key; uint8_t *field; } qos_fields[] = {
+            { "sensor", &staged->qos.sensor_qos },
+            { "actuator", &staged->qos.actuator_qos },
+            { "status", &staged->qos.status_qos },
+            { "error", &staged->qos.error_qos },
+        };
+        if (!cJSON_IsObject(qos)) {
+            snprintf(err, err_len, "invalid qos");
+            return ESP_ERR_INVALID_ARG;
+        }
+        for (size_t i = 0; i < sizeof(qos_fields) / sizeof(qos_fields[0]); i++) {
+            number = *qos_fields[i].field;
+            if (!config_get_number(qos, qos_fields[i].key, &number, err, err_len)) {
+                return ESP_ERR_INVALID_ARG;
+            }
+            *qos_fields[i].field = number > 255 ? 255 : (uint8_t)number;
+        }
+    }
+    
+    number = staged->sensor_deadband;
+    if (!config_get_number(doc, "deadband", &number, err, err_len)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    staged->sensor_deadband = (float)number;
+    
+    const cJSON *deadbands = cJSON_GetObjectItem(doc, "sensor_deadbands");
+    if (deadbands) {
+        if (!cJSON_IsObject(deadbands)) {
+            snprintf(err, err_len, "invalid sensor_deadbands");
+            return ESP_ERR_INVALID_ARG;
+        }
+        const cJSON *entry;
+        cJSON_ArrayForEach(entry, deadbands) {
+            if (!cJSON_IsNumber(entry) || !(entry->valuedouble >= 0)) {
+                snprintf(err, err_len, "invalid deadband for %s", entry->string);
+                return ESP_ERR_INVALID_ARG;
+            }
+            // Types are matched across the gateway and its children (see config_apply)
+            bool known = find_sensor_by_type(0, entry->string) != NULL;
+            for (uint16_t i = 0; !known && i < g_bridge_ctx->sensor_count; i++) {
+                known = strcmp(g_bridge_ctx->sensors[i].type, entry->string) == 0;
+            }
+            if (!known) {
+                snprintf(err, err_len, "unknown sensor type %s", entry->string);
+                return ESP_ERR_NOT_FOUND;
+            }
+        }
+        staged->sensor_deadbands = deadbands;
+    }
+    
+    number = staged->log_level;
+    if (!config_get_number(doc, "log_level", &number, err, err_len)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    staged->log_level = number > 255 ? 255 : (uint8_t)number;
+    
+    return config_validate(staged, err, err_len);
+}
+
+/**
+ * @brief Apply validated settings in one step (caller holds the mutex)
+ * 
+ * Nothing here touches the WiFi or MQTT connection. Returns true when the
+ * actuator command subscriptions need renewing at the new QoS.
+ */
+static bool config_apply(const live_config_t *staged) {
+    mcp_bridge_config_t *config = &g_bridge_ctx->config;
+    bool interval_changed = staged->sensor_publish_interval_ms != config->sensor_publish_interval_ms;
+    bool resubscribe = staged->qos.actuator_qos != config->qos_config.actuator_qos;
+    
+    if (staged->log_level != config->log_level) {
+        esp_log_level_set(TAG, (esp_log_level_t)staged->log_level);
+    }
+    
+    g_bridge_ctx->config_version = staged->version;
+    config->sensor_publish_interval_ms = staged->sensor_publish_interval_ms;
+    config->qos_config = staged->qos;
+    config->sensor_deadband = staged->sensor_deadband;
+    config->log_level = staged->log_level;
+    
+    // The map replaces every per-sensor override; unlisted types fall back to the default
+    if (staged->sensor_deadbands) {
+        for (uint16_t i = 0; i < g_bridge_ctx->sensor_count; i++) {
+            sensor_node_t *sensor = &g_bridge_ctx->sensors[i];
+            const cJSON *entry = cJSON_GetObjectItem(staged->sensor_deadbands, sensor->type);
+            sensor->deadband = entry ? (float)entry->valuedouble : -1.0f;
+        }
+    }
+    
+    // Restart the sensor period so a shorter interval takes effect now
+    if (interval_changed && g_bridge_ctx->sensor_task_handle) {
+        xTaskNotify(g_bridge_ctx->sensor_task_handle, SENSOR_NOTIFY_RESCHEDULE, eSetBits);
+    }
+    return resubscribe;
+}
+
+/**
+ * @brief Build the effective live config as JSON (caller holds the mutex)
+ */
+static cJSON* config_to_json(void) {
+    const mcp_bridge_config_t *config = &g_bridge_ctx->config;
+    cJSON *json = cJSON_CreateObject();
+    if (!json) {
+        return NULL;
+    }
+    
+    cJSON_AddNumberToObject(json, "version", g_bridge_ctx->config_version);
+    cJSON_AddNumberToObject(json, "sensor_publish_interval_ms", config->sensor_publish_interval_ms);
+    
+    cJSON *qos = cJSON_AddObjectToObject(json, "qos");
+    cJSON_AddNumberToObject(qos, "sensor", config->qos_config.sensor_qos);
+    cJSON_AddNumberToObject(qos, "actuator", config->qos_config.actuator_qos);
+    cJSON_AddNumberToObject(qos, "status", config->qos_config.status_qos);
+    cJSON_AddNumberToObject(qos, "error", config->qos_config.error_qos);
+    
+    cJSON_AddNumberToObject(json, "deadband", config->sensor_deadband);
+    cJSON *deadbands = cJSON_AddObjectToObject(json, "sensor_deadbands");
+    for (uint16_t i = 0; i < g_bridge_ctx->sensor_count; i++) {
+        const sensor_node_t *sensor = &g_bridge_ctx->sensors[i];
+        if (sensor->deadband >= 0 && !cJSON_GetObjectItem(deadbands, sensor->type)) {
+            cJSON_AddNumberToObject(deadbands, sensor->type, sensor->deadband);
+        }
+    }
+    
+    cJSON_AddNumberToObject(json, "log_level", config->log_level);
+    return json;
+}
+
+/**
+ * @brief Store a server-pushed document in NVS so it survives a reboot
+ */
+static void nvs_store_document(const char *key, const char *document) {
+    nvs_handle_t nvs;
+    if (nvs_open(MCP_BRIDGE_NVS_NAMESPACE, NVS_READWRITE, &nvs) == ESP_OK) {
+        if (nvs_set_str(nvs, key, document) != ESP_OK || nvs_commit(nvs) != ESP_OK) {
+            ESP_LOGW(TAG, "Failed to persist %s", key);
+        }
+        nvs_close(nvs);
+    } else {
+        ESP_LOGW(TAG, "NVS unavailable, %s not persisted", key);
+    }
+}
+
+/**
+ * @brief Load a document stored by nvs_store_document (caller frees, NULL = none)
+ */
+static char* nvs_load_document(const char *key) {
+    nvs_handle_t nvs;
+    size_t len = 0;
+    if (nvs_open(MCP_BRIDGE_NVS_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK) {
+        return NULL;
+    }
+    
+    char *document = NULL;
+    if (nvs_get_str(nvs, key, NULL, &len) == ESP_OK && len > 0) {
+        document = malloc(len);
+        if (document && nvs_get_str(nvs, key, document, &len) != ESP_OK) {
+            free(document);
+            document = NULL;
+        }
+    }
+    nvs_close(nvs);
+    return document;
+}
+
+/**
+ * @brief Persist the effective live config to NVS so it survives a reboot
+ */
+static void config_persist(void) {
+    xSemaphoreTake(g_bridge_ctx->mutex, portMAX_DELAY);
+    cJSON *json = config_to_json();
+    xSemaphoreGive(g_bridge_ctx->mutex);
+    
+    char *document = json ? cJSON_PrintUnformatted(json) : NULL;
+    cJSON_Delete(json);
+    if (!document) {
+        ESP_LOGW(TAG, "Out of memory, config not persisted");
+        return;
+    }
+    
+    nvs_store_document("config", document);
+    free(document);
+}
+
+/**
+ * @brief Re-apply the config persisted by a previous boot
+ */
+static void config_restore(void) {
+    char *document = nvs_load_document("config");
+    if (!document) {
+        return;
+    }
+    
+    cJSON *doc = cJSON_Parse(document);
+    free(document);
+    if (!doc) {
+        ESP_LOGW(TAG, "Stored config is corrupt, using defaults");
+        return;
+    }
+    
+    char err[MCP_BRIDGE_CONFIG_ERROR_LEN] = {0};
+    live_config_t staged;
+    xSemaphoreTake(g_bridge_ctx->mutex, portMAX_DELAY);
+    esp_err_t ret = config_parse(doc, &staged, err, sizeof(err));
+    if (ret == ESP_OK) {
+        config_apply(&staged);
+    }
+    xSemaphoreGive(g_bridge_ctx->mutex);
+    cJSON_Delete(doc);
+    
+    if (ret == ESP_OK) {
+        ESP_LOGI(TAG, "Restored config version %lu", (unsigned long)g_bridge_ctx->config_version);
+    } else {
+        ESP_LOGW(TAG, "Stored config rejected (%s), using defaults", err);
+    }
+}
+
+/**
+ * @brief Report the outcome of a config update with the effective settings
+ */
+static void config_publish_ack(uint32_t version, const char *status, const char *error) {
+    cJSON *json = cJSON_CreateObject();
+    if (!json) {
+        return;
+    }
+    cJSON_AddStringToObject(json, "device_id", g_bridge_ctx->device_id);
+    cJSON_AddNumberToObject(json, "version", version);
+    cJSON_AddStringToObject(json, "status", status);
+    if (error) {
+        cJSON_AddStringToObject(json, "error", error);
+    }
+    xSemaphoreTake(g_bridge_ctx->mutex, portMAX_DELAY);
+    cJSON_AddItemToObject(json, "config", config_to_json());
+    xSemaphoreGive(g_bridge_ctx->mutex);
+    json_add_timestamp(json);
+    
+    char *message = cJSON_PrintUnformatted(json);
+    cJSON_Delete(json);
+    if (!message) {
+        return;
+    }
+    
+    char topic[MCP_BRIDGE_MAX_TOPIC_LEN];
+    snprintf(topic, sizeof(topic), "devices/%s/config/ack", g_bridge_ctx->device_id);
+    if (bridge_publish(MCP_MESSAGE_CLASS_STATUS, topic, message, 0, g_bridge_ctx->config.qos_config.status_qos, false, NULL) >= 0) {
+        g_bridge_ctx->messages_sent++;
+    }
+    free(message);
+}
+
+/**
+ * @brief Handle a config document pushed by the server (actuator task)
+ * 
+ * Versions only move forward: an older version is acked as stale and the
+ * same version (the retained copy redelivered on resubscribe) as unchanged.
+ */
+static void config_handle_update(const char *payload) {
+    char err[MCP_BRIDGE_CONFIG_ERROR_LEN] = {0};
+    const char *status = "rejected";
+    uint32_t version = 0;
+    bool resubscribe = false;
+    
+    cJSON *doc = cJSON_Parse(payload);
+    const cJSON *version_json = doc ? cJSON_GetObjectItem(doc, "version") : NULL;
+    if (!doc) {
+        snprintf(err, sizeof(err), "invalid JSON");
+    } else if (!cJSON_IsNumber(version_json) || version_json->valuedouble < 1 || 
+               version_json->valuedouble > UINT32_MAX) {
+        snprintf(err, sizeof(err), "missing or invalid version");
+    } else {
+        version = (uint32_t)version_json->valuedouble;
+        
+        xSemaphoreTake(g_bridge_ctx->mutex, portMAX_DELAY);
+        if (version == g_bridge_ctx->config_version) {
+            status = "unchanged";
+        } else if (version < g_bridge_ctx->config_version) {
+            status = "stale";
+        } else {
+            live_config_t staged;
+            if (config_parse(doc, &staged, err, sizeof(err)) == ESP_OK) {
+                resubscribe = config_apply(&staged);
+                status = "applied";
+            }
+        }
+        xSemaphoreGive(g_bridge_ctx->mutex);
+    }
+    cJSON_Delete(doc);
+    
+    if (strcmp(status, "applied") == 0) {
+        ESP_LOGI(TAG, "Applied config version %lu", (unsigned long)version);
+        config_persist();
+        if (resubscribe && g_bridge_ctx->mqtt_connected) {
+            mqtt_subscribe_all();
+        }
+    } else if (err[0]) {
+        ESP_LOGW(TAG, "Config version %lu rejected: %s", (unsigned long)version, err);
+    }
+    
+    config_publish_ack(version, status, err[0] ? err : NULL);
+}
+
+/* ==================== RULE ENGINE ==================== */
+
+/**
+ * @brief Copy a rule field into a fixed buffer
+ * 
+ * Numbers and booleans are formatted the same way as actuator command values.
+ */
+static bool rule_get_string(const cJSON *item, const char *key, char *out, size_t out_len,
+                            bool required, char *err, size_t err_len) {
+    const cJSON *field = cJSON_GetObjectItem(item, key);
+    out[0] = '\0';
+    if (cJSON_IsString(field) && strlen(field->valuestring) < out_len) {
+        strcpy(out, field->valuestring);
+    } else if (cJSON_IsNumber(field)) {
+        snprintf(out, out_len, "%.2f", field->valuedouble);
+    } else if (cJSON_IsBool(field)) {
+        snprintf(out, out_len, "%s", cJSON_IsTrue(field) ? "true" : "false");
+    } else if (field) {
+        snprintf(err, err_len, "invalid rule %s", key);
+        return false;
+    }
+    if (required && !out[0]) {
+        snprintf(err, err_len, "rule missing %s", key);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Compile one rule, resolving its sensor and actuator (caller holds the mutex)
+ * 
+ * Components of a child device are addressed by their type key, "child_id/type".
+ */
+static esp_err_t rule_compile(const cJSON *item, mcp_rule_t *rule, char *err, size_t err_len) {
+    char sensor_key[MCP_BRIDGE_MAX_TOPIC_LEN];
+    char actuator_key[MCP_BRIDGE_MAX_TOPIC_LEN];
+    char channel[32];
+    char op[4];
+    
+    memset(rule, 0, sizeof(*rule));
+    if (!cJSON_IsObject(item)) {
+        snprintf(err, err_len, "invalid rule");
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (!rule_get_string(item, "id", rule->id, sizeof(rule->id), true, err, err_len) ||
+        !rule_get_string(item, "sensor", sensor_key, sizeof(sensor_key), true, err, err_len) ||
+        !rule_get_string(item, "channel", channel, sizeof(channel), false, err, err_len) ||
+        !rule_get_string(item, "op", op, sizeof(op), true, err, err_len) ||
+        !rule_get_string(item, "actuator", actuator_key, sizeof(actuator_key), true, err, err_len) ||
+        !rule_get_string(item, "action", rule->action, sizeof(rule->action), true, err, err_len) ||
+        !rule_get_string(item, "value", rule->value, sizeof(rule->value), false, err, err_len) ||
+        !rule_get_string(item, "clear_action", rule->clear_action, sizeof(rule->clear_action), 
+                         false, err, err_len) ||
+        !rule_get_string(item, "clear_value", rule->clear_value, sizeof(rule->clear_value), 
+                         false, err, err_len)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    
+    if (strcmp(op, ">") != 0 && strcmp(op, "<") != 0) {
+        snprintf(err, err_len, "rule %s: op must be > or <", rule->id);
+        return ESP_ERR_INVALID_ARG;
+    }
+    rule->above = op[0] == '>';
+    
+    const cJSON *threshold = cJSON_GetObjectItem(item, "threshold");
+    const cJSON *hysteresis = cJSON_GetObjectItem(item, "hysteresis");
+    if (!cJSON_IsNumber(threshold) || 
+        (hysteresis && (!cJSON_IsNumber(hysteresis) || !(hysteresis->valuedouble >= 0)))) {
+        snprintf(err, err_len, "rule %s: invalid threshold or hysteresis", rule->id);
+        return ESP_ERR_INVALID_ARG;
+    }
+    rule->threshold = (float)threshold->valuedouble;
+    rule->hysteresis = hysteresis ? (float)hysteresis->valuedouble : 0.0f;
+    
+    int sensor = mcp_registry_index_find(&g_bridge_ctx->sensor_types, sensor_key, sensor_type_at);
+    if (sensor < 0) {
+        snprintf(err, err_len, "rule %s: unknown sensor %s", rule->id, sensor_key);
+        return ESP_ERR_NOT_FOUND;
+    }
+    rule->sensor = sensor;
+    
+    const sensor_node_t *node = &g_bridge_ctx->sensors[sensor];
+    if (channel[0]) {
+        rule->channel = node->channel_count;
+        for (uint8_t i = 0; node->channels && i < node->channel_count; i++) {
+            if (strcmp(node->channels[i].name, channel) == 0) {
+                rule->channel = i;
+                break;
+            }
+        }
+        if (rule->channel == node->channel_count) {
+            snprintf(err, err_len, "rule %s: unknown channel %s", rule->id, channel);
+            return ESP_ERR_NOT_FOUND;
+        }
+    }
+    
+    int actuator = mcp_registry_index_find(&g_bridge_ctx->actuator_types, actuator_key, actuator_type_at);
+    if (actuator < 0) {
+        snprintf(err, err_len, "rule %s: unknown actuator %s", rule->id, actuator_key);
+        return ESP_ERR_NOT_FOUND;
+    }
+    rule->actuator = actuator;
+    return ESP_OK;
+}
+
+/**
+ * @brief Compile a rule document into a table sorted by sensor (caller holds the mutex)
+ * 
+ * Nothing is installed here, so a document with one bad rule changes nothing.
+ */
+static esp_err_t rules_compile(const cJSON *doc, mcp_rule_t *table, uint8_t *count, 
+                               char *err, size_t err_len) {
+    const cJSON *rules = cJSON_GetObjectItem(doc, "rules");
+    if (!cJSON_IsArray(rules)) {
+        snprintf(err, err_len, "missing rules array");
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (cJSON_GetArraySize(rules) > MCP_BRIDGE_MAX_RULES) {
+        snprintf(err, err_len, "more than %d rules", MCP_BRIDGE_MAX_RULES);
+        return ESP_ERR_INVALID_SIZE;
+    }
+    
+    *count = 0;
+    const cJSON *item;
+    cJSON_ArrayForEach(item, rules) {
+        mcp_rule_t rule;
+        esp_err_t ret = rule_compile(item, &rule, err, err_len);
+        if (ret != ESP_OK) {
+            return ret;
+        }
+        for (uint8_t i = 0; i < *count; i++) {
+            if (strcmp(table[i].id, rule.id) == 0) {
+                snprintf(err, err_len, "duplicate rule %s", rule.id);
+                return ESP_ERR_INVALID_ARG;
+            }
+        }
+        
+        // Insertion sort by sensor, keeping document order within a sensor
+        uint8_t i = *count;
+        while (i > 0 && table[i - 1].sensor > rule.sensor) {
+            table[i] = table[i - 1];
+            i--;
+        }
+        table[i] = rule;
+        (*count)++;
+    }
+    return ESP_OK;
+}
+
+/**
+ * @brief Swap in a compiled table (caller holds the mutex)
+ * 
+ * Every rule of the new table starts inactive, so a condition that already
+ * holds fires its action once more on the next reading.
+ * 
+ * @return The previous table, to be freed by the caller
+ */
+static mcp_rule_t* rules_install(mcp_rule_t *table, uint8_t count, uint32_t version) {
+    mcp_rule_t *old = g_bridge_ctx->rules;
+    g_bridge_ctx->rules = table;
+    g_bridge_ctx->rule_count = count;
+    g_bridge_ctx->rules_version = version;
+    
+    for (uint16_t i = 0; i < g_bridge_ctx->sensor_count; i++) {
+        g_bridge_ctx->sensors[i].rule_start = 0;
+        g_bridge_ctx->sensors[i].rule_count = 0;
+    }
+    for (uint8_t i = 0; i < count; i++) {
+        sensor_node_t *sensor = &g_bridge_ctx->sensors[table[i].sensor];
+        if (!sensor->rule_count) {
+            sensor->rule_start = i;
+        }
+        sensor->rule_count++;
+    }
+    return old;
+}
+
+/**
+ * @brief Queue the actuator command of a rule that changed state
+ * @return false if the command queue is full
+ */
+static bool rule_fire(const mcp_rule_t *rule, const char *action, const char *value, float reading) {
+    const actuator_node_t *actuator = &g_bridge_ctx->actuators[rule->actuator];
+    mcp_command_t cmd = {
+        .kind = MCP_COMMAND_ACTUATOR,
+        .device = actuator->device,
+        .reading = reading,
+        .timestamp = get_timestamp()
+    };
+    strncpy(cmd.actuator_type, actuator->type, sizeof(cmd.actuator_type) - 1);
+    strncpy(cmd.action, action, sizeof(cmd.action) - 1);
+    strncpy(cmd.value, value, sizeof(cmd.value) - 1);
+    strncpy(cmd.rule, rule->id, sizeof(cmd.rule) - 1);
+    
+    if (xQueueSend(g_bridge_ctx->command_queue, &cmd, 0) != pdTRUE) {
+        ESP_LOGW(TAG, "Command queue full, rule %s retried on the next reading", rule->id);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Evaluate the rules of a sensor against a fresh reading (caller holds the mutex)
+ * 
+ * Only the sensor's own rules are looked at, and actions are queued to the
+ * actuator task rather than run here, so a poll never costs more than
+ * MCP_BRIDGE_MAX_RULES comparisons. Rules act on state changes only.
+ */
+static void rules_evaluate(const sensor_node_t *sensor, const float *values) {
+    mcp_rule_t *rule = &g_bridge_ctx->rules[sensor->rule_start];
+    for (uint8_t i = 0; i < sensor->rule_count; i++, rule++) {
+        float value = values[rule->channel];
+        if (isnan(value)) {
+            continue;
+        }
+        
+        // Leaving the active state takes the hysteresis on top of the threshold
+        bool active;
+        if (rule->above) {
+            active = value > (rule->active ? rule->threshold - rule->hysteresis : rule->threshold);
+        } else {
+            active = value < (rule->active ? rule->threshold + rule->hysteresis : rule->threshold);
+        }
+        if (active == rule->active) {
+            continue;
+        }
+        
+        const char *action = active ? rule->action : rule->clear_action;
+        if (action[0] && !rule_fire(rule, action, active ? rule->value : rule->clear_value, value)) {
+            continue;
+        }
+        rule->active = active;
+    }
+}
+
+/**
+ * @brief Report the outcome of an actuator command issued by a local rule
+ * 
+ * The rule acts whether or not the broker is reachable; only the report is
+ * lost while offline.
+ */
+static void rules_report_fired(const mcp_command_t *cmd, esp_err_t ret) {
+    g_bridge_ctx->rules_fired++;
+    if (!g_bridge_ctx->mqtt_connected) {
+        return;
+    }
+    
+    cJSON *json = cJSON_CreateObject();
+    if (!json) {
+        return;
+    }
+    char actuator[MCP_BRIDGE_MAX_TOPIC_LEN];
+    type_key_format(actuator, sizeof(actuator), cmd->device, cmd->actuator_type);
+    
+    cJSON_AddStringToObject(json, "device_id", g_bridge_ctx->device_id);
+    cJSON_AddStringToObject(json, "rule", cmd->rule);
+    cJSON_AddStringToObject(json, "actuator", actuator);
+    cJSON_AddStringToObject(json, "action", cmd->action);
+    if (cmd->value[0]) {
+        cJSON_AddStringToObject(json, "value", cmd->value);
+    }
+    cJSON_AddNumberToObject(json, "reading", cmd->reading);
+    cJSON_AddStringToObject(json, "status", ret == ESP_OK ? "ok" : "error");
+    if (ret != ESP_OK) {
+        cJSON_AddStringToObject(json, "error", esp_err_to_name(ret));
+    }
+    json_add_timestamp(json);
+    
+    char *message = cJSON_PrintUnformatted(json);
+    cJSON_Delete(json);
+    if (!message) {
+        return;
+    }
+    
+    char topic[MCP_BRIDGE_MAX_TOPIC_LEN];
+    snprintf(topic, sizeof(topic), "devices/%s/rules/fired", g_bridge_ctx->device_id);
+    if (bridge_publish(MCP_MESSAGE_CLASS_STATUS, topic, message, 0, g_bridge_ctx->config.qos_config.status_qos, false, NULL) >= 0) {
+        g_bridge_ctx->messages_sent++;
+    }
+    free(message);
+}
+
+/**
+ * @brief Report the outcome of a rule table update
+ */
+static void rules_publish_ack(uint32_t version, const char *status, const char *error) {
+    cJSON *json = cJSON_CreateObject();
+    if (!json) {
+        return;
+    }
+    cJSON_AddStringToObject(json, "device_id", g_bridge_ctx->device_id);
+    cJSON_AddNumberToObject(json, "version", version);
+    cJSON_AddStringToObject(json, "status", status);
+    if (error) {
+        cJSON_AddStringToObject(json, "error", error);
+    }
+    cJSON_AddNumberToObject(json, "rules_version", g_bridge_ctx->rules_version);
+    cJSON_AddNumberToObject(json, "rules", g_bridge_ctx->rule_count);
+    json_add_timestamp(json);
+    
+    char *message = cJSON_PrintUnformatted(json);
+    cJSON_Delete(json);
+    if (!message) {
+        return;
+    }
+    
+    char topic[MCP_BRIDGE_MAX_TOPIC_LEN];
+    snprintf(topic, sizeof(topic), "devices/%s/rules/ack", g_bridge_ctx->device_id);
+    if (bridge_publish(MCP_MESSAGE_CLASS_STATUS, topic, message, 0, g_bridge_ctx->config.qos_config.status_qos, false, NULL) >= 0) {
+        g_bridge_ctx->messages_sent++;
+    }
+    free(message);
+}
+
+/**
+ * @brief Compile and install a rule document
+ * @return Status for the ack: "applied", "unchanged", "stale" or "rejected" (err set)
+ */
+static const char* rules_load(const cJSON *doc, uint32_t version, char *err, size_t err_len) {
+    const char *status = "rejected";
+    uint8_t count = 0;
+    mcp_rule_t *table = calloc(MCP_BRIDGE_MAX_RULES, sizeof(mcp_rule_t));
+    
+    xSemaphoreTake(g_bridge_ctx->mutex, portMAX_DELAY);
+    if (version == g_bridge_ctx->rules_version) {
+        status = "unchanged";
+    } else if (version < g_bridge_ctx->rules_version) {
+        status = "stale";
+    } else if (!table) {
+        snprintf(err, err_len, "out of memory");
+    } else if (rules_compile(doc, table, &count, err, err_len) == ESP_OK) {
+        table = rules_install(table, count, version);
+        status = "applied";
+    }
+    xSemaphoreGive(g_bridge_ctx->mutex);
+    
+    free(table);
+    return status;
+}
+
+/**
+ * @brief Handle a rule document pushed by the server (actuator task)
+ * 
+ * Versioned like the live config: the retained copy redelivered on
+ * resubscribe is acked as unchanged and older versions as stale.
+ */
+static void rules_handle_update(const char *payload) {
+    char err[MCP_BRIDGE_CONFIG_ERROR_LEN] = {0};
+    const char *status = "rejected";
+    uint32_t version = 0;
+    
+    cJSON *doc = cJSON_Parse(payload);
+    const cJSON *version_json = doc ? cJSON_GetObjectItem(doc, "version") : NULL;
+    if (!doc) {
+        snprintf(err, sizeof(err), "invalid JSON");
+    } else if (!cJSON_IsNumber(version_json) || version_json->valuedouble < 1 || 
+               version_json->valuedouble > UINT32_MAX) {
+        snprintf(err, sizeof(err), "missing or invalid version");
+    } else {
+        version = (uint32_t)version_json->valuedouble;
+        status = rules_load(doc, version, err, sizeof(err));
+    }
+    cJSON_Delete(doc);
+    
+    if (strcmp(status, "applied") == 0) {
+        ESP_LOGI(TAG, "Applied rules version %lu (%u rules)", 
+                (unsigned long)version, g_bridge_ctx->rule_count);
+        nvs_store_document("rules", payload);
+    } else if (err[0]) {
+        ESP_LOGW(TAG, "Rules version %lu rejected: %s", (unsigned long)version, err);
+    }
+    
+    rules_publish_ack(version, status, err[0] ? err : NULL);
+}
+
+/**
+ * @brief Re-install the rule table persisted by a previous boot
+ * 
+ * Rules work without the broker, so they are back before the first connect.
+ */
+static void rules_restore(void) {
+    char *document = nvs_load_document("rules");
+    if (!document) {
+        return;
+    }
+    
+    cJSON *doc = cJSON_Parse(document);
+    free(document);
+    const cJSON *version = doc ? cJSON_GetObjectItem(doc, "version") : NULL;
+    if (!cJSON_IsNumber(version) || version->valuedouble < 1) {
+        ESP_LOGW(TAG, "Stored rules are corrupt, ignored");
+        cJSON_Delete(doc);
+        return;
+    }
+    
+    char err[MCP_BRIDGE_CONFIG_ERROR_LEN] = {0};
+    const char *status = rules_load(doc, (uint32_t)version->valuedouble, err, sizeof(err));
+    cJSON_Delete(doc);
+    
+    if (strcmp(status, "applied") == 0) {
+        ESP_LOGI(TAG, "Restored rules version %lu", (unsigned long)g_bridge_ctx->rules_version);
+    } else {
+        ESP_LOGW(TAG, "Stored rules rejected (%s)", err);
+    }
+}
+
+/* ==================== SENSOR READS ==================== */
+
+/**
+ * @brief Longest a read of this sensor may take, in microseconds
+ */
+static int64_t sensor_read_timeout_us(const sensor_node_t *sensor) {
+    uint32_t ms = sensor->metadata.read_timeout_ms ? 
+                  sensor->metadata.read_timeout_ms : CONFIG_MCP_BRIDGE_SENSOR_READ_TIMEOUT_MS;
+    return (int64_t)ms * 1000;
+}
+
+/**
+ * @brief Hand the result of a read to the sensor task
+ * 
+ * Called by the read task, by the application for asynchronous sensors (any
+ * task, or from within start_cb) and for starts that failed. Results of reads
+ * that timed out or were already reported are dropped. Each sensor has at
+ * most one read in flight, so the completion queue never fills.
+ * 
+ * @return ESP_OK if accepted, ESP_ERR_INVALID_STATE for a stale result
+ */
+static esp_err_t sensor_read_complete(uint16_t entry, uint16_t gen, esp_err_t result, 
+                                      const float *values, size_t count) {
+    mcp_bridge_context_t *ctx = g_bridge_ctx;
+    sensor_node_t *sensor = &ctx->sensors[entry];
+    bool accepted = false;
+    bool waiter = false;
+    
+    portENTER_CRITICAL(&ctx->read_lock);
+    if (sensor->read_gen == gen && 
+        (sensor->read_state == SENSOR_READ_QUEUED || sensor->read_state == SENSOR_READ_RUNNING)) {
+        sensor->read_state = SENSOR_READ_DONE;
+        sensor->read_result = result;
+        sensor->read_done_us = esp_timer_get_time();
+        if (result == ESP_OK) {
+            memcpy(sensor->read_values, values, count * sizeof(float));
+        }
+        if (ctx->read_waiter == entry) {
+            ctx->read_waiter = -1;
+            ctx->read_waiter_result = result;
+            memcpy(ctx->read_waiter_values, sensor->read_values, sizeof(ctx->read_waiter_values));
+            waiter = true;
+        }
+        accepted = true;
+    }
+    portEXIT_CRITICAL(&ctx->read_lock);
+    
+    if (!accepted) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    xQueueSend(ctx->read_done, &entry, 0);
+    if (waiter) {
+        xSemaphoreGive(ctx->read_waiter_sem);
+    }
+    if (ctx->sensor_task_handle) {
+        xTaskNotify(ctx->sensor_task_handle, SENSOR_NOTIFY_READ_DONE, eSetBits);
+    }
+    return ESP_OK;
+}
+
+/**
+ * @brief Start reading a sensor (caller holds the mutex)
+ * 
+ * Read callbacks are queued for the read task; asynchronous sensors are
+ * started in place. The result arrives on the completion queue, also when
+ * the start itself fails.
+ * 
+ * @return ESP_OK if started, ESP_ERR_INVALID_STATE if a read is still in flight
+ */
+static esp_err_t sensor_read_start(sensor_node_t *sensor, int64_t slot_us, bool on_demand) {
+    mcp_bridge_context_t *ctx = g_bridge_ctx;
+    uint16_t entry = sensor - ctx->sensors;
+    
+    portENTER_CRITICAL(&ctx->read_lock);
+    if (sensor->read_state != SENSOR_READ_IDLE) {
+        portEXIT_CRITICAL(&ctx->read_lock);
+        return ESP_ERR_INVALID_STATE;
+    }
+    uint16_t gen = ++sensor->read_gen;
+    sensor->read_state = sensor->read_start_cb ? SENSOR_READ_RUNNING : SENSOR_READ_QUEUED;
+    sensor->read_started_us = esp_timer_get_time();
+    // An entry left by an expired queued read serves this one; queueing another would
+    // let a stuck read task fill the queue with duplicates
+    bool enqueue = !sensor->read_start_cb && !sensor->read_queued;
+    if (enqueue) {
+        sensor->read_queued = true;
+    }
+    portEXIT_CRITICAL(&ctx->read_lock);
+    
+    sensor->read_slot_us = slot_us;
+    sensor->read_on_demand = on_demand;
+    ctx->reads_in_flight++;
+    
+    esp_err_t ret = ESP_OK;
+    if (sensor->read_start_cb) {
+        ret = sensor->read_start_cb(sensor->sensor_id, (mcp_sensor_read_token_t)entry << 16 | gen, 
+                                    sensor->user_data);
+    } else if (enqueue && xQueueSend(ctx->read_queue, &entry, 0) != pdTRUE) {
+        portENTER_CRITICAL(&ctx->read_lock);
+        sensor->read_queued = false;
+        portEXIT_CRITICAL(&ctx->read_lock);
+        ret = ESP_ERR_NO_MEM;
+    }
+    if (ret != ESP_OK) {
+        sensor_read_complete(entry, gen, ret, NULL, 0);
+    }
+    return ESP_OK;
+}
+
+/**
+ * @brief Run read callbacks, one at a time, outside the bridge mutex
+ * 
+ * Not subscribed to the task watchdog: a callback that never returns shows
+ * up as timed-out reads and an open breaker. When its read expires, the
+ * task is left in the callback and a new one takes over the queue (see
+ * sensor_read_expire()). A replaced task exits if its callback ever
+ * returns; its result is dropped.
+ * 
+ * @param pvParameters Generation of this read task
+ */
+static void sensor_read_task(void *pvParameters) {
+    mcp_bridge_context_t *ctx = g_bridge_ctx;
+    uint32_t task_gen = (uint32_t)(uintptr_t)pvParameters;
+    uint16_t entry;
+    
+    for (;;) {
+        if (xQueueReceive(ctx->read_queue, &entry, portMAX_DELAY) != pdTRUE) {
+            continue;
+        }
+        
+        sensor_node_t *sensor = &ctx->sensors[entry];
+        portENTER_CRITICAL(&ctx->read_lock);
+        sensor->read_queued = false;
+        bool run = sensor->read_state == SENSOR_READ_QUEUED;
+        uint16_t gen = sensor->read_gen;
+        if (run) {
+            sensor->read_state = SENSOR_READ_RUNNING;
+            sensor->read_started_us = esp_timer_get_time();
+            ctx->read_task_entry = entry;
+        }
+        portEXIT_CRITICAL(&ctx->read_lock);
+        if (!run) {
+            continue;
+        }
+        
+        float values[MCP_BRIDGE_MAX_SENSOR_CHANNELS];
+        esp_err_t ret = sensor_read(sensor, values);
+        portENTER_CRITICAL(&ctx->read_lock);
+        bool replaced = ctx->read_task_gen != task_gen;
+        if (replaced) {
+            sensor->read_stuck_task = NULL;
+            ctx->read_tasks_abandoned--;
+        } else {
+            ctx->read_task_entry = -1;
+        }
+        portEXIT_CRITICAL(&ctx->read_lock);
+        if (replaced) {
+            ESP_LOGW(TAG, "Read of %s returned after it was abandoned", sensor->sensor_id);
+            vTaskDelete(NULL);
+        }
+        sensor_read_complete(entry, gen, ret, values, sensor->channel_count);
+    }
+}
+
+/**
+ * @brief Start a read task that takes over the read queue
+ * 
+ * @return ESP_OK, or ESP_ERR_NO_MEM if the task could not be created
+ */
+static esp_err_t sensor_read_task_start(void) {
+    mcp_bridge_context_t *ctx = g_bridge_ctx;
+    if (xTaskCreate(sensor_read_task, "mcp_read", 4096, (void *)(uintptr_t)ctx->read_task_gen, 5,
+                    &ctx->read_task_handle) != pdPASS) {
+        ctx->read_task_handle = NULL;
+        ESP_LOGE(TAG, "Failed to start a read task, queued sensor reads will time out");
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+/**
+ * @brief Whether a read task is still inside this sensor's expired callback
+ */
+static bool sensor_read_stuck(const sensor_node_t *sensor) {
+    mcp_bridge_context_t *ctx = g_bridge_ctx;
+    portENTER_CRITICAL(&ctx->read_lock);
+    bool stuck = sensor->read_stuck_task || ctx->read_task_entry == sensor - ctx->sensors;
+    portEXIT_CRITICAL(&ctx->read_lock);
+    return stuck;
+}
+
+/**
+ * @brief Publish a change of a sensor's circuit breaker
+ */
+static void sensor_breaker_report(sensor_node_t *sensor) {
+    char message[96];
+    if (sensor->breaker == SENSOR_BREAKER_OPEN) {
+        snprintf(message, sizeof(message), "%s: circuit open after %u failed reads (%s), retry in %lu ms",
+                 sensor->sensor_id, sensor->read_failures, esp_err_to_name(sensor->read_error),
+                 (unsigned long)((sensor->breaker_retry_us - esp_timer_get_time()) / 1000));
+        ESP_LOGW(TAG, "Sensor %s", message);
+    } else {
+        snprintf(message, sizeof(message), "%s: circuit closed", sensor->sensor_id);
+        ESP_LOGI(TAG, "Sensor %s", message);
+    }
+    send_event(MCP_EVENT_SENSOR_READ_ERROR, sensor);
+    mcp_bridge_publish_error("sensor_breaker", message, sensor->breaker == SENSOR_BREAKER_OPEN ? 2 : 0);
+}
+
+/**
+ * @brief Count a finished read in the sensor's circuit breaker (caller holds the mutex)
+ * 
+ * CONFIG_MCP_BRIDGE_SENSOR_BREAKER_THRESHOLD failures in a row open the
+ * breaker. Once the backoff has passed the next poll is a trial read:
+ * success closes the breaker, failure opens it again for twice as long,
+ * up to CONFIG_MCP_BRIDGE_SENSOR_BREAKER_MAX_MS.
+ */
+static void sensor_breaker_record(sensor_node_t *sensor, esp_err_t ret) {
+    if (ret == ESP_OK) {
+        sensor->read_failures = 0;
+        if (sensor->breaker != SENSOR_BREAKER_CLOSED) {
+            sensor->breaker = SENSOR_BREAKER_CLOSED;
+            sensor->breaker_trips = 0;
+            g_bridge_ctx->sensor_breakers_open--;
+            sensor_breaker_report(sensor);
+        }
+        return;
+    }
+    
+    sensor->read_error = ret;
+    if (sensor->read_failures < UINT8_MAX) {
+        sensor->read_failures++;
+    }
+    if (sensor->breaker == SENSOR_BREAKER_OPEN ||
+        (sensor->breaker == SENSOR_BREAKER_CLOSED && 
+         sensor->read_failures < CONFIG_MCP_BRIDGE_SENSOR_BREAKER_THRESHOLD)) {
+        return;
+    }
+    
+    uint32_t backoff_ms = CONFIG_MCP_BRIDGE_SENSOR_BREAKER_BASE_MS;
+    for (uint8_t i = 0; i < sensor->breaker_trips && backoff_ms < CONFIG_MCP_BRIDGE_SENSOR_BREAKER_MAX_MS; i++) {
+        backoff_ms *= 2;
+    }
+    if (backoff_ms > CONFIG_MCP_BRIDGE_SENSOR_BREAKER_MAX_MS) {
+        backoff_ms = CONFIG_MCP_BRIDGE_SENSOR_BREAKER_MAX_MS;
+    }
+    if (sensor->breaker_trips < UINT8_MAX) {
+        sensor->breaker_trips++;
+    }
+    if (sensor->breaker == SENSOR_BREAKER_CLOSED) {
+        g_bridge_ctx->sensor_breakers_open++;
+    }
+    sensor->breaker = SENSOR_BREAKER_OPEN;
+    sensor->breaker_retry_us = esp_timer_get_time() + (int64_t)backoff_ms * 1000;
+    sensor_breaker_report(sensor);
+}
+
+/**
+ * @brief Count a failed read (caller holds the mutex)
+ */
+static void sensor_read_failed(sensor_node_t *sensor, esp_err_t ret) {
+    ESP_LOGE(TAG, "Failed to read sensor %s: %s", sensor->sensor_id, esp_err_to_name(ret));
+    g_bridge_ctx->sensor_read_errors++;
+    sensor_breaker_record(sensor, ret);
+}
+
+/**
+ * @brief Fail the reads that are past their deadline (caller holds the mutex)
+ * 
+ * A read may wait for the read task as long as its callback may run, and
+ * both count as a timeout. When the read task is the one stuck in an
+ * expired callback, it is abandoned there and a new read task serves the
+ * queue, up to MCP_BRIDGE_READ_TASKS_ABANDONED_MAX stuck tasks. Further
+ * polls of that sensor fail at once until the callback returns.
+ * 
+ * @return Ticks until the next deadline (portMAX_DELAY if none)
+ */
+static TickType_t sensor_read_expire(void) {
+    mcp_bridge_context_t *ctx = g_bridge_ctx;
+    int64_t now_us = esp_timer_get_time();
+    int64_t next_us = INT64_MAX;
+    bool replace = false;
+    
+    for (uint16_t i = 0; i < ctx->sensor_count && ctx->reads_in_flight; i++) {
+        sensor_node_t *sensor = &ctx->sensors[i];
+        int64_t deadline_us = 0;
+        bool expired = false;
+        
+        portENTER_CRITICAL(&ctx->read_lock);
+        if (sensor->read_state == SENSOR_READ_RUNNING || sensor->read_state == SENSOR_READ_QUEUED) {
+            deadline_us = sensor->read_started_us + sensor_read_timeout_us(sensor);
+            if (deadline_us <= now_us) {
+                sensor->read_state = SENSOR_READ_IDLE;
+                expired = true;
+                if (ctx->read_task_entry == i && ctx->read_tasks_abandoned < MCP_BRIDGE_READ_TASKS_ABANDONED_MAX) {
+                    sensor->read_stuck_task = ctx->read_task_handle;
+                    ctx->read_task_entry = -1;
+                    ctx->read_task_gen++;
+                    ctx->read_tasks_abandoned++;
+                    replace = true;
+                }
+            }
+        }
+        portEXIT_CRITICAL(&ctx->read_lock);
+        
+        if (expired) {
+            ctx->reads_in_flight--;
+            ctx->sensor_read_timeouts++;
+            sensor_read_failed(sensor, ESP_ERR_TIMEOUT);
+        } else if (deadline_us && deadline_us < next_us) {
+            next_us = deadline_us;
+        }
+    }
+    
+    if (replace) {
+        ESP_LOGW(TAG, "Read task stuck in a sensor callback, starting another (%u stuck)", 
+                ctx->read_tasks_abandoned);
+    }
+    if (replace || (!ctx->read_task_handle && ctx->reads_in_flight)) {
+        sensor_read_task_start();
+    }
+    
+    if (next_us == INT64_MAX) {
+        return portMAX_DELAY;
+    }
+    return pdMS_TO_TICKS((uint32_t)((next_us - now_us + 999) / 1000)) + 1;
+}
+
+/**
+ * @brief Abandon every read in flight once the bridge tasks are stopped
+ * 
+ * Also deletes the read tasks still stuck in a callback.
+ */
+static void sensor_reads_reset(void) {
+    mcp_bridge_context_t *ctx = g_bridge_ctx;
+    
+    for (uint16_t i = 0; i < ctx->sensor_count; i++) {
+        portENTER_CRITICAL(&ctx->read_lock);
+        TaskHandle_t stuck = ctx->sensors[i].read_stuck_task;
+        ctx->sensors[i].read_stuck_task = NULL;
+        ctx->sensors[i].read_state = SENSOR_READ_IDLE;
+        ctx->sensors[i].read_queued = false;
+        portEXIT_CRITICAL(&ctx->read_lock);
+        if (stuck) {
+            vTaskDelete(stuck);
+        }
+    }
+    
+    portENTER_CRITICAL(&ctx->read_lock);
+    ctx->read_task_entry = -1;
+    ctx->read_task_gen++;
+    ctx->read_tasks_abandoned = 0;
+    ctx->read_waiter = -1;
+    portEXIT_CRITICAL(&ctx->read_lock);
+    
+    ctx->reads_in_flight = 0;
+    if (ctx->read_queue) {
+        xQueueReset(ctx->read_queue);
+        xQueueReset(ctx->read_done);
+    }
+}
+
+/* ==================== HEALTH MONITOR ==================== */
+
+/**
+ * @brief Start the task watchdog unless the system already did
+ * 
+ * An already running TWDT keeps its system configuration
+ * (CONFIG_ESP_TASK_WDT_TIMEOUT_S); the bridge tasks are simply added to it.
+ */
+static esp_err_t health_watchdog_init(void) {
+    esp_task_wdt_config_t twdt = {
+        .timeout_ms = CONFIG_MCP_BRIDGE_WATCHDOG_TIMEOUT * 1000,
+        .idle_core_mask = 0,
+        .trigger_panic = true,
+    };
+    esp_err_t ret = esp_task_wdt_init(&twdt);
+    if (ret == ESP_ERR_INVALID_STATE) {
+        return ESP_OK;
+    }
+    if (ret != ESP_OK) {
+        ESP_LOGW(TAG, "Task watchdog unavailable: %s", esp_err_to_name(ret));
+    }
+    return ret;
+}
+
+/**
+ * @brief Subscribe the calling bridge task to the task watchdog
+ */
+static void health_watch_task(void) {
+    if (g_bridge_ctx->watchdog_armed && esp_task_wdt_add(NULL) != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to add %s to the task watchdog", pcTaskGetName(NULL));
+    }
+}
+
+/**
+ * @brief Tell the task watchdog the calling bridge task is alive
+ * 
+ * Bridge tasks block for at most MCP_BRIDGE_TASK_FEED_MS between calls, so
+ * only a stuck callback or publish can let the watchdog expire.
+ */
+static void health_feed(void) {
+    if (g_bridge_ctx->watchdog_armed) {
+        esp_task_wdt_reset();
+    }
+}
+
+/**
+ * @brief Stop watching a bridge task and delete it
+ */
+static void health_task_delete(TaskHandle_t *handle) {
+    if (!*handle) {
+        return;
+    }
+    if (g_bridge_ctx->watchdog_armed) {
+        esp_task_wdt_delete(*handle);
+    }
+    vTaskDelete(*handle);
+    *handle = NULL;
+}
+
+/**
+ * @brief Heap fragmentation in percent: how much of the free heap is not in the largest block
+ */
+static uint32_t health_heap_fragmentation(size_t free_heap, size_t largest_block) {
+    return free_heap ? 100 - (uint32_t)((uint64_t)largest_block * 100 / free_heap) : 0;
+}
+
+/**
+ * @brief Publish the health record
+ * 
+ * Formatted into a stack buffer and sent at QoS 0, so reporting low memory
+ * needs no heap itself. CPU shares cover the time since the previous record
+ * (run time stats must be enabled in FreeRTOS). Counters are totals since
+ * boot (or the last mcp_bridge_reset_metrics()); the server keeps the latest
+ * record per device.
+ */
+static void health_publish(health_cpu_t *cpu, bool low_memory) {
+    char record[MCP_BRIDGE_HEALTH_RECORD_LEN];
+    size_t free_heap = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+    size_t largest_block = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+    int64_t now_us = esp_timer_get_time();
+    bool synced;
+    int64_t ts_us = get_timestamp_us(&synced);
+    
+    int len = snprintf(record, sizeof(record),
+                       "{\"device_id\":\"%s\",\"timestamp\":%lld,\"ts_us\":%lld,\"time_synced\":%s,"
+                       "\"uptime_s\":%lu,\"low_memory\":%s,\"heap\":{\"free\":%u,\"min_free\":%u,"
+                       "\"largest_block\":%u,\"frag_pct\":%lu},\"tasks\":[",
+                       g_bridge_ctx->device_id, (long long)(now_us / 1000), (long long)ts_us,
+                       synced ? "true" : "false", (unsigned long)(now_us / 1000000),
+                       low_memory ? "true" : "false", (unsigned)free_heap,
+                       (unsigned)heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT), (unsigned)largest_block,
+                       (unsigned long)health_heap_fragmentation(free_heap, largest_block));
+    
+    TaskHandle_t tasks[MCP_BRIDGE_HEALTH_TASKS] = {
+        g_bridge_ctx->sensor_task_handle,
+        g_bridge_ctx->read_task_handle,
+        g_bridge_ctx->actuator_task_handle,
+        g_bridge_ctx->isr_task_handle,
+        g_bridge_ctx->health_task_handle,
+        g_bridge_ctx->mqtt_task_handle,
+    };
+#if CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+    // Counters are compared as 32-bit differences; the health interval keeps them from wrapping twice
+    uint32_t total_runtime = (uint32_t)portGET_RUN_TIME_COUNTER_VALUE();
+    uint32_t elapsed = (total_runtime - cpu->total_runtime) * portNUM_PROCESSORS;
+    cpu->total_runtime = total_runtime;
+#endif
+    
+    bool first = true;
+    for (int i = 0; i < MCP_BRIDGE_HEALTH_TASKS && len > 0 && len < (int)sizeof(record); i++) {
+        if (!tasks[i]) {
+            continue;
+        }
+        len += snprintf(record + len, sizeof(record) - len, "%s{\"name\":\"%s\",\"stack_free\":%u",
+                        first ? "" : ",", pcTaskGetName(tasks[i]), 
+                        (unsigned)uxTaskGetStackHighWaterMark(tasks[i]));
+        first = false;
+#if CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+        uint32_t runtime = (uint32_t)ulTaskGetRunTimeCounter(tasks[i]);
+        if (len < (int)sizeof(record) && elapsed) {
+            len += snprintf(record + len, sizeof(record) - len, ",\"cpu_pct\":%.1f",
+                            (double)(runtime - cpu->task_runtime[i]) * 100.0 / elapsed);
+        }
+        cpu->task_runtime[i] = runtime;
+#endif
+        if (len < (int)sizeof(record)) {
+            len += snprintf(record + len, sizeof(record) - len, "}");
+        }
+    }
+    if (len > 0 && len < (int)sizeof(record)) {
+        len += snprintf(record + len, sizeof(record) - len,
+                        "],\"counters\":{\"messages_sent\":%lu,\"messages_received\":%lu,"
+                        "\"connection_failures\":%lu,\"sensor_read_errors\":%lu,\"actuator_errors\":%lu,"
+                        "\"wifi_reconnections\":%lu,\"mqtt_reconnections\":%lu,\"isr_samples_dropped\":%lu,"
+                        "\"rules_fired\":%lu}",
+                        (unsigned long)g_bridge_ctx->messages_sent, (unsigned long)g_bridge_ctx->messages_received,
+                        (unsigned long)g_bridge_ctx->connection_failures,
+                        (unsigned long)g_bridge_ctx->sensor_read_errors,
+                        (unsigned long)g_bridge_ctx->actuator_errors,
+                        (unsigned long)g_bridge_ctx->wifi_link.reconnections,
+                        (unsigned long)g_bridge_ctx->mqtt_link.reconnections,
+                        (unsigned long)g_bridge_ctx->isr_samples_dropped,
+                        (unsigned long)g_bridge_ctx->rules_fired);
+    }
+    wifi_ap_record_t ap;
+    if (len > 0 && len < (int)sizeof(record) && esp_wifi_sta_get_ap_info(&ap) == ESP_OK) {
+        len += snprintf(record + len, sizeof(record) - len, ",\"rssi\":%d", ap.rssi);
+    }
+    if (len > 0 && len < (int)sizeof(record)) {
+        len += snprintf(record + len, sizeof(record) - len, 
+                        ",\"sensor_read_timeouts\":%lu,\"read_tasks_stuck\":%u,\"breakers_open\":[",
+                        (unsigned long)g_bridge_ctx->sensor_read_timeouts, g_bridge_ctx->read_tasks_abandoned);
+    }
+    
+    // Sensors whose circuit breaker is open, as many as fit
+    first = true;
+    for (uint16_t s = 0; g_bridge_ctx->sensor_breakers_open && s < g_bridge_ctx->sensor_count; s++) {
+        const sensor_node_t *sensor = &g_bridge_ctx->sensors[s];
+        if (sensor->breaker != SENSOR_BREAKER_OPEN || len <= 0 ||
+            len + strlen(sensor->sensor_id) + 8 >= sizeof(record)) {
+            continue;
+        }
+        len += snprintf(record + len, sizeof(record) - len, "%s\"%s\"", first ? "" : ",", sensor->sensor_id);
+        first = false;
+    }
+    if (len > 0 && len < (int)sizeof(record)) {
+        len += snprintf(record + len, sizeof(record) - len, "]}");
+    }
+    if (len <= 0 || len >= (int)sizeof(record)) {
+        ESP_LOGW(TAG, "Health record truncated, not sent");
+        return;
+    }
+    
+    char topic[MCP_BRIDGE_MAX_TOPIC_LEN];
+    snprintf(topic, sizeof(topic), "devices/%s/health", g_bridge_ctx->device_id);
+    if (bridge_publish(MCP_MESSAGE_CLASS_TELEMETRY, topic, record, len, 0, false, NULL) >= 0) {
+        g_bridge_ctx->messages_sent++;
+    }
+}
+
+/* ==================== ON-DEMAND READS ==================== */
+
+/**
+ * @brief Get a fresh reading for an on-demand request (caller holds the mutex)
+ * 
+ * Joins a read already in flight instead of starting a second one.
+ * 
+ * @return ESP_OK or a read error when a read just finished, ESP_ERR_NOT_FINISHED
+ *         if the result is to be collected with sensor_read_wait()
+ */
+static esp_err_t sensor_read_await(sensor_node_t *sensor, float *values) {
+    mcp_bridge_context_t *ctx = g_bridge_ctx;
+    int32_t entry = sensor - ctx->sensors;
+    esp_err_t ret = ESP_ERR_NOT_FINISHED;
+    
+    // A read task is still inside this sensor's abandoned callback
+    if (sensor_read_stuck(sensor)) {
+        return ESP_ERR_TIMEOUT;
+    }
+    
+    xSemaphoreTake(ctx->read_waiter_sem, 0);
+    portENTER_CRITICAL(&ctx->read_lock);
+    uint8_t state = sensor->read_state;
+    if (state == SENSOR_READ_DONE) {
+        ret = sensor->read_result;
+        memcpy(values, sensor->read_values, sizeof(sensor->read_values));
+    } else {
+        ctx->read_waiter = entry;
+    }
+    portEXIT_CRITICAL(&ctx->read_lock);
+    
+    if (state == SENSOR_READ_IDLE) {
+        sensor_read_start(sensor, 0, true);
+    }
+    return ret;
+}
+
+/**
+ * @brief Wait for the read sensor_read_await() joined or started
+ * 
+ * Called without the mutex. Gives up after the sensor's read timeout, and
+ * feeds the watchdog every MCP_BRIDGE_TASK_FEED_MS while it waits.
+ */
+static esp_err_t sensor_read_wait(const sensor_node_t *sensor, float *values) {
+    mcp_bridge_context_t *ctx = g_bridge_ctx;
+    int32_t entry = sensor - ctx->sensors;
+    int64_t deadline_us = esp_timer_get_time() + sensor_read_timeout_us(sensor);
+    bool done = false;
+    
+    while (!done) {
+        int64_t left_ms = (deadline_us - esp_timer_get_time()) / 1000;
+        if (left_ms <= 0) {
+            break;
+        }
+        TickType_t wait = pdMS_TO_TICKS(left_ms < MCP_BRIDGE_TASK_FEED_MS ? left_ms : MCP_BRIDGE_TASK_FEED_MS);
+        done = xSemaphoreTake(ctx->read_waiter_sem, wait + 1) == pdTRUE;
+        health_feed();
+    }
+    if (!done) {
+        portENTER_CRITICAL(&ctx->read_lock);
+        bool finished = ctx->read_waiter != entry;
+        ctx->read_waiter = -1;
+        portEXIT_CRITICAL(&ctx->read_lock);
+        
+        // Finished just as we gave up; the semaphore is being given
+        if (!finished || 
+            xSemaphoreTake(ctx->read_waiter_sem, pdMS_TO_TICKS(MCP_BRIDGE_TASK_FEED_MS)) != pdTRUE) {
+            return ESP_ERR_TIMEOUT;
+        }
+    }
+    memcpy(values, ctx->read_waiter_values, sizeof(ctx->read_waiter_values));
+    return ctx->read_waiter_result;
+}
+
+/**
+ * @brief Read a sensor immediately and answer on its response topic
+ * 
+ * Runs in the actuator task, outside the polling schedule. The response
+ * echoes the request ID so the server can match it to the waiting call.
+ * The read itself goes through the read task or the sensor's start
+ * callback like a scheduled one and is bounded by its timeout. A sensor
+ * whose circuit breaker is open is not read.
+ */
+static void sensor_handle_read(uint16_t device, const char *sensor_type, const char *request_id) {
+    float values[MCP_BRIDGE_MAX_SENSOR_CHANNELS] = {0};
+    esp_err_t ret = ESP_ERR_NOT_FOUND;
+    const char *error = "unknown sensor";
+    int64_t started_us = esp_timer_get_time();
+    
+    xSemaphoreTake(g_bridge_ctx->mutex, portMAX_DELAY);
+    sensor_node_t *sensor = find_sensor_by_type(device, sensor_type);
+    if (sensor && !sensor->read_cb && !sensor->read_multi_cb && !sensor->read_start_cb) {
+        error = NULL;
+        ret = sensor_read(sensor, values);
+        if (ret != ESP_OK) {
+            g_bridge_ctx->sensor_read_errors++;
+        }
+    } else if (sensor && sensor->breaker == SENSOR_BREAKER_OPEN) {
+        error = "circuit open";
+        ret = MCP_BRIDGE_ERR_SENSOR_FAILED;
+    } else if (sensor) {
+        error = NULL;
+        ret = sensor_read_await(sensor, values);
+    }
+    xSemaphoreGive(g_bridge_ctx->mutex);
     
-    wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
-    ESP_ERROR_CHECK(esp_wifi_init(&cfg));
+    if (ret == ESP_ERR_NOT_FINISHED) {
+        ret = sensor_read_wait(sensor, values);
+    }
     
-    esp_event_handler_instance_t instance_any_id;
-    esp_event_handler_instance_t instance_got_ip;
-    ESP_ERROR_CHECK(esp_event_handler_instance_register(WIFI_EVENT,
-                                                        ESP_EVENT_ANY_ID,
-                                                        &wifi_event_handler,
-                                                        NULL,
-                                                        &instance_any_id));
-    ESP_ERROR_CHECK(esp_event_handler_instance_register(IP_EVENT,
-                                                        IP_EVENT_STA_GOT_IP,
-                                                        &wifi_event_handler,
-                                                        NULL,
-                                                        &instance_got_ip));
+    int64_t read_us = esp_timer_get_time() - started_us;
     
-    wifi_config_t wifi_config = {
-        .sta = {
-            .threshold.authmode = WIFI_AUTH_WPA2_PSK,
-            .pmf_cfg = {
-                .capable = true,
-                .required = false
-            },
-        },
-    };
+    cJSON *json = cJSON_CreateObject();
+    if (!json) {
+        return;
+    }
+    cJSON_AddStringToObject(json, "device_id", device_id_of(device));
+    cJSON_AddStringToObject(json, "request_id", request_id);
+    json_add_timestamp(json);
+    cJSON_AddStringToObject(json, "component", sensor_type);
+    if (ret == ESP_OK) {
+        cJSON_AddStringToObject(json, "status", "ok");
+        json_add_sensor_value(json, sensor, values);
+    } else {
+        cJSON_AddStringToObject(json, "status", "error");
+        cJSON_AddStringToObject(json, "error", error ? error : esp_err_to_name(ret));
+    }
+    cJSON_AddNumberToObject(json, "read_us", (double)read_us);
     
-    // Copy SSID and password
-    strncpy((char*)wifi_config.sta.ssid, config->wifi_ssid, sizeof(wifi_config.sta.ssid) - 1);
-    strncpy((char*)wifi_config.sta.password, config->wifi_password, sizeof(wifi_config.sta.password) - 1);
+    char *message = cJSON_PrintUnformatted(json);
+    cJSON_Delete(json);
+    if (!message) {
+        return;
+    }
     
-    ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
-    ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_config));
-    ESP_ERROR_CHECK(esp_wifi_start());
+    char topic[MCP_BRIDGE_MAX_TOPIC_LEN];
+    snprintf(topic, sizeof(topic), "devices/%s/sensors/%s/response", device_id_of(device), sensor_type);
+    if (bridge_publish(MCP_MESSAGE_CLASS_STATUS, topic, message, 0, g_bridge_ctx->config.qos_config.status_qos, false, NULL) >= 0) {
+        g_bridge_ctx->messages_sent++;
+    }
+    free(message);
     
-    ESP_LOGI(TAG, "WiFi initialization finished");
+    if (blog_enabled(ESP_LOG_DEBUG)) {
+        blog_record_t rec = { .id = BLOG_SENSOR_READ, .level = ESP_LOG_DEBUG, .num = ret, .value = read_us };
+        blog_text(&rec, 0, sizeof(rec.text), sensor_type, strlen(sensor_type));
+        blog_record(&rec);
+    }
+}
+
+/* ==================== OTA UPDATES ==================== */
+
+#if CONFIG_MCP_BRIDGE_OTA
+/**
+ * @brief Report update progress on devices/{id}/ota/status
+ * 
+ * "receiving" doubles as the per-chunk ack (offset = stream bytes applied);
+ * rewind asks the server to resend from offset.
+ */
+static void ota_publish_status(const char *version, const char *state, const char *error, bool rewind) {
+    const ota_state_t *ota = &g_bridge_ctx->ota;
+    cJSON *json = cJSON_CreateObject();
+    if (!json) {
+        return;
+    }
+    cJSON_AddStringToObject(json, "device_id", g_bridge_ctx->device_id);
+    cJSON_AddStringToObject(json, "version", version);
+    cJSON_AddStringToObject(json, "state", state);
+    cJSON_AddNumberToObject(json, "offset", ota->received);
+    cJSON_AddNumberToObject(json, "size", ota->size);
+    cJSON_AddNumberToObject(json, "chunk_size", CONFIG_MCP_BRIDGE_OTA_CHUNK_SIZE);
+    if (rewind) {
+        cJSON_AddBoolToObject(json, "rewind", true);
+    }
+    if (error) {
+        cJSON_AddStringToObject(json, "error", error);
+    }
+    if (strcmp(state, "done") == 0) {
+        cJSON_AddNumberToObject(json, "duration_ms", (double)((esp_timer_get_time() - ota->started_us) / 1000));
+    }
     
-    return ESP_OK;
+    char *message = cJSON_PrintUnformatted(json);
+    cJSON_Delete(json);
+    if (!message) {
+        return;
+    }
+    
+    // Acks are frequent and the server re-asks when one is lost; outcomes must arrive
+    bool ack = strcmp(state, "receiving") == 0;
+    char topic[MCP_BRIDGE_MAX_TOPIC_LEN];
+    snprintf(topic, sizeof(topic), "devices/%s/ota/status", g_bridge_ctx->device_id);
+    if (bridge_publish(MCP_MESSAGE_CLASS_STATUS, topic, message, 0, ack ? 0 : 1, false, NULL) >= 0) {
+        g_bridge_ctx->messages_sent++;
+    }
+    free(message);
 }
 
-/* ==================== MQTT MANAGEMENT ==================== */
+/**
+ * @brief Drop the update in progress and release its resources
+ */
+static void ota_release(bool abort) {
+    ota_state_t *ota = &g_bridge_ctx->ota;
+    if (abort) {
+        esp_ota_abort(ota->handle);
+    }
+    mbedtls_sha256_free(&ota->sha);
+    free(ota->buffer);
+    ota->buffer = NULL;
+    ota->active = false;
+}
 
 /**
- * @brief MQTT event handler
+ * @brief Abort the update in progress and report why
  */
-static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_t event_id, void *event_data) {
-    esp_mqtt_event_handle_t event = event_data;
+static void ota_fail(const char *error) {
+    ESP_LOGE(TAG, "Firmware update to %s failed: %s", g_bridge_ctx->ota.version, error);
+    ota_release(true);
+    ota_publish_status(g_bridge_ctx->ota.version, "failed", error, false);
+}
+
+/**
+ * @brief Append bytes to the new image
+ */
+static esp_err_t ota_write(const uint8_t *data, size_t len) {
+    ota_state_t *ota = &g_bridge_ctx->ota;
+    if (len > ota->image_size - ota->written) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    esp_err_t ret = esp_ota_write(ota->handle, data, len);
+    if (ret == ESP_OK) {
+        mbedtls_sha256_update(&ota->sha, data, len);
+        ota->written += len;
+    }
+    return ret;
+}
+
+/**
+ * @brief Delta COPY: append a range of the running image to the new one
+ * 
+ * Runs on the actuator task, which feeds the watchdog per buffer since a
+ * COPY can span many erase sectors.
+ */
+static esp_err_t ota_copy(uint32_t offset, uint32_t len) {
+    ota_state_t *ota = &g_bridge_ctx->ota;
+    if (offset > ota->source_size || len > ota->source_size - offset) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    while (len > 0) {
+        uint32_t n = len < MCP_BRIDGE_OTA_COPY_BUF ? len : MCP_BRIDGE_OTA_COPY_BUF;
+        esp_err_t ret = esp_partition_read(ota->source, offset, ota->buffer, n);
+        if (ret == ESP_OK) {
+            ret = ota_write(ota->buffer, n);
+        }
+        if (ret != ESP_OK) {
+            return ret;
+        }
+        offset += n;
+        len -= n;
+        health_feed();
+    }
+    return ESP_OK;
+}
+
+/**
+ * @brief Apply a piece of the update stream, in order
+ */
+static esp_err_t ota_apply(const uint8_t *data, size_t len) {
+    ota_state_t *ota = &g_bridge_ctx->ota;
+    if (!ota->delta) {
+        return ota_write(data, len);
+    }
     
-    switch ((esp_mqtt_event_id_t)event_id) {
-        case MQTT_EVENT_CONNECTED:
-            ESP_LOGI(TAG, "MQTT connected");
-            g_bridge_ctx->mqtt_connected = true;
-            g_bridge_ctx->mqtt_retry_count = 0;
-            xEventGroupSetBits(g_bridge_ctx->mqtt_event_group, MQTT_CONNECTED_BIT);
-            send_event(MCP_EVENT_MQTT_CONNECTED, NULL);
-            
-            // Subscribe to actuator command topics
-            actuator_node_t *actuator = g_bridge_ctx->actuators;
-            while (actuator) {
-                char topic[MCP_BRIDGE_MAX_TOPIC_LEN];
-                snprintf(topic, sizeof(topic), "devices/%s/actuators/%s/cmd", 
-                        g_bridge_ctx->device_id, actuator->type);
-                esp_mqtt_client_subscribe(g_bridge_ctx->mqtt_client, topic, 1);
-                ESP_LOGI(TAG, "Subscribed to %s", topic);
-                actuator = actuator->next;
-            }
-            
-            // Publish capabilities
-            char *capabilities = create_capabilities_message();
-            if (capabilities) {
-                char topic[MCP_BRIDGE_MAX_TOPIC_LEN];
-                snprintf(topic, sizeof(topic), "devices/%s/capabilities", g_bridge_ctx->device_id);
-                esp_mqtt_client_publish(g_bridge_ctx->mqtt_client, topic, capabilities, 0, 1, true);
-                free(capabilities);
+    while (len > 0) {
+        if (ota->insert_left) {
+            size_t n = len < ota->insert_left ? len : ota->insert_left;
+            esp_err_t ret = ota_write(data, n);
+            if (ret != ESP_OK) {
+                return ret;
             }
-            
-            // Publish online status
-            mcp_bridge_publish_device_status("online");
-            break;
-            
-        case MQTT_EVENT_DISCONNECTED:
-            ESP_LOGW(TAG, "MQTT disconnected");
-            g_bridge_ctx->mqtt_connected = false;
-            xEventGroupSetBits(g_bridge_ctx->mqtt_event_group, MQTT_FAIL_BIT);
-            send_event(MCP_EVENT_MQTT_DISCONNECTED, NULL);
-            break;
-            
-        case MQTT_EVENT_DATA: {
-            ESP_LOGI(TAG, "MQTT message received: %.*s", event->topic_len, event->topic);
-            g_bridge_ctx->messages_received++;
-            
-            // Parse topic to extract actuator type
-            char topic[MCP_BRIDGE_MAX_TOPIC_LEN];
-            strncpy(topic, event->topic, event->topic_len);
-            topic[event->topic_len] = '\0';
-            
-            // Topic format: devices/{device_id}/actuators/{actuator_type}/cmd
-            char *token = strtok(topic, "/");
-            if (token && strcmp(token, "devices") == 0) {
-                token = strtok(NULL, "/"); // device_id
-                token = strtok(NULL, "/"); // "actuators"
-                if (token && strcmp(token, "actuators") == 0) {
-                    char *actuator_type = strtok(NULL, "/");
-                    token = strtok(NULL, "/"); // "cmd"
-                    
-                    if (actuator_type && token && strcmp(token, "cmd") == 0) {
-                        // Parse JSON payload
-                        char payload[MCP_BRIDGE_MAX_MESSAGE_LEN];
-                        strncpy(payload, event->data, event->data_len);
-                        payload[event->data_len] = '\0';
-                        
-                        cJSON *json = cJSON_Parse(payload);
-                        if (json) {
-                            cJSON *action_json = cJSON_GetObjectItem(json, "action");
-                            cJSON *value_json = cJSON_GetObjectItem(json, "value");
-                            
-                            if (action_json && cJSON_IsString(action_json)) {
-                                mcp_command_t cmd = {0};
-                                strncpy(cmd.actuator_id, actuator_type, sizeof(cmd.actuator_id) - 1);
-                                strncpy(cmd.action, action_json->valuestring, sizeof(cmd.action) - 1);
-                                
-                                if (value_json) {
-                                    if (cJSON_IsString(value_json)) {
-                                        strncpy(cmd.value, value_json->valuestring, sizeof(cmd.value) - 1);
-                                    } else if (cJSON_IsNumber(value_json)) {
-                                        snprintf(cmd.value, sizeof(cmd.value), "%.2f", value_json->valuedouble);
-                                    } else if (cJSON_IsBool(value_json)) {
-                                        strncpy(cmd.value, cJSON_IsTrue(value_json) ? "true" : "false", sizeof(cmd.value) - 1);
-                                    }
-                                }
-                                cmd.timestamp = get_timestamp();
-                                
-                                // Queue command for processing
-                                if (xQueueSend(g_bridge_ctx->command_queue, &cmd, 0) != pdTRUE) {
-                                    ESP_LOGW(TAG, "Command queue full, dropping command");
-                                }
-                                
-                                send_event(MCP_EVENT_COMMAND_RECEIVED, &cmd);
-                            }
-                            cJSON_Delete(json);
-                        }
-                    }
-                }
+            ota->insert_left -= n;
+            data += n;
+            len -= n;
+            continue;
+        }
+        if (!ota->op) {
+            ota->op = *data++;
+            len--;
+            ota->args_len = 0;
+            if (ota->op != MCP_BRIDGE_OTA_OP_COPY && ota->op != MCP_BRIDGE_OTA_OP_INSERT) {
+                return ESP_ERR_INVALID_RESPONSE;
             }
-            break;
+            continue;
         }
         
-        case MQTT_EVENT_ERROR:
-            ESP_LOGE(TAG, "MQTT error occurred");
-            g_bridge_ctx->connection_failures++;
-            break;
-            
-        default:
-            break;
+        size_t args_size = ota->op == MCP_BRIDGE_OTA_OP_COPY ? 8 : 4;
+        size_t n = len < args_size - ota->args_len ? len : args_size - ota->args_len;
+        memcpy(ota->args + ota->args_len, data, n);
+        ota->args_len += n;
+        data += n;
+        len -= n;
+        if (ota->args_len < args_size) {
+            continue;
+        }
+        
+        const uint8_t *a = ota->args;
+        uint32_t first = a[0] | a[1] << 8 | a[2] << 16 | (uint32_t)a[3] << 24;
+        uint32_t second = a[4] | a[5] << 8 | a[6] << 16 | (uint32_t)a[7] << 24;
+        if (ota->op == MCP_BRIDGE_OTA_OP_COPY) {
+            esp_err_t ret = ota_copy(first, second);
+            if (ret != ESP_OK) {
+                return ret;
+            }
+        } else {
+            ota->insert_left = first;
+        }
+        ota->op = 0;
     }
+    return ESP_OK;
 }
 
 /**
- * @brief Initialize MQTT client
+ * @brief Parse a hex SHA-256 digest
  */
-static esp_err_t mqtt_init_internal(const mcp_bridge_config_t *config) {
-    esp_mqtt_client_config_t mqtt_cfg = {
-        .broker.address.uri = config->mqtt_broker_uri,
-        .credentials.client_id = g_bridge_ctx->device_id,
-        .session.last_will = {
-            .topic = NULL, // Will be set below
-            .msg = "{\"value\":\"offline\"}",
-            .qos = 1,
-            .retain = true
+static bool ota_parse_digest(const cJSON *item, uint8_t digest[32]) {
+    if (!cJSON_IsString(item) || strlen(item->valuestring) != 64) {
+        return false;
+    }
+    for (int i = 0; i < 32; i++) {
+        unsigned int byte;
+        if (sscanf(item->valuestring + i * 2, "%2x", &byte) != 1) {
+            return false;
         }
-    };
+        digest[i] = (uint8_t)byte;
+    }
+    return true;
+}
+
+/**
+ * @brief Check that the running partition holds the image the delta was made against
+ */
+static bool ota_source_matches(const esp_partition_t *source, uint32_t size, const uint8_t expected[32]) {
+    ota_state_t *ota = &g_bridge_ctx->ota;
+    mbedtls_sha256_context sha;
+    uint8_t digest[32];
+    
+    mbedtls_sha256_init(&sha);
+    mbedtls_sha256_starts(&sha, 0);
+    for (uint32_t offset = 0; offset < size; offset += MCP_BRIDGE_OTA_COPY_BUF) {
+        uint32_t n = size - offset < MCP_BRIDGE_OTA_COPY_BUF ? size - offset : MCP_BRIDGE_OTA_COPY_BUF;
+        if (esp_partition_read(source, offset, ota->buffer, n) != ESP_OK) {
+            mbedtls_sha256_free(&sha);
+            return false;
+        }
+        mbedtls_sha256_update(&sha, ota->buffer, n);
+        health_feed();
+    }
+    mbedtls_sha256_finish(&sha, digest);
+    mbedtls_sha256_free(&sha);
+    return memcmp(digest, expected, sizeof(digest)) == 0;
+}
+
+/**
+ * @brief Start (or resume) the update announced on devices/{id}/ota
+ * 
+ * An announcement of the version already in progress is the server asking
+ * for the current offset after lost chunks or a reconnect; the download
+ * continues from there. Progress does not survive a restart.
+ */
+static void ota_handle_start(const char *payload) {
+    ota_state_t *ota = &g_bridge_ctx->ota;
+    cJSON *json = cJSON_Parse(payload);
+    const cJSON *version = cJSON_GetObjectItem(json, "version");
+    if (!cJSON_IsString(version) || strlen(version->valuestring) >= sizeof(ota->version)) {
+        ESP_LOGW(TAG, "OTA announcement without a valid version ignored");
+        cJSON_Delete(json);
+        return;
+    }
     
-    // Set last will topic
-    static char will_topic[MCP_BRIDGE_MAX_TOPIC_LEN];
-    snprintf(will_topic, sizeof(will_topic), "devices/%s/status", g_bridge_ctx->device_id);
-    mqtt_cfg.session.last_will.topic = will_topic;
+    if (ota->active && strcmp(ota->version, version->valuestring) == 0) {
+        ota_publish_status(ota->version, "receiving", NULL, true);
+        cJSON_Delete(json);
+        return;
+    }
+    if (ota->active) {
+        ESP_LOGW(TAG, "Update to %s superseded by %s", ota->version, version->valuestring);
+        ota_release(true);
+    }
     
-    g_bridge_ctx->mqtt_client = esp_mqtt_client_init(&mqtt_cfg);
-    if (!g_bridge_ctx->mqtt_client) {
-        ESP_LOGE(TAG, "Failed to initialize MQTT client");
-        return ESP_FAIL;
+    *ota = (ota_state_t) {0};
+    strcpy(ota->version, version->valuestring);
+    const cJSON *mode = cJSON_GetObjectItem(json, "mode");
+    const cJSON *size = cJSON_GetObjectItem(json, "size");
+    const cJSON *image_size = cJSON_GetObjectItem(json, "image_size");
+    const cJSON *source_version = cJSON_GetObjectItem(json, "source_version");
+    const cJSON *source_size = cJSON_GetObjectItem(json, "source_size");
+    uint8_t source_sha256[32];
+    
+    ota->delta = cJSON_IsString(mode) && strcmp(mode->valuestring, "delta") == 0;
+    ota->source = esp_ota_get_running_partition();
+    ota->target = esp_ota_get_next_update_partition(NULL);
+    const char *error = NULL;
+    if (!cJSON_IsNumber(size) || size->valuedouble < 1 || !cJSON_IsNumber(image_size) || 
+        image_size->valuedouble < 1 || !ota_parse_digest(cJSON_GetObjectItem(json, "sha256"), ota->sha256)) {
+        error = "size, image_size and sha256 are required";
+    } else if (!ota->target) {
+        error = "no OTA partition";
+    } else if (image_size->valuedouble > ota->target->size) {
+        error = "image larger than the OTA partition";
+    } else if (ota->delta && (!cJSON_IsString(source_version) || 
+               strcmp(source_version->valuestring, esp_app_get_description()->version) != 0)) {
+        error = "delta made for another source version";
+    } else if (ota->delta && (!cJSON_IsNumber(source_size) || source_size->valuedouble > ota->source->size ||
+               !ota_parse_digest(cJSON_GetObjectItem(json, "source_sha256"), source_sha256))) {
+        error = "source_size and source_sha256 are required for a delta";
+    }
+    if (!error) {
+        ota->size = (uint32_t)size->valuedouble;
+        ota->image_size = (uint32_t)image_size->valuedouble;
+        ota->source_size = ota->delta ? (uint32_t)source_size->valuedouble : 0;
+    }
+    cJSON_Delete(json);
+    
+    if (!error) {
+        ota->buffer = malloc(MCP_BRIDGE_OTA_COPY_BUF);
+        if (!ota->buffer) {
+            error = "out of memory";
+        } else if (ota->delta && !ota_source_matches(ota->source, ota->source_size, source_sha256)) {
+            error = "running image does not match the delta source";
+        }
+    }
+    
+    esp_err_t ret = ESP_OK;
+    if (!error) {
+        ret = esp_ota_begin(ota->target, OTA_WITH_SEQUENTIAL_WRITES, &ota->handle);
+        if (ret != ESP_OK) {
+            error = esp_err_to_name(ret);
+        }
+    }
+    if (error) {
+        ESP_LOGE(TAG, "Firmware update to %s refused: %s", ota->version, error);
+        free(ota->buffer);
+        ota->buffer = NULL;
+        ota_publish_status(ota->version, "failed", error, false);
+        return;
+    }
+    
+    mbedtls_sha256_init(&ota->sha);
+    mbedtls_sha256_starts(&ota->sha, 0);
+    ota->started_us = esp_timer_get_time();
+    ota->active = true;
+    ESP_LOGI(TAG, "Firmware update to %s started: %s, %lu bytes for a %lu byte image", ota->version,
+            ota->delta ? "delta" : "full image", (unsigned long)ota->size, (unsigned long)ota->image_size);
+    ota_publish_status(ota->version, "receiving", NULL, true);
+}
+
+/**
+ * @brief Check the new image and boot into it
+ * 
+ * The digest of every byte written must match the announcement before
+ * esp_ota_end() validates the image and the boot partition is switched.
+ */
+static void ota_finish(void) {
+    ota_state_t *ota = &g_bridge_ctx->ota;
+    uint8_t digest[32];
+    
+    if (ota->op || ota->insert_left || ota->written != ota->image_size) {
+        ota_fail("update stream ended inside the image");
+        return;
+    }
+    mbedtls_sha256_finish(&ota->sha, digest);
+    if (memcmp(digest, ota->sha256, sizeof(digest)) != 0) {
+        ota_fail("image digest mismatch");
+        return;
+    }
+    
+    esp_err_t ret = esp_ota_end(ota->handle);
+    if (ret == ESP_OK) {
+        ret = esp_ota_set_boot_partition(ota->target);
+    }
+    ota_release(false);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Firmware update to %s failed: %s", ota->version, esp_err_to_name(ret));
+        ota_publish_status(ota->version, "failed", esp_err_to_name(ret), false);
+        return;
+    }
+    
+    ESP_LOGI(TAG, "Firmware %s installed in %lld ms, restarting", ota->version,
+            (long long)((esp_timer_get_time() - ota->started_us) / 1000));
+    ota_publish_status(ota->version, "done", NULL, false);
+    vTaskDelay(pdMS_TO_TICKS(1000));    // Let the outcome reach the broker
+    esp_restart();
+}
+
+/**
+ * @brief Apply one chunk of the update stream
+ * 
+ * Chunks must arrive in order. Duplicates are ignored; on the first chunk
+ * past a gap the server is asked once to rewind, later ones in the same
+ * window are dropped silently.
+ */
+static void ota_handle_chunk(uint32_t offset, const uint8_t *data, uint32_t len) {
+    ota_state_t *ota = &g_bridge_ctx->ota;
+    if (!ota->active || offset < ota->received) {
+        return;
+    }
+    if (offset > ota->received) {
+        if (!ota->rewound) {
+            ota->rewound = true;
+            ota_publish_status(ota->version, "receiving", NULL, true);
+        }
+        return;
+    }
+    if (len > ota->size - ota->received) {
+        ota_fail("chunk past the end of the update");
+        return;
+    }
+    
+    esp_err_t ret = ota_apply(data, len);
+    if (ret != ESP_OK) {
+        ota_fail(esp_err_to_name(ret));
+        return;
+    }
+    ota->received += len;
+    ota->rewound = false;
+    
+    if (ota->received < ota->size) {
+        ota_publish_status(ota->version, "receiving", NULL, false);
+    } else {
+        ota_finish();
+    }
+}
+#endif
+
+/* ==================== TASK IMPLEMENTATIONS ==================== */
+
+/**
+ * @brief Aligned slot a read starting now belongs to (0 = none)
+ * 
+ * Only reads starting within CONFIG_MCP_BRIDGE_ALIGNED_JITTER_MS of their
+ * slot are stamped with it.
+ */
+static int64_t sensor_slot(const sensor_node_t *sensor) {
+#if CONFIG_MCP_BRIDGE_ALIGNED_SAMPLING
+    if (sensor->slot_us && g_bridge_ctx->time_synced) {
+        bool synced;
+        int64_t offset_us = get_timestamp_us(&synced) - sensor->slot_us;
+        if (offset_us > -(int64_t)CONFIG_MCP_BRIDGE_ALIGNED_JITTER_MS * 1000 &&
+            offset_us < (int64_t)CONFIG_MCP_BRIDGE_ALIGNED_JITTER_MS * 1000) {
+            return sensor->slot_us;
+        }
+    }
+#endif
+    return 0;
+}
+
+/**
+ * @brief Start a scheduled read of one sensor (caller holds the mutex)
+ * 
+ * While MQTT is down only sensors that drive local rules are read. An open
+ * circuit breaker skips polls until its backoff has passed. A sensor whose
+ * last read is still in flight skips this poll.
+ */
+static void sensor_poll(sensor_node_t *sensor) {
+    if (!g_bridge_ctx->mqtt_connected && !sensor->rule_count) {
+        return;
+    }
+    if (sensor->breaker == SENSOR_BREAKER_OPEN) {
+        if (esp_timer_get_time() < sensor->breaker_retry_us) {
+            return;
+        }
+        sensor->breaker = SENSOR_BREAKER_HALF_OPEN;
+    }
+    
+    // A read task is still inside this sensor's abandoned callback
+    if (sensor_read_stuck(sensor)) {
+        sensor_read_failed(sensor, ESP_ERR_TIMEOUT);
+        return;
+    }
+    if (sensor_read_start(sensor, sensor_slot(sensor), false) != ESP_OK && sensor->read_on_demand) {
+        // An on-demand read is in flight; publish it as this poll
+        sensor->read_on_demand = false;
+        sensor->read_slot_us = 0;
+    }
+}
+
+/**
+ * @brief Take a finished read off the completion queue (caller holds the mutex)
+ * 
+ * A scheduled read evaluates the sensor's rules and is published unless it
+ * is within its deadband; an on-demand read only updates the last value.
+ */
+static void sensor_read_finish(uint16_t entry) {
+    mcp_bridge_context_t *ctx = g_bridge_ctx;
+    sensor_node_t *sensor = &ctx->sensors[entry];
+    float values[MCP_BRIDGE_MAX_SENSOR_CHANNELS];
+    
+    portENTER_CRITICAL(&ctx->read_lock);
+    if (sensor->read_state != SENSOR_READ_DONE) {
+        portEXIT_CRITICAL(&ctx->read_lock);
+        return;
+    }
+    sensor->read_state = SENSOR_READ_IDLE;
+    esp_err_t ret = sensor->read_result;
+    int64_t sampled_us = sensor->read_done_us;
+    memcpy(values, sensor->read_values, sizeof(values));
+    portEXIT_CRITICAL(&ctx->read_lock);
+    ctx->reads_in_flight--;
+    
+    if (ret != ESP_OK) {
+        sensor_read_failed(sensor, ret);
+        return;
     }
+    sensor_breaker_record(sensor, ESP_OK);
     
-    ESP_ERROR_CHECK(esp_mqtt_client_register_event(g_bridge_ctx->mqtt_client, ESP_EVENT_ANY_ID, mqtt_event_handler, NULL));
-    ESP_ERROR_CHECK(esp_mqtt_client_start(g_bridge_ctx->mqtt_client));
+    if (!sensor->read_on_demand && sensor->rule_count) {
+        rules_evaluate(sensor, values);
+    }
     
-    return ESP_OK;
+    if (sensor->read_on_demand || !ctx->mqtt_connected || sensor_within_deadband(sensor, values)) {
+        // On demand, offline, or within the deadband of the last published value; nothing worth sending
+        sensor->last_value = values[0];
+        sensor->last_read_time = get_timestamp();
+    } else if (publish_sensor_reading(sensor, values, sampled_us, sensor->read_slot_us) == ESP_OK) {
+        if (blog_enabled(ESP_LOG_DEBUG)) {
+            blog_record(&(blog_record_t) { .id = BLOG_SENSOR_PUBLISHED, .level = ESP_LOG_DEBUG, 
+                                           .ref = sensor, .value = values[0] });
+        }
+    } else {
+        ESP_LOGE(TAG, "Failed to publish sensor data for %s", sensor->sensor_id);
+        sensor->last_value = values[0];
+        sensor->last_read_time = get_timestamp();
+    }
 }
 
-/* ==================== TASK IMPLEMENTATIONS ==================== */
-
 /**
  * @brief Sensor polling task
+ * 
+ * Sleeps until the earliest sensor is due and polls only the sensors that
+ * are, so the cost of a wakeup does not grow with the number of sensors
+ * waiting on longer intervals. Polls only start reads; results come back
+ * on the completion queue, so slow sensors overlap and a hung callback only
+ * costs a replacement read task. Also sends the gateway batch when it is
+ * due. Keeps polling without MQTT while local rules are installed.
  */
 static void sensor_task(void *pvParameters) {
-    TickType_t xLastWakeTime = xTaskGetTickCount();
-    
     ESP_LOGI(TAG, "Sensor polling task started");
+    health_watch_task();
     
     while (g_bridge_ctx->running) {
-        // Wait for the configured interval
-        vTaskDelayUntil(&xLastWakeTime, 
-                       pdMS_TO_TICKS(g_bridge_ctx->config.sensor_publish_interval_ms));
+        health_feed();
         
-        // Skip if not connected
-        if (!g_bridge_ctx->mqtt_connected) {
+        // Sleep until the next sensor is due, but wake every second to feed the watchdog
+        TickType_t wait = pdMS_TO_TICKS(MCP_BRIDGE_TASK_FEED_MS);
+        xSemaphoreTake(g_bridge_ctx->mutex, portMAX_DELAY);
+        if ((g_bridge_ctx->mqtt_connected || g_bridge_ctx->rule_count) && 
+            g_bridge_ctx->sensor_schedule.len > 0) {
+            sensor_node_t *next = &g_bridge_ctx->sensors[g_bridge_ctx->sensor_schedule.heap[0]];
+            int32_t left = (int32_t)(next->next_due - xTaskGetTickCount());
+            if (left < (int32_t)wait) {
+                wait = left > 0 ? (TickType_t)left : 0;
+            }
+        }
+        TickType_t read_wait = sensor_read_expire();
+        if (read_wait < wait) {
+            wait = read_wait;
+        }
+        xSemaphoreGive(g_bridge_ctx->mutex);
+        
+        TickType_t batch_wait = gateway_batch_service();
+        if (batch_wait < wait) {
+            wait = batch_wait;
+        }
+        
+        // A new MQTT session or interval change wakes us for an immediate reading of everything
+        uint32_t notified = 0;
+        xTaskNotifyWait(0, UINT32_MAX, &notified, wait);
+        if (notified & SENSOR_NOTIFY_RESCHEDULE) {
+            xSemaphoreTake(g_bridge_ctx->mutex, portMAX_DELAY);
+            schedule_reset(xTaskGetTickCount());
+            xSemaphoreGive(g_bridge_ctx->mutex);
+        }
+        
+        // Finish the reads that completed, on-demand ones included
+        uint16_t entry;
+        xSemaphoreTake(g_bridge_ctx->mutex, portMAX_DELAY);
+        while (xQueueReceive(g_bridge_ctx->read_done, &entry, 0) == pdTRUE) {
+            sensor_read_finish(entry);
+            health_feed();
+        }
+        xSemaphoreGive(g_bridge_ctx->mutex);
+        
+        // Skip if not connected, unless local rules still need readings
+        if (!g_bridge_ctx->mqtt_connected && !g_bridge_ctx->rule_count) {
             continue;
         }
         
-        // Poll all registered sensors
+        // Start reading the sensors that are due
         xSemaphoreTake(g_bridge_ctx->mutex, portMAX_DELAY);
         
-        sensor_node_t *sensor = g_bridge_ctx->sensors;
-        while (sensor) {
-            float value;
-            esp_err_t ret = sensor->read_cb(sensor->sensor_id, &value, sensor->user_data);
-            
-            if (ret == ESP_OK) {
-                sensor->last_value = value;
-                sensor->last_read_time = get_timestamp();
-                
-                // Create and publish sensor data
-                char *message = create_sensor_message(sensor->sensor_id, sensor->type, value, sensor->unit);
-                if (message) {
-                    char topic[MCP_BRIDGE_MAX_TOPIC_LEN];
-                    snprintf(topic, sizeof(topic), "devices/%s/sensors/%s/data", 
-                            g_bridge_ctx->device_id, sensor->type);
-                    
-                    int msg_id = esp_mqtt_client_publish(g_bridge_ctx->mqtt_client, topic, message, 0, 0, false);
-                    if (msg_id >= 0) {
-                        g_bridge_ctx->messages_sent++;
-                        ESP_LOGD(TAG, "Published sensor %s: %.2f %s", sensor->sensor_id, value, sensor->unit ? sensor->unit : "");
-                    } else {
-                        ESP_LOGE(TAG, "Failed to publish sensor data for %s", sensor->sensor_id);
-                    }
-                    
-                    free(message);
-                }
-            } else {
-                ESP_LOGE(TAG, "Failed to read sensor %s: %s", 
-                        sensor->sensor_id, esp_err_to_name(ret));
-                g_bridge_ctx->sensor_read_errors++;
+        TickType_t now = xTaskGetTickCount();
+        while (g_bridge_ctx->sensor_schedule.len > 0) {
+            sensor_node_t *sensor = &g_bridge_ctx->sensors[g_bridge_ctx->sensor_schedule.heap[0]];
+            if ((int32_t)(sensor->next_due - now) > 0) {
+                break;
             }
             
-            sensor = sensor->next;
+            sensor_poll(sensor);
+            health_feed();
+            schedule_advance(sensor, now);
+            mcp_schedule_sift_down(&g_bridge_ctx->sensor_schedule);
         }
         
         xSemaphoreGive(g_bridge_ctx->mutex);
@@ -618,6 +5668,46 @@ static void sensor_task(void *pvParameters) {
     vTaskDelete(NULL);
 }
 
+/**
+ * @brief Publish samples queued from ISRs as soon as they arrive
+ * 
+ * Runs above the polling and command tasks and never takes the bridge
+ * mutex, so an edge is not held up behind a slow read_cb. Each sample keeps
+ * the time of the interrupt, not the time it was published.
+ */
+static void isr_publish_task(void *pvParameters) {
+    isr_sample_t sample;
+    
+    ESP_LOGI(TAG, "ISR publish task started");
+    health_watch_task();
+    
+    while (g_bridge_ctx->running) {
+        health_feed();
+        if (xQueueReceive(g_bridge_ctx->isr_queue, &sample, pdMS_TO_TICKS(MCP_BRIDGE_TASK_FEED_MS)) != pdTRUE) {
+            continue;
+        }
+        
+        sensor_node_t *sensor = &g_bridge_ctx->sensors[sample.sensor];
+        if (!g_bridge_ctx->mqtt_connected) {
+            if (blog_enabled(ESP_LOG_DEBUG)) {
+                blog_record(&(blog_record_t) { .id = BLOG_EVENT_DROPPED, .level = ESP_LOG_DEBUG, .ref = sensor });
+            }
+            continue;
+        }
+        
+        if (publish_sensor_reading(sensor, &sample.value, sample.sampled_us, 0) == ESP_OK) {
+            if (blog_enabled(ESP_LOG_DEBUG)) {
+                blog_record(&(blog_record_t) { .id = BLOG_EVENT_PUBLISHED, .level = ESP_LOG_DEBUG, .ref = sensor,
+                                               .num = (int32_t)(esp_timer_get_time() - sample.sampled_us) });
+            }
+        } else {
+            ESP_LOGE(TAG, "Failed to publish event from %s", sensor->sensor_id);
+        }
+    }
+    
+    vTaskDelete(NULL);
+}
+
 /**
  * @brief Actuator command processing task
  */
@@ -625,17 +5715,106 @@ static void actuator_task(void *pvParameters) {
     mcp_command_t cmd;
     
     ESP_LOGI(TAG, "Actuator command task started");
+    health_watch_task();
     
     while (g_bridge_ctx->running) {
-        if (xQueueReceive(g_bridge_ctx->command_queue, &cmd, pdMS_TO_TICKS(1000)) == pdTRUE) {
-            ESP_LOGI(TAG, "Processing command for %s: %s = %s", cmd.actuator_id, cmd.action, cmd.value);
+        health_feed();
+#if CONFIG_MCP_BRIDGE_OUTBOX_PERSIST
+        outbox_service();
+#endif
+        if (xQueueReceive(g_bridge_ctx->command_queue, &cmd, pdMS_TO_TICKS(MCP_BRIDGE_TASK_FEED_MS)) == pdTRUE) {
+            if (cmd.kind == MCP_COMMAND_SESSION_START) {
+                transports_connect();
+#if CONFIG_MCP_BRIDGE_OUTBOX_PERSIST
+                // Messages left unacknowledged by the last session or boot go first
+                outbox_replay();
+#endif
+                
+                // The first reading of a session goes out regardless of the deadband
+                xSemaphoreTake(g_bridge_ctx->mutex, portMAX_DELAY);
+                for (uint16_t i = 0; i < g_bridge_ctx->sensor_count; i++) {
+                    g_bridge_ctx->sensors[i].published = false;
+                }
+                xSemaphoreGive(g_bridge_ctx->mutex);
+                
+                // Publish the full document only when it changed, otherwise announce the hash
+                if (capabilities_refresh() == ESP_OK) {
+                    if (g_bridge_ctx->caps_changed) {
+                        capabilities_publish_full();
+                    } else {
+                        capabilities_announce();
+                    }
+                }
+                mcp_bridge_publish_device_status("online");
+                
+                // Children ride on this session; restate their documents and status
+                capabilities_publish_children();
+                for (uint16_t c = 0; c < g_bridge_ctx->child_count; c++) {
+                    child_publish_status(c + 1, g_bridge_ctx->children[c].online);
+                }
+                if (g_bridge_ctx->sensor_task_handle) {
+                    xTaskNotify(g_bridge_ctx->sensor_task_handle, SENSOR_NOTIFY_RESCHEDULE, eSetBits);
+                }
+#if CONFIG_BOOTLOADER_APP_ROLLBACK_ENABLE
+                // Reaching the broker is what proves a freshly installed image
+                esp_ota_mark_app_valid_cancel_rollback();
+#endif
+#if CONFIG_MCP_BRIDGE_OTA
+                if (g_bridge_ctx->ota.active) {
+                    ota_publish_status(g_bridge_ctx->ota.version, "receiving", NULL, true);
+                }
+#endif
+                continue;
+            }
+            if (cmd.kind == MCP_COMMAND_CAPABILITIES_GET) {
+                capabilities_publish_full();
+                continue;
+            }
+            if (cmd.kind == MCP_COMMAND_SENSOR_READ) {
+                sensor_handle_read(cmd.device, cmd.read.sensor_type, cmd.read.request_id);
+                continue;
+            }
+            if (cmd.kind == MCP_COMMAND_CONFIG_SET) {
+                config_handle_update(cmd.payload);
+                free(cmd.payload);
+                continue;
+            }
+            if (cmd.kind == MCP_COMMAND_RULES_SET) {
+                rules_handle_update(cmd.payload);
+                free(cmd.payload);
+                continue;
+            }
+#if CONFIG_MCP_BRIDGE_OTA
+            if (cmd.kind == MCP_COMMAND_OTA_START) {
+                ota_handle_start(cmd.payload);
+                free(cmd.payload);
+                continue;
+            }
+            if (cmd.kind == MCP_COMMAND_OTA_CHUNK) {
+                ota_handle_chunk(cmd.chunk.offset, (const uint8_t *)cmd.payload + 4, cmd.chunk.len);
+                free(cmd.payload);
+                continue;
+            }
+#endif
             
-            // Find the actuator
-            actuator_node_t *actuator = find_actuator(cmd.actuator_id);
+            // Find the actuator addressed by the topic or rule
+            esp_err_t ret = ESP_ERR_NOT_FOUND;
+            actuator_node_t *actuator = find_actuator_by_type(cmd.device, cmd.actuator_type);
             if (actuator) {
-                esp_err_t ret = actuator->control_cb(cmd.actuator_id, cmd.action, cmd.value, actuator->user_data);
+                if (blog_enabled(ESP_LOG_INFO)) {
+                    blog_record_t rec = { .id = BLOG_COMMAND, .level = ESP_LOG_INFO, .ref = actuator };
+                    blog_text(&rec, BLOG_ACTION_OFFSET, BLOG_VALUE_OFFSET - BLOG_ACTION_OFFSET, 
+                              cmd.action, strlen(cmd.action));
+                    blog_text(&rec, BLOG_VALUE_OFFSET, BLOG_RULE_OFFSET - BLOG_VALUE_OFFSET, 
+                              cmd.value, strlen(cmd.value));
+                    blog_text(&rec, BLOG_RULE_OFFSET, sizeof(rec.text) - BLOG_RULE_OFFSET, 
+                              cmd.rule, strlen(cmd.rule));
+                    blog_record(&rec);
+                }
+                ret = actuator->control_cb(actuator->actuator_id, cmd.action, cmd.value, actuator->user_data);
                 if (ret != ESP_OK) {
-                    ESP_LOGE(TAG, "Actuator control failed for %s: %s", cmd.actuator_id, esp_err_to_name(ret));
+                    ESP_LOGE(TAG, "Actuator control failed for %s: %s", actuator->actuator_id, esp_err_to_name(ret));
+                    g_bridge_ctx->actuator_errors++;
                     
                     // Publish error
                     char error_msg[128];
@@ -643,7 +5822,10 @@ static void actuator_task(void *pvParameters) {
                     mcp_bridge_publish_error("actuator_error", error_msg, 2);
                 }
             } else {
-                ESP_LOGE(TAG, "Unknown actuator: %s", cmd.actuator_id);
+                ESP_LOGE(TAG, "Unknown actuator: %s/%s", device_id_of(cmd.device), cmd.actuator_type);
+            }
+            if (cmd.rule[0]) {
+                rules_report_fired(&cmd, ret);
             }
         }
     }
@@ -652,26 +5834,42 @@ static void actuator_task(void *pvParameters) {
 }
 
 /**
- * @brief Watchdog task
+ * @brief Health monitor task
+ * 
+ * Checks the heap every second and publishes the health record every
+ * CONFIG_MCP_BRIDGE_HEALTH_INTERVAL seconds, and right away when free heap
+ * drops below CONFIG_MCP_BRIDGE_LOW_HEAP_THRESHOLD. Runs below the other
+ * bridge tasks, so it also formats the deferred log records.
  */
-static void watchdog_task(void *pvParameters) {
-    ESP_LOGI(TAG, "Watchdog task started");
+static void health_task(void *pvParameters) {
+    health_cpu_t cpu = {0};
+    int64_t interval_us = (int64_t)CONFIG_MCP_BRIDGE_HEALTH_INTERVAL * 1000000;
+    int64_t next_us = esp_timer_get_time() + interval_us;
+    bool low_memory = false;
+    
+    ESP_LOGI(TAG, "Health monitor task started");
+    health_watch_task();
     
     while (g_bridge_ctx->running) {
-        // Check system health
-        if (esp_get_free_heap_size() < 10000) {
-            ESP_LOGW(TAG, "Low memory warning: %d bytes free", esp_get_free_heap_size());
-            mcp_bridge_publish_error("low_memory", "Free heap below 10KB", 1);
-        }
+        health_feed();
+        vTaskDelay(pdMS_TO_TICKS(MCP_BRIDGE_TASK_FEED_MS));
+        blog_drain();
         
-        // Check connectivity
-        if (!g_bridge_ctx->wifi_connected || !g_bridge_ctx->mqtt_connected) {
-            ESP_LOGW(TAG, "Connectivity issues - WiFi: %s, MQTT: %s", 
-                    g_bridge_ctx->wifi_connected ? "OK" : "FAIL",
-                    g_bridge_ctx->mqtt_connected ? "OK" : "FAIL");
+        uint32_t free_heap = esp_get_free_heap_size();
+        bool low = free_heap < CONFIG_MCP_BRIDGE_LOW_HEAP_THRESHOLD;
+        if (low && !low_memory) {
+            ESP_LOGW(TAG, "Low memory: %lu bytes free, largest block %u", (unsigned long)free_heap,
+                    (unsigned)heap_caps_get_largest_free_block(MALLOC_CAP_8BIT));
         }
         
-        vTaskDelay(pdMS_TO_TICKS(30000)); // Check every 30 seconds
+        int64_t now_us = esp_timer_get_time();
+        if ((low && !low_memory) || now_us >= next_us) {
+            if (g_bridge_ctx->mqtt_connected) {
+                health_publish(&cpu, low);
+            }
+            next_us = now_us + interval_us;
+        }
+        low_memory = low;
     }
     
     vTaskDelete(NULL);
@@ -702,8 +5900,24 @@ esp_err_t mcp_bridge_init(const mcp_bridge_config_t *config) {
         g_bridge_ctx->config.mqtt_broker_uri = CONFIG_MCP_BRIDGE_MQTT_BROKER_URL;
         g_bridge_ctx->config.sensor_publish_interval_ms = CONFIG_MCP_BRIDGE_SENSOR_PUBLISH_INTERVAL;
         g_bridge_ctx->config.enable_watchdog = CONFIG_MCP_BRIDGE_ENABLE_WATCHDOG;
+        g_bridge_ctx->config.log_level = CONFIG_MCP_BRIDGE_LOG_LEVEL;
+    }
+    if (g_bridge_ctx->config.sensor_publish_interval_ms == 0) {
+        g_bridge_ctx->config.sensor_publish_interval_ms = CONFIG_MCP_BRIDGE_SENSOR_PUBLISH_INTERVAL;
+    }
+    const mcp_mqtt_qos_config_t qos_unset = {0};
+    if (memcmp(&g_bridge_ctx->config.qos_config, &qos_unset, sizeof(qos_unset)) == 0) {
+        g_bridge_ctx->config.qos_config = (mcp_mqtt_qos_config_t) {
+            .sensor_qos = 0,
+            .actuator_qos = 1,
+            .status_qos = 1,
+            .error_qos = 1,
+        };
     }
     
+    // log_level gates the bridge's own logs, deferred or not
+    esp_log_level_set(TAG, (esp_log_level_t)g_bridge_ctx->config.log_level);
+    
     // Validate configuration
     if (!g_bridge_ctx->config.wifi_ssid || !g_bridge_ctx->config.wifi_password || !g_bridge_ctx->config.mqtt_broker_uri) {
         ESP_LOGE(TAG, "Invalid configuration: missing required parameters");
@@ -721,7 +5935,14 @@ esp_err_t mcp_bridge_init(const mcp_bridge_config_t *config) {
     
     // Create synchronization primitives
     g_bridge_ctx->mutex = xSemaphoreCreateMutex();
-    if (!g_bridge_ctx->mutex) {
+    transports_init();
+    
+    g_bridge_ctx->publish_lock = xSemaphoreCreateMutex();
+    g_bridge_ctx->batch_lock = xSemaphoreCreateMutex();
+    if (!g_bridge_ctx->mutex || !g_bridge_ctx->publish_lock || !g_bridge_ctx->batch_lock) {
+        if (g_bridge_ctx->mutex) vSemaphoreDelete(g_bridge_ctx->mutex);
+        if (g_bridge_ctx->publish_lock) vSemaphoreDelete(g_bridge_ctx->publish_lock);
+        if (g_bridge_ctx->batch_lock) vSemaphoreDelete(g_bridge_ctx->batch_lock);
         free(g_bridge_ctx);
         g_bridge_ctx = NULL;
         return ESP_ERR_NO_MEM;
@@ -729,6 +5950,8 @@ esp_err_t mcp_bridge_init(const mcp_bridge_config_t *config) {
     
     g_bridge_ctx->command_queue = xQueueCreate(MCP_BRIDGE_COMMAND_QUEUE_SIZE, sizeof(mcp_command_t));
     if (!g_bridge_ctx->command_queue) {
+        vSemaphoreDelete(g_bridge_ctx->batch_lock);
+        vSemaphoreDelete(g_bridge_ctx->publish_lock);
         vSemaphoreDelete(g_bridge_ctx->mutex);
         free(g_bridge_ctx);
         g_bridge_ctx = NULL;
@@ -741,12 +5964,18 @@ esp_err_t mcp_bridge_init(const mcp_bridge_config_t *config) {
         if (g_bridge_ctx->wifi_event_group) vEventGroupDelete(g_bridge_ctx->wifi_event_group);
         if (g_bridge_ctx->mqtt_event_group) vEventGroupDelete(g_bridge_ctx->mqtt_event_group);
         vQueueDelete(g_bridge_ctx->command_queue);
+        vSemaphoreDelete(g_bridge_ctx->batch_lock);
+        vSemaphoreDelete(g_bridge_ctx->publish_lock);
         vSemaphoreDelete(g_bridge_ctx->mutex);
         free(g_bridge_ctx);
         g_bridge_ctx = NULL;
         return ESP_ERR_NO_MEM;
     }
     
+    portMUX_INITIALIZE(&g_bridge_ctx->read_lock);
+    g_bridge_ctx->read_task_entry = -1;
+    g_bridge_ctx->read_waiter = -1;
+    
     g_bridge_ctx->boot_time = get_timestamp();
     g_bridge_ctx->initialized = true;
     
@@ -770,36 +5999,41 @@ esp_err_t mcp_bridge_start(void) {
         return ESP_OK;
     }
     
-    g_bridge_ctx->running = true;
-    
-    // Initialize WiFi
-    esp_err_t ret = wifi_init_internal(&g_bridge_ctx->config);
+    esp_err_t ret = nvs_init_internal();
     if (ret != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to initialize WiFi: %s", esp_err_to_name(ret));
-        g_bridge_ctx->running = false;
+        ESP_LOGE(TAG, "Failed to initialize NVS: %s", esp_err_to_name(ret));
         return ret;
     }
+    sequence_boot_init();
     
-    // Wait for WiFi connection
-    EventBits_t bits = xEventGroupWaitBits(g_bridge_ctx->wifi_event_group,
-                                          WIFI_CONNECTED_BIT | WIFI_FAIL_BIT,
-                                          pdFALSE,
-                                          pdFALSE,
-                                          pdMS_TO_TICKS(30000));
+    // Unsigned messages would be dropped by the server, so do not connect without a key
+    if (g_bridge_ctx->config.enable_device_auth && auth_init() != ESP_OK) {
+        ESP_LOGE(TAG, "Device authentication enabled but unavailable");
+        return MCP_BRIDGE_ERR_AUTH_FAILED;
+    }
     
-    if (bits & WIFI_CONNECTED_BIT) {
-        ESP_LOGI(TAG, "Connected to WiFi");
-    } else if (bits & WIFI_FAIL_BIT) {
-        ESP_LOGE(TAG, "Failed to connect to WiFi");
-        g_bridge_ctx->running = false;
-        return ESP_ERR_WIFI_CONN;
-    } else {
-        ESP_LOGE(TAG, "WiFi connection timeout");
+#if CONFIG_MCP_BRIDGE_OUTBOX_PERSIST
+    // Without the partition the bridge runs with the RAM outbox only
+    outbox_init();
+#endif
+    
+    g_bridge_ctx->running = true;
+    
+    // Build the capabilities document up front so the connect path only compares hashes
+    capabilities_refresh();
+    
+    // Settings pushed by the server on a previous boot win over the compiled-in ones
+    config_restore();
+    rules_restore();
+    
+    ret = conn_supervisor_init();
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to create reconnect timers");
         g_bridge_ctx->running = false;
-        return ESP_ERR_TIMEOUT;
+        return ret;
     }
     
-    // Initialize MQTT
+    // Create the MQTT client first; it is started from the IP event handler
     ret = mqtt_init_internal(&g_bridge_ctx->config);
     if (ret != ESP_OK) {
         ESP_LOGE(TAG, "Failed to initialize MQTT: %s", esp_err_to_name(ret));
@@ -807,207 +6041,662 @@ esp_err_t mcp_bridge_start(void) {
         return ret;
     }
     
+    // Initialize WiFi; connection progress is reported through events
+    ret = wifi_init_internal(&g_bridge_ctx->config);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to initialize WiFi: %s", esp_err_to_name(ret));
+        g_bridge_ctx->running = false;
+        return ret;
+    }
+    
+    // Readings are stamped with boot-relative time until the first sync
+    time_sync_start();
+    
+    // Event samples from ISRs; kept across stop/start so handles stay valid
+    if (!g_bridge_ctx->isr_queue) {
+        g_bridge_ctx->isr_queue = xQueueCreate(CONFIG_MCP_BRIDGE_ISR_QUEUE_SIZE, sizeof(isr_sample_t));
+        if (!g_bridge_ctx->isr_queue) {
+            ESP_LOGE(TAG, "Failed to create ISR sample queue");
+            g_bridge_ctx->running = false;
+            return ESP_ERR_NO_MEM;
+        }
+    }
+    
+    // Sensor read queues, one slot per sensor; kept across stop/start like the ISR queue
+    if (!g_bridge_ctx->read_queue) {
+        g_bridge_ctx->read_queue = xQueueCreate(MCP_BRIDGE_MAX_SENSORS, sizeof(uint16_t));
+        g_bridge_ctx->read_done = xQueueCreate(MCP_BRIDGE_MAX_SENSORS, sizeof(uint16_t));
+        g_bridge_ctx->read_waiter_sem = xSemaphoreCreateBinary();
+        if (!g_bridge_ctx->read_queue || !g_bridge_ctx->read_done || !g_bridge_ctx->read_waiter_sem) {
+            if (g_bridge_ctx->read_queue) vQueueDelete(g_bridge_ctx->read_queue);
+            if (g_bridge_ctx->read_done) vQueueDelete(g_bridge_ctx->read_done);
+            if (g_bridge_ctx->read_waiter_sem) vSemaphoreDelete(g_bridge_ctx->read_waiter_sem);
+            g_bridge_ctx->read_queue = NULL;
+            ESP_LOGE(TAG, "Failed to create sensor read queues");
+            g_bridge_ctx->running = false;
+            return ESP_ERR_NO_MEM;
+        }
+    }
+    
+    // Hot-path logs are formatted by the health task; kept across stop/start like the ISR queue
+#if CONFIG_MCP_BRIDGE_DEFERRED_LOG_QUEUE > 0
+    if (!g_bridge_ctx->log_queue) {
+        g_bridge_ctx->log_queue = xQueueCreate(CONFIG_MCP_BRIDGE_DEFERRED_LOG_QUEUE, sizeof(blog_record_t));
+        if (!g_bridge_ctx->log_queue) {
+            ESP_LOGW(TAG, "No memory for the deferred log queue, logging in place");
+        }
+    }
+#endif
+    
+    // Bridge tasks subscribe themselves to the task watchdog when they start
+    g_bridge_ctx->watchdog_armed = g_bridge_ctx->config.enable_watchdog && health_watchdog_init() == ESP_OK;
+    
     // Create tasks
+    sensor_read_task_start();
     xTaskCreate(sensor_task, "mcp_sensor", 4096, NULL, 5, &g_bridge_ctx->sensor_task_handle);
     xTaskCreate(actuator_task, "mcp_actuator", 3072, NULL, 6, &g_bridge_ctx->actuator_task_handle);
+    xTaskCreate(isr_publish_task, "mcp_isr_pub", 3072, NULL, 7, &g_bridge_ctx->isr_task_handle);
+    xTaskCreate(health_task, "mcp_health", 4096, NULL, 4, &g_bridge_ctx->health_task_handle);
+    
+    ESP_LOGI(TAG, "MCP Bridge started, connecting in background");
+    return ESP_OK;
+}
+
+esp_err_t mcp_bridge_wait_connected(uint32_t timeout_ms) {
+    if (!g_bridge_ctx || !g_bridge_ctx->running) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    
+    EventBits_t bits = xEventGroupWaitBits(g_bridge_ctx->mqtt_event_group, MQTT_CONNECTED_BIT,
+                                          pdFALSE, pdTRUE, pdMS_TO_TICKS(timeout_ms));
+    return (bits & MQTT_CONNECTED_BIT) ? ESP_OK : ESP_ERR_TIMEOUT;
+}
+
+esp_err_t mcp_bridge_stop(void) {
+    if (!g_bridge_ctx || !g_bridge_ctx->running) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    
+    g_bridge_ctx->running = false;
+    conn_supervisor_stop();
+    
+    // Send what the children still have pending, then publish offline status
+    if (g_bridge_ctx->mqtt_connected) {
+        xSemaphoreTake(g_bridge_ctx->batch_lock, portMAX_DELAY);
+        gateway_batch_send();
+        xSemaphoreGive(g_bridge_ctx->batch_lock);
+        for (uint16_t c = 0; c < g_bridge_ctx->child_count; c++) {
+            child_publish_status(c + 1, false);
+        }
+        mcp_bridge_publish_device_status("offline");
+    }
+    
+    // Stop tasks
+    health_task_delete(&g_bridge_ctx->sensor_task_handle);
+    health_task_delete(&g_bridge_ctx->read_task_handle);
+    health_task_delete(&g_bridge_ctx->actuator_task_handle);
+    health_task_delete(&g_bridge_ctx->isr_task_handle);
+    health_task_delete(&g_bridge_ctx->health_task_handle);
+    sensor_reads_reset();
+    blog_drain();
+    
+    // Stop MQTT client
+    if (g_bridge_ctx->mqtt_client) {
+        g_bridge_ctx->mqtt_transport.disconnect(&g_bridge_ctx->mqtt_transport);
+        esp_mqtt_client_destroy(g_bridge_ctx->mqtt_client);
+        g_bridge_ctx->mqtt_client = NULL;
+    }
+#if CONFIG_MCP_BRIDGE_OUTBOX_PERSIST
+    outbox_release_client();
+#endif
+    
+    transports_release(false);
+    time_sync_stop();
+    
+    ESP_LOGI(TAG, "MCP Bridge stopped");
+    return ESP_OK;
+}
+
+esp_err_t mcp_bridge_deinit(void) {
+    if (!g_bridge_ctx) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    
+    if (g_bridge_ctx->running) {
+        ESP_LOGE(TAG, "Bridge must be stopped before deinitializing");
+        return ESP_ERR_INVALID_STATE;
+    }
+    
+    // Free sensor registry
+    for (uint16_t s = 0; s < g_bridge_ctx->sensor_count; s++) {
+        sensor_node_release(&g_bridge_ctx->sensors[s]);
+    }
+    free(g_bridge_ctx->sensors);
+    free(g_bridge_ctx->sensor_schedule.heap);
+    mcp_registry_index_free(&g_bridge_ctx->sensor_ids);
+    mcp_registry_index_free(&g_bridge_ctx->sensor_types);
+    
+    // Free actuator registry
+    for (uint16_t a = 0; a < g_bridge_ctx->actuator_count; a++) {
+        actuator_node_release(&g_bridge_ctx->actuators[a]);
+    }
+    free(g_bridge_ctx->actuators);
+    mcp_registry_index_free(&g_bridge_ctx->actuator_ids);
+    mcp_registry_index_free(&g_bridge_ctx->actuator_types);
+    
+    // Free child registry and any batch that never went out
+    for (uint16_t c = 0; c < g_bridge_ctx->child_count; c++) {
+        free(g_bridge_ctx->children[c].device_id);
+        free(g_bridge_ctx->children[c].description);
+    }
+    free(g_bridge_ctx->children);
+    mcp_registry_index_free(&g_bridge_ctx->child_ids);
+    cJSON_Delete(g_bridge_ctx->batch);
+    
+    free(g_bridge_ctx->rules);
+    free(g_bridge_ctx->caps_document);
+#if CONFIG_MCP_BRIDGE_TLS_SESSION_RESUME
+    if (g_bridge_ctx->tls.session) {
+        esp_tls_free_client_session(g_bridge_ctx->tls.session);
+    }
+#endif
+#if CONFIG_MCP_BRIDGE_OTA
+    if (g_bridge_ctx->ota.active) {
+        ota_release(true);
+    }
+#endif
+    conn_supervisor_deinit();
+    auth_deinit();
+    transports_release(true);
+#if CONFIG_MCP_BRIDGE_OUTBOX_PERSIST
+    outbox_deinit();
+#endif
+    
+    // Clean up synchronization objects
+    if (g_bridge_ctx->mutex) vSemaphoreDelete(g_bridge_ctx->mutex);
+    if (g_bridge_ctx->publish_lock) vSemaphoreDelete(g_bridge_ctx->publish_lock);
+    if (g_bridge_ctx->batch_lock) vSemaphoreDelete(g_bridge_ctx->batch_lock);
+    if (g_bridge_ctx->command_queue) {
+        // Config updates and OTA messages still queued own a heap copy of their payload
+        mcp_command_t cmd;
+        while (xQueueReceive(g_bridge_ctx->command_queue, &cmd, 0) == pdTRUE) {
+            free(cmd.payload);
+        }
+        vQueueDelete(g_bridge_ctx->command_queue);
+    }
+    if (g_bridge_ctx->isr_queue) vQueueDelete(g_bridge_ctx->isr_queue);
+    if (g_bridge_ctx->read_queue) {
+        vQueueDelete(g_bridge_ctx->read_queue);
+        vQueueDelete(g_bridge_ctx->read_done);
+        vSemaphoreDelete(g_bridge_ctx->read_waiter_sem);
+    }
+    if (g_bridge_ctx->log_queue) vQueueDelete(g_bridge_ctx->log_queue);
+    if (g_bridge_ctx->wifi_event_group) vEventGroupDelete(g_bridge_ctx->wifi_event_group);
+    if (g_bridge_ctx->mqtt_event_group) vEventGroupDelete(g_bridge_ctx->mqtt_event_group);
+    
+    free(g_bridge_ctx);
+    g_bridge_ctx = NULL;
+    
+    ESP_LOGI(TAG, "MCP Bridge deinitialized");
+    return ESP_OK;
+}
+
+esp_err_t mcp_bridge_register_event_handler(mcp_event_handler_t handler, void *user_data) {
+    if (!g_bridge_ctx || !handler) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    
+    g_bridge_ctx->event_handler = handler;
+    g_bridge_ctx->event_handler_user_data = user_data;
+    
+    return ESP_OK;
+}
+
+/**
+ * @brief Add a sensor to the registry and the poll schedule
+ * 
+ * At most one of read_cb / read_multi_cb / read_start_cb is set; with none
+ * (push-only child sensors) the sensor is not polled. channels is NULL for
+ * single-value sensors. With borrow the strings and channels are used in
+ * place (static descriptor tables) instead of copied.
+ */
+static esp_err_t sensor_register(uint16_t device, const char *sensor_id, const char *type, const char *unit,
+                                 const mcp_sensor_channel_t *channels, size_t channel_count,
+                                 const mcp_sensor_metadata_t *metadata,
+                                 mcp_sensor_read_cb_t read_cb, mcp_sensor_read_multi_cb_t read_multi_cb,
+                                 mcp_sensor_read_start_cb_t read_start_cb, void *user_data, bool borrow) {
+    if (g_bridge_ctx->sensor_count >= MCP_BRIDGE_MAX_SENSORS) {
+        ESP_LOGE(TAG, "Maximum number of sensors reached");
+        return ESP_ERR_NO_MEM;
+    }
+    
+    if (!g_bridge_ctx->sensors && sensor_registry_alloc() != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to allocate sensor registry (%d entries)", MCP_BRIDGE_MAX_SENSORS);
+        return ESP_ERR_NO_MEM;
+    }
+    
+    // Check for duplicate
+    if (find_sensor(sensor_id)) {
+        ESP_LOGE(TAG, "Sensor %s already registered", sensor_id);
+        return ESP_ERR_INVALID_STATE;
+    }
+    
+    // Fill the next free slot; it only becomes visible once sensor_count covers it
+    uint16_t entry = g_bridge_ctx->sensor_count;
+    sensor_node_t *node = &g_bridge_ctx->sensors[entry];
+    memset(node, 0, sizeof(*node));
+    
+    // Copy sensor information (descriptor tables stay where they are)
+    char key[MCP_BRIDGE_MAX_TOPIC_LEN];
+    type_key_format(key, sizeof(key), device, type);
+    node->device = device;
+    node->borrowed = borrow;
+    if (borrow) {
+        node->sensor_id = sensor_id;
+        node->type = type;
+        node->unit = unit;
+        node->channels = channels;
+    } else {
+        node->sensor_id = strdup(sensor_id);
+        node->type = strdup(type);
+        node->unit = unit ? strdup(unit) : NULL;
+    }
+    node->type_key = device ? strdup(key) : node->type;
+    if (metadata) {
+        memcpy(&node->metadata, metadata, sizeof(mcp_sensor_metadata_t));
+    }
+    node->channel_count = channels ? channel_count : 1;
+    if (channels && !borrow) {
+        mcp_sensor_channel_t *copy = calloc(channel_count, sizeof(mcp_sensor_channel_t));
+        if (!copy) {
+            sensor_node_release(node);
+            memset(node, 0, sizeof(*node));
+            return ESP_ERR_NO_MEM;
+        }
+        for (size_t i = 0; i < channel_count; i++) {
+            copy[i].name = strdup(channels[i].name);
+            copy[i].unit = channels[i].unit ? strdup(channels[i].unit) : NULL;
+        }
+        node->channels = copy;
+    }
+    node->read_cb = read_cb;
+    node->read_multi_cb = read_multi_cb;
+    node->read_start_cb = read_start_cb;
+    node->user_data = user_data;
+    node->deadband = -1.0f;
+    
+    // Add to registry
+    xSemaphoreTake(g_bridge_ctx->mutex, portMAX_DELAY);
+    sensor_node_t *same_type = find_sensor_by_type(device, type);
+    // The server tracks sequence numbers per data topic, which sensors of a type share
+    node->seq_owner = same_type ? same_type - g_bridge_ctx->sensors : entry;
+#if MCP_BRIDGE_MQTT5_ENABLED
+    // Sensors of the same type share a data topic, so they share its alias
+    if (same_type) {
+        node->topic_alias.alias = same_type->topic_alias.alias;
+    }
+    // Child readings go out on the batch topic and need no alias of their own
+    if (!device && !node->topic_alias.alias && 
+        g_bridge_ctx->next_topic_alias < CONFIG_MCP_BRIDGE_MQTT5_TOPIC_ALIAS_MAX) {
+        node->topic_alias.alias = ++g_bridge_ctx->next_topic_alias;
+    }
+#endif
+    g_bridge_ctx->sensor_count++;
+    mcp_registry_index_insert(&g_bridge_ctx->sensor_ids, node->sensor_id, entry);
+    if (!same_type) {
+        mcp_registry_index_insert(&g_bridge_ctx->sensor_types, node->type_key, entry);
+    }
+    if (read_cb || read_multi_cb || read_start_cb) {
+        node->next_due = xTaskGetTickCount();
+        mcp_schedule_push(&g_bridge_ctx->sensor_schedule, entry);
+    }
+    g_bridge_ctx->caps_dirty = true;
+    xSemaphoreGive(g_bridge_ctx->mutex);
+    
+    // Tables log one line for all their entries; a line per sensor is most of their boot time
+    ESP_LOG_LEVEL_LOCAL(borrow ? ESP_LOG_DEBUG : ESP_LOG_INFO, TAG, 
+                        "Registered sensor: %s (type: %s, channels: %u, device: %s)", 
+                        sensor_id, type, node->channel_count, device_id_of(device));
+    
+    return ESP_OK;
+}
+
+esp_err_t mcp_bridge_register_sensor(const char *sensor_id,
+                                    const char *type,
+                                    const char *unit,
+                                    const mcp_sensor_metadata_t *metadata,
+                                    mcp_sensor_read_cb_t read_cb,
+                                    void *user_data) {
+    if (!g_bridge_ctx || !sensor_id || !type || !read_cb) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    
+    return sensor_register(0, sensor_id, type, unit, NULL, 0, metadata, read_cb, NULL, NULL, user_data, false);
+}
+
+esp_err_t mcp_bridge_register_multi_sensor(const char *sensor_id,
+                                          const char *type,
+                                          const mcp_sensor_channel_t *channels,
+                                          size_t channel_count,
+                                          const mcp_sensor_metadata_t *metadata,
+                                          mcp_sensor_read_multi_cb_t read_cb,
+                                          void *user_data) {
+    if (!g_bridge_ctx || !sensor_id || !type || !channels || !read_cb ||
+        channel_count == 0 || channel_count > MCP_BRIDGE_MAX_SENSOR_CHANNELS) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    for (size_t i = 0; i < channel_count; i++) {
+        if (!channels[i].name) {
+            return ESP_ERR_INVALID_ARG;
+        }
+    }
     
-    if (g_bridge_ctx->config.enable_watchdog) {
-        xTaskCreate(watchdog_task, "mcp_watchdog", 2048, NULL, 4, &g_bridge_ctx->watchdog_task_handle);
+    return sensor_register(0, sensor_id, type, NULL, channels, channel_count, metadata, NULL, read_cb, NULL, 
+                           user_data, false);
+}
+
+esp_err_t mcp_bridge_register_async_sensor(const char *sensor_id,
+                                          const char *type,
+                                          const char *unit,
+                                          const mcp_sensor_metadata_t *metadata,
+                                          mcp_sensor_read_start_cb_t start_cb,
+                                          void *user_data) {
+    if (!g_bridge_ctx || !sensor_id || !type || !start_cb) {
+        return ESP_ERR_INVALID_ARG;
     }
     
-    ESP_LOGI(TAG, "MCP Bridge started successfully");
-    return ESP_OK;
+    return sensor_register(0, sensor_id, type, unit, NULL, 0, metadata, NULL, NULL, start_cb, user_data, false);
 }
 
-esp_err_t mcp_bridge_stop(void) {
-    if (!g_bridge_ctx || !g_bridge_ctx->running) {
+esp_err_t mcp_bridge_sensor_read_done(mcp_sensor_read_token_t token, esp_err_t result, float value) {
+    mcp_bridge_context_t *ctx = g_bridge_ctx;
+    uint16_t entry = token >> 16;
+    if (!ctx || entry >= ctx->sensor_count || !ctx->sensors[entry].read_start_cb) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (!ctx->read_done) {
         return ESP_ERR_INVALID_STATE;
     }
     
-    g_bridge_ctx->running = false;
-    
-    // Publish offline status
-    if (g_bridge_ctx->mqtt_connected) {
-        mcp_bridge_publish_device_status("offline");
+    return sensor_read_complete(entry, token & 0xFFFF, result, &value, 1);
+}
+
+/**
+ * @brief Add an actuator to the registry (borrow: use the strings in place)
+ */
+static esp_err_t actuator_register(uint16_t device, const char *actuator_id, const char *type,
+                                   const mcp_actuator_metadata_t *metadata,
+                                   mcp_actuator_control_cb_t control_cb, void *user_data, bool borrow) {
+    if (g_bridge_ctx->actuator_count >= MCP_BRIDGE_MAX_ACTUATORS) {
+        ESP_LOGE(TAG, "Maximum number of actuators reached");
+        return ESP_ERR_NO_MEM;
     }
     
-    // Stop tasks
-    if (g_bridge_ctx->sensor_task_handle) {
-        vTaskDelete(g_bridge_ctx->sensor_task_handle);
-        g_bridge_ctx->sensor_task_handle = NULL;
+    if (!g_bridge_ctx->actuators && actuator_registry_alloc() != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to allocate actuator registry (%d entries)", MCP_BRIDGE_MAX_ACTUATORS);
+        return ESP_ERR_NO_MEM;
     }
-    if (g_bridge_ctx->actuator_task_handle) {
-        vTaskDelete(g_bridge_ctx->actuator_task_handle);
-        g_bridge_ctx->actuator_task_handle = NULL;
+    
+    // Check for duplicate
+    if (find_actuator(actuator_id)) {
+        ESP_LOGE(TAG, "Actuator %s already registered", actuator_id);
+        return ESP_ERR_INVALID_STATE;
     }
-    if (g_bridge_ctx->watchdog_task_handle) {
-        vTaskDelete(g_bridge_ctx->watchdog_task_handle);
-        g_bridge_ctx->watchdog_task_handle = NULL;
+    
+    // Fill the next free slot
+    uint16_t entry = g_bridge_ctx->actuator_count;
+    actuator_node_t *node = &g_bridge_ctx->actuators[entry];
+    memset(node, 0, sizeof(*node));
+    
+    // Copy actuator information
+    char key[MCP_BRIDGE_MAX_TOPIC_LEN];
+    type_key_format(key, sizeof(key), device, type);
+    node->device = device;
+    node->borrowed = borrow;
+    node->actuator_id = borrow ? actuator_id : strdup(actuator_id);
+    node->type = borrow ? type : strdup(type);
+    node->type_key = device ? strdup(key) : node->type;
+    if (metadata) {
+        memcpy(&node->metadata, metadata, sizeof(mcp_actuator_metadata_t));
     }
+    node->control_cb = control_cb;
+    node->user_data = user_data;
     
-    // Stop MQTT client
-    if (g_bridge_ctx->mqtt_client) {
-        esp_mqtt_client_stop(g_bridge_ctx->mqtt_client);
-        esp_mqtt_client_destroy(g_bridge_ctx->mqtt_client);
-        g_bridge_ctx->mqtt_client = NULL;
+    // Add to registry
+    xSemaphoreTake(g_bridge_ctx->mutex, portMAX_DELAY);
+    bool type_known = find_actuator_by_type(device, type) != NULL;
+    g_bridge_ctx->actuator_count++;
+    mcp_registry_index_insert(&g_bridge_ctx->actuator_ids, node->actuator_id, entry);
+    if (!type_known) {
+        mcp_registry_index_insert(&g_bridge_ctx->actuator_types, node->type_key, entry);
     }
+    if (!device && !type_known) {
+        g_bridge_ctx->subscriptions_stale = true;   // New command topic
+    }
+    g_bridge_ctx->caps_dirty = true;
+    xSemaphoreGive(g_bridge_ctx->mutex);
+    
+    ESP_LOG_LEVEL_LOCAL(borrow ? ESP_LOG_DEBUG : ESP_LOG_INFO, TAG, "Registered actuator: %s (type: %s, device: %s)", 
+                        actuator_id, type, device_id_of(device));
     
-    ESP_LOGI(TAG, "MCP Bridge stopped");
     return ESP_OK;
 }
 
-esp_err_t mcp_bridge_deinit(void) {
-    if (!g_bridge_ctx) {
-        return ESP_ERR_INVALID_STATE;
+esp_err_t mcp_bridge_register_actuator(const char *actuator_id,
+                                      const char *type,
+                                      const mcp_actuator_metadata_t *metadata,
+                                      mcp_actuator_control_cb_t control_cb,
+                                      void *user_data) {
+    if (!g_bridge_ctx || !actuator_id || !type || !control_cb) {
+        return ESP_ERR_INVALID_ARG;
     }
     
-    if (g_bridge_ctx->running) {
-        ESP_LOGE(TAG, "Bridge must be stopped before deinitializing");
-        return ESP_ERR_INVALID_STATE;
+    return actuator_register(0, actuator_id, type, metadata, control_cb, user_data, false);
+}
+
+esp_err_t mcp_bridge_register_sensor_table(const mcp_sensor_desc_t *table, size_t count) {
+    if (!g_bridge_ctx || (!table && count)) {
+        return ESP_ERR_INVALID_ARG;
     }
     
-    // Free sensor list
-    sensor_node_t *sensor = g_bridge_ctx->sensors;
-    while (sensor) {
-        sensor_node_t *next = sensor->next;
-        free(sensor->sensor_id);
-        free(sensor->type);
-        free(sensor->unit);
-        free(sensor);
-        sensor = next;
+    // Check the whole table first so a bad entry registers nothing
+    if (count > MCP_BRIDGE_MAX_SENSORS - g_bridge_ctx->sensor_count) {
+        ESP_LOGE(TAG, "Sensor table of %u entries does not fit, %u of %d sensors registered",
+                (unsigned)count, g_bridge_ctx->sensor_count, MCP_BRIDGE_MAX_SENSORS);
+        return ESP_ERR_NO_MEM;
     }
-    
-    // Free actuator list
-    actuator_node_t *actuator = g_bridge_ctx->actuators;
-    while (actuator) {
-        actuator_node_t *next = actuator->next;
-        free(actuator->actuator_id);
-        free(actuator->type);
-        free(actuator->last_status);
-        free(actuator);
-        actuator = next;
+    for (size_t i = 0; i < count; i++) {
+        const mcp_sensor_desc_t *desc = &table[i];
+        int callbacks = !!desc->read_cb + !!desc->read_multi_cb + !!desc->read_start_cb;
+        if (!desc->sensor_id || !desc->type || callbacks != 1 || 
+            !desc->channels != !desc->read_multi_cb ||
+            (desc->channels && (desc->channel_count == 0 || desc->channel_count > MCP_BRIDGE_MAX_SENSOR_CHANNELS))) {
+            ESP_LOGE(TAG, "Invalid sensor descriptor %u (%s)", (unsigned)i, desc->sensor_id ? desc->sensor_id : "?");
+            return ESP_ERR_INVALID_ARG;
+        }
+        for (uint8_t c = 0; desc->channels && c < desc->channel_count; c++) {
+            if (!desc->channels[c].name) {
+                return ESP_ERR_INVALID_ARG;
+            }
+        }
+        bool duplicate = find_sensor(desc->sensor_id) != NULL;
+        for (size_t j = 0; j < i && !duplicate; j++) {
+            duplicate = strcmp(table[j].sensor_id, desc->sensor_id) == 0;
+        }
+        if (duplicate) {
+            ESP_LOGE(TAG, "Sensor %s already registered", desc->sensor_id);
+            return ESP_ERR_INVALID_STATE;
+        }
     }
     
-    // Clean up synchronization objects
-    if (g_bridge_ctx->mutex) vSemaphoreDelete(g_bridge_ctx->mutex);
-    if (g_bridge_ctx->command_queue) vQueueDelete(g_bridge_ctx->command_queue);
-    if (g_bridge_ctx->wifi_event_group) vEventGroupDelete(g_bridge_ctx->wifi_event_group);
-    if (g_bridge_ctx->mqtt_event_group) vEventGroupDelete(g_bridge_ctx->mqtt_event_group);
-    
-    free(g_bridge_ctx);
-    g_bridge_ctx = NULL;
-    
-    ESP_LOGI(TAG, "MCP Bridge deinitialized");
+    int64_t start_us = esp_timer_get_time();
+    for (size_t i = 0; i < count; i++) {
+        const mcp_sensor_desc_t *desc = &table[i];
+        esp_err_t ret = sensor_register(0, desc->sensor_id, desc->type, desc->unit, desc->channels, 
+                                        desc->channel_count, &desc->metadata, desc->read_cb, desc->read_multi_cb,
+                                        desc->read_start_cb, desc->user_data, true);
+        if (ret != ESP_OK) {
+            return ret;
+        }
+    }
+    ESP_LOGI(TAG, "Registered %u sensors from table in %lld us", (unsigned)count, 
+             (long long)(esp_timer_get_time() - start_us));
     return ESP_OK;
 }
 
-esp_err_t mcp_bridge_register_event_handler(mcp_event_handler_t handler, void *user_data) {
-    if (!g_bridge_ctx || !handler) {
+esp_err_t mcp_bridge_register_actuator_table(const mcp_actuator_desc_t *table, size_t count) {
+    if (!g_bridge_ctx || (!table && count)) {
         return ESP_ERR_INVALID_ARG;
     }
     
-    g_bridge_ctx->event_handler = handler;
-    g_bridge_ctx->event_handler_user_data = user_data;
+    // Check the whole table first so a bad entry registers nothing
+    if (count > MCP_BRIDGE_MAX_ACTUATORS - g_bridge_ctx->actuator_count) {
+        ESP_LOGE(TAG, "Actuator table of %u entries does not fit, %u of %d actuators registered",
+                (unsigned)count, g_bridge_ctx->actuator_count, MCP_BRIDGE_MAX_ACTUATORS);
+        return ESP_ERR_NO_MEM;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (!table[i].actuator_id || !table[i].type || !table[i].control_cb) {
+            ESP_LOGE(TAG, "Invalid actuator descriptor %u", (unsigned)i);
+            return ESP_ERR_INVALID_ARG;
+        }
+        bool duplicate = find_actuator(table[i].actuator_id) != NULL;
+        for (size_t j = 0; j < i && !duplicate; j++) {
+            duplicate = strcmp(table[j].actuator_id, table[i].actuator_id) == 0;
+        }
+        if (duplicate) {
+            ESP_LOGE(TAG, "Actuator %s already registered", table[i].actuator_id);
+            return ESP_ERR_INVALID_STATE;
+        }
+    }
     
+    int64_t start_us = esp_timer_get_time();
+    for (size_t i = 0; i < count; i++) {
+        const mcp_actuator_desc_t *desc = &table[i];
+        esp_err_t ret = actuator_register(0, desc->actuator_id, desc->type, &desc->metadata, desc->control_cb,
+                                          desc->user_data, true);
+        if (ret != ESP_OK) {
+            return ret;
+        }
+    }
+    ESP_LOGI(TAG, "Registered %u actuators from table in %lld us", (unsigned)count, 
+             (long long)(esp_timer_get_time() - start_us));
     return ESP_OK;
 }
 
-esp_err_t mcp_bridge_register_sensor(const char *sensor_id,
-                                    const char *type,
-                                    const char *unit,
-                                    const mcp_sensor_metadata_t *metadata,
-                                    mcp_sensor_read_cb_t read_cb,
-                                    void *user_data) {
-    if (!g_bridge_ctx || !sensor_id || !type || !read_cb) {
+esp_err_t mcp_bridge_register_child(const char *child_id, const char *description) {
+    if (!g_bridge_ctx || !child_id || !*child_id || 
+        strlen(child_id) >= MCP_BRIDGE_DEVICE_ID_LEN || strpbrk(child_id, "/+#")) {
         return ESP_ERR_INVALID_ARG;
     }
     
-    if (g_bridge_ctx->sensor_count >= MCP_BRIDGE_MAX_SENSORS) {
-        ESP_LOGE(TAG, "Maximum number of sensors reached");
+    if (g_bridge_ctx->child_count >= MCP_BRIDGE_MAX_CHILDREN) {
+        ESP_LOGE(TAG, "Maximum number of child devices reached");
         return ESP_ERR_NO_MEM;
     }
     
-    // Check for duplicate
-    if (find_sensor(sensor_id)) {
-        ESP_LOGE(TAG, "Sensor %s already registered", sensor_id);
-        return ESP_ERR_INVALID_STATE;
+    if (!g_bridge_ctx->children && child_registry_alloc() != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to allocate child registry (%d entries)", MCP_BRIDGE_MAX_CHILDREN);
+        return ESP_ERR_NO_MEM;
     }
     
-    // Allocate new sensor node
-    sensor_node_t *node = calloc(1, sizeof(sensor_node_t));
-    if (!node) {
-        return ESP_ERR_NO_MEM;
+    if (device_lookup(child_id) >= 0) {
+        ESP_LOGE(TAG, "Device %s already registered", child_id);
+        return ESP_ERR_INVALID_STATE;
     }
     
-    // Copy sensor information
-    node->sensor_id = strdup(sensor_id);
-    node->type = strdup(type);
-    if (unit) {
-        node->unit = strdup(unit);
+    uint16_t entry = g_bridge_ctx->child_count;
+    child_node_t *node = &g_bridge_ctx->children[entry];
+    memset(node, 0, sizeof(*node));
+    node->device_id = strdup(child_id);
+    node->online = true;
+    if (description) {
+        node->description = strdup(description);
     }
-    if (metadata) {
-        memcpy(&node->metadata, metadata, sizeof(mcp_sensor_metadata_t));
+    if (!node->device_id) {
+        free(node->description);
+        memset(node, 0, sizeof(*node));
+        return ESP_ERR_NO_MEM;
     }
-    node->read_cb = read_cb;
-    node->user_data = user_data;
     
-    // Add to list
     xSemaphoreTake(g_bridge_ctx->mutex, portMAX_DELAY);
-    node->next = g_bridge_ctx->sensors;
-    g_bridge_ctx->sensors = node;
-    g_bridge_ctx->sensor_count++;
+#if MCP_BRIDGE_MQTT5_ENABLED
+    if (!g_bridge_ctx->batch_alias.alias && 
+        g_bridge_ctx->next_topic_alias < CONFIG_MCP_BRIDGE_MQTT5_TOPIC_ALIAS_MAX) {
+        g_bridge_ctx->batch_alias.alias = ++g_bridge_ctx->next_topic_alias;
+    }
+#endif
+    g_bridge_ctx->child_count++;
+    mcp_registry_index_insert(&g_bridge_ctx->child_ids, node->device_id, entry);
+    g_bridge_ctx->subscriptions_stale = true;
+    g_bridge_ctx->caps_dirty = true;
     xSemaphoreGive(g_bridge_ctx->mutex);
     
-    ESP_LOGI(TAG, "Registered sensor: %s (type: %s)", sensor_id, type);
+    ESP_LOGI(TAG, "Registered child device: %s", child_id);
     
     return ESP_OK;
 }
 
-esp_err_t mcp_bridge_register_actuator(const char *actuator_id,
-                                      const char *type,
-                                      const mcp_actuator_metadata_t *metadata,
-                                      mcp_actuator_control_cb_t control_cb,
-                                      void *user_data) {
-    if (!g_bridge_ctx || !actuator_id || !type || !control_cb) {
+esp_err_t mcp_bridge_register_child_sensor(const char *child_id,
+                                          const char *sensor_id,
+                                          const char *type,
+                                          const char *unit,
+                                          const mcp_sensor_metadata_t *metadata,
+                                          mcp_sensor_read_cb_t read_cb,
+                                          void *user_data) {
+    if (!g_bridge_ctx || !child_id || !sensor_id || !type) {
         return ESP_ERR_INVALID_ARG;
     }
     
-    if (g_bridge_ctx->actuator_count >= MCP_BRIDGE_MAX_ACTUATORS) {
-        ESP_LOGE(TAG, "Maximum number of actuators reached");
-        return ESP_ERR_NO_MEM;
+    child_node_t *child = find_child(child_id);
+    if (!child) {
+        ESP_LOGE(TAG, "Unknown child device: %s", child_id);
+        return ESP_ERR_NOT_FOUND;
     }
     
-    // Check for duplicate
-    if (find_actuator(actuator_id)) {
-        ESP_LOGE(TAG, "Actuator %s already registered", actuator_id);
-        return ESP_ERR_INVALID_STATE;
+    return sensor_register(child - g_bridge_ctx->children + 1, sensor_id, type, unit, NULL, 0, metadata, read_cb, NULL, NULL, 
+                           user_data, false);
+}
+
+esp_err_t mcp_bridge_register_child_actuator(const char *child_id,
+                                            const char *actuator_id,
+                                            const char *type,
+                                            const mcp_actuator_metadata_t *metadata,
+                                            mcp_actuator_control_cb_t control_cb,
+                                            void *user_data) {
+    if (!g_bridge_ctx || !child_id || !actuator_id || !type || !control_cb) {
+        return ESP_ERR_INVALID_ARG;
     }
     
-    // Allocate new actuator node
-    actuator_node_t *node = calloc(1, sizeof(actuator_node_t));
-    if (!node) {
-        return ESP_ERR_NO_MEM;
+    child_node_t *child = find_child(child_id);
+    if (!child) {
+        ESP_LOGE(TAG, "Unknown child device: %s", child_id);
+        return ESP_ERR_NOT_FOUND;
     }
     
-    // Copy actuator information
-    node->actuator_id = strdup(actuator_id);
-    node->type = strdup(type);
-    if (metadata) {
-        memcpy(&node->metadata, metadata, sizeof(mcp_actuator_metadata_t));
+    return actuator_register(child - g_bridge_ctx->children + 1, actuator_id, type, metadata, control_cb, user_data,
+                             false);
+}
+
+esp_err_t mcp_bridge_set_child_online(const char *child_id, bool online) {
+    if (!g_bridge_ctx || !child_id) {
+        return ESP_ERR_INVALID_ARG;
     }
-    node->control_cb = control_cb;
-    node->user_data = user_data;
     
-    // Add to list
-    xSemaphoreTake(g_bridge_ctx->mutex, portMAX_DELAY);
-    node->next = g_bridge_ctx->actuators;
-    g_bridge_ctx->actuators = node;
-    g_bridge_ctx->actuator_count++;
-    xSemaphoreGive(g_bridge_ctx->mutex);
+    child_node_t *child = find_child(child_id);
+    if (!child) {
+        ESP_LOGE(TAG, "Unknown child device: %s", child_id);
+        return ESP_ERR_NOT_FOUND;
+    }
     
-    ESP_LOGI(TAG, "Registered actuator: %s (type: %s)", actuator_id, type);
+    bool changed = child->online != online;
+    child->online = online;
     
-    return ESP_OK;
+    // Restated at every session start, so a change while offline is not lost
+    if (!changed || !g_bridge_ctx->mqtt_connected) {
+        return ESP_OK;
+    }
+    return child_publish_status(child - g_bridge_ctx->children + 1, online);
 }
 
 esp_err_t mcp_bridge_publish_sensor_data(const char *sensor_id, float value) {
@@ -1025,28 +6714,73 @@ esp_err_t mcp_bridge_publish_sensor_data(const char *sensor_id, float value) {
         ESP_LOGE(TAG, "Unknown sensor: %s", sensor_id);
         return ESP_ERR_NOT_FOUND;
     }
+    if (sensor->channels) {
+        ESP_LOGE(TAG, "Sensor %s has %u channels; use mcp_bridge_publish_multi_sensor_data", 
+                sensor_id, sensor->channel_count);
+        return ESP_ERR_INVALID_ARG;
+    }
     
-    // Create and publish sensor data
-    char *message = create_sensor_message(sensor_id, sensor->type, value, sensor->unit);
-    if (!message) {
-        return ESP_ERR_NO_MEM;
+    return publish_sensor_reading(sensor, &value, esp_timer_get_time(), 0);
+}
+
+esp_err_t mcp_bridge_publish_multi_sensor_data(const char *sensor_id, const float *values, size_t count) {
+    if (!g_bridge_ctx || !sensor_id || !values) {
+        return ESP_ERR_INVALID_ARG;
     }
     
-    char topic[MCP_BRIDGE_MAX_TOPIC_LEN];
-    snprintf(topic, sizeof(topic), "devices/%s/sensors/%s/data", 
-            g_bridge_ctx->device_id, sensor->type);
+    if (!g_bridge_ctx->mqtt_connected) {
+        ESP_LOGW(TAG, "Cannot publish - MQTT not connected");
+        return ESP_ERR_INVALID_STATE;
+    }
     
-    int msg_id = esp_mqtt_client_publish(g_bridge_ctx->mqtt_client, topic, message, 0, 0, false);
-    free(message);
+    sensor_node_t *sensor = find_sensor(sensor_id);
+    if (!sensor) {
+        ESP_LOGE(TAG, "Unknown sensor: %s", sensor_id);
+        return ESP_ERR_NOT_FOUND;
+    }
+    if (count != sensor->channel_count) {
+        ESP_LOGE(TAG, "Sensor %s expects %u values, got %u", 
+                sensor_id, sensor->channel_count, (unsigned)count);
+        return ESP_ERR_INVALID_ARG;
+    }
     
-    if (msg_id >= 0) {
-        g_bridge_ctx->messages_sent++;
-        sensor->last_value = value;
-        sensor->last_read_time = get_timestamp();
-        return ESP_OK;
-    } else {
-        return ESP_FAIL;
+    return publish_sensor_reading(sensor, values, esp_timer_get_time(), 0);
+}
+
+esp_err_t mcp_bridge_get_sensor_handle(const char *sensor_id, mcp_sensor_handle_t *handle) {
+    if (!g_bridge_ctx || !sensor_id || !handle) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    
+    int entry = mcp_registry_index_find(&g_bridge_ctx->sensor_ids, sensor_id, sensor_id_at);
+    if (entry < 0) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    if (g_bridge_ctx->sensors[entry].channels) {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    *handle = entry;
+    return ESP_OK;
+}
+
+esp_err_t IRAM_ATTR mcp_bridge_publish_from_isr(mcp_sensor_handle_t handle, float value,
+                                               BaseType_t *higher_priority_task_woken) {
+    mcp_bridge_context_t *ctx = g_bridge_ctx;
+    if (!ctx || !ctx->isr_queue || handle >= ctx->sensor_count) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    
+    // No heap, no locks, no logging: just a fixed-size copy into the queue
+    isr_sample_t sample = {
+        .sensor = handle,
+        .value = value,
+        .sampled_us = esp_timer_get_time(),
+    };
+    if (xQueueSendFromISR(ctx->isr_queue, &sample, higher_priority_task_woken) != pdTRUE) {
+        ctx->isr_samples_dropped++;
+        return ESP_ERR_NO_MEM;
     }
+    return ESP_OK;
 }
 
 esp_err_t mcp_bridge_publish_actuator_status(const char *actuator_id, const char *status) {
@@ -1067,8 +6801,8 @@ esp_err_t mcp_bridge_publish_actuator_status(const char *actuator_id, const char
     
     // Create status message
     cJSON *json = cJSON_CreateObject();
-    cJSON_AddStringToObject(json, "device_id", g_bridge_ctx->device_id);
-    cJSON_AddNumberToObject(json, "timestamp", get_timestamp());
+    cJSON_AddStringToObject(json, "device_id", device_id_of(actuator->device));
+    json_add_timestamp(json);
     cJSON_AddStringToObject(json, "value", status);
     
     char *message = cJSON_Print(json);
@@ -1080,9 +6814,9 @@ esp_err_t mcp_bridge_publish_actuator_status(const char *actuator_id, const char
     
     char topic[MCP_BRIDGE_MAX_TOPIC_LEN];
     snprintf(topic, sizeof(topic), "devices/%s/actuators/%s/status", 
-            g_bridge_ctx->device_id, actuator->type);
+            device_id_of(actuator->device), actuator->type);
     
-    int msg_id = esp_mqtt_client_publish(g_bridge_ctx->mqtt_client, topic, message, 0, 1, false);
+    int msg_id = bridge_publish(MCP_MESSAGE_CLASS_STATUS, topic, message, 0, g_bridge_ctx->config.qos_config.status_qos, false, NULL);
     free(message);
     
     if (msg_id >= 0) {
@@ -1111,7 +6845,7 @@ esp_err_t mcp_bridge_publish_device_status(const char *status) {
     // Create status message
     cJSON *json = cJSON_CreateObject();
     cJSON_AddStringToObject(json, "value", status);
-    cJSON_AddNumberToObject(json, "timestamp", get_timestamp());
+    json_add_timestamp(json);
     
     char *message = cJSON_Print(json);
     cJSON_Delete(json);
@@ -1123,7 +6857,7 @@ esp_err_t mcp_bridge_publish_device_status(const char *status) {
     char topic[MCP_BRIDGE_MAX_TOPIC_LEN];
     snprintf(topic, sizeof(topic), "devices/%s/status", g_bridge_ctx->device_id);
     
-    int msg_id = esp_mqtt_client_publish(g_bridge_ctx->mqtt_client, topic, message, 0, 1, true);
+    int msg_id = bridge_publish(MCP_MESSAGE_CLASS_STATUS, topic, message, 0, g_bridge_ctx->config.qos_config.status_qos, true, NULL);
     free(message);
     
     if (msg_id >= 0) {
@@ -1141,7 +6875,9 @@ esp_err_t mcp_bridge_publish_error(const char *error_type,
         return ESP_ERR_INVALID_ARG;
     }
     
-    if (!g_bridge_ctx->mqtt_connected) {
+    // With the flash outbox the error is kept and sent once connected
+    if (!g_bridge_ctx->mqtt_connected && 
+        !outbox_persists(MCP_MESSAGE_CLASS_STATUS, g_bridge_ctx->config.qos_config.error_qos, false)) {
         ESP_LOGW(TAG, "Cannot publish error - MQTT not connected");
         return ESP_ERR_INVALID_STATE;
     }
@@ -1151,7 +6887,7 @@ esp_err_t mcp_bridge_publish_error(const char *error_type,
     cJSON *value_obj = cJSON_CreateObject();
     
     cJSON_AddStringToObject(json, "device_id", g_bridge_ctx->device_id);
-    cJSON_AddNumberToObject(json, "timestamp", get_timestamp());
+    json_add_timestamp(json);
     
     cJSON_AddStringToObject(value_obj, "error_type", error_type);
     cJSON_AddStringToObject(value_obj, "message", message);
@@ -1169,7 +6905,7 @@ esp_err_t mcp_bridge_publish_error(const char *error_type,
     char topic[MCP_BRIDGE_MAX_TOPIC_LEN];
     snprintf(topic, sizeof(topic), "devices/%s/error", g_bridge_ctx->device_id);
     
-    int msg_id = esp_mqtt_client_publish(g_bridge_ctx->mqtt_client, topic, json_message, 0, 1, false);
+    int msg_id = bridge_publish(MCP_MESSAGE_CLASS_STATUS, topic, json_message, 0, g_bridge_ctx->config.qos_config.error_qos, false, NULL);
     free(json_message);
     
     if (msg_id >= 0) {
@@ -1195,6 +6931,131 @@ esp_err_t mcp_bridge_get_status(bool *wifi_connected, bool *mqtt_connected) {
     return ESP_OK;
 }
 
+esp_err_t mcp_bridge_get_metrics(mcp_bridge_metrics_t *metrics) {
+    if (!g_bridge_ctx) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (!metrics) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    
+    *metrics = (mcp_bridge_metrics_t) {
+        .messages_sent = g_bridge_ctx->messages_sent,
+        .messages_received = g_bridge_ctx->messages_received,
+        .connection_failures = g_bridge_ctx->connection_failures,
+        .sensor_read_errors = g_bridge_ctx->sensor_read_errors,
+        .actuator_errors = g_bridge_ctx->actuator_errors,
+        .isr_samples_dropped = g_bridge_ctx->isr_samples_dropped,
+        .rules_fired = g_bridge_ctx->rules_fired,
+        .log_dropped = g_bridge_ctx->log_dropped,
+        .uptime_seconds = (uint32_t)(esp_timer_get_time() / 1000000),
+        .wifi_reconnections = g_bridge_ctx->wifi_link.reconnections,
+        .mqtt_reconnections = g_bridge_ctx->mqtt_link.reconnections,
+        .free_heap_size = esp_get_free_heap_size(),
+        .min_free_heap_size = esp_get_minimum_free_heap_size(),
+        .largest_free_block = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT),
+        .wifi_connect_attempts = g_bridge_ctx->wifi_link.attempts,
+        .mqtt_connect_attempts = g_bridge_ctx->mqtt_link.attempts,
+        .wifi_backoff_ms = g_bridge_ctx->wifi_link.backoff_ms,
+        .mqtt_backoff_ms = g_bridge_ctx->mqtt_link.backoff_ms,
+        .wifi_last_outage_ms = g_bridge_ctx->wifi_link.last_outage_ms,
+        .mqtt_last_outage_ms = g_bridge_ctx->mqtt_link.last_outage_ms,
+#if CONFIG_MCP_BRIDGE_ENABLE_TLS
+        .tls_full_handshakes = g_bridge_ctx->tls.full_handshakes,
+        .tls_resumed_handshakes = g_bridge_ctx->tls.resumed_handshakes,
+        .tls_full_handshake_ms = g_bridge_ctx->tls.full_handshake_ms,
+        .tls_resumed_handshake_ms = g_bridge_ctx->tls.resumed_handshake_ms,
+        .tls_full_handshake_heap = g_bridge_ctx->tls.full_handshake_heap,
+        .tls_resumed_handshake_heap = g_bridge_ctx->tls.resumed_handshake_heap,
+#endif
+        .auth_counter = g_bridge_ctx->auth_counter,
+#if CONFIG_MCP_BRIDGE_OUTBOX_PERSIST
+        .outbox_pending = g_bridge_ctx->outbox.count,
+        .outbox_unpersisted = g_bridge_ctx->outbox_unpersisted,
+        .outbox_erases = g_bridge_ctx->outbox.erases,
+#endif
+        .sensor_read_timeouts = g_bridge_ctx->sensor_read_timeouts,
+        .sensor_breakers_open = g_bridge_ctx->sensor_breakers_open,
+    };
+    
+    return ESP_OK;
+}
+
+esp_err_t mcp_bridge_reset_metrics(void) {
+    if (!g_bridge_ctx) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    
+    g_bridge_ctx->messages_sent = 0;
+    g_bridge_ctx->messages_received = 0;
+    g_bridge_ctx->connection_failures = 0;
+    g_bridge_ctx->sensor_read_errors = 0;
+    g_bridge_ctx->sensor_read_timeouts = 0;
+    g_bridge_ctx->actuator_errors = 0;
+    g_bridge_ctx->isr_samples_dropped = 0;
+    g_bridge_ctx->rules_fired = 0;
+    g_bridge_ctx->log_dropped = 0;
+    g_bridge_ctx->wifi_link.attempts = 0;
+    g_bridge_ctx->wifi_link.reconnections = 0;
+    g_bridge_ctx->mqtt_link.attempts = 0;
+    g_bridge_ctx->mqtt_link.reconnections = 0;
+#if CONFIG_MCP_BRIDGE_ENABLE_TLS
+    g_bridge_ctx->tls.full_handshakes = 0;
+    g_bridge_ctx->tls.resumed_handshakes = 0;
+#endif
+#if CONFIG_MCP_BRIDGE_OUTBOX_PERSIST
+    g_bridge_ctx->outbox_unpersisted = 0;
+#endif
+    
+    return ESP_OK;
+}
+
+esp_err_t mcp_bridge_set_auth_key(const uint8_t *key, size_t key_len) {
+    if (!key || key_len != MCP_BRIDGE_AUTH_KEY_LEN) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    
+    nvs_handle_t nvs;
+    esp_err_t ret = nvs_open(MCP_BRIDGE_NVS_NAMESPACE, NVS_READWRITE, &nvs);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+    ret = nvs_set_blob(nvs, "auth_key", key, key_len);
+    if (ret == ESP_OK) {
+        ret = nvs_commit(nvs);
+    }
+    nvs_close(nvs);
+    return ret;
+}
+
+esp_err_t mcp_bridge_set_transport(mcp_message_class_t message_class, mcp_transport_t *transport) {
+    if (!g_bridge_ctx || g_bridge_ctx->running) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if ((unsigned)message_class >= MCP_MESSAGE_CLASS_MAX || (transport && !transport->publish)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    
+    mcp_transport_t *old = g_bridge_ctx->transports[message_class];
+    if (!transport) {
+        transport = &g_bridge_ctx->mqtt_transport;
+    }
+    g_bridge_ctx->transports[message_class] = transport;
+    
+    // Destroy the old one unless another class still uses it; MQTT belongs to the bridge
+    bool shared = old == &g_bridge_ctx->mqtt_transport;
+    for (int c = 0; c < MCP_MESSAGE_CLASS_MAX; c++) {
+        shared |= g_bridge_ctx->transports[c] == old;
+    }
+    if (!shared && old->destroy) {
+        old->destroy(old);
+    }
+    
+    ESP_LOGI(TAG, "%s messages go through %s", 
+            message_class == MCP_MESSAGE_CLASS_TELEMETRY ? "Telemetry" : "Status", transport->name);
+    return ESP_OK;
+}
+
 const char* mcp_bridge_get_device_id(void) {
     return g_bridge_ctx ? g_bridge_ctx->device_id : NULL;
 }
@@ -1206,9 +7067,10 @@ esp_err_t mcp_bridge_reconnect(void) {
     
     ESP_LOGI(TAG, "Forcing reconnection...");
     
-    // Reset retry counters
-    g_bridge_ctx->wifi_retry_count = 0;
-    g_bridge_ctx->mqtt_retry_count = 0;
+    // Start over with the shortest backoff window
+    conn_supervisor_stop();
+    g_bridge_ctx->wifi_link.attempt = 0;
+    g_bridge_ctx->mqtt_link.attempt = 0;
     
     // Disconnect and reconnect WiFi
     if (g_bridge_ctx->wifi_connected) {
@@ -1217,10 +7079,53 @@ esp_err_t mcp_bridge_reconnect(void) {
     
     // Stop and restart MQTT client
     if (g_bridge_ctx->mqtt_client) {
-        esp_mqtt_client_stop(g_bridge_ctx->mqtt_client);
+        mcp_transport_t *mqtt = &g_bridge_ctx->mqtt_transport;
+        mqtt->disconnect(mqtt);
         vTaskDelay(pdMS_TO_TICKS(1000));
-        esp_mqtt_client_start(g_bridge_ctx->mqtt_client);
+        mqtt->connect(mqtt);
+    }
+    
+    return ESP_OK;
+}
+
+esp_err_t mcp_bridge_update_config(const mcp_bridge_config_t *config) {
+    if (!g_bridge_ctx) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (!config) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    
+    // Only the live-tunable fields; connection settings need a reinit
+    char err[MCP_BRIDGE_CONFIG_ERROR_LEN] = {0};
+    live_config_t staged;
+    bool resubscribe = false;
+    xSemaphoreTake(g_bridge_ctx->mutex, portMAX_DELAY);
+    config_stage_current(&staged);
+    if (config->sensor_publish_interval_ms) {
+        staged.sensor_publish_interval_ms = config->sensor_publish_interval_ms;
+    }
+    const mcp_mqtt_qos_config_t qos_unset = {0};
+    if (memcmp(&config->qos_config, &qos_unset, sizeof(qos_unset)) != 0) {
+        staged.qos = config->qos_config;
+    }
+    staged.sensor_deadband = config->sensor_deadband;
+    staged.log_level = config->log_level;
+    esp_err_t ret = config_validate(&staged, err, sizeof(err));
+    if (ret == ESP_OK) {
+        resubscribe = config_apply(&staged);
+    }
+    xSemaphoreGive(g_bridge_ctx->mutex);
+    
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Config update rejected: %s", err);
+        return ret;
     }
     
+    config_persist();
+    if (resubscribe && g_bridge_ctx->mqtt_connected) {
+        mqtt_subscribe_all();
+    }
+    ESP_LOGI(TAG, "Config updated");
     return ESP_OK;
 }
@@ -8,6 +8,7 @@
 #include "esp_log.h"
 #include "esp_system.h"
 #include "esp_mac.h"
+#include "esp_app_desc.h"
 #include "mcp_device.h"
 
 static const char *TAG = "MCP_DEVICE";
@@ -146,7 +147,7 @@ esp_err_t mcp_device_get_system_info(mcp_device_info_t *info, const char *device
     
     // Fill in system information
     info->device_id = device_id;
-    info->firmware_version = "1.0.0";
+    info->firmware_version = esp_app_get_description()->version;
     info->hardware_version = "ESP32";
     info->manufacturer = "Espressif";
     
@@ -172,9 +173,13 @@ esp_err_t mcp_device_get_system_info(mcp_device_info_t *info, const char *device
     }
     
     info->serial_number = device_id; // Use device ID as serial for now
-    info->max_sensors = 16;
-    info->max_actuators = 16;
+    info->max_sensors = CONFIG_MCP_BRIDGE_MAX_SENSORS;
+    info->max_actuators = CONFIG_MCP_BRIDGE_MAX_ACTUATORS;
+#if CONFIG_MCP_BRIDGE_OTA
     info->supports_ota_update = true;
+#else
+    info->supports_ota_update = false;
+#endif
     info->supports_remote_config = true;
     
     return ESP_OK;
@@ -0,0 +1,414 @@
+/**
+ * @file mcp_outbox.c
+ * @brief Append-only message log on raw flash (persistent MQTT outbox)
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "mcp_outbox.h"
+
+#define OUTBOX_MAGIC 0x4F42                     /**< "BO" */
+#define OUTBOX_SECTOR_MAGIC 0x53584F42          /**< "BOXS" */
+#define OUTBOX_STATE_PENDING 0xFF               /**< As written */
+#define OUTBOX_STATE_DONE 0x00                  /**< Programmed once delivered */
+#define ALIGN4(n) (((n) + 3) & ~(size_t)3)
+
+/**
+ * @brief Record header, followed by the NUL-terminated topic and the payload
+ *
+ * The state byte is not covered by the CRC; it is the only byte ever
+ * programmed after the record is written.
+ */
+typedef struct {
+    uint16_t magic;
+    uint8_t state;
+    uint8_t qos;
+    uint32_t seq;
+    uint16_t topic_len;                         /**< Including the NUL */
+    uint16_t data_len;
+    uint32_t crc;
+} record_header_t;
+
+#define HEADER_LEN sizeof(record_header_t)
+
+/**
+ * @brief Written first whenever the head enters a sector; the newest epoch marks the head
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t epoch;
+} sector_header_t;
+
+static uint32_t crc32_update(uint32_t crc, const uint8_t *data, size_t len) {
+    static const uint32_t table[16] = {
+        0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+        0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+    };
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++) {
+        crc = table[(crc ^ data[i]) & 0x0F] ^ (crc >> 4);
+        crc = table[(crc ^ (data[i] >> 4)) & 0x0F] ^ (crc >> 4);
+    }
+    return ~crc;
+}
+
+static uint32_t record_crc(const record_header_t *header, const uint8_t *body) {
+    uint32_t crc = crc32_update(0, &header->qos, 1);
+    crc = crc32_update(crc, (const uint8_t *)&header->seq, sizeof(header->seq));
+    crc = crc32_update(crc, (const uint8_t *)&header->topic_len, sizeof(header->topic_len));
+    crc = crc32_update(crc, (const uint8_t *)&header->data_len, sizeof(header->data_len));
+    return crc32_update(crc, body, header->topic_len + header->data_len);
+}
+
+static uint32_t sector_base(const mcp_outbox_t *outbox, uint32_t sector) {
+    return sector * outbox->storage.sector_size;
+}
+
+static int mark_done(mcp_outbox_t *outbox, uint32_t offset) {
+    uint8_t done = OUTBOX_STATE_DONE;
+    return outbox->storage.write(outbox->storage.ctx, offset + offsetof(record_header_t, state), &done, 1);
+}
+
+static void entry_drop(mcp_outbox_t *outbox, uint16_t index) {
+    memmove(&outbox->entries[index], &outbox->entries[index + 1],
+            (outbox->count - index - 1) * sizeof(mcp_outbox_entry_t));
+    outbox->count--;
+}
+
+static bool sector_erased(mcp_outbox_t *outbox, uint32_t sector) {
+    const mcp_outbox_storage_t *st = &outbox->storage;
+    for (uint32_t pos = 0; pos < st->sector_size; pos += outbox->buf_size) {
+        size_t len = st->sector_size - pos < outbox->buf_size ? st->sector_size - pos : outbox->buf_size;
+        if (st->read(st->ctx, sector_base(outbox, sector) + pos, outbox->buf, len) != 0) {
+            return false;
+        }
+        for (size_t i = 0; i < len; i++) {
+            if (outbox->buf[i] != 0xFF) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Copy the pending records of a sector to the head, then erase it
+ *
+ * Records that do not fit are lost; that only happens when more is pending
+ * than one sector holds.
+ */
+static int outbox_compact(mcp_outbox_t *outbox, uint32_t sector) {
+    const mcp_outbox_storage_t *st = &outbox->storage;
+    uint32_t head = sector_base(outbox, outbox->head_sector);
+
+    for (uint16_t i = 0; i < outbox->count; ) {
+        mcp_outbox_entry_t *entry = &outbox->entries[i];
+        if (entry->offset / st->sector_size != sector) {
+            i++;
+            continue;
+        }
+        if (outbox->head_pos + entry->size > st->sector_size ||
+            st->read(st->ctx, entry->offset, outbox->buf, entry->size) != 0 ||
+            st->write(st->ctx, head + outbox->head_pos, outbox->buf, entry->size) != 0) {
+            outbox->lost++;
+            entry_drop(outbox, i);
+            continue;
+        }
+        entry->offset = head + outbox->head_pos;
+        outbox->head_pos += entry->size;
+        outbox->relocated++;
+        i++;
+    }
+
+    if (sector_erased(outbox, sector)) {
+        return 0;
+    }
+    outbox->erases++;
+    return st->erase(st->ctx, sector_base(outbox, sector), st->sector_size);
+}
+
+/**
+ * @brief Move the head into the next (erased) sector and compact the one after it
+ */
+static int outbox_advance(mcp_outbox_t *outbox) {
+    const mcp_outbox_storage_t *st = &outbox->storage;
+    uint32_t sector = (outbox->head_sector + 1) % st->sector_count;
+    sector_header_t header = { .magic = OUTBOX_SECTOR_MAGIC, .epoch = outbox->epoch + 1 };
+
+    outbox->head_sector = sector;
+    outbox->head_pos = st->sector_size;
+    if (!sector_erased(outbox, sector)) {
+        // Only after a failed erase or on a partition used for something else before
+        outbox->erases++;
+        if (st->erase(st->ctx, sector_base(outbox, sector), st->sector_size) != 0) {
+            return -1;
+        }
+    }
+    if (st->write(st->ctx, sector_base(outbox, sector), &header, sizeof(header)) != 0) {
+        return -1;
+    }
+    outbox->epoch++;
+    outbox->head_pos = sizeof(header);
+    return outbox_compact(outbox, (sector + 1) % st->sector_count);
+}
+
+/**
+ * @brief Take over a pending record found while scanning
+ */
+static void outbox_adopt(mcp_outbox_t *outbox, const record_header_t *header, uint32_t offset, uint32_t size) {
+    for (uint16_t i = 0; i < outbox->count; i++) {
+        if (outbox->entries[i].seq == header->seq) {
+            // Copied by a compaction that did not get to erase the original; the copy is kept
+            return;
+        }
+    }
+    if (outbox->count == outbox->capacity) {
+        mark_done(outbox, offset);
+        outbox->lost++;
+        return;
+    }
+
+    // Keep the entries in append order
+    uint16_t i = outbox->count;
+    while (i > 0 && outbox->entries[i - 1].seq > header->seq) {
+        outbox->entries[i] = outbox->entries[i - 1];
+        i--;
+    }
+    outbox->entries[i] = (mcp_outbox_entry_t) {
+        .seq = header->seq,
+        .offset = offset,
+        .size = size,
+        .qos = header->qos,
+        .msg_id = -1,
+    };
+    outbox->count++;
+}
+
+/**
+ * @brief Walk the records of one sector
+ *
+ * @param end Set to the end of the last intact record
+ * @return true if the sector ends in erased flash, false if in a torn or foreign record
+ */
+static bool outbox_scan_sector(mcp_outbox_t *outbox, uint32_t sector, uint32_t *end,
+                               bool *found, uint32_t *newest) {
+    const mcp_outbox_storage_t *st = &outbox->storage;
+    static const uint8_t erased[HEADER_LEN] = {
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF
+    };
+    uint32_t base = sector_base(outbox, sector);
+    uint32_t pos = sizeof(sector_header_t);
+    bool clean = true;
+
+    while (pos + HEADER_LEN <= st->sector_size) {
+        record_header_t header;
+        if (st->read(st->ctx, base + pos, &header, HEADER_LEN) != 0) {
+            clean = false;
+            break;
+        }
+        if (memcmp(&header, erased, HEADER_LEN) == 0) {
+            break;
+        }
+        uint32_t size = ALIGN4(HEADER_LEN + header.topic_len + header.data_len);
+        if (header.magic != OUTBOX_MAGIC || header.topic_len == 0 || size > outbox->buf_size ||
+            size > st->sector_size - pos ||
+            st->read(st->ctx, base + pos, outbox->buf, size) != 0 ||
+            record_crc(&header, outbox->buf + HEADER_LEN) != header.crc) {
+            clean = false;
+            break;
+        }
+
+        if (!*found || header.seq > *newest) {
+            *found = true;
+            *newest = header.seq;
+        }
+        if (header.state == OUTBOX_STATE_PENDING) {
+            outbox_adopt(outbox, &header, base + pos, size);
+        }
+        pos += size;
+    }
+
+    *end = pos;
+    return clean;
+}
+
+/**
+ * @brief Rebuild the pending list and head from flash
+ *
+ * Until a compaction has erased its source sector, the head holds nothing
+ * but copies of records still intact in that source. So an interrupted
+ * compaction is either finished (copies intact) or started over by erasing
+ * the head (a copy was torn).
+ */
+static int outbox_recover(mcp_outbox_t *outbox) {
+    const mcp_outbox_storage_t *st = &outbox->storage;
+    bool any = false;
+    uint32_t head = 0;
+    for (uint32_t s = 0; s < st->sector_count; s++) {
+        sector_header_t header;
+        if (st->read(st->ctx, sector_base(outbox, s), &header, sizeof(header)) != 0) {
+            return -1;
+        }
+        if (header.magic == OUTBOX_SECTOR_MAGIC && (!any || header.epoch > outbox->epoch)) {
+            any = true;
+            head = s;
+            outbox->epoch = header.epoch;
+        }
+    }
+
+    outbox->count = 0;
+    if (!any) {
+        // Empty or foreign partition: the first append starts in sector 0
+        outbox->epoch = 0;
+        outbox->next_seq = 1;
+        outbox->head_sector = st->sector_count - 1;
+        outbox->head_pos = st->sector_size;
+        return 0;
+    }
+
+    // The head is scanned first so that copies win over their originals
+    bool found = false;
+    uint32_t newest = 0;
+    uint32_t end;
+    bool clean = outbox_scan_sector(outbox, head, &end, &found, &newest);
+    for (uint32_t i = 1; i < st->sector_count; i++) {
+        uint32_t s = (head + i) % st->sector_count;
+        sector_header_t header;
+        if (st->read(st->ctx, sector_base(outbox, s), &header, sizeof(header)) == 0 &&
+            header.magic == OUTBOX_SECTOR_MAGIC) {
+            uint32_t unused;
+            outbox_scan_sector(outbox, s, &unused, &found, &newest);
+        }
+    }
+    outbox->next_seq = found ? newest + 1 : 1;
+    outbox->head_sector = head;
+    outbox->head_pos = clean ? end : st->sector_size;     // Never write behind a torn record
+
+    uint32_t next = (head + 1) % st->sector_count;
+    if (sector_erased(outbox, next)) {
+        return 0;
+    }
+    if (!clean) {
+        outbox->erases++;
+        if (st->erase(st->ctx, sector_base(outbox, head), st->sector_size) != 0) {
+            return -1;
+        }
+        return outbox_recover(outbox);
+    }
+    return outbox_compact(outbox, next);
+}
+
+int mcp_outbox_open(mcp_outbox_t *outbox, const mcp_outbox_storage_t *storage,
+                    uint16_t capacity, size_t max_record) {
+    memset(outbox, 0, sizeof(*outbox));
+    if (storage->sector_count < 2 || storage->sector_size < sizeof(sector_header_t) + HEADER_LEN * 2 ||
+        capacity == 0) {
+        return -1;
+    }
+
+    outbox->storage = *storage;
+    outbox->capacity = capacity;
+    outbox->buf_size = ALIGN4(HEADER_LEN + max_record + 1);
+    if (outbox->buf_size > storage->sector_size) {
+        outbox->buf_size = storage->sector_size;
+    }
+    outbox->entries = calloc(capacity, sizeof(mcp_outbox_entry_t));
+    outbox->buf = malloc(outbox->buf_size);
+    if (!outbox->entries || !outbox->buf) {
+        mcp_outbox_close(outbox);
+        return -1;
+    }
+
+    if (outbox_recover(outbox) != 0) {
+        mcp_outbox_close(outbox);
+        return -1;
+    }
+    return 0;
+}
+
+void mcp_outbox_close(mcp_outbox_t *outbox) {
+    free(outbox->entries);
+    free(outbox->buf);
+    outbox->entries = NULL;
+    outbox->buf = NULL;
+    outbox->count = 0;
+}
+
+int mcp_outbox_append(mcp_outbox_t *outbox, const char *topic, const char *data, size_t len, uint8_t qos) {
+    const mcp_outbox_storage_t *st = &outbox->storage;
+    size_t topic_len = strlen(topic) + 1;
+    size_t size = ALIGN4(HEADER_LEN + topic_len + len);
+    if (size > outbox->buf_size || topic_len > UINT16_MAX || len > UINT16_MAX ||
+        outbox->count == outbox->capacity) {
+        return -1;
+    }
+
+    for (uint32_t tries = 0; outbox->head_pos + size > st->sector_size; tries++) {
+        if (tries == st->sector_count || outbox_advance(outbox) != 0) {
+            return -1;
+        }
+    }
+
+    record_header_t header = {
+        .magic = OUTBOX_MAGIC,
+        .state = OUTBOX_STATE_PENDING,
+        .qos = qos,
+        .seq = outbox->next_seq,
+        .topic_len = topic_len,
+        .data_len = len,
+    };
+    uint8_t *body = outbox->buf + HEADER_LEN;
+    memcpy(body, topic, topic_len);
+    memcpy(body + topic_len, data, len);
+    memset(body + topic_len + len, 0xFF, size - HEADER_LEN - topic_len - len);
+    header.crc = record_crc(&header, body);
+    memcpy(outbox->buf, &header, HEADER_LEN);
+
+    uint32_t offset = sector_base(outbox, outbox->head_sector) + outbox->head_pos;
+    if (st->write(st->ctx, offset, outbox->buf, size) != 0) {
+        // Whatever reached the flash is garbage now; continue in the next sector
+        outbox->head_pos = st->sector_size;
+        return -1;
+    }
+
+    outbox->entries[outbox->count] = (mcp_outbox_entry_t) {
+        .seq = outbox->next_seq++,
+        .offset = offset,
+        .size = size,
+        .qos = qos,
+        .msg_id = -1,
+    };
+    outbox->head_pos += size;
+    outbox->appends++;
+    return outbox->count++;
+}
+
+int mcp_outbox_remove(mcp_outbox_t *outbox, uint16_t index) {
+    if (index >= outbox->count) {
+        return -1;
+    }
+    // Even if the mark fails the message was delivered; at worst it is sent again after a reboot
+    int ret = mark_done(outbox, outbox->entries[index].offset);
+    entry_drop(outbox, index);
+    return ret;
+}
+
+int mcp_outbox_load(mcp_outbox_t *outbox, uint16_t index, const char **topic, const char **data, size_t *len) {
+    if (index >= outbox->count) {
+        return -1;
+    }
+    const mcp_outbox_entry_t *entry = &outbox->entries[index];
+    record_header_t header;
+    if (outbox->storage.read(outbox->storage.ctx, entry->offset, outbox->buf, entry->size) != 0) {
+        return -1;
+    }
+    memcpy(&header, outbox->buf, HEADER_LEN);
+    if (header.seq != entry->seq || record_crc(&header, outbox->buf + HEADER_LEN) != header.crc) {
+        return -1;
+    }
+
+    *topic = (const char *)outbox->buf + HEADER_LEN;
+    *data = *topic + header.topic_len;
+    *len = header.data_len;
+    return 0;
+}
@@ -0,0 +1,105 @@
+/**
+ * @file mcp_outbox.h
+ * @brief Append-only message log on raw flash (persistent MQTT outbox)
+ *
+ * Messages are appended as records to a ring of erase sectors. Delivering a
+ * message only programs one byte of its record, so the log is erased one
+ * sector at a time as the write head comes round: the head always moves
+ * into an erased sector and then compacts the next one, copying the records
+ * still pending there to the head before erasing it. Every sector is erased
+ * once per pass, which spreads wear evenly. The code uses no ESP-IDF APIs
+ * so it runs on a host against a file standing in for the flash.
+ */
+
+#ifndef MCP_OUTBOX_H
+#define MCP_OUTBOX_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * @brief Flash access; all functions return 0 on success
+ *
+ * Writes only ever turn bits from 1 to 0 (NOR flash semantics); erase sets
+ * whole sectors to 0xFF.
+ */
+typedef struct {
+    int (*read)(void *ctx, uint32_t offset, void *dst, size_t len);
+    int (*write)(void *ctx, uint32_t offset, const void *src, size_t len);
+    int (*erase)(void *ctx, uint32_t offset, size_t len);
+    uint32_t sector_size;
+    uint32_t sector_count;                      /**< At least 2 */
+    void *ctx;
+} mcp_outbox_storage_t;
+
+/**
+ * @brief A pending message
+ */
+typedef struct {
+    uint32_t seq;                               /**< Append order, survives reboots */
+    uint32_t offset;                            /**< Record position in storage */
+    uint16_t size;                              /**< Record size in storage */
+    uint8_t qos;
+    int msg_id;                                 /**< Owned by the caller (-1 after open) */
+} mcp_outbox_entry_t;
+
+typedef struct {
+    mcp_outbox_storage_t storage;
+    mcp_outbox_entry_t *entries;                /**< Pending messages, oldest first */
+    uint16_t count;
+    uint16_t capacity;
+    uint32_t head_sector;
+    uint32_t head_pos;                          /**< Next write position in head_sector */
+    uint32_t epoch;                             /**< Bumped whenever the head enters a sector */
+    uint32_t next_seq;
+    uint8_t *buf;                               /**< One record, for appends, copies and loads */
+    size_t buf_size;
+
+    // Statistics
+    uint32_t appends;
+    uint32_t erases;
+    uint32_t relocated;                         /**< Records copied forward by compaction */
+    uint32_t lost;                              /**< Pending records that could not be kept */
+} mcp_outbox_t;
+
+/**
+ * @brief Open the log and load the messages still pending
+ *
+ * Repairs what a power cut may have left behind: a torn last record, an
+ * unfinished compaction and records copied twice.
+ *
+ * @param capacity Most messages pending at once
+ * @param max_record Largest message (topic and payload) accepted
+ * @return 0 on success, -1 on storage or memory failure
+ */
+int mcp_outbox_open(mcp_outbox_t *outbox, const mcp_outbox_storage_t *storage,
+                    uint16_t capacity, size_t max_record);
+
+/**
+ * @brief Release memory (the log stays in flash)
+ */
+void mcp_outbox_close(mcp_outbox_t *outbox);
+
+/**
+ * @brief Append a message
+ *
+ * @return Index of its entry, or -1 if it is too large, the log is full or
+ *         the storage failed
+ */
+int mcp_outbox_append(mcp_outbox_t *outbox, const char *topic, const char *data, size_t len, uint8_t qos);
+
+/**
+ * @brief Mark a message delivered and drop its entry
+ */
+int mcp_outbox_remove(mcp_outbox_t *outbox, uint16_t index);
+
+/**
+ * @brief Read a pending message into the outbox buffer
+ *
+ * The pointers stay valid until the next call on the outbox. The topic is
+ * NUL-terminated.
+ */
+int mcp_outbox_load(mcp_outbox_t *outbox, uint16_t index, const char **topic, const char **data, size_t *len);
+
+#endif /* MCP_OUTBOX_H */
@@ -0,0 +1,96 @@
+/**
+ * @file mcp_registry.c
+ * @brief Name index and poll schedule for the sensor and actuator registries
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "mcp_registry.h"
+
+uint32_t mcp_registry_hash(const char *key) {
+    uint32_t hash = 2166136261u;
+    while (*key) {
+        hash = (hash ^ (uint8_t)*key++) * 16777619u;
+    }
+    return hash;
+}
+
+int mcp_registry_index_init(mcp_registry_index_t *index, uint32_t capacity) {
+    uint32_t slots = 1;
+    while (slots < capacity * 2) {
+        slots <<= 1;
+    }
+    index->slots = calloc(slots, sizeof(uint16_t));
+    if (!index->slots) {
+        return -1;
+    }
+    index->mask = slots - 1;
+    return 0;
+}
+
+void mcp_registry_index_free(mcp_registry_index_t *index) {
+    free(index->slots);
+    index->slots = NULL;
+    index->mask = 0;
+}
+
+int mcp_registry_index_find(const mcp_registry_index_t *index, const char *key, mcp_registry_key_fn key_of) {
+    if (!index->slots) {
+        return -1;
+    }
+    for (uint32_t i = mcp_registry_hash(key) & index->mask; index->slots[i]; i = (i + 1) & index->mask) {
+        uint16_t entry = index->slots[i] - 1;
+        if (strcmp(key_of(entry), key) == 0) {
+            return entry;
+        }
+    }
+    return -1;
+}
+
+void mcp_registry_index_insert(mcp_registry_index_t *index, const char *key, uint16_t entry) {
+    uint32_t i = mcp_registry_hash(key) & index->mask;
+    while (index->slots[i]) {
+        i = (i + 1) & index->mask;
+    }
+    index->slots[i] = entry + 1;
+}
+
+/**
+ * @brief Whether entry a is due before entry b (wrap-safe)
+ */
+static bool schedule_before(const mcp_schedule_t *schedule, uint16_t a, uint16_t b) {
+    return (int32_t)(schedule->due_of(a) - schedule->due_of(b)) < 0;
+}
+
+static void schedule_swap(mcp_schedule_t *schedule, uint16_t i, uint16_t j) {
+    uint16_t tmp = schedule->heap[i];
+    schedule->heap[i] = schedule->heap[j];
+    schedule->heap[j] = tmp;
+}
+
+void mcp_schedule_push(mcp_schedule_t *schedule, uint16_t entry) {
+    uint16_t *heap = schedule->heap;
+    uint16_t pos = schedule->len++;
+    heap[pos] = entry;
+    while (pos > 0 && schedule_before(schedule, heap[pos], heap[(pos - 1) / 2])) {
+        schedule_swap(schedule, pos, (pos - 1) / 2);
+        pos = (pos - 1) / 2;
+    }
+}
+
+void mcp_schedule_sift_down(mcp_schedule_t *schedule) {
+    uint16_t *heap = schedule->heap;
+    uint16_t len = schedule->len;
+    uint16_t pos = 0;
+
+    for (;;) {
+        uint32_t left = 2u * pos + 1, right = left + 1, first = pos;
+        if (left < len && schedule_before(schedule, heap[left], heap[first])) first = left;
+        if (right < len && schedule_before(schedule, heap[right], heap[first])) first = right;
+        if (first == pos) {
+            return;
+        }
+        schedule_swap(schedule, pos, first);
+        pos = first;
+    }
+}
@@ -0,0 +1,80 @@
+/**
+ * @file mcp_registry.h
+ * @brief Name index and poll schedule for the sensor and actuator registries
+ *
+ * Registries are arrays that never move, so both structures store entry
+ * numbers and ask the caller for an entry's key or due time. Lookups cost
+ * a hash and a short probe, and the schedule hands out the next due entry
+ * in logarithmic time, so neither grows with entries that are idle. The
+ * code uses no ESP-IDF APIs so it runs on a host for benchmarks.
+ */
+
+#ifndef MCP_REGISTRY_H
+#define MCP_REGISTRY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * @brief Open-addressing hash index from a name to a registry entry
+ *
+ * Sized to at least twice the registry capacity, so probes stay short and
+ * always reach an empty slot.
+ */
+typedef struct {
+    uint16_t *slots;                            /**< Registry index + 1 (0 = empty) */
+    uint16_t mask;                              /**< Slot count - 1 (power of two) */
+} mcp_registry_index_t;
+
+/** @brief Key of a registry entry */
+typedef const char *(*mcp_registry_key_fn)(uint16_t entry);
+
+/**
+ * @brief Min-heap of registry entries by due tick
+ */
+typedef struct {
+    uint16_t *heap;                             /**< Registry entries, earliest due first */
+    uint16_t len;
+    uint32_t (*due_of)(uint16_t entry);         /**< Due tick of an entry (compared wrap-safe) */
+} mcp_schedule_t;
+
+/**
+ * @brief FNV-1a hash of a registry key
+ */
+uint32_t mcp_registry_hash(const char *key);
+
+/**
+ * @brief Allocate an empty index for a registry of the given capacity
+ *
+ * @return 0 on success, -1 when out of memory
+ */
+int mcp_registry_index_init(mcp_registry_index_t *index, uint32_t capacity);
+
+/**
+ * @brief Release the index memory
+ */
+void mcp_registry_index_free(mcp_registry_index_t *index);
+
+/**
+ * @brief Look up a key; key_of returns the key of a registry entry
+ *
+ * @return Registry index, or -1 if not present (also before init)
+ */
+int mcp_registry_index_find(const mcp_registry_index_t *index, const char *key, mcp_registry_key_fn key_of);
+
+/**
+ * @brief Add an entry under key (the caller checks for duplicates)
+ */
+void mcp_registry_index_insert(mcp_registry_index_t *index, const char *key, uint16_t entry);
+
+/**
+ * @brief Add an entry to the schedule (heap has room for every entry)
+ */
+void mcp_schedule_push(mcp_schedule_t *schedule, uint16_t entry);
+
+/**
+ * @brief Restore heap order after the head's due tick moved later
+ */
+void mcp_schedule_sift_down(mcp_schedule_t *schedule);
+
+#endif /* MCP_REGISTRY_H */
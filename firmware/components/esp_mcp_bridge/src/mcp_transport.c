@@ -0,0 +1,290 @@
+/**
+ * @file mcp_transport.c
+ * @brief UDP/CoAP and loopback transports for MCP Bridge
+ *
+ * The bridge serializes publish calls, so backends need no locking of
+ * their own for publishing.
+ */
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "esp_log.h"
+#include "esp_random.h"
+#include "lwip/sockets.h"
+#include "lwip/netdb.h"
+#include "mcp_transport.h"
+
+static const char *TAG = "MCP_TRANSPORT";
+
+/* ==================== UDP / CoAP ==================== */
+
+#define COAP_VERSION_NON_TKL0 0x50      /**< Version 1, non-confirmable, no token */
+#define COAP_CODE_POST 0x02
+#define COAP_OPTION_URI_PATH 11
+#define COAP_OPTION_CONTENT_FORMAT 12
+#define COAP_PAYLOAD_MARKER 0xFF
+#define COAP_FORMAT_JSON 50
+#define COAP_FORMAT_SENSOR_BINARY 65001         /**< Experimental range; see payload_codec.py */
+#define COAP_FORMAT_SENSOR_MULTI_BINARY 65002
+#define UDP_MAX_DATAGRAM 1472                   /**< Fits a 1500-byte MTU without fragmentation */
+
+typedef struct {
+    char *host;
+    uint16_t port;
+    int sock;                                   /**< Connected UDP socket (-1 = none) */
+    uint16_t message_id;
+    uint8_t datagram[UDP_MAX_DATAGRAM];
+} udp_transport_t;
+
+/**
+ * @brief Map a content type to a CoAP Content-Format (-1 = omit the option)
+ */
+static int coap_content_format(const char *content_type) {
+    if (!content_type) {
+        return -1;
+    }
+    if (strcmp(content_type, "application/json") == 0) {
+        return COAP_FORMAT_JSON;
+    }
+    if (strcmp(content_type, "application/x-mcp-sensor") == 0) {
+        return COAP_FORMAT_SENSOR_BINARY;
+    }
+    if (strcmp(content_type, "application/x-mcp-sensor-multi") == 0) {
+        return COAP_FORMAT_SENSOR_MULTI_BINARY;
+    }
+    return -1;
+}
+
+/**
+ * @brief Append one CoAP option; returns the new length, or 0 if it does not fit
+ */
+static size_t coap_put_option(uint8_t *buf, size_t pos, size_t size, uint16_t delta,
+                              const uint8_t *value, size_t value_len) {
+    uint8_t ext[4];
+    size_t ext_len = 0;
+    uint8_t nibbles[2];
+    size_t fields[2] = { delta, value_len };
+
+    for (int i = 0; i < 2; i++) {
+        if (fields[i] < 13) {
+            nibbles[i] = fields[i];
+        } else if (fields[i] < 269) {
+            nibbles[i] = 13;
+            ext[ext_len++] = fields[i] - 13;
+        } else {
+            nibbles[i] = 14;
+            ext[ext_len++] = (fields[i] - 269) >> 8;
+            ext[ext_len++] = (fields[i] - 269) & 0xff;
+        }
+    }
+    if (pos + 1 + ext_len + value_len > size) {
+        return 0;
+    }
+    buf[pos++] = nibbles[0] << 4 | nibbles[1];
+    memcpy(buf + pos, ext, ext_len);
+    pos += ext_len;
+    memcpy(buf + pos, value, value_len);
+    return pos + value_len;
+}
+
+static esp_err_t udp_connect(mcp_transport_t *transport) {
+    udp_transport_t *udp = transport->ctx;
+    if (udp->sock >= 0) {
+        return ESP_OK;
+    }
+
+    char port[6];
+    snprintf(port, sizeof(port), "%u", udp->port);
+    struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_DGRAM };
+    struct addrinfo *addr = NULL;
+    if (getaddrinfo(udp->host, port, &hints, &addr) != 0 || !addr) {
+        ESP_LOGW(TAG, "Cannot resolve %s", udp->host);
+        return ESP_FAIL;
+    }
+
+    int sock = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+    if (sock >= 0 && connect(sock, addr->ai_addr, addr->ai_addrlen) != 0) {
+        close(sock);
+        sock = -1;
+    }
+    freeaddrinfo(addr);
+    if (sock < 0) {
+        ESP_LOGW(TAG, "Cannot open UDP socket to %s:%u", udp->host, udp->port);
+        return ESP_FAIL;
+    }
+
+    udp->sock = sock;
+    ESP_LOGI(TAG, "CoAP/UDP transport to %s:%u", udp->host, udp->port);
+    return ESP_OK;
+}
+
+static void udp_disconnect(mcp_transport_t *transport) {
+    udp_transport_t *udp = transport->ctx;
+    if (udp->sock >= 0) {
+        close(udp->sock);
+        udp->sock = -1;
+    }
+}
+
+static int udp_publish(mcp_transport_t *transport, const char *topic, const char *data, int len,
+                       int qos, bool retain, const char *content_type) {
+    udp_transport_t *udp = transport->ctx;
+    if (udp->sock < 0) {
+        return -1;
+    }
+
+    uint8_t *buf = udp->datagram;
+    uint16_t message_id = udp->message_id++;
+    buf[0] = COAP_VERSION_NON_TKL0;
+    buf[1] = COAP_CODE_POST;
+    buf[2] = message_id >> 8;
+    buf[3] = message_id & 0xff;
+    size_t pos = 4;
+
+    // One Uri-Path option per topic level; options are delta-encoded
+    uint16_t option = 0;
+    for (const char *segment = topic; pos && *segment; ) {
+        const char *end = strchr(segment, '/');
+        size_t segment_len = end ? (size_t)(end - segment) : strlen(segment);
+        pos = coap_put_option(buf, pos, sizeof(udp->datagram), COAP_OPTION_URI_PATH - option,
+                              (const uint8_t *)segment, segment_len);
+        option = COAP_OPTION_URI_PATH;
+        segment += segment_len + (end ? 1 : 0);
+    }
+
+    int format = coap_content_format(content_type);
+    if (pos && format >= 0) {
+        uint8_t value[2] = { format >> 8, format & 0xff };
+        bool wide = format > 0xff;
+        pos = coap_put_option(buf, pos, sizeof(udp->datagram), COAP_OPTION_CONTENT_FORMAT - option,
+                              wide ? value : value + 1, wide ? 2 : 1);
+    }
+
+    if (!pos || pos + 1 + len > sizeof(udp->datagram)) {
+        ESP_LOGW(TAG, "Message on %s too large for one datagram", topic);
+        return -1;
+    }
+    if (len > 0) {
+        buf[pos++] = COAP_PAYLOAD_MARKER;
+        memcpy(buf + pos, data, len);
+        pos += len;
+    }
+
+    return send(udp->sock, buf, pos, 0) == (int)pos ? 0 : -1;
+}
+
+static void udp_destroy(mcp_transport_t *transport) {
+    udp_disconnect(transport);
+    udp_transport_t *udp = transport->ctx;
+    free(udp->host);
+    free(udp);
+    free(transport);
+}
+
+mcp_transport_t *mcp_transport_udp_create(const char *host, uint16_t port) {
+    if (!host) {
+        return NULL;
+    }
+
+    mcp_transport_t *transport = calloc(1, sizeof(mcp_transport_t));
+    udp_transport_t *udp = calloc(1, sizeof(udp_transport_t));
+    char *host_copy = strdup(host);
+    if (!transport || !udp || !host_copy) {
+        free(transport);
+        free(udp);
+        free(host_copy);
+        return NULL;
+    }
+
+    udp->host = host_copy;
+    udp->port = port;
+    udp->sock = -1;
+    udp->message_id = esp_random() & 0xffff;
+    *transport = (mcp_transport_t) {
+        .name = "coap+udp",
+        .connect = udp_connect,
+        .disconnect = udp_disconnect,
+        .publish = udp_publish,
+        .destroy = udp_destroy,
+        .ctx = udp,
+    };
+    return transport;
+}
+
+/* ==================== LOOPBACK ==================== */
+
+typedef struct {
+    mcp_transport_receive_cb_t sent_cb;
+    void *sent_arg;
+    mcp_transport_receive_cb_t receive_cb;      /**< Installed by the bridge */
+    void *receive_arg;
+    uint32_t sent;
+} loopback_transport_t;
+
+static int loopback_publish(mcp_transport_t *transport, const char *topic, const char *data, int len,
+                            int qos, bool retain, const char *content_type) {
+    loopback_transport_t *loop = transport->ctx;
+    loop->sent++;
+    if (loop->sent_cb) {
+        loop->sent_cb(topic, strlen(topic), data, len, loop->sent_arg);
+    }
+    return 0;
+}
+
+static esp_err_t loopback_subscribe(mcp_transport_t *transport, const char *topic_filter, int qos) {
+    return ESP_OK;                              // Everything injected is delivered
+}
+
+static void loopback_set_receive_cb(mcp_transport_t *transport, mcp_transport_receive_cb_t cb, void *arg) {
+    loopback_transport_t *loop = transport->ctx;
+    loop->receive_cb = cb;
+    loop->receive_arg = arg;
+}
+
+static void loopback_destroy(mcp_transport_t *transport) {
+    free(transport->ctx);
+    free(transport);
+}
+
+mcp_transport_t *mcp_transport_loopback_create(mcp_transport_receive_cb_t sent_cb, void *arg) {
+    mcp_transport_t *transport = calloc(1, sizeof(mcp_transport_t));
+    loopback_transport_t *loop = calloc(1, sizeof(loopback_transport_t));
+    if (!transport || !loop) {
+        free(transport);
+        free(loop);
+        return NULL;
+    }
+
+    loop->sent_cb = sent_cb;
+    loop->sent_arg = arg;
+    *transport = (mcp_transport_t) {
+        .name = "loopback",
+        .publish = loopback_publish,
+        .subscribe = loopback_subscribe,
+        .set_receive_cb = loopback_set_receive_cb,
+        .destroy = loopback_destroy,
+        .ctx = loop,
+    };
+    return transport;
+}
+
+esp_err_t mcp_transport_loopback_inject(mcp_transport_t *transport, const char *topic,
+                                        const char *data, int len) {
+    if (!transport || !topic || transport->publish != loopback_publish) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    loopback_transport_t *loop = transport->ctx;
+    if (!loop->receive_cb) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    loop->receive_cb(topic, strlen(topic), data, len, loop->receive_arg);
+    return ESP_OK;
+}
+
+uint32_t mcp_transport_loopback_sent(const mcp_transport_t *transport) {
+    if (!transport || transport->publish != loopback_publish) {
+        return 0;
+    }
+    return ((const loopback_transport_t *)transport->ctx)->sent;
+}
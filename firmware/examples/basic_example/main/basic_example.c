@@ -33,6 +33,7 @@ static float last_temperature = 25.0;
 static float last_humidity = 50.0;
 static uint32_t motion_events = 0;
 static uint32_t counter_value = 0;
+static mcp_sensor_handle_t button_handle;
 
 /**
  * @brief Temperature sensor read callback
@@ -320,11 +321,25 @@ static void metrics_task(void *pvParameters) {
                     metrics.free_heap_size, metrics.min_free_heap_size);
             ESP_LOGI(TAG, "WiFi reconnections: %lu", metrics.wifi_reconnections);
             ESP_LOGI(TAG, "MQTT reconnections: %lu", metrics.mqtt_reconnections);
+            ESP_LOGI(TAG, "Connect attempts - WiFi: %lu, MQTT: %lu (last outage %lu ms)", 
+                    metrics.wifi_connect_attempts, metrics.mqtt_connect_attempts,
+                    metrics.mqtt_last_outage_ms);
             ESP_LOGI(TAG, "===================");
         }
     }
 }
 
+/**
+ * @brief Button edge interrupt: hand the new level to the bridge
+ */
+static void IRAM_ATTR button_isr_handler(void *arg) {
+    BaseType_t woken = pdFALSE;
+    mcp_bridge_publish_from_isr(button_handle, gpio_get_level(BUTTON_GPIO) ? 0.0f : 1.0f, &woken);
+    if (woken) {
+        portYIELD_FROM_ISR();
+    }
+}
+
 /**
  * @brief Initialize hardware
  */
@@ -339,7 +354,8 @@ static void init_hardware(void) {
     };
     gpio_config(&io_conf);
     
-    // Configure button GPIO with pull-up
+    // Configure button GPIO with pull-up, interrupt on both edges
+    io_conf.intr_type = GPIO_INTR_ANYEDGE;
     io_conf.mode = GPIO_MODE_INPUT;
     io_conf.pin_bit_mask = (1ULL << BUTTON_GPIO);
     io_conf.pull_up_en = 1;
@@ -478,6 +494,11 @@ void app_main(void) {
     // Start the bridge
     ESP_ERROR_CHECK(mcp_bridge_start());
     
+    // Publish button presses as they happen instead of waiting for the next poll
+    ESP_ERROR_CHECK(mcp_bridge_get_sensor_handle("button", &button_handle));
+    ESP_ERROR_CHECK(gpio_install_isr_service(0));
+    ESP_ERROR_CHECK(gpio_isr_handler_add(BUTTON_GPIO, button_isr_handler, NULL));
+    
     // Create enhanced tasks
     xTaskCreate(batch_sensor_task, "batch_sensor", 3072, NULL, 5, NULL);
     xTaskCreate(metrics_task, "metrics", 2048, NULL, 4, NULL);
@@ -10,6 +10,7 @@ import asyncio
 import json
 import logging
 import random
+import socket
 import time
 import math
 from datetime import datetime, timedelta
@@ -63,6 +64,55 @@ class DeviceConfig:
     cpu_usage_range: tuple = (10, 30)
 
 
+class ReconnectBackoff:
+    """
+    Reconnect pacing of the firmware connection supervisor.
+
+    Exponential backoff with full jitter: the window doubles per failed attempt
+    up to max_ms and each retry waits a random time inside it. The generator is
+    seeded from the device ID (FNV-1a + xorshift32), exactly like the firmware,
+    so a simulated device retries on the same schedule as the real one.
+    """
+
+    # Matches MCP_BRIDGE_CONNECTION_STABLE_MS
+    STABLE_S = 60.0
+
+    def __init__(self, device_id: str, base_ms: int = 1000, max_ms: int = 120000):
+        seed = 2166136261
+        for byte in device_id.encode():
+            seed = ((seed ^ byte) * 16777619) & 0xFFFFFFFF
+        self._state = seed or 1
+        self.base_ms = base_ms
+        self.max_ms = max_ms
+        self.attempt = 0
+        self.up_since: Optional[float] = None
+
+    def _next_random(self) -> int:
+        x = self._state
+        x ^= (x << 13) & 0xFFFFFFFF
+        x ^= x >> 17
+        x ^= (x << 5) & 0xFFFFFFFF
+        self._state = x
+        return x
+
+    def next_delay(self) -> float:
+        """Seconds to wait before the next attempt"""
+        window = min(self.base_ms << min(self.attempt, 16), self.max_ms)
+        self.attempt += 1
+        return (self._next_random() % (window + 1)) / 1000.0
+
+    def connected(self, now: Optional[float] = None):
+        """Record a successful connection"""
+        self.up_since = time.monotonic() if now is None else now
+
+    def disconnected(self, now: Optional[float] = None):
+        """Record a lost connection; only a stable connection resets the backoff"""
+        now = time.monotonic() if now is None else now
+        if self.up_since is not None and now - self.up_since >= self.STABLE_S:
+            self.attempt = 0
+        self.up_since = None
+
+
 class MockESP32Device:
     """Simulates an ESP32 device with realistic behavior"""
     
@@ -84,6 +134,7 @@ class MockESP32Device:
         self.boot_time_ms = 0  # Simulate milliseconds since boot
         self.message_count = 0
         self.error_count = 0
+        self.config_version = 0  # Last live config version applied
         
         # MQTT client setup
         self.client = mqtt.Client(mqtt.CallbackAPIVersion.VERSION2, 
@@ -93,8 +144,12 @@ class MockESP32Device:
         
         self.client.on_connect = self._on_connect
         self.client.on_disconnect = self._on_disconnect
+        self.client.on_connect_fail = self._on_connect_fail
         self.client.on_message = self._on_message
         
+        # Reconnects are paced like the firmware instead of paho's fixed doubling
+        self.backoff = ReconnectBackoff(config.device_id)
+        
         # Initialize sensor values and actuator states
         self._initialize_sensors()
         self._initialize_actuators()
@@ -133,6 +188,7 @@ class MockESP32Device:
         """Handle MQTT connection"""
         if rc == 0:
             self.online = True
+            self.backoff.connected()
             self.logger.info(f"Connected to MQTT broker")
             
             # Subscribe to command topics
@@ -141,8 +197,11 @@ class MockESP32Device:
                 client.subscribe(topic)
                 self.logger.info(f"Subscribed to {topic}")
             
-            # Subscribe to general device commands
+            # Subscribe to general device commands and live configuration
             client.subscribe(f"devices/{self.config.device_id}/cmd")
+            client.subscribe(f"devices/{self.config.device_id}/config", qos=1)
+            client.subscribe(f"devices/{self.config.device_id}/sensors/+/read", qos=1)
+            client.subscribe(f"devices/{self.config.device_id}/ping", qos=0)
             
             # Publish device capabilities and initial status (sync versions)
             try:
@@ -159,12 +218,34 @@ class MockESP32Device:
         """Handle MQTT disconnection"""
         self.online = False
         self.logger.warning(f"Disconnected from MQTT broker: {rc}")
+        self.backoff.disconnected()
+        self._schedule_reconnect()
+    
+    def _on_connect_fail(self, client, userdata):
+        """Handle a failed connection attempt (broker unreachable)"""
+        self._schedule_reconnect()
+    
+    def _schedule_reconnect(self):
+        """Set the delay the paho loop thread waits before its next attempt"""
+        if not self.running:
+            return
+        delay = self.backoff.next_delay()
+        # A fresh min == max delay makes paho wait exactly this long once
+        self.client.reconnect_delay_set(delay, delay)
+        self.logger.info(f"Reconnect attempt {self.backoff.attempt} in {delay:.1f}s")
     
     def _on_message(self, client, userdata, msg):
         """Handle incoming MQTT messages"""
+        received_us = time.time_ns() // 1000
         try:
             topic = msg.topic
             payload = json.loads(msg.payload.decode())
+            
+            if topic == f"devices/{self.config.device_id}/ping":
+                # Answered right here like the firmware does, so the timing stays honest
+                self._send_ping_response_sync(payload.get("ping_id"), received_us)
+                return
+            
             self.logger.info(f"Received command on {topic}: {payload}")
             
             if "/actuators/" in topic and "/cmd" in topic:
@@ -174,6 +255,10 @@ class MockESP32Device:
                 # Use thread to handle command since we're not in async context
                 import threading
                 threading.Thread(target=self._handle_actuator_command_sync, args=(actuator_name, payload)).start()
+            elif "/sensors/" in topic and topic.endswith("/read"):
+                self._handle_sensor_read(topic.split("/")[3], payload)
+            elif topic == f"devices/{self.config.device_id}/config":
+                self._handle_config_update(payload)
             elif topic.endswith("/cmd"):
                 # General device command
                 import threading
@@ -183,6 +268,58 @@ class MockESP32Device:
             self.logger.error(f"Error processing message: {e}")
             self.error_count += 1
     
+    def _handle_sensor_read(self, sensor_name: str, request: Dict[str, Any]):
+        """Answer an on-demand read immediately, outside the update schedule"""
+        response = {
+            "device_id": self.config.device_id,
+            "request_id": request.get("request_id"),
+            "component": sensor_name,
+            "timestamp": self._get_millis_since_boot()
+        }
+        if sensor_name in self.sensor_values:
+            unit = self.sensor_values[sensor_name]["config"].unit
+            response["status"] = "ok"
+            response["value"] = {"reading": round(self._generate_realistic_sensor_value(sensor_name), 2),
+                                 "unit": unit, "quality": 100}
+        else:
+            response["status"] = "error"
+            response["error"] = "unknown sensor"
+        self.client.publish(f"devices/{self.config.device_id}/sensors/{sensor_name}/response",
+                            json.dumps(response), qos=1)
+    
+    def _handle_config_update(self, document: Dict[str, Any]):
+        """Apply a live config push the way the firmware does and acknowledge it"""
+        version = document.get("version")
+        interval_ms = document.get("sensor_publish_interval_ms")
+        error = None
+        
+        if not isinstance(version, int) or version < 1:
+            status, error, version = "rejected", "missing or invalid version", 0
+        elif version == self.config_version:
+            status = "unchanged"
+        elif version < self.config_version:
+            status = "stale"
+        elif interval_ms is not None and not (100 <= interval_ms <= 86400000):
+            status, error = "rejected", "sensor_publish_interval_ms out of range"
+        else:
+            status = "applied"
+            self.config_version = version
+            if interval_ms is not None:
+                for sensor_data in self.sensor_values.values():
+                    sensor_data["config"].update_interval = interval_ms / 1000.0
+            self.logger.info(f"Applied config version {version}")
+        
+        ack = {
+            "device_id": self.config.device_id,
+            "version": version,
+            "status": status,
+            "config": {"version": self.config_version},
+            "timestamp": self._get_millis_since_boot()
+        }
+        if error:
+            ack["error"] = error
+        self.client.publish(f"devices/{self.config.device_id}/config/ack", json.dumps(ack), qos=1)
+    
     def _handle_actuator_command_sync(self, actuator_name: str, command: Dict[str, Any]):
         """Sync version of actuator command handler"""
         try:
@@ -231,7 +368,7 @@ class MockESP32Device:
                 # Handle ping command
                 ping_id = command.get("ping_id")
                 if ping_id:
-                    self._send_ping_response_sync(ping_id)
+                    self._send_ping_response_sync(ping_id, time.time_ns() // 1000)
                 else:
                     self.logger.warning("Received ping command without ping_id")
                     
@@ -256,23 +393,22 @@ class MockESP32Device:
         except Exception as e:
             self.logger.error(f"Error handling device command: {e}")
     
-    def _send_ping_response_sync(self, ping_id: str):
+    def _send_ping_response_sync(self, ping_id: str, received_us: int):
         """Send ping response (pong) back to server"""
         try:
+            # The host clock stands in for an SNTP-synchronized device clock
             pong_response = {
-                "action": "pong",
                 "ping_id": ping_id,
-                "timestamp": self._get_millis_since_boot(),
-                "device_id": self.config.device_id,
-                "uptime_ms": self._get_millis_since_boot()
+                "rx_us": received_us,
+                "tx_us": time.time_ns() // 1000,
+                "time_synced": True
             }
             
-            # Send pong response via status topic
-            topic = f"devices/{self.config.device_id}/status"
+            topic = f"devices/{self.config.device_id}/pong"
             result = self.client.publish(topic, json.dumps(pong_response))
             
             if result.rc == mqtt.MQTT_ERR_SUCCESS:
-                self.logger.info(f"Sent ping response: {ping_id}")
+                self.logger.debug(f"Sent ping response: {ping_id}")
             else:
                 self.logger.error(f"Failed to send ping response: {result.rc}")
                 
@@ -623,33 +759,31 @@ class MockESP32Device:
         self.error_count += 1
     
     async def _connection_monitor(self):
-        """Monitor and maintain MQTT connection"""
+        """Simulate connection issues; the paho loop thread reconnects with backoff"""
         while self.running:
             try:
-                if not self.online:
-                    self.logger.info("Attempting to reconnect...")
-                    self.client.connect(self.mqtt_broker, self.mqtt_port, 60)
-                    self.client.loop_start()
-                
                 # Simulate occasional connection issues
                 if random.random() < 0.0001:  # Very rare connection issues
                     self.logger.warning("Simulating connection issue")
-                    self.client.disconnect()
+                    # Drop the link without a DISCONNECT packet, like a lost AP
+                    sock = self.client.socket()
+                    if sock:
+                        sock.shutdown(socket.SHUT_RDWR)
                 
                 await asyncio.sleep(10)  # Check every 10 seconds
                 
             except Exception as e:
                 self.logger.error(f"Connection error: {e}")
-                await asyncio.sleep(30)  # Wait longer before retrying
+                await asyncio.sleep(30)
     
     async def start(self):
         """Start the mock device"""
         self.running = True
         self.logger.info(f"Starting mock ESP32 device: {self.config.device_id}")
         
-        # Connect to MQTT
+        # Connect to MQTT; the loop thread keeps retrying until the broker is reachable
         try:
-            self.client.connect(self.mqtt_broker, self.mqtt_port, 60)
+            self.client.connect_async(self.mqtt_broker, self.mqtt_port, 60)
             self.client.loop_start()
         except Exception as e:
             self.logger.error(f"Failed to connect to MQTT broker: {e}")
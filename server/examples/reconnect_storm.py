@@ -0,0 +1,138 @@
+#!/usr/bin/env python3
+"""
+Reconnect Storm Simulation
+
+Simulates a fleet of devices that lose the broker at the same moment and
+compares two reconnect policies against a broker that can only complete a
+limited number of connection handshakes per second:
+
+  fixed     retry every --fixed-delay seconds (esp-mqtt's fixed reconnect delay)
+  backoff   the firmware connection supervisor: exponential backoff with
+            full jitter seeded from the device ID (ReconnectBackoff)
+
+Runs in virtual time, so 1,000 devices and a multi-minute outage finish in
+about a second without a broker.
+"""
+
+import argparse
+import heapq
+from collections import Counter
+from dataclasses import dataclass
+from typing import Callable, Dict, List
+
+from mock_esp32_device import ReconnectBackoff
+
+
+@dataclass
+class StormResult:
+    """Outcome of one simulated outage"""
+    policy: str
+    attempts_per_bucket: Counter
+    accepted_per_bucket: Counter
+    total_attempts: int
+    peak_attempts_per_s: int  # Once the broker is back; the storm that can flatten it
+    recovered_at: float  # Seconds after the outage ended until the last device connected
+
+
+def simulate(policy: str, device_count: int, outage_s: float, capacity_per_s: int,
+             duration_s: float, bucket_s: float, fixed_delay_s: float) -> StormResult:
+    """Run one outage with the given policy and return per-bucket connect attempts"""
+    device_ids = [f"esp32_{i:06x}" for i in range(device_count)]
+
+    if policy == "fixed":
+        def make_delay(device_id: str) -> Callable[[], float]:
+            return lambda: fixed_delay_s
+    else:
+        def make_delay(device_id: str) -> Callable[[], float]:
+            return ReconnectBackoff(device_id).next_delay
+
+    next_delay: Dict[str, Callable[[], float]] = {d: make_delay(d) for d in device_ids}
+
+    # Every device sees the disconnect at t=0 and schedules its first retry
+    events = [(next_delay[d](), d) for d in device_ids]
+    heapq.heapify(events)
+
+    attempts = Counter()
+    accepted = Counter()
+    per_second = Counter()
+    handshakes = Counter()
+    recovered_at = float("inf")
+    connected = 0
+
+    while events:
+        t, device_id = heapq.heappop(events)
+        if t > duration_s:
+            break
+
+        second = int(t)
+        per_second[second] += 1
+        attempts[int(t // bucket_s)] += 1
+
+        # The broker is down during the outage and refuses handshakes above its capacity
+        if t >= outage_s and handshakes[second] < capacity_per_s:
+            handshakes[second] += 1
+            accepted[int(t // bucket_s)] += 1
+            connected += 1
+            if connected == device_count:
+                recovered_at = t - outage_s
+            continue
+
+        heapq.heappush(events, (t + next_delay[device_id](), device_id))
+
+    return StormResult(
+        policy=policy,
+        attempts_per_bucket=attempts,
+        accepted_per_bucket=accepted,
+        total_attempts=sum(attempts.values()),
+        peak_attempts_per_s=max((n for s, n in per_second.items() if s >= outage_s), default=0),
+        recovered_at=recovered_at
+    )
+
+
+def print_curve(result: StormResult, duration_s: float, bucket_s: float, width: int = 50):
+    """Print connect attempts per second as an ASCII bar chart"""
+    buckets = int(duration_s // bucket_s)
+    peak = max((result.attempts_per_bucket[b] for b in range(buckets)), default=0) or 1
+
+    print(f"\n{result.policy}: connect attempts/s ('#' attempts, '+' accepted)")
+    for b in range(buckets):
+        rate = result.attempts_per_bucket[b] / bucket_s
+        ok = result.accepted_per_bucket[b]
+        bar_len = round(result.attempts_per_bucket[b] / peak * width)
+        ok_len = min(bar_len, round(ok / peak * width))
+        bar = "+" * ok_len + "#" * (bar_len - ok_len)
+        print(f"{b * bucket_s:6.0f}s {rate:7.1f} |{bar}")
+
+
+def main():
+    """Main entry point"""
+    parser = argparse.ArgumentParser(description="Simulate a fleet reconnect storm")
+    parser.add_argument("--devices", "-d", type=int, default=1000, help="Number of devices")
+    parser.add_argument("--outage", type=float, default=60.0, help="Broker outage length (s)")
+    parser.add_argument("--capacity", type=int, default=50,
+                        help="Connection handshakes the broker completes per second")
+    parser.add_argument("--duration", type=float, default=300.0, help="Simulated time (s)")
+    parser.add_argument("--bucket", type=float, default=10.0, help="Chart bucket size (s)")
+    parser.add_argument("--fixed-delay", type=float, default=10.0,
+                        help="Retry delay of the fixed policy (s)")
+    args = parser.parse_args()
+
+    results: List[StormResult] = []
+    for policy in ("fixed", "backoff"):
+        result = simulate(policy, args.devices, args.outage, args.capacity,
+                          args.duration, args.bucket, args.fixed_delay)
+        results.append(result)
+        print_curve(result, args.duration, args.bucket)
+
+    print(f"\n{args.devices} devices, {args.outage:.0f}s outage, "
+          f"broker accepts {args.capacity} connects/s")
+    print(f"{'policy':<10}{'peak/s after outage':>21}{'attempts':>10}{'recovered after':>17}")
+    for result in results:
+        recovered = (f"{result.recovered_at:.0f}s" if result.recovered_at != float("inf")
+                     else "not within run")
+        print(f"{result.policy:<10}{result.peak_attempts_per_s:>21}"
+              f"{result.total_attempts:>10}{recovered:>17}")
+
+
+if __name__ == "__main__":
+    main()
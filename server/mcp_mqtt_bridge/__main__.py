@@ -56,6 +56,12 @@ def parse_args():
         default=os.getenv("MQTT_PASSWORD"),
         help="MQTT password for authentication"
     )
+    parser.add_argument(
+        "--mqtt-protocol",
+        default=os.getenv("MQTT_PROTOCOL", "5"),
+        choices=["5", "3.1.1"],
+        help="MQTT protocol version; v5 falls back to v3.1.1 if refused (default: 5)"
+    )
     
     # Database settings
     parser.add_argument(
@@ -64,6 +70,41 @@ def parse_args():
         help="SQLite database file path (default: ./data/bridge.db)"
     )
     
+    # Firmware updates
+    parser.add_argument(
+        "--firmware-dir",
+        default=os.getenv("FIRMWARE_DIR", "./data/firmware"),
+        help="Directory of firmware images named {version}.bin (default: ./data/firmware)"
+    )
+    
+    # Message authentication
+    parser.add_argument(
+        "--auth-keys",
+        default=os.getenv("AUTH_KEYS_FILE"),
+        help="JSON file mapping device IDs to hex HMAC keys; messages of listed devices must be signed"
+    )
+    parser.add_argument(
+        "--auth-required",
+        action="store_true",
+        help="Drop messages from devices that have no key in --auth-keys"
+    )
+    
+    # Telemetry over CoAP/UDP
+    parser.add_argument(
+        "--coap-port",
+        type=int,
+        default=int(os.getenv("COAP_PORT", "0")) or None,
+        help="UDP port for devices sending telemetry over CoAP, e.g. 5683 (default: disabled)"
+    )
+    
+    # Ingest
+    parser.add_argument(
+        "--drop-duplicates",
+        action="store_true",
+        default=os.getenv("DROP_DUPLICATE_READINGS", "").lower() in ("1", "true", "yes"),
+        help="Do not store readings whose sequence number was already received (they are still counted)"
+    )
+    
     # System settings
     parser.add_argument(
         "--device-timeout",
@@ -135,7 +176,13 @@ async def main():
             mqtt_password=args.mqtt_password,
             db_path=str(db_path),
             device_timeout_minutes=args.device_timeout,
-            use_fastmcp=args.use_fastmcp
+            use_fastmcp=args.use_fastmcp,
+            mqtt_protocol=args.mqtt_protocol,
+            firmware_dir=args.firmware_dir,
+            auth_keys_file=args.auth_keys,
+            require_device_auth=args.auth_required,
+            coap_port=args.coap_port,
+            drop_duplicate_readings=args.drop_duplicates
         )
         
         # Handle stdio mode for FastMCP
@@ -6,16 +6,23 @@ to provide a complete IoT-to-LLM bridge.
 """
 
 import asyncio
+import json
 import logging
-from typing import Optional, Dict, Any
+import struct
+import time
+import uuid
+from typing import Optional, Dict, Any, List, Tuple
 from datetime import datetime
 
-from .timezone_utils import from_timestamp_utc, utc_now, utc_timestamp, utc_isoformat
+from .timezone_utils import utc_now, utc_timestamp, utc_isoformat
 
 from .mqtt_manager import MQTTManager
+from .coap_listener import CoapListener
+from .message_auth import MessageAuthenticator
 from .database import DatabaseManager  
 from .device_manager import DeviceManager
 from .mcp_server import MCPServerManager
+from .firmware_update import FirmwareStore, FirmwareUpdate
 try:
     from .fastmcp_server import FastMCPServer
     FASTMCP_AVAILABLE = True
@@ -26,6 +33,12 @@ from .data_models import SensorReading, ActuatorState
 
 logger = logging.getLogger(__name__)
 
+# Firmware chunk (little-endian): u32 offset in the update stream, followed by the data
+_OTA_CHUNK_HEADER = struct.Struct("<I")
+OTA_CHUNK_SIZE = 4096               # Upper bound; devices announce what fits their MQTT buffer
+OTA_WINDOW = 4                      # Chunks in flight before waiting for an acknowledgement
+OTA_IDLE_SECONDS = 10.0             # Silence after which the device is asked where it stands
+
 class MCPMQTTBridge:
     """Main bridge coordinator class"""
     
@@ -36,12 +49,28 @@ class MCPMQTTBridge:
                  mqtt_password: Optional[str] = None,
                  db_path: str = "bridge.db",
                  device_timeout_minutes: int = 5,
-                 use_fastmcp: bool = True):
+                 use_fastmcp: bool = True,
+                 mqtt_protocol: str = "5",
+                 firmware_dir: str = "firmware",
+                 auth_keys_file: Optional[str] = None,
+                 require_device_auth: bool = False,
+                 coap_port: Optional[int] = None,
+                 drop_duplicate_readings: bool = False):
         
         # Initialize components
         self.database = DatabaseManager(db_path)
+        self.firmware = FirmwareStore(firmware_dir)
         self.device_manager = DeviceManager(device_timeout_minutes)
-        self.mqtt = MQTTManager(mqtt_broker, mqtt_port, mqtt_username, mqtt_password)
+        self.authenticator = (MessageAuthenticator.from_file(auth_keys_file, counter_store=self.database)
+                              if auth_keys_file else None)
+        self.mqtt = MQTTManager(mqtt_broker, mqtt_port, mqtt_username, mqtt_password,
+                                protocol=mqtt_protocol, authenticator=self.authenticator,
+                                require_auth=require_device_auth)
+        # Telemetry devices send over CoAP/UDP instead of the broker (optional)
+        self.coap_port = coap_port
+        self.coap = CoapListener(self.mqtt.handle_message) if coap_port else None
+        # Readings whose sequence number was already seen are counted either way; optionally not stored
+        self.drop_duplicate_readings = drop_duplicate_readings
         
         # Initialize MCP server (prefer FastMCP if available and requested)
         if use_fastmcp and FASTMCP_AVAILABLE:
@@ -56,6 +85,11 @@ class MCPMQTTBridge:
         
         # State
         self.running = False
+        self._config_waiters: Dict[Tuple[str, int], asyncio.Future] = {}
+        self._rules_waiters: Dict[Tuple[str, int], asyncio.Future] = {}
+        self._read_waiters: Dict[str, asyncio.Future] = {}
+        self._ping_waiters: Dict[str, asyncio.Future] = {}
+        self._ota_sessions: Dict[str, Tuple[asyncio.AbstractEventLoop, asyncio.Queue]] = {}
         self._setup_event_handlers()
     
     def _setup_event_handlers(self):
@@ -63,10 +97,19 @@ class MCPMQTTBridge:
         
         # MQTT message handlers
         self.mqtt.add_message_handler("devices/+/sensors/+/data", self._handle_sensor_data)
+        self.mqtt.add_message_handler("devices/+/batch", self._handle_gateway_batch)
+        self.mqtt.add_message_handler("devices/+/sensors/+/response", self._handle_sensor_read_response)
         self.mqtt.add_message_handler("devices/+/actuators/+/status", self._handle_actuator_status)
         self.mqtt.add_message_handler("devices/+/capabilities", self._handle_device_capabilities)
+        self.mqtt.add_message_handler("devices/+/capabilities/announce", self._handle_capabilities_announce)
         self.mqtt.add_message_handler("devices/+/status", self._handle_device_status)
         self.mqtt.add_message_handler("devices/+/error", self._handle_device_error)
+        self.mqtt.add_message_handler("devices/+/health", self._handle_device_health)
+        self.mqtt.add_message_handler("devices/+/pong", self._handle_pong)
+        self.mqtt.add_message_handler("devices/+/config/ack", self._handle_config_ack)
+        self.mqtt.add_message_handler("devices/+/rules/ack", self._handle_rules_ack)
+        self.mqtt.add_message_handler("devices/+/rules/fired", self._handle_rule_fired)
+        self.mqtt.add_message_handler("devices/+/ota/status", self._handle_ota_status)
         
         # Connection event handlers
         self.mqtt.add_connection_callback(self._on_mqtt_connected)
@@ -85,6 +128,8 @@ class MCPMQTTBridge:
         
         # Connect to MQTT
         await self.mqtt.connect()
+        if self.coap:
+            await self.coap.start(port=self.coap_port)
         
         # Start background tasks without blocking
         self.running = True
@@ -109,7 +154,11 @@ class MCPMQTTBridge:
             # Wait for tasks to finish cancelling
             await asyncio.gather(*self._background_tasks, return_exceptions=True)
         
+        if self.coap:
+            self.coap.stop()
         await self.mqtt.disconnect()
+        if self.authenticator:
+            self.authenticator.flush()
     
     async def _device_timeout_task(self):
         """Periodically check for device timeouts"""
@@ -155,22 +204,95 @@ class MCPMQTTBridge:
             sensor_type = parts[3]
             
             logger.debug(f"Sensor data from {device_id}/{sensor_type}: {payload}")
+            self._record_sensor_reading(device_id, sensor_type, payload)
             
-            # Update device state
-            self.device_manager.update_sensor_reading(device_id, sensor_type, payload)
+        except Exception as e:
+            logger.error(f"Error handling sensor data: {e}")
+    
+    def _handle_gateway_batch(self, topic: str, payload: Dict[str, Any]):
+        """Handle a batch of child device readings sent by a gateway"""
+        try:
+            # Parse topic: devices/{gateway_id}/batch
+            parts = topic.split('/')
+            if len(parts) != 3:
+                logger.warning(f"Invalid batch topic format: {topic}")
+                return
             
-            # Store in database
-            sensor_data = {
-                "device_id": device_id,
-                "sensor_type": sensor_type,
-                "value": payload.get("value", {}).get("reading", 0),
-                "unit": payload.get("value", {}).get("unit", ""),
-                "timestamp": utc_isoformat(from_timestamp_utc(payload.get("timestamp", utc_timestamp())))
-            }
-            self.database.store_sensor_data(sensor_data)
+            gateway_id = parts[1]
+            self.device_manager.mark_device_seen(gateway_id)
+            if self.device_manager.track_sequence(gateway_id, "batch", payload) and self.drop_duplicate_readings:
+                logger.debug(f"Dropped duplicate batch from {gateway_id}")
+                return
+            
+            readings = payload.get("readings", [])
+            for entry in readings:
+                child_id = entry.get("device_id")
+                sensor_type = entry.get("component")
+                if not child_id or not sensor_type:
+                    logger.warning(f"Skipping incomplete batch entry from {gateway_id}: {entry}")
+                    continue
+                
+                # Link before recording so the reading uses the gateway's clock
+                child = self.device_manager.get_device(child_id)
+                if child is None or child.gateway_id != gateway_id:
+                    self.device_manager.link_child(child_id, gateway_id)
+                self._record_sensor_reading(child_id, sensor_type, entry, boot=payload.get("boot"))
+            
+            logger.debug(f"Batch of {len(readings)} child readings from {gateway_id}")
             
         except Exception as e:
-            logger.error(f"Error handling sensor data: {e}")
+            logger.error(f"Error handling gateway batch: {e}")
+    
+    def _record_sensor_reading(self, device_id: str, sensor_type: str, payload: Dict[str, Any],
+                               boot: Optional[int] = None):
+        """Update the cached reading and store it in the database"""
+        if (self.device_manager.track_sequence(device_id, sensor_type, payload, boot) and 
+                self.drop_duplicate_readings):
+            return
+        
+        reading = self.device_manager.update_sensor_reading(device_id, sensor_type, payload)
+        
+        sensor_data = {
+            "device_id": device_id,
+            "sensor_type": sensor_type,
+            "value": reading.value,
+            "unit": reading.unit or "",
+            "timestamp": utc_isoformat(reading.timestamp)
+        }
+        if reading.channels is not None:
+            sensor_data["channels"] = reading.channels
+        if reading.bucket_us is not None:
+            sensor_data["bucket_us"] = reading.bucket_us
+        self.database.store_sensor_data(sensor_data)
+    
+    def _handle_sensor_read_response(self, topic: str, payload: Dict[str, Any]):
+        """Handle the answer to an on-demand sensor read"""
+        try:
+            # Parse topic: devices/{device_id}/sensors/{sensor_type}/response
+            parts = topic.split('/')
+            if len(parts) != 5:
+                logger.warning(f"Invalid sensor response topic format: {topic}")
+                return
+            
+            device_id = parts[1]
+            sensor_type = parts[3]
+            
+            # A fresh reading is as good as a scheduled one; keep it
+            if payload.get("status") == "ok":
+                self._record_sensor_reading(device_id, sensor_type, payload)
+            
+            self._resolve_waiter(self._read_waiters, payload.get("request_id"), payload)
+            
+        except Exception as e:
+            logger.error(f"Error handling sensor read response: {e}")
+    
+    @staticmethod
+    def _resolve_waiter(waiters: Dict[Any, asyncio.Future], key: Any, payload: Dict[str, Any]):
+        """Hand a device reply from the MQTT thread to the coroutine waiting for it"""
+        waiter = waiters.pop(key, None)
+        if waiter and not waiter.done():
+            waiter.get_loop().call_soon_threadsafe(
+                lambda: waiter.done() or waiter.set_result(payload))
     
     def _handle_actuator_status(self, topic: str, payload: Dict[str, Any]):
         """Handle actuator status updates"""
@@ -187,16 +309,10 @@ class MCPMQTTBridge:
             logger.debug(f"Actuator status from {device_id}/{actuator_type}: {payload}")
             
             # Update device state
-            self.device_manager.update_actuator_status(device_id, actuator_type, payload)
+            state = self.device_manager.update_actuator_state(device_id, actuator_type, payload)
             
             # Store in database
-            state = ActuatorState(
-                device_id=device_id,
-                actuator_type=actuator_type,
-                state=payload.get("state", "unknown"),
-                timestamp=from_timestamp_utc(payload.get("timestamp", utc_timestamp()))
-            )
-            self.database.store_actuator_state(state)
+            self.database.store_actuator_state(device_id, actuator_type, state.state, state.timestamp)
             
         except Exception as e:
             logger.error(f"Error handling actuator status: {e}")
@@ -212,6 +328,12 @@ class MCPMQTTBridge:
             
             device_id = parts[1]
             
+            # Retained re-deliveries and unchanged republishes need no rewrite
+            if self.device_manager.has_capabilities_hash(device_id, payload.get("caps_hash")):
+                logger.debug(f"Capabilities for {device_id} unchanged (hash {payload.get('caps_hash')})")
+                self.device_manager.mark_device_seen(device_id)
+                return
+            
             logger.info(f"Processing device capabilities from {device_id}")
             logger.debug(f"Full payload: {payload}")
             
@@ -251,6 +373,40 @@ class MCPMQTTBridge:
             import traceback
             logger.error(f"Traceback: {traceback.format_exc()}")
     
+    def _handle_capabilities_announce(self, topic: str, payload: Dict[str, Any]):
+        """Handle compact capability announcements (hash + version only)"""
+        try:
+            # Parse topic: devices/{device_id}/capabilities/announce
+            parts = topic.split('/')
+            if len(parts) != 4:
+                logger.warning(f"Invalid capabilities announce topic format: {topic}")
+                return
+            
+            device_id = parts[1]
+            caps_hash = payload.get("caps_hash")
+            
+            # Fast path: in-memory copy already matches
+            if self.device_manager.has_capabilities_hash(device_id, caps_hash):
+                logger.debug(f"Capabilities cache hit for {device_id}")
+                self.device_manager.mark_device_seen(device_id)
+                return
+            
+            # Server restarted: restore from the stored copy if it matches
+            stored = self.database.get_device_capabilities(device_id)
+            if stored and caps_hash and stored.get("caps_hash") == caps_hash:
+                logger.info(f"Restored capabilities for {device_id} from database (hash {caps_hash})")
+                self.device_manager.update_device_capabilities(device_id, stored)
+                self.device_manager.mark_device_seen(device_id)
+                return
+            
+            # Hash miss: ask the device for the full document
+            logger.info(f"Capabilities hash miss for {device_id}, requesting full document")
+            self.mqtt.publish_nowait(f"devices/{device_id}/capabilities/get", 
+                                     {"caps_hash": caps_hash}, qos=1)
+            
+        except Exception as e:
+            logger.error(f"Error handling capabilities announce: {e}")
+    
     def _handle_device_status(self, topic: str, payload: Dict[str, Any]):
         """Handle device status updates"""
         try:
@@ -261,7 +417,10 @@ class MCPMQTTBridge:
                 return
             
             device_id = parts[1]
-            status = payload.get("status", "unknown")
+            # Devices send {"value": "online"}; "status" is the older spelling
+            status = payload.get("value", payload.get("status", "unknown"))
+            if payload.get("gateway"):
+                self.device_manager.link_child(device_id, payload["gateway"])
             
             logger.debug(f"Device status from {device_id}: {status}")
             
@@ -285,21 +444,140 @@ class MCPMQTTBridge:
             logger.warning(f"Device error from {device_id}: {payload}")
             
             # Store error in device manager
-            error_msg = payload.get("message", "Unknown error")
-            self.device_manager.add_device_error(device_id, error_msg)
+            error_record = self.device_manager.add_device_error(device_id, payload)
             
             # Store in database
             self.database.store_device_event(
                 device_id=device_id,
                 event_type="error",
-                data=payload,
-                severity=payload.get("severity", 2),
-                timestamp=from_timestamp_utc(payload.get("timestamp", utc_timestamp()))
+                data=json.dumps(payload),
+                severity=error_record["severity"],
+                timestamp=error_record["timestamp"]
             )
             
         except Exception as e:
             logger.error(f"Error handling device error: {e}")
     
+    def _handle_device_health(self, topic: str, payload: Dict[str, Any]):
+        """Handle the periodic device health record"""
+        try:
+            # Parse topic: devices/{device_id}/health
+            parts = topic.split('/')
+            if len(parts) != 3:
+                logger.warning(f"Invalid health topic format: {topic}")
+                return
+            
+            device_id = parts[1]
+            record = self.device_manager.update_device_health(device_id, payload)
+            self.database.store_device_health(device_id, payload, record["timestamp"])
+            
+            # Low memory is kept as an event; regular records only update the device
+            if record["low_memory"]:
+                self.database.store_device_event(
+                    device_id=device_id,
+                    event_type="low_memory",
+                    data=json.dumps(payload),
+                    severity=1,
+                    timestamp=record["timestamp"]
+                )
+            
+        except Exception as e:
+            logger.error(f"Error handling device health: {e}")
+    
+    def _handle_pong(self, topic: str, payload: Dict[str, Any]):
+        """Handle a device's answer to a latency probe"""
+        # Stamped before anything else; it closes the measured round trip
+        received_us = time.time_ns() // 1000
+        try:
+            # Parse topic: devices/{device_id}/pong
+            parts = topic.split('/')
+            if len(parts) != 3:
+                logger.warning(f"Invalid pong topic format: {topic}")
+                return
+            
+            self._resolve_waiter(self._ping_waiters, payload.get("ping_id"),
+                                 {**payload, "received_us": received_us})
+            
+        except Exception as e:
+            logger.error(f"Error handling pong: {e}")
+    
+    def _handle_config_ack(self, topic: str, payload: Dict[str, Any]):
+        """Handle a device's answer to a live config update"""
+        try:
+            # Parse topic: devices/{device_id}/config/ack
+            parts = topic.split('/')
+            if len(parts) != 4:
+                logger.warning(f"Invalid config ack topic format: {topic}")
+                return
+            
+            device_id = parts[1]
+            self.device_manager.update_device_config(device_id, payload)
+            
+            self._resolve_waiter(self._config_waiters, (device_id, payload.get("version")), payload)
+            
+        except Exception as e:
+            logger.error(f"Error handling config ack: {e}")
+    
+    def _handle_rules_ack(self, topic: str, payload: Dict[str, Any]):
+        """Handle a device's answer to a rule table update"""
+        try:
+            # Parse topic: devices/{device_id}/rules/ack
+            parts = topic.split('/')
+            if len(parts) != 4:
+                logger.warning(f"Invalid rules ack topic format: {topic}")
+                return
+            
+            device_id = parts[1]
+            self.device_manager.update_device_rules(device_id, payload)
+            
+            self._resolve_waiter(self._rules_waiters, (device_id, payload.get("version")), payload)
+            
+        except Exception as e:
+            logger.error(f"Error handling rules ack: {e}")
+    
+    def _handle_rule_fired(self, topic: str, payload: Dict[str, Any]):
+        """Handle a report of an actuator action taken by a device-side rule"""
+        try:
+            # Parse topic: devices/{device_id}/rules/fired
+            parts = topic.split('/')
+            if len(parts) != 4:
+                logger.warning(f"Invalid rule fired topic format: {topic}")
+                return
+            
+            device_id = parts[1]
+            event_record = self.device_manager.add_rule_event(device_id, payload)
+            
+            self.database.store_device_event(
+                device_id=device_id,
+                event_type="rule_fired",
+                data=json.dumps(payload),
+                severity=0 if event_record["status"] == "ok" else 2,
+                timestamp=event_record["timestamp"]
+            )
+            
+        except Exception as e:
+            logger.error(f"Error handling rule fired report: {e}")
+    
+    def _handle_ota_status(self, topic: str, payload: Dict[str, Any]):
+        """Handle firmware update progress from a device"""
+        try:
+            # Parse topic: devices/{device_id}/ota/status
+            parts = topic.split('/')
+            if len(parts) != 4:
+                logger.warning(f"Invalid OTA status topic format: {topic}")
+                return
+            
+            device_id = parts[1]
+            self.device_manager.update_device_ota(device_id, payload)
+            
+            session = self._ota_sessions.get(device_id)
+            if session:
+                loop, queue = session
+                loop.call_soon_threadsafe(queue.put_nowait, payload)
+            
+        except Exception as e:
+            logger.error(f"Error handling OTA status: {e}")
+    
     def _on_mqtt_connected(self, reconnected: bool):
         """Handle MQTT connection established"""
         logger.info("MQTT connected successfully")
@@ -329,6 +607,239 @@ class MCPMQTTBridge:
         
         return success
     
+    async def request_sensor_read(self, device_id: str, sensor_type: str,
+                                  timeout_seconds: float = 2.0) -> Optional[Dict[str, Any]]:
+        """Ask a device to read one sensor now, bypassing its publish interval
+        
+        Returns the device's response (status "ok" or "error"), or None if
+        the request could not be sent or no answer arrived in time.
+        """
+        request_id = uuid.uuid4().hex[:16]
+        waiter = asyncio.get_running_loop().create_future()
+        self._read_waiters[request_id] = waiter
+        
+        try:
+            if not self.mqtt.publish_nowait(f"devices/{device_id}/sensors/{sensor_type}/read",
+                                            {"request_id": request_id}, qos=1):
+                return None
+            self.device_manager.increment_sent_messages(device_id)
+            return await asyncio.wait_for(waiter, timeout_seconds)
+        except asyncio.TimeoutError:
+            logger.warning(f"No response to read of {device_id}/{sensor_type} within {timeout_seconds}s")
+            return None
+        finally:
+            self._read_waiters.pop(request_id, None)
+    
+    async def ping_device(self, device_id: str, timeout_seconds: float = 5.0) -> Dict[str, Any]:
+        """Measure the round-trip time and clock offset to a device
+        
+        The device answers in its MQTT task with its receive and transmit
+        times. Returns the measurement with status "online", or status
+        "send_failed" or "timeout". Every attempt feeds the device's
+        latency statistics.
+        """
+        ping_id = uuid.uuid4().hex[:16]
+        waiter = asyncio.get_running_loop().create_future()
+        self._ping_waiters[ping_id] = waiter
+        
+        try:
+            sent_us = time.time_ns() // 1000
+            if not self.mqtt.publish_nowait(f"devices/{device_id}/ping", {"ping_id": ping_id}, qos=0):
+                return {"status": "send_failed", "ping_id": ping_id}
+            self.device_manager.increment_sent_messages(device_id)
+            pong = await asyncio.wait_for(waiter, timeout_seconds)
+        except asyncio.TimeoutError:
+            pong = None
+        finally:
+            self._ping_waiters.pop(ping_id, None)
+        
+        received_us = pong["received_us"] if pong else 0
+        result = self.device_manager.record_ping(device_id, sent_us, received_us, pong)
+        return {**result, "ping_id": ping_id}
+    
+    async def update_firmware(self, device_ids: List[str], version: str,
+                              timeout_seconds: float = 900.0) -> Dict[str, Dict[str, Any]]:
+        """Update the firmware of many devices at once
+        
+        Each device gets a delta against the version it reports when that
+        image is in the firmware store, the full image otherwise. Results
+        carry the transfer size and duration per device.
+        """
+        results = await asyncio.gather(*(self._ota_transfer(device_id, version, timeout_seconds)
+                                         for device_id in device_ids))
+        return dict(zip(device_ids, results))
+    
+    async def _ota_transfer(self, device_id: str, version: str, timeout_seconds: float) -> Dict[str, Any]:
+        """Stream one firmware update and follow the device's acknowledgements
+        
+        Chunks are sent at QoS 0 with a window of OTA_WINDOW. The device acks
+        every chunk with its stream offset and flags a rewind when it saw a
+        gap or reconnected, so lost chunks and dropped connections resume
+        where the device stands instead of starting over.
+        """
+        device = self.device_manager.get_device(device_id)
+        if not device:
+            return {"status": "not_found", "version": version}
+        source_version = device.capabilities.firmware_version
+        if source_version == version:
+            return {"status": "up_to_date", "version": version}
+        
+        try:
+            update = self.firmware.update_for(source_version, version)
+        except ValueError as e:
+            return {"status": "error", "version": version, "error": str(e)}
+        
+        start = self._ota_start_document(update)
+        topic = f"devices/{device_id}/ota"
+        queue: asyncio.Queue = asyncio.Queue()
+        self._ota_sessions[device_id] = (asyncio.get_running_loop(), queue)
+        
+        started = time.monotonic()
+        deadline = started + timeout_seconds
+        result: Dict[str, Any] = {"status": "timeout"}
+        transfer_bytes = next_offset = acked = chunk_size = 0
+        try:
+            if not self.mqtt.publish_nowait(topic, start, qos=1):
+                return {"status": "send_failed", "version": version}
+            
+            while time.monotonic() < deadline:
+                while chunk_size and next_offset < len(update.data) and next_offset - acked < OTA_WINDOW * chunk_size:
+                    chunk = update.data[next_offset:next_offset + chunk_size]
+                    if not self.mqtt.publish_nowait(f"{topic}/chunk", _OTA_CHUNK_HEADER.pack(next_offset) + chunk):
+                        break
+                    transfer_bytes += len(chunk)
+                    next_offset += len(chunk)
+                
+                try:
+                    status = await asyncio.wait_for(queue.get(), min(OTA_IDLE_SECONDS, deadline - time.monotonic()))
+                except asyncio.TimeoutError:
+                    # Lost chunks or acks, or the device is reconnecting: ask where it stands
+                    self.mqtt.publish_nowait(topic, start, qos=1)
+                    continue
+                
+                if status.get("version") != version:
+                    continue
+                state = status.get("state")
+                if state == "done":
+                    result = {"status": "done", "device_duration_ms": status.get("duration_ms")}
+                    break
+                if state == "failed":
+                    result = {"status": "failed", "error": status.get("error")}
+                    break
+                
+                chunk_size = min(OTA_CHUNK_SIZE, status.get("chunk_size") or OTA_CHUNK_SIZE)
+                acked = status.get("offset", acked)
+                if status.get("rewind"):
+                    next_offset = acked
+        finally:
+            self._ota_sessions.pop(device_id, None)
+        
+        result.update({
+            "version": version,
+            "from_version": source_version,
+            "mode": update.mode,
+            "image_bytes": update.image_size,
+            "update_bytes": len(update.data),
+            "transfer_bytes": transfer_bytes,
+            "duration_s": round(time.monotonic() - started, 2)
+        })
+        self.device_manager.add_ota_result(device_id, result)
+        self.database.store_device_event(
+            device_id=device_id,
+            event_type="ota_update",
+            data=json.dumps(result),
+            severity=0 if result["status"] == "done" else 2,
+            timestamp=utc_now()
+        )
+        return result
+    
+    @staticmethod
+    def _ota_start_document(update: FirmwareUpdate) -> Dict[str, Any]:
+        """Announce an update; sent again to ask a device for its progress"""
+        start = {
+            "version": update.version,
+            "mode": update.mode,
+            "size": len(update.data),
+            "image_size": update.image_size,
+            "sha256": update.sha256
+        }
+        if update.mode == "delta":
+            start.update({
+                "source_version": update.source_version,
+                "source_size": update.source_size,
+                "source_sha256": update.source_sha256
+            })
+        return start
+    
+    async def _push_versioned(self, device_ids: List[str], topic_suffix: str, document: Dict[str, Any],
+                              waiters: Dict[Tuple[str, int], asyncio.Future], next_version,
+                              timeout_seconds: float) -> Dict[str, Dict[str, Any]]:
+        """Publish a retained, versioned document to many devices and wait for their acks
+        
+        Devices that are offline pick the document up when they reconnect;
+        those report "timeout" here. Each result carries the raw ack.
+        """
+        loop = asyncio.get_running_loop()
+        pending: Dict[str, Tuple[int, asyncio.Future]] = {}
+        results: Dict[str, Dict[str, Any]] = {}
+        
+        for device_id in device_ids:
+            version = next_version(device_id)
+            waiter = loop.create_future()
+            waiters[(device_id, version)] = waiter
+            
+            if self.mqtt.publish_nowait(f"devices/{device_id}/{topic_suffix}", 
+                                        {"version": version, **document}, qos=1, retain=True):
+                self.device_manager.increment_sent_messages(device_id)
+                pending[device_id] = (version, waiter)
+            else:
+                waiters.pop((device_id, version), None)
+                results[device_id] = {"status": "send_failed", "version": version}
+        
+        async def wait_ack(device_id: str, version: int, waiter: asyncio.Future):
+            try:
+                ack = await asyncio.wait_for(waiter, timeout_seconds)
+                results[device_id] = {
+                    "status": ack.get("status", "unknown"),
+                    "version": version,
+                    "error": ack.get("error"),
+                    "ack": ack
+                }
+            except asyncio.TimeoutError:
+                waiters.pop((device_id, version), None)
+                results[device_id] = {"status": "timeout", "version": version}
+        
+        await asyncio.gather(*(wait_ack(device_id, version, waiter)
+                               for device_id, (version, waiter) in pending.items()))
+        return results
+    
+    async def push_device_config(self, device_ids: List[str], config: Dict[str, Any],
+                                 timeout_seconds: float = 10.0) -> Dict[str, Dict[str, Any]]:
+        """Push a live config to many devices at once and wait for their acks"""
+        results = await self._push_versioned(device_ids, "config", config, self._config_waiters,
+                                             self.device_manager.next_config_version, timeout_seconds)
+        for result in results.values():
+            ack = result.pop("ack", None)
+            if ack is not None:
+                result["config"] = ack.get("config")
+        return results
+    
+    async def push_device_rules(self, device_ids: List[str], rules: List[Dict[str, Any]],
+                                timeout_seconds: float = 10.0) -> Dict[str, Dict[str, Any]]:
+        """Replace the local rule table of many devices at once and wait for their acks
+        
+        An empty list removes all rules. Devices compile and check the table
+        against their own sensors and actuators and reject it as a whole.
+        """
+        results = await self._push_versioned(device_ids, "rules", {"rules": rules}, self._rules_waiters,
+                                             self.device_manager.next_rules_version, timeout_seconds)
+        for device_id, result in results.items():
+            ack = result.pop("ack", None)
+            if ack is not None:
+                result["rules"] = ack.get("rules")
+                self.device_manager.update_device_rules(device_id, ack, rules)
+        return results
+    
     async def call_mcp_tool(self, tool_name: str, arguments: Dict[str, Any]) -> Any:
         """Call MCP tool and return result"""
         result = await self.mcp_server.handle_tool_call(tool_name, arguments)
@@ -0,0 +1,137 @@
+"""
+CoAP/UDP receiver for device telemetry sent outside the broker.
+
+Devices can route a message class through mcp_transport_udp_create(): every
+message becomes one CoAP POST whose Uri-Path is the MQTT topic and whose
+Content-Format is the content type. Messages are handed to
+MQTTManager.handle_message, so authentication, decoding and routing are the
+same as for MQTT. Confirmable requests are acknowledged; the firmware sends
+non-confirmable ones and never retransmits.
+"""
+
+import asyncio
+import logging
+import struct
+from typing import Callable, Optional, Tuple
+
+from .payload_codec import (CONTENT_TYPE_JSON, CONTENT_TYPE_SENSOR_BINARY,
+                            CONTENT_TYPE_SENSOR_MULTI_BINARY)
+
+logger = logging.getLogger(__name__)
+
+COAP_DEFAULT_PORT = 5683
+
+COAP_VERSION = 1
+COAP_TYPE_CON = 0
+COAP_TYPE_NON = 1
+COAP_TYPE_ACK = 2
+COAP_CODE_POST = 0x02
+COAP_CODE_CHANGED = 0x44            # 2.04
+COAP_OPTION_URI_PATH = 11
+COAP_OPTION_CONTENT_FORMAT = 12
+COAP_PAYLOAD_MARKER = 0xFF
+
+# Content-Format numbers; 65000+ is the experimental range, same values as the firmware
+CONTENT_FORMATS = {
+    50: CONTENT_TYPE_JSON,
+    65001: CONTENT_TYPE_SENSOR_BINARY,
+    65002: CONTENT_TYPE_SENSOR_MULTI_BINARY,
+}
+
+_HEADER = struct.Struct("!BBH")
+
+
+class CoapDecodeError(ValueError):
+    """Raised when a datagram is not a CoAP POST we understand"""
+
+
+def _option_field(nibble: int, data: bytes, pos: int) -> Tuple[int, int]:
+    """Resolve an option delta or length nibble; returns (value, new position)"""
+    if nibble < 13:
+        return nibble, pos
+    if nibble == 13 and pos < len(data):
+        return data[pos] + 13, pos + 1
+    if nibble == 14 and pos + 1 < len(data):
+        return (data[pos] << 8 | data[pos + 1]) + 269, pos + 2
+    raise CoapDecodeError("Invalid option encoding")
+
+
+def parse_coap_message(data: bytes) -> Tuple[int, int, bytes, str, Optional[str], bytes]:
+    """Parse a CoAP request
+
+    Returns (type, message ID, token, topic, content type, payload). The
+    topic is the Uri-Path segments joined with '/'.
+    """
+    if len(data) < _HEADER.size:
+        raise CoapDecodeError("Datagram shorter than a CoAP header")
+    first, code, message_id = _HEADER.unpack_from(data)
+    version, msg_type, token_len = first >> 6, (first >> 4) & 0x03, first & 0x0F
+    if version != COAP_VERSION or token_len > 8:
+        raise CoapDecodeError("Not a CoAP v1 message")
+    if code != COAP_CODE_POST:
+        raise CoapDecodeError(f"Unsupported CoAP code {code >> 5}.{code & 0x1F:02d}")
+
+    pos = _HEADER.size + token_len
+    token = data[_HEADER.size:pos]
+    option = 0
+    segments = []
+    content_format = None
+    while pos < len(data) and data[pos] != COAP_PAYLOAD_MARKER:
+        delta, length = data[pos] >> 4, data[pos] & 0x0F
+        delta, pos = _option_field(delta, data, pos + 1)
+        length, pos = _option_field(length, data, pos)
+        value = data[pos:pos + length]
+        if len(value) != length:
+            raise CoapDecodeError("Truncated option")
+        pos += length
+        option += delta
+        if option == COAP_OPTION_URI_PATH:
+            segments.append(value.decode("utf-8", errors="strict"))
+        elif option == COAP_OPTION_CONTENT_FORMAT:
+            content_format = int.from_bytes(value, "big")
+
+    if not segments:
+        raise CoapDecodeError("Missing Uri-Path")
+    payload = data[pos + 1:] if pos < len(data) else b""
+    content_type = CONTENT_FORMATS.get(content_format) if content_format is not None else None
+    if content_format is not None and content_type is None:
+        raise CoapDecodeError(f"Unsupported Content-Format {content_format}")
+    return msg_type, message_id, token, "/".join(segments), content_type, payload
+
+
+class CoapListener(asyncio.DatagramProtocol):
+    """Receives device messages over CoAP/UDP and hands them to a message handler"""
+
+    def __init__(self, handle_message: Callable[[str, bytes, Optional[str]], None]):
+        self.handle_message = handle_message
+        self.transport: Optional[asyncio.DatagramTransport] = None
+        self.received = 0
+        self.rejected = 0
+
+    async def start(self, host: str = "0.0.0.0", port: int = COAP_DEFAULT_PORT):
+        loop = asyncio.get_running_loop()
+        await loop.create_datagram_endpoint(lambda: self, local_addr=(host, port))
+        logger.info(f"CoAP listener on udp://{host}:{port}")
+
+    def stop(self):
+        if self.transport:
+            self.transport.close()
+            self.transport = None
+
+    def connection_made(self, transport):
+        self.transport = transport
+
+    def datagram_received(self, data: bytes, addr):
+        try:
+            msg_type, message_id, token, topic, content_type, payload = parse_coap_message(data)
+        except (CoapDecodeError, UnicodeDecodeError) as e:
+            self.rejected += 1
+            logger.debug(f"Ignored datagram from {addr[0]}: {e}")
+            return
+
+        self.received += 1
+        if msg_type == COAP_TYPE_CON and self.transport:
+            header = _HEADER.pack(COAP_VERSION << 6 | COAP_TYPE_ACK << 4 | len(token),
+                                  COAP_CODE_CHANGED, message_id)
+            self.transport.sendto(header + token, addr)
+        self.handle_message(topic, payload, content_type)
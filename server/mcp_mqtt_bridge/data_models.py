@@ -2,8 +2,9 @@
 Data models for the MCP-MQTT bridge server.
 """
 
+from collections import deque
 from datetime import datetime, timedelta
-from typing import Dict, List, Any, Optional
+from typing import Deque, Dict, List, Any, Optional, Tuple
 from dataclasses import dataclass, field
 from .timezone_utils import utc_now, age_seconds
 
@@ -17,6 +18,8 @@ class SensorReading:
     unit: Optional[str]
     timestamp: datetime
     quality: Optional[float] = None
+    channels: Optional[Dict[str, float]] = None  # Multi-channel sensors; value is the first channel
+    bucket_us: Optional[int] = None  # Aligned sampling slot (epoch us), shared by every device sampling on it
 
 
 @dataclass
@@ -36,6 +39,8 @@ class DeviceCapabilities:
     metadata: Dict[str, Any] = field(default_factory=dict)
     firmware_version: Optional[str] = None
     hardware_version: Optional[str] = None
+    caps_hash: Optional[str] = None  # Content hash announced by the device
+    caps_version: Optional[int] = None
 
 
 @dataclass
@@ -49,6 +54,85 @@ class IoTDevice:
     sensor_readings: Dict[str, SensorReading] = field(default_factory=dict)
     actuator_states: Dict[str, ActuatorState] = field(default_factory=dict)
     errors: List[Dict[str, Any]] = field(default_factory=list)
+    config_version: Optional[int] = None  # Last live config version the device acknowledged
+    config: Dict[str, Any] = field(default_factory=dict)  # Effective live config reported by the device
+    gateway_id: Optional[str] = None  # Gateway bridge this child device is published through (None = direct)
+    rules_version: Optional[int] = None  # Last local rule table version the device acknowledged
+    rules: List[Dict[str, Any]] = field(default_factory=list)  # Local rules last applied on the device
+    rule_events: List[Dict[str, Any]] = field(default_factory=list)  # Recent actions fired by local rules
+    health: Dict[str, Any] = field(default_factory=dict)  # Last health record (heap, fragmentation, tasks, counters)
+    ota: Dict[str, Any] = field(default_factory=dict)  # Last firmware update progress reported by the device
+    ota_results: List[Dict[str, Any]] = field(default_factory=list)  # Recent firmware update outcomes
+
+
+SEQUENCE_WINDOW = 64  # Sequence numbers below the highest one still told apart as late or repeated
+
+
+@dataclass
+class SequenceTracker:
+    """Loss, duplicate and reorder counts for one stream of sequence numbers
+    
+    Constant work per message: the device's boot epoch, the highest sequence
+    seen in it, and a bitmap of which of the SEQUENCE_WINDOW numbers below
+    that have arrived. A gap counts as lost until its readings turn up late.
+    """
+    boot: Optional[int] = None
+    highest: int = 0
+    window: int = 0  # Bit i: sequence highest - i has arrived
+    received: int = 0
+    lost: int = 0
+    duplicates: int = 0
+    reordered: int = 0
+    restarts: int = 0
+    
+    def observe(self, boot: int, seq: int) -> bool:
+        """Record one sequence number; returns True if it was seen before"""
+        # Boot epoch 0: the device could not count boots, so a restart shows only as sequence 1 again
+        restarted = boot == 0 and seq == 1 and self.highest > 1
+        if self.boot is None or boot > self.boot or restarted:
+            if self.boot is not None:
+                # Readings of the new boot before this one are missing so far
+                self.restarts += 1
+                self.lost += max(seq - 1, 0)
+            self.boot, self.highest, self.window = boot, seq, 1
+        elif boot < self.boot:
+            self.reordered += 1  # Delayed across a reset
+        elif seq > self.highest:
+            shift = seq - self.highest
+            self.lost += shift - 1
+            if shift < SEQUENCE_WINDOW:
+                self.window = ((self.window << shift) | 1) & ((1 << SEQUENCE_WINDOW) - 1)
+            else:
+                self.window = 1
+            self.highest = seq
+        else:
+            offset = self.highest - seq
+            if offset >= SEQUENCE_WINDOW:
+                self.reordered += 1  # Too old to tell; counted as late
+            elif self.window & (1 << offset):
+                self.duplicates += 1
+                return True
+            else:
+                self.window |= 1 << offset
+                self.reordered += 1
+                self.lost = max(self.lost - 1, 0)
+        self.received += 1
+        return False
+    
+    def stats(self) -> Dict[str, Any]:
+        expected = self.received + self.lost
+        return {
+            "boot": self.boot,
+            "last_seq": self.highest,
+            "received": self.received,
+            "lost": self.lost,
+            "duplicates": self.duplicates,
+            "reordered": self.reordered,
+            "restarts": self.restarts,
+            "loss_rate": round(self.lost / expected, 6) if expected else 0.0,
+            "duplicate_rate": round(self.duplicates / (self.received + self.duplicates), 6) if self.received else 0.0,
+            "reorder_rate": round(self.reordered / self.received, 6) if self.received else 0.0
+        }
 
 
 @dataclass
@@ -60,10 +144,50 @@ class DeviceMetrics:
     sensor_read_errors: int = 0
     last_activity: datetime = field(default_factory=utc_now)
     uptime_start: datetime = field(default_factory=utc_now)
+    pings_sent: int = 0
+    pings_lost: int = 0
+    # Recent (rtt_ms, clock_offset_ms) ping samples; offset is None while the device clock is unsynced
+    ping_samples: Deque[Tuple[float, Optional[float]]] = field(default_factory=lambda: deque(maxlen=100))
+    # Per-sensor sequence tracking ("batch" for the gateway's own batches)
+    sequences: Dict[str, SequenceTracker] = field(default_factory=dict)
     
     @property
     def uptime_seconds(self) -> int:
         return int(age_seconds(self.uptime_start))
+    
+    def latency_stats(self) -> Dict[str, Any]:
+        """Round-trip time statistics over the recent ping samples
+        
+        The clock offset (device minus server) is taken from the fastest
+        synced sample, where queueing delays distort it least.
+        """
+        stats: Dict[str, Any] = {"pings_sent": self.pings_sent, "pings_lost": self.pings_lost,
+                                 "samples": len(self.ping_samples)}
+        if not self.ping_samples:
+            return stats
+        
+        rtts = sorted(rtt for rtt, _ in self.ping_samples)
+        synced = [sample for sample in self.ping_samples if sample[1] is not None]
+        stats.update({
+            "last_rtt_ms": round(self.ping_samples[-1][0], 3),
+            "min_rtt_ms": round(rtts[0], 3),
+            "avg_rtt_ms": round(sum(rtts) / len(rtts), 3),
+            "p95_rtt_ms": round(rtts[min(len(rtts) - 1, int(len(rtts) * 0.95))], 3),
+            "max_rtt_ms": round(rtts[-1], 3),
+            "clock_offset_ms": round(min(synced)[1], 3) if synced else None
+        })
+        return stats
+    
+    def sequence_stats(self) -> Dict[str, Any]:
+        """Loss, duplicate and reorder statistics over all sequenced streams of the device"""
+        streams = {name: tracker.stats() for name, tracker in self.sequences.items()}
+        total = SequenceTracker()
+        for tracker in self.sequences.values():
+            for name in ("received", "lost", "duplicates", "reordered", "restarts"):
+                setattr(total, name, getattr(total, name) + getattr(tracker, name))
+        summary = {key: value for key, value in total.stats().items() if key not in ("boot", "last_seq")}
+        summary["streams"] = streams
+        return summary
 
 
 @dataclass
@@ -38,6 +38,7 @@ class DatabaseManager:
                         value REAL NOT NULL,
                         unit TEXT,
                         quality REAL,
+                        channels TEXT,
                         timestamp DATETIME NOT NULL,
                         created_at DATETIME DEFAULT CURRENT_TIMESTAMP
                     );
@@ -83,6 +84,8 @@ class DatabaseManager:
                         metadata TEXT,
                         firmware_version TEXT,
                         hardware_version TEXT,
+                        caps_hash TEXT,
+                        caps_version INTEGER,
                         last_updated DATETIME DEFAULT CURRENT_TIMESTAMP
                     );
                     
@@ -115,11 +118,18 @@ class DatabaseManager:
                         sensor_type TEXT NOT NULL,
                         value REAL NOT NULL,
                         unit TEXT,
+                        channels TEXT,
                         timestamp DATETIME NOT NULL,
                         created_at DATETIME DEFAULT CURRENT_TIMESTAMP,
                         FOREIGN KEY (device_id) REFERENCES devices(device_id)
                     );
                     
+                    CREATE TABLE IF NOT EXISTS auth_counters (
+                        device_id TEXT PRIMARY KEY,
+                        counter INTEGER NOT NULL,
+                        updated_at DATETIME
+                    );
+                    
                     CREATE TABLE IF NOT EXISTS device_errors (
                         id INTEGER PRIMARY KEY AUTOINCREMENT,
                         device_id TEXT NOT NULL,
@@ -131,26 +141,59 @@ class DatabaseManager:
                         FOREIGN KEY (device_id) REFERENCES devices(device_id)
                     );
                 """)
+                
+                # Capabilities are deduplicated by content hash on reconnect
+                self._add_missing_column(conn, "device_capabilities", "caps_hash", "TEXT")
+                self._add_missing_column(conn, "device_capabilities", "caps_version", "INTEGER")
+                
+                # Multi-channel readings are stored as one row with a JSON channels column;
+                # readings taken on an aligned sampling slot are keyed by it (epoch us)
+                for table in ("sensor_readings", "sensor_data"):
+                    self._add_missing_column(conn, table, "channels", "TEXT")
+                    self._add_missing_column(conn, table, "bucket_us", "INTEGER")
+                    conn.execute(f"CREATE INDEX IF NOT EXISTS idx_{table}_bucket "
+                                 f"ON {table}(sensor_type, bucket_us)")
+                
+                # Latest device health record, next to the server-side counters
+                for column, declaration in (("uptime_s", "INTEGER"), ("free_heap", "INTEGER"),
+                                            ("min_free_heap", "INTEGER"), ("largest_block", "INTEGER"),
+                                            ("heap_frag_pct", "INTEGER"), ("rssi", "INTEGER"),
+                                            ("low_memory", "INTEGER"), ("device_counters", "TEXT"),
+                                            ("health_at", "DATETIME")):
+                    self._add_missing_column(conn, "device_metrics", column, declaration)
             logger.info("Database initialized successfully")
         except Exception as e:
             logger.error(f"Failed to initialize database: {e}")
             raise
     
+    @staticmethod
+    def _add_missing_column(conn: sqlite3.Connection, table: str, column: str, declaration: str):
+        """Add a column introduced after the table was first created"""
+        existing = {row[1] for row in conn.execute(f"PRAGMA table_info({table})")}
+        if column not in existing:
+            conn.execute(f"ALTER TABLE {table} ADD COLUMN {column} {declaration}")
+    
+    @staticmethod
+    def _channels_json(channels: Optional[Dict[str, float]]) -> Optional[str]:
+        return json.dumps(channels) if channels is not None else None
+    
     def store_sensor_reading(self, reading: SensorReading):
         """Store a sensor reading"""
         try:
             with sqlite3.connect(self.db_path) as conn:
                 conn.execute("""
                     INSERT INTO sensor_readings 
-                    (device_id, sensor_type, value, unit, quality, timestamp)
-                    VALUES (?, ?, ?, ?, ?, ?)
+                    (device_id, sensor_type, value, unit, quality, channels, timestamp, bucket_us)
+                    VALUES (?, ?, ?, ?, ?, ?, ?, ?)
                 """, (
                     reading.device_id,
                     reading.sensor_type,
                     reading.value,
                     reading.unit,
                     reading.quality,
-                    reading.timestamp
+                    self._channels_json(reading.channels),
+                    reading.timestamp,
+                    reading.bucket_us
                 ))
         except Exception as e:
             logger.error(f"Failed to store sensor reading: {e}")
@@ -161,10 +204,11 @@ class DatabaseManager:
             with sqlite3.connect(self.db_path) as conn:
                 conn.executemany("""
                     INSERT INTO sensor_readings 
-                    (device_id, sensor_type, value, unit, quality, timestamp)
-                    VALUES (?, ?, ?, ?, ?, ?)
+                    (device_id, sensor_type, value, unit, quality, channels, timestamp, bucket_us)
+                    VALUES (?, ?, ?, ?, ?, ?, ?, ?)
                 """, [
-                    (r.device_id, r.sensor_type, r.value, r.unit, r.quality, r.timestamp)
+                    (r.device_id, r.sensor_type, r.value, r.unit, r.quality,
+                     self._channels_json(r.channels), r.timestamp, r.bucket_us)
                     for r in readings
                 ])
             logger.debug(f"Stored {len(readings)} sensor readings")
@@ -277,8 +321,9 @@ class DatabaseManager:
             with sqlite3.connect(self.db_path) as conn:
                 conn.execute("""
                     INSERT OR REPLACE INTO device_capabilities 
-                    (device_id, sensors, actuators, metadata, firmware_version, hardware_version, last_updated)
-                    VALUES (?, ?, ?, ?, ?, ?, ?)
+                    (device_id, sensors, actuators, metadata, firmware_version, hardware_version,
+                     caps_hash, caps_version, last_updated)
+                    VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?)
                 """, (
                     device_id,
                     json.dumps(capabilities.get('sensors', [])),
@@ -286,33 +331,155 @@ class DatabaseManager:
                     json.dumps(capabilities.get('metadata', {})),
                     capabilities.get('firmware_version'),
                     capabilities.get('hardware_version'),
+                    capabilities.get('caps_hash'),
+                    capabilities.get('caps_version'),
                     utc_now()
                 ))
         except Exception as e:
             logger.error(f"Failed to update device capabilities: {e}")
     
-    def update_device_metrics(self, device_id: str, metrics: Dict[str, Any]):
-        """Update device metrics"""
+    def get_device_capabilities(self, device_id: str) -> Optional[Dict[str, Any]]:
+        """Get the stored capabilities document for a device"""
+        try:
+            with sqlite3.connect(self.db_path) as conn:
+                cursor = conn.execute("""
+                    SELECT sensors, actuators, metadata, firmware_version, hardware_version,
+                           caps_hash, caps_version
+                    FROM device_capabilities WHERE device_id = ?
+                """, (device_id,))
+                row = cursor.fetchone()
+                if row:
+                    return {
+                        "sensors": json.loads(row[0]) if row[0] else [],
+                        "actuators": json.loads(row[1]) if row[1] else [],
+                        "metadata": json.loads(row[2]) if row[2] else {},
+                        "firmware_version": row[3],
+                        "hardware_version": row[4],
+                        "caps_hash": row[5],
+                        "caps_version": row[6]
+                    }
+                return None
+        except Exception as e:
+            logger.error(f"Failed to get device capabilities: {e}")
+            return None
+    
+    def update_device_metrics(self, device_id: str, metrics: Any):
+        """Update the server-side counters of a device
+        
+        Accepts a DeviceMetrics or a dict; the health columns are left alone.
+        """
+        def value(name: str, default: Any) -> Any:
+            if isinstance(metrics, dict):
+                return metrics.get(name, default)
+            return getattr(metrics, name, default)
+        
         try:
             with sqlite3.connect(self.db_path) as conn:
                 conn.execute("""
-                    INSERT OR REPLACE INTO device_metrics 
+                    INSERT INTO device_metrics 
                     (device_id, messages_sent, messages_received, connection_failures, 
                      sensor_read_errors, last_activity, uptime_start, last_updated)
                     VALUES (?, ?, ?, ?, ?, ?, ?, ?)
+                    ON CONFLICT(device_id) DO UPDATE SET
+                        messages_sent = excluded.messages_sent,
+                        messages_received = excluded.messages_received,
+                        connection_failures = excluded.connection_failures,
+                        sensor_read_errors = excluded.sensor_read_errors,
+                        last_activity = excluded.last_activity,
+                        uptime_start = excluded.uptime_start,
+                        last_updated = excluded.last_updated
                 """, (
                     device_id,
-                    metrics.get('messages_sent', 0),
-                    metrics.get('messages_received', 0),
-                    metrics.get('connection_failures', 0),
-                    metrics.get('sensor_read_errors', 0),
-                    metrics.get('last_activity', utc_now()),
-                    metrics.get('uptime_start', utc_now()),
+                    value('messages_sent', 0),
+                    value('messages_received', 0),
+                    value('connection_failures', 0),
+                    value('sensor_read_errors', 0),
+                    value('last_activity', utc_now()),
+                    value('uptime_start', utc_now()),
                     utc_now()
                 ))
         except Exception as e:
             logger.error(f"Failed to update device metrics: {e}")
     
+    def store_device_health(self, device_id: str, health: Dict[str, Any], timestamp: datetime = None):
+        """Keep the latest health record of a device in device_metrics"""
+        heap = health.get("heap") or {}
+        counters = health.get("counters")
+        try:
+            with sqlite3.connect(self.db_path) as conn:
+                conn.execute("""
+                    INSERT INTO device_metrics 
+                    (device_id, uptime_s, free_heap, min_free_heap, largest_block, heap_frag_pct,
+                     rssi, low_memory, device_counters, health_at, last_updated)
+                    VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)
+                    ON CONFLICT(device_id) DO UPDATE SET
+                        uptime_s = excluded.uptime_s,
+                        free_heap = excluded.free_heap,
+                        min_free_heap = excluded.min_free_heap,
+                        largest_block = excluded.largest_block,
+                        heap_frag_pct = excluded.heap_frag_pct,
+                        rssi = excluded.rssi,
+                        low_memory = excluded.low_memory,
+                        device_counters = excluded.device_counters,
+                        health_at = excluded.health_at,
+                        last_updated = excluded.last_updated
+                """, (
+                    device_id,
+                    health.get("uptime_s"),
+                    heap.get("free"),
+                    heap.get("min_free"),
+                    heap.get("largest_block"),
+                    heap.get("frag_pct"),
+                    health.get("rssi"),
+                    int(bool(health.get("low_memory"))),
+                    json.dumps(counters) if counters is not None else None,
+                    timestamp or utc_now(),
+                    utc_now()
+                ))
+        except Exception as e:
+            logger.error(f"Failed to store device health: {e}")
+    
+    def get_device_metrics(self, device_id: str) -> Optional[Dict[str, Any]]:
+        """Get the stored counters and latest health record of a device"""
+        try:
+            with sqlite3.connect(self.db_path) as conn:
+                conn.row_factory = sqlite3.Row
+                row = conn.execute("SELECT * FROM device_metrics WHERE device_id = ?",
+                                   (device_id,)).fetchone()
+                if row:
+                    metrics = dict(row)
+                    metrics["device_counters"] = (json.loads(metrics["device_counters"])
+                                                  if metrics["device_counters"] else {})
+                    metrics["low_memory"] = bool(metrics["low_memory"])
+                    return metrics
+                return None
+        except Exception as e:
+            logger.error(f"Failed to get device metrics: {e}")
+            return None
+    
+    def load_auth_counters(self) -> Dict[str, int]:
+        """Newest authentication counter accepted from each device"""
+        try:
+            with sqlite3.connect(self.db_path) as conn:
+                return {row[0]: row[1] for row in conn.execute("SELECT device_id, counter FROM auth_counters")}
+        except Exception as e:
+            logger.error(f"Failed to load authentication counters: {e}")
+            return {}
+    
+    def store_auth_counters(self, counters: Dict[str, int]):
+        """Save the newest authentication counters; a counter never moves back"""
+        try:
+            now = utc_now()
+            with sqlite3.connect(self.db_path) as conn:
+                conn.executemany("""
+                    INSERT INTO auth_counters (device_id, counter, updated_at) VALUES (?, ?, ?)
+                    ON CONFLICT(device_id) DO UPDATE SET
+                        counter = MAX(counter, excluded.counter),
+                        updated_at = excluded.updated_at
+                """, [(device_id, counter, now) for device_id, counter in counters.items()])
+        except Exception as e:
+            logger.error(f"Failed to store authentication counters: {e}")
+    
     def cleanup_old_data(self, retention_days: int = 30):
         """Clean up old data beyond retention period"""
         try:
@@ -472,14 +639,16 @@ class DatabaseManager:
             with sqlite3.connect(self.db_path) as conn:
                 cursor = conn.cursor()
                 cursor.execute("""
-                    INSERT INTO sensor_data (device_id, sensor_type, value, unit, timestamp)
-                    VALUES (?, ?, ?, ?, ?)
+                    INSERT INTO sensor_data (device_id, sensor_type, value, unit, channels, timestamp, bucket_us)
+                    VALUES (?, ?, ?, ?, ?, ?, ?)
                 """, (
                     sensor_data["device_id"],
                     sensor_data["sensor_type"],
                     sensor_data["value"],
                     sensor_data.get("unit", ""),
-                    sensor_data["timestamp"]
+                    self._channels_json(sensor_data.get("channels")),
+                    sensor_data["timestamp"],
+                    sensor_data.get("bucket_us")
                 ))
                 conn.commit()
         except Exception as e:
@@ -493,7 +662,7 @@ class DatabaseManager:
                 cursor = conn.cursor()
                 since_time = utc_isoformat(utc_minus_timedelta(timedelta(minutes=history_minutes)))
                 cursor.execute("""
-                    SELECT device_id, sensor_type, value, unit, timestamp
+                    SELECT device_id, sensor_type, value, unit, timestamp, channels
                     FROM sensor_data 
                     WHERE device_id = ? AND sensor_type = ? AND timestamp > ?
                     ORDER BY timestamp DESC
@@ -505,7 +674,8 @@ class DatabaseManager:
                         "sensor_type": row[1],
                         "value": row[2],
                         "unit": row[3],
-                        "timestamp": row[4]
+                        "timestamp": row[4],
+                        "channels": json.loads(row[5]) if row[5] else None
                     }
                     for row in rows
                 ]
@@ -513,6 +683,31 @@ class DatabaseManager:
             logger.error(f"Failed to get sensor data: {e}")
             return []
     
+    def get_sensor_snapshot(self, sensor_type: str, bucket_us: int) -> List[Dict[str, Any]]:
+        """Get every device's reading of a sensor type taken on one aligned sampling slot"""
+        try:
+            with sqlite3.connect(self.db_path) as conn:
+                cursor = conn.execute("""
+                    SELECT device_id, value, unit, channels
+                    FROM sensor_data
+                    WHERE sensor_type = ? AND bucket_us = ?
+                    ORDER BY device_id
+                """, (sensor_type, bucket_us))
+                return [
+                    {
+                        "device_id": row[0],
+                        "sensor_type": sensor_type,
+                        "value": row[1],
+                        "unit": row[2],
+                        "channels": json.loads(row[3]) if row[3] else None,
+                        "bucket_us": bucket_us
+                    }
+                    for row in cursor.fetchall()
+                ]
+        except Exception as e:
+            logger.error(f"Failed to get sensor snapshot: {e}")
+            return []
+    
     def log_device_error(self, error_data: Dict[str, Any]):
         """Log a device error"""
         try:
@@ -824,6 +1019,20 @@ class DatabaseManager:
                     LIMIT 100
                 """
             },
+            {
+                "name": "Aligned readings across devices",
+                "description": "Pair temperature and humidity taken on the same clock-aligned slot "
+                               "(bucket_us, epoch microseconds) on every device",
+                "query": """
+                    SELECT t.bucket_us, t.device_id, t.value AS temperature, h.device_id AS humidity_device,
+                           h.value AS humidity
+                    FROM sensor_data t
+                    JOIN sensor_data h ON h.sensor_type = 'humidity' AND h.bucket_us = t.bucket_us
+                    WHERE t.sensor_type = 'temperature' AND t.bucket_us IS NOT NULL
+                    ORDER BY t.bucket_us DESC
+                    LIMIT 100
+                """
+            },
             {
                 "name": "Sensor readings by time range",
                 "description": "Get sensor data within a specific time range",
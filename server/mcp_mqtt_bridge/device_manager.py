@@ -3,10 +3,13 @@ Device management for the MCP-MQTT bridge.
 """
 
 import logging
+import time
 from datetime import datetime, timedelta
 from typing import Dict, List, Any, Optional
-from .data_models import IoTDevice, SensorReading, ActuatorState, DeviceCapabilities, DeviceMetrics
-from .timezone_utils import utc_now, from_timestamp_utc, age_seconds, is_expired, utc_isoformat, ensure_utc
+from .data_models import (IoTDevice, SensorReading, ActuatorState, DeviceCapabilities, DeviceMetrics,
+                          SequenceTracker)
+from .timezone_utils import (utc_now, age_seconds, is_expired, utc_isoformat, ensure_utc, message_timestamp,
+                             message_bucket_us)
 
 logger = logging.getLogger(__name__)
 
@@ -62,11 +65,77 @@ class DeviceManager:
         device.capabilities.metadata = capabilities_data.get("metadata", {})
         device.capabilities.firmware_version = capabilities_data.get("firmware_version")
         device.capabilities.hardware_version = capabilities_data.get("hardware_version")
+        device.capabilities.caps_hash = capabilities_data.get("caps_hash")
+        device.capabilities.caps_version = capabilities_data.get("caps_version")
         device.last_seen = utc_now()
         
+        # Gateway documents list their children; child documents name their gateway
+        if capabilities_data.get("gateway"):
+            self.link_child(device_id, capabilities_data["gateway"])
+        for child_id in capabilities_data.get("children", []):
+            self.link_child(child_id, device_id)
+        
         logger.info(f"Updated capabilities for device {device_id}")
     
-    def update_sensor_reading(self, device_id: str, sensor_type: str, reading_data: Dict[str, Any]):
+    def link_child(self, child_id: str, gateway_id: str) -> IoTDevice:
+        """Record that a child device is published through a gateway"""
+        if child_id not in self.devices:
+            self.devices[child_id] = IoTDevice(device_id=child_id)
+        
+        child = self.devices[child_id]
+        if child.gateway_id != gateway_id:
+            child.gateway_id = gateway_id
+            logger.info(f"Device {child_id} is a child of gateway {gateway_id}")
+        
+        # Children are stamped with the gateway's clock
+        gateway = self.devices.get(gateway_id)
+        if gateway and gateway.boot_time:
+            child.boot_time = gateway.boot_time
+        elif child.boot_time is None:
+            child.boot_time = utc_now()
+        return child
+    
+    def get_children(self, gateway_id: str) -> List[IoTDevice]:
+        """Get the child devices published through a gateway"""
+        return [device for device in self.devices.values() if device.gateway_id == gateway_id]
+    
+    def has_capabilities_hash(self, device_id: str, caps_hash: Optional[str]) -> bool:
+        """Check whether the cached capabilities for a device match a content hash"""
+        device = self.devices.get(device_id)
+        if not device or not caps_hash:
+            return False
+        return device.capabilities.caps_hash == caps_hash
+    
+    def mark_device_seen(self, device_id: str):
+        """Mark a known device as online without touching its cached state"""
+        device = self.devices.get(device_id)
+        if device:
+            device.online = True
+            device.last_seen = utc_now()
+    
+    def track_sequence(self, device_id: str, stream: str, message: Dict[str, Any],
+                       boot: Optional[int] = None) -> bool:
+        """Check a reading or batch against its stream's sequence; returns True if it is a duplicate
+        
+        Args:
+            stream: Sensor type, or "batch" for a gateway's batches
+            boot: Boot epoch for messages that carry none of their own (batch entries)
+        
+        Messages without a sequence number (older firmware) are not tracked.
+        """
+        seq = message.get("seq")
+        if seq is None:
+            return False
+        if device_id not in self.device_metrics:
+            self.device_metrics[device_id] = DeviceMetrics()
+        tracker = self.device_metrics[device_id].sequences.setdefault(stream, SequenceTracker())
+        
+        duplicate = tracker.observe(int(message.get("boot", boot or 0)), int(seq))
+        if duplicate:
+            logger.debug(f"Duplicate {stream} message {seq} from {device_id}")
+        return duplicate
+    
+    def update_sensor_reading(self, device_id: str, sensor_type: str, reading_data: Dict[str, Any]) -> SensorReading:
         """Update sensor reading for a device"""
         if device_id not in self.devices:
             self.devices[device_id] = IoTDevice(device_id=device_id)
@@ -77,7 +146,14 @@ class DeviceManager:
         
         # Extract value
         value_data = reading_data.get("value", {})
-        if isinstance(value_data, dict):
+        channels = None
+        if isinstance(value_data, dict) and "readings" in value_data:
+            # Multi-channel sensor: one record, per-channel units live in the capabilities
+            channels = self._channel_readings(device, sensor_type, value_data["readings"])
+            reading_value = next(iter(channels.values()), 0)
+            unit = None
+            quality = value_data.get("quality")
+        elif isinstance(value_data, dict):
             reading_value = value_data.get("reading", 0)
             unit = value_data.get("unit")
             quality = value_data.get("quality")
@@ -86,9 +162,12 @@ class DeviceManager:
             unit = None
             quality = None
         
-        # Create reading with proper timestamp handling
-        raw_timestamp = reading_data.get("timestamp", utc_now().timestamp())
-        timestamp = ensure_utc(raw_timestamp, device.boot_time)
+        # Binary payloads carry no unit; take it from the announced capabilities
+        if unit is None and channels is None:
+            unit = device.capabilities.metadata.get(sensor_type, {}).get("unit")
+        
+        # SNTP-synced devices send epoch microseconds; no boot-time reconstruction needed
+        timestamp = message_timestamp(reading_data, device.boot_time)
         
         reading = SensorReading(
             device_id=device_id,
@@ -96,7 +175,9 @@ class DeviceManager:
             value=reading_value,
             unit=unit,
             quality=quality,
-            timestamp=timestamp
+            timestamp=timestamp,
+            channels=channels,
+            bucket_us=message_bucket_us(reading_data)
         )
         
         device.sensor_readings[sensor_type] = reading
@@ -110,8 +191,22 @@ class DeviceManager:
         self.device_metrics[device_id].last_activity = utc_now()
         
         logger.debug(f"Updated sensor reading for {device_id}/{sensor_type}: {reading_value}")
+        return reading
     
-    def update_actuator_state(self, device_id: str, actuator_type: str, state_data: Dict[str, Any]):
+    @staticmethod
+    def _channel_readings(device: IoTDevice, sensor_type: str, readings: Any) -> Dict[str, float]:
+        """Name the channels of a multi-channel reading (binary records send a plain list)"""
+        if isinstance(readings, dict):
+            return dict(readings)
+        
+        channels = device.capabilities.metadata.get(sensor_type, {}).get("channels", [])
+        names = [channel.get("name") for channel in channels]
+        return {
+            names[i] if i < len(names) and names[i] else f"ch{i}": value
+            for i, value in enumerate(readings)
+        }
+    
+    def update_actuator_state(self, device_id: str, actuator_type: str, state_data: Dict[str, Any]) -> ActuatorState:
         """Update actuator state for a device"""
         if device_id not in self.devices:
             self.devices[device_id] = IoTDevice(device_id=device_id)
@@ -121,9 +216,7 @@ class DeviceManager:
         device = self.devices[device_id]
         state = state_data.get("value", "unknown")
         
-        # Create state record with proper timestamp handling
-        raw_timestamp = state_data.get("timestamp", utc_now().timestamp())
-        timestamp = ensure_utc(raw_timestamp, device.boot_time)
+        timestamp = message_timestamp(state_data, device.boot_time)
         
         actuator_state = ActuatorState(
             device_id=device_id,
@@ -142,6 +235,7 @@ class DeviceManager:
         self.device_metrics[device_id].last_activity = utc_now()
         
         logger.info(f"Updated actuator state for {device_id}/{actuator_type}: {state}")
+        return actuator_state
     
     def update_device_status(self, device_id: str, status_data: Dict[str, Any]):
         """Update device online/offline status"""
@@ -157,8 +251,15 @@ class DeviceManager:
         
         if was_online != device.online:
             logger.info(f"Device {device_id} is now {'online' if device.online else 'offline'}")
+        
+        # Children have no connection of their own; they are unreachable with their gateway
+        if not device.online:
+            for child in self.get_children(device_id):
+                if child.online:
+                    child.online = False
+                    logger.info(f"Device {child.device_id} is now offline (gateway {device_id} offline)")
     
-    def add_device_error(self, device_id: str, error_data: Dict[str, Any]):
+    def add_device_error(self, device_id: str, error_data: Dict[str, Any]) -> Dict[str, Any]:
         """Add error to device error log"""
         if device_id not in self.devices:
             self.devices[device_id] = IoTDevice(device_id=device_id)
@@ -169,7 +270,7 @@ class DeviceManager:
             "error_type": error_data.get("value", {}).get("error_type", "unknown"),
             "message": error_data.get("value", {}).get("message", ""),
             "severity": error_data.get("value", {}).get("severity", 2),
-            "timestamp": from_timestamp_utc(error_data.get("timestamp", utc_now().timestamp()))
+            "timestamp": message_timestamp(error_data, device.boot_time)
         }
         
         device.errors.append(error_record)
@@ -189,6 +290,169 @@ class DeviceManager:
             self.device_metrics[device_id].connection_failures += 1
         
         logger.warning(f"Error from {device_id}: {error_record['error_type']} - {error_record['message']}")
+        return error_record
+    
+    def update_device_config(self, device_id: str, ack: Dict[str, Any]):
+        """Record the effective live config reported in a config ack"""
+        if device_id not in self.devices:
+            self.devices[device_id] = IoTDevice(device_id=device_id)
+        
+        device = self.devices[device_id]
+        config = ack.get("config")
+        if isinstance(config, dict):
+            device.config = config
+            device.config_version = config.get("version", device.config_version)
+        device.last_seen = utc_now()
+        
+        logger.info(f"Config ack from {device_id}: version {ack.get('version')} {ack.get('status')}")
+    
+    def next_config_version(self, device_id: str) -> int:
+        """Pick a config version the device will accept as newer"""
+        device = self.devices.get(device_id)
+        last = device.config_version if device and device.config_version else 0
+        return max(int(time.time()), last + 1)
+    
+    def update_device_health(self, device_id: str, health: Dict[str, Any]) -> Dict[str, Any]:
+        """Record the periodic health record of a device"""
+        if device_id not in self.devices:
+            self.devices[device_id] = IoTDevice(device_id=device_id)
+        
+        device = self.devices[device_id]
+        record = {
+            "uptime_s": health.get("uptime_s"),
+            "low_memory": bool(health.get("low_memory")),
+            "heap": health.get("heap", {}),
+            "tasks": health.get("tasks", []),
+            "counters": health.get("counters", {}),
+            "rssi": health.get("rssi"),
+            "timestamp": message_timestamp(health, device.boot_time)
+        }
+        device.health = record
+        device.last_seen = utc_now()
+        
+        if record["low_memory"]:
+            logger.warning(f"Low memory on {device_id}: {record['heap']}")
+        return record
+    
+    def update_device_rules(self, device_id: str, ack: Dict[str, Any],
+                            rules: Optional[List[Dict[str, Any]]] = None):
+        """Record the rule table state reported in a rules ack"""
+        if device_id not in self.devices:
+            self.devices[device_id] = IoTDevice(device_id=device_id)
+        
+        device = self.devices[device_id]
+        device.rules_version = ack.get("rules_version", device.rules_version)
+        if rules is not None and ack.get("status") == "applied":
+            device.rules = rules
+        device.last_seen = utc_now()
+        
+        logger.info(f"Rules ack from {device_id}: version {ack.get('version')} {ack.get('status')}")
+    
+    def next_rules_version(self, device_id: str) -> int:
+        """Pick a rule table version the device will accept as newer"""
+        device = self.devices.get(device_id)
+        last = device.rules_version if device and device.rules_version else 0
+        return max(int(time.time()), last + 1)
+    
+    def add_rule_event(self, device_id: str, event: Dict[str, Any]) -> Dict[str, Any]:
+        """Record an actuator action a device took on its own because of a local rule"""
+        if device_id not in self.devices:
+            self.devices[device_id] = IoTDevice(device_id=device_id)
+        
+        device = self.devices[device_id]
+        
+        event_record = {
+            "rule": event.get("rule"),
+            "actuator": event.get("actuator"),
+            "action": event.get("action"),
+            "value": event.get("value"),
+            "reading": event.get("reading"),
+            "status": event.get("status", "ok"),
+            "error": event.get("error"),
+            "timestamp": message_timestamp(event, device.boot_time)
+        }
+        
+        device.rule_events.append(event_record)
+        device.last_seen = utc_now()
+        
+        # Keep only last 100 rule events per device
+        if len(device.rule_events) > 100:
+            device.rule_events = device.rule_events[-100:]
+        
+        logger.info(f"Rule {event_record['rule']} on {device_id}: "
+                    f"{event_record['actuator']} {event_record['action']} ({event_record['status']})")
+        return event_record
+    
+    def record_ping(self, device_id: str, sent_us: int, received_us: int,
+                    pong: Optional[Dict[str, Any]]) -> Dict[str, Any]:
+        """Turn a ping exchange into RTT and clock offset and add it to the device's statistics
+        
+        Args:
+            sent_us: Server wall clock when the ping was published (epoch microseconds)
+            received_us: Server wall clock when the pong arrived
+            pong: The device's answer with rx_us/tx_us, or None if it was lost
+        """
+        if device_id not in self.device_metrics:
+            self.device_metrics[device_id] = DeviceMetrics()
+        metrics = self.device_metrics[device_id]
+        metrics.pings_sent += 1
+        
+        if pong is None:
+            metrics.pings_lost += 1
+            return {"status": "timeout"}
+        
+        # NTP-style: the time the device held the ping is not network latency
+        rx_us, tx_us = pong.get("rx_us", 0), pong.get("tx_us", 0)
+        device_us = max(0, tx_us - rx_us)
+        rtt_ms = max(0, received_us - sent_us - device_us) / 1000
+        offset_ms = None
+        if pong.get("time_synced"):
+            offset_ms = ((rx_us - sent_us) + (tx_us - received_us)) / 2000
+        metrics.ping_samples.append((rtt_ms, offset_ms))
+        metrics.messages_received += 1
+        metrics.last_activity = utc_now()
+        
+        if device_id in self.devices:
+            self.devices[device_id].last_seen = utc_now()
+        
+        return {
+            "status": "online",
+            "rtt_ms": round(rtt_ms, 3),
+            "device_processing_ms": round(device_us / 1000, 3),
+            "clock_offset_ms": round(offset_ms, 3) if offset_ms is not None else None,
+            "time_synced": bool(pong.get("time_synced"))
+        }
+    
+    def update_device_ota(self, device_id: str, status: Dict[str, Any]):
+        """Record firmware update progress reported by a device"""
+        if device_id not in self.devices:
+            self.devices[device_id] = IoTDevice(device_id=device_id)
+        
+        device = self.devices[device_id]
+        device.ota = {
+            "version": status.get("version"),
+            "state": status.get("state"),
+            "offset": status.get("offset"),
+            "size": status.get("size"),
+            "error": status.get("error"),
+            "timestamp": utc_now()
+        }
+        device.last_seen = utc_now()
+    
+    def add_ota_result(self, device_id: str, result: Dict[str, Any]):
+        """Keep the outcome of a firmware update (transfer size and duration)"""
+        if device_id not in self.devices:
+            self.devices[device_id] = IoTDevice(device_id=device_id)
+        
+        device = self.devices[device_id]
+        device.ota_results.append({**result, "timestamp": utc_now()})
+        
+        # Keep only last 20 updates per device
+        if len(device.ota_results) > 20:
+            device.ota_results = device.ota_results[-20:]
+        
+        logger.info(f"Firmware update of {device_id} to {result.get('version')}: {result.get('status')} "
+                    f"({result.get('mode')}, {result.get('transfer_bytes')} bytes, {result.get('duration_s')} s)")
     
     def check_device_timeouts(self):
         """Check for devices that haven't been seen recently and mark them offline"""
@@ -209,13 +473,17 @@ class DeviceManager:
             "device_id": device_id,
             "online": device.online,
             "last_seen": utc_isoformat(device.last_seen),
+            "gateway_id": device.gateway_id,
+            "children": [child.device_id for child in self.get_children(device_id)],
             "uptime_seconds": metrics.uptime_seconds,
             "capabilities": {
                 "sensors": device.capabilities.sensors,
                 "actuators": device.capabilities.actuators,
                 "metadata": device.capabilities.metadata,
                 "firmware_version": device.capabilities.firmware_version,
-                "hardware_version": device.capabilities.hardware_version
+                "hardware_version": device.capabilities.hardware_version,
+                "caps_hash": device.capabilities.caps_hash,
+                "caps_version": device.capabilities.caps_version
             },
             "current_state": {
                 "sensors": {
@@ -223,6 +491,7 @@ class DeviceManager:
                         "value": reading.value,
                         "unit": reading.unit,
                         "quality": reading.quality,
+                        "channels": reading.channels,
                         "timestamp": utc_isoformat(reading.timestamp),
                         "age_seconds": age_seconds(reading.timestamp)
                     }
@@ -244,6 +513,17 @@ class DeviceManager:
                 "sensor_read_errors": metrics.sensor_read_errors,
                 "last_activity": utc_isoformat(metrics.last_activity) if metrics.last_activity else None
             },
+            "config": device.config,
+            "health": device.health,
+            "ota": {
+                "progress": {**device.ota, "timestamp": utc_isoformat(device.ota["timestamp"])} if device.ota else None,
+                "recent_updates": [{**r, "timestamp": utc_isoformat(r["timestamp"])} for r in device.ota_results[-5:]]
+            },
+            "rules": {
+                "version": device.rules_version,
+                "rules": device.rules,
+                "recent_events": device.rule_events[-10:]
+            },
             "recent_errors": device.errors[-10:] if device.errors else []
         }
     
@@ -256,6 +536,7 @@ class DeviceManager:
                 "device_id": device.device_id,
                 "online": device.online,
                 "last_seen": utc_isoformat(device.last_seen),
+                "gateway_id": device.gateway_id,
                 "sensors": device.capabilities.sensors,
                 "actuators": device.capabilities.actuators,
                 "firmware_version": device.capabilities.firmware_version,
@@ -263,6 +544,7 @@ class DeviceManager:
                     sensor: {
                         "value": reading.value,
                         "unit": reading.unit,
+                        "channels": reading.channels,
                         "timestamp": utc_isoformat(reading.timestamp)
                     }
                     for sensor, reading in device.sensor_readings.items()
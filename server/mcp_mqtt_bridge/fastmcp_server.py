@@ -91,9 +91,10 @@ class FastMCPServer:
             return await self._list_devices(online_only)
         
         @self.mcp.tool()
-        async def read_sensor(device_id: str, sensor_type: str, history_minutes: int = 0) -> Dict[str, Any]:
-            """Read current sensor data with optional history"""
-            return await self._read_sensor(device_id, sensor_type, history_minutes)
+        async def read_sensor(device_id: str, sensor_type: str, history_minutes: int = 0,
+                              fresh: bool = False, timeout_seconds: float = 2.0) -> Dict[str, Any]:
+            """Read current sensor data with optional history; fresh=True reads the device now"""
+            return await self._read_sensor(device_id, sensor_type, history_minutes, fresh, timeout_seconds)
         
         @self.mcp.tool()
         async def read_all_sensors(device_ids: Optional[List[str]] = None,
@@ -142,6 +143,36 @@ class FastMCPServer:
             """Ping a device to check if it's responsive"""
             return await self._ping_device(device_id, timeout_seconds)
 
+        @self.mcp.tool()
+        async def set_device_config(device_ids: Optional[List[str]] = None,
+                                    device_id: Optional[str] = None,
+                                    sensor_publish_interval_ms: Optional[int] = None,
+                                    deadband: Optional[float] = None,
+                                    sensor_deadbands: Optional[Dict[str, float]] = None,
+                                    log_level: Optional[int] = None,
+                                    qos: Optional[Dict[str, int]] = None,
+                                    timeout_seconds: int = 10) -> Dict[str, Any]:
+            """Push live configuration (interval, deadband, log level, QoS) to devices without a reconnect"""
+            return await self._set_device_config(device_ids, device_id, sensor_publish_interval_ms,
+                                                 deadband, sensor_deadbands, log_level, qos,
+                                                 timeout_seconds)
+
+        @self.mcp.tool()
+        async def set_device_rules(rules: List[Dict[str, Any]],
+                                   device_ids: Optional[List[str]] = None,
+                                   device_id: Optional[str] = None,
+                                   timeout_seconds: int = 10) -> Dict[str, Any]:
+            """Replace the device-side threshold rules (sensor > or < threshold with hysteresis drives an actuator action)"""
+            return await self._set_device_rules(rules, device_ids, device_id, timeout_seconds)
+
+        @self.mcp.tool()
+        async def update_device_firmware(version: str,
+                                         device_ids: Optional[List[str]] = None,
+                                         device_id: Optional[str] = None,
+                                         timeout_seconds: int = 900) -> Dict[str, Any]:
+            """Update device firmware over MQTT (delta against the running version when possible)"""
+            return await self._update_device_firmware(version, device_ids, device_id, timeout_seconds)
+
         @self.mcp.tool()
         async def query_database(query: str, max_rows: Optional[int] = None) -> Dict[str, Any]:
             """Execute a custom SQL query on the sensor database (SELECT only)"""
@@ -170,6 +201,7 @@ class FastMCPServer:
             device_info = {
                 "device_id": device.device_id,
                 "is_online": device.online,
+                "gateway_id": device.gateway_id,
                 "last_seen": device.last_seen.isoformat() if device.last_seen else None,
                 "sensors": list(device.sensor_readings.keys()),
                 "actuators": list(device.actuator_states.keys()),
@@ -180,12 +212,18 @@ class FastMCPServer:
         return device_list
     
     async def _read_sensor(self, device_id: str, sensor_type: str, 
-                          history_minutes: int = 0) -> Dict[str, Any]:
+                          history_minutes: int = 0, fresh: bool = False,
+                          timeout_seconds: float = 2.0) -> Dict[str, Any]:
         """Read current sensor data with optional history"""
         device = self.device_manager.get_device(device_id)
         if not device:
             raise ValueError(f"Device {device_id} not found")
         
+        # Ask the device for a reading now; its response replaces the cached one
+        fresh_response = None
+        if fresh and self.bridge and hasattr(self.bridge, 'request_sensor_read'):
+            fresh_response = await self.bridge.request_sensor_read(device_id, sensor_type, timeout_seconds)
+        
         # Get current reading
         current_reading = device.sensor_readings.get(sensor_type)
         if not current_reading:
@@ -199,6 +237,13 @@ class FastMCPServer:
             "timestamp": current_reading.timestamp.isoformat(),
             "quality": current_reading.quality
         }
+        if current_reading.channels is not None:
+            result["channels"] = current_reading.channels
+        
+        if fresh:
+            result["fresh"] = bool(fresh_response and fresh_response.get("status") == "ok")
+            if not result["fresh"]:
+                result["fresh_error"] = (fresh_response or {}).get("error", "no response from device")
         
         # Add historical data if requested
         if history_minutes > 0:
@@ -209,7 +254,8 @@ class FastMCPServer:
                 {
                     "value": reading["value"],
                     "timestamp": reading["timestamp"],
-                    "unit": reading["unit"]
+                    "unit": reading["unit"],
+                    **({"channels": reading["channels"]} if reading.get("channels") else {})
                 }
                 for reading in history
             ]
@@ -377,15 +423,22 @@ class FastMCPServer:
         if not metrics:
             return {"device_id": device_id, "error": "No metrics available"}
         
-        return {
+        result = {
             "device_id": device_id,
             "messages_sent": metrics.messages_sent,
             "messages_received": metrics.messages_received,
             "connection_failures": metrics.connection_failures,
             "sensor_read_errors": metrics.sensor_read_errors,
             "last_activity": metrics.last_activity.isoformat(),
-            "uptime_seconds": metrics.uptime_seconds
+            "uptime_seconds": metrics.uptime_seconds,
+            "latency": metrics.latency_stats(),
+            "sequence": metrics.sequence_stats()
         }
+        if device.health:
+            # What the device itself reported in its last health record
+            result["device_health"] = {key: device.health.get(key) 
+                                       for key in ("uptime_s", "heap", "counters", "rssi")}
+        return result
     
     async def _ping_device(self, device_id: str, timeout_seconds: int = 5) -> Dict[str, Any]:
         """Ping a device to check if it's responsive"""
@@ -394,6 +447,42 @@ class FastMCPServer:
         temp_manager = MCPServerManager(self.device_manager, self.database_manager, self.bridge)
         return await temp_manager.ping_device(device_id, timeout_seconds)
 
+    async def _set_device_config(self, device_ids: Optional[List[str]] = None,
+                                 device_id: Optional[str] = None,
+                                 sensor_publish_interval_ms: Optional[int] = None,
+                                 deadband: Optional[float] = None,
+                                 sensor_deadbands: Optional[Dict[str, float]] = None,
+                                 log_level: Optional[int] = None,
+                                 qos: Optional[Dict[str, int]] = None,
+                                 timeout_seconds: int = 10) -> Dict[str, Any]:
+        """Push live configuration to devices"""
+        # Delegate to the MCPServerManager implementation
+        from .mcp_server import MCPServerManager
+        temp_manager = MCPServerManager(self.device_manager, self.database_manager, self.bridge)
+        return await temp_manager.set_device_config(device_ids, device_id, sensor_publish_interval_ms,
+                                                    deadband, sensor_deadbands, log_level, qos,
+                                                    timeout_seconds)
+
+    async def _set_device_rules(self, rules: List[Dict[str, Any]],
+                                device_ids: Optional[List[str]] = None,
+                                device_id: Optional[str] = None,
+                                timeout_seconds: int = 10) -> Dict[str, Any]:
+        """Push local rule tables to devices"""
+        # Delegate to the MCPServerManager implementation
+        from .mcp_server import MCPServerManager
+        temp_manager = MCPServerManager(self.device_manager, self.database_manager, self.bridge)
+        return await temp_manager.set_device_rules(rules, device_ids, device_id, timeout_seconds)
+
+    async def _update_device_firmware(self, version: str,
+                                      device_ids: Optional[List[str]] = None,
+                                      device_id: Optional[str] = None,
+                                      timeout_seconds: int = 900) -> Dict[str, Any]:
+        """Update device firmware over MQTT"""
+        # Delegate to the MCPServerManager implementation
+        from .mcp_server import MCPServerManager
+        temp_manager = MCPServerManager(self.device_manager, self.database_manager, self.bridge)
+        return await temp_manager.update_device_firmware(version, device_ids, device_id, timeout_seconds)
+
     async def _query_database(self, query: str, max_rows: Optional[int] = None) -> Dict[str, Any]:
         """Execute a custom SQL query on the database"""
         try:
@@ -451,8 +540,9 @@ class FastMCPServer:
                         "list_devices", "read_sensor", "read_all_sensors",
                         "control_actuator", "get_device_info", "query_devices",
                         "get_alerts", "get_system_status", "get_device_metrics",
-                        "ping_device", "query_database", "get_database_schema",
-                        "get_query_examples"
+                        "ping_device", "set_device_config", "set_device_rules",
+                        "update_device_firmware", "query_database",
+                        "get_database_schema", "get_query_examples"
                     ]
                 }
         except Exception as e:
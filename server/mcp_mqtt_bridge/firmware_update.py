@@ -0,0 +1,198 @@
+"""
+Firmware images and delta updates for over-the-air updates via MQTT.
+
+Images are stored as {firmware_dir}/{version}.bin. A device is updated with
+a delta against the image it runs when that image is known and the delta is
+smaller; otherwise the full image is sent. Deltas are computed once per
+(source, target) pair and cached in {firmware_dir}/deltas.
+
+Delta stream (little-endian), applied by the device against its running
+partition while it writes the new one:
+  u8 0x01 COPY,   u32 source offset, u32 length
+  u8 0x02 INSERT, u32 length, followed by length literal bytes
+"""
+
+import hashlib
+import logging
+import struct
+from dataclasses import dataclass
+from pathlib import Path
+from typing import Dict, List, Optional, Tuple
+
+logger = logging.getLogger(__name__)
+
+DELTA_OP_COPY = 0x01
+DELTA_OP_INSERT = 0x02
+_DELTA_COPY = struct.Struct("<BII")
+_DELTA_INSERT = struct.Struct("<BI")
+
+# Source is indexed at this granularity; shorter matches are sent as literals
+DELTA_BLOCK_SIZE = 32
+
+# Longest single COPY; the device copies one op without yielding, so long
+# matches are split to keep each op to a few flash sectors
+DELTA_MAX_COPY = 64 * 1024
+
+
+class DeltaError(ValueError):
+    """Raised when a delta stream is malformed or does not fit its source"""
+
+
+def _common_length(source: bytes, s: int, target: bytes, t: int) -> int:
+    """Number of equal bytes at source[s:] and target[t:]"""
+    limit = min(len(source) - s, len(target) - t)
+    length = 0
+    # Compare in slices first; per-byte loops are slow in Python
+    while length + 256 <= limit and source[s + length:s + length + 256] == target[t + length:t + length + 256]:
+        length += 256
+    while length < limit and source[s + length] == target[t + length]:
+        length += 1
+    return length
+
+
+def _emit_insert(out: bytearray, literal: bytes):
+    if literal:
+        out += _DELTA_INSERT.pack(DELTA_OP_INSERT, len(literal))
+        out += literal
+
+
+def compute_delta(source: bytes, target: bytes, block_size: int = DELTA_BLOCK_SIZE) -> bytes:
+    """Encode target as COPY/INSERT operations against source
+
+    Source blocks are indexed at block_size alignment and every target
+    offset is looked up, so code that moved by any number of bytes is still
+    found. Matches are extended in both directions, then sent as COPYs of
+    at most DELTA_MAX_COPY bytes.
+    """
+    index: Dict[bytes, int] = {}
+    for offset in range(0, len(source) - block_size + 1, block_size):
+        index.setdefault(source[offset:offset + block_size], offset)
+
+    out = bytearray()
+    literal_start = 0
+    t = 0
+    while t + block_size <= len(target):
+        s = index.get(target[t:t + block_size])
+        if s is None:
+            t += 1
+            continue
+
+        back = 0
+        while back < t - literal_start and back < s and source[s - back - 1] == target[t - back - 1]:
+            back += 1
+        start_s, start_t = s - back, t - back
+        length = back + block_size
+        length += _common_length(source, start_s + length, target, start_t + length)
+
+        _emit_insert(out, target[literal_start:start_t])
+        for offset in range(0, length, DELTA_MAX_COPY):
+            out += _DELTA_COPY.pack(DELTA_OP_COPY, start_s + offset, min(DELTA_MAX_COPY, length - offset))
+        t = literal_start = start_t + length
+
+    _emit_insert(out, target[literal_start:])
+    return bytes(out)
+
+
+def apply_delta(source: bytes, delta: bytes) -> bytes:
+    """Rebuild the target image from source and a delta (same algorithm as the firmware)"""
+    out = bytearray()
+    pos = 0
+    while pos < len(delta):
+        op = delta[pos]
+        if op == DELTA_OP_COPY and pos + _DELTA_COPY.size <= len(delta):
+            _, offset, length = _DELTA_COPY.unpack_from(delta, pos)
+            if offset + length > len(source):
+                raise DeltaError(f"COPY past the end of the source at {pos}")
+            out += source[offset:offset + length]
+            pos += _DELTA_COPY.size
+        elif op == DELTA_OP_INSERT and pos + _DELTA_INSERT.size <= len(delta):
+            _, length = _DELTA_INSERT.unpack_from(delta, pos)
+            pos += _DELTA_INSERT.size
+            if pos + length > len(delta):
+                raise DeltaError(f"INSERT past the end of the delta at {pos}")
+            out += delta[pos:pos + length]
+            pos += length
+        else:
+            raise DeltaError(f"Invalid delta operation 0x{op:02x} at {pos}")
+    return bytes(out)
+
+
+@dataclass
+class FirmwareUpdate:
+    """What to send to move a device from one firmware version to another"""
+    version: str
+    mode: str                           # "delta" or "full"
+    data: bytes                         # Delta stream or the full image
+    image_size: int
+    sha256: str                         # Digest of the target image
+    source_version: Optional[str] = None
+    source_size: Optional[int] = None
+    source_sha256: Optional[str] = None  # Digest of the image the delta applies to
+
+
+class FirmwareStore:
+    """Firmware images by version, with a cache of the deltas between them"""
+
+    def __init__(self, firmware_dir: str = "firmware"):
+        self.firmware_dir = Path(firmware_dir)
+        self._deltas: Dict[Tuple[str, str], bytes] = {}
+
+    def _image_path(self, version: str) -> Path:
+        if not version or "/" in version or "\\" in version or version.startswith("."):
+            raise ValueError(f"Invalid firmware version: {version!r}")
+        return self.firmware_dir / f"{version}.bin"
+
+    def list_versions(self) -> List[str]:
+        """Versions with an image in the firmware directory"""
+        if not self.firmware_dir.is_dir():
+            return []
+        return sorted(path.stem for path in self.firmware_dir.glob("*.bin"))
+
+    def image(self, version: str) -> Optional[bytes]:
+        """Full image of a version, or None if it is not stored"""
+        path = self._image_path(version)
+        return path.read_bytes() if path.is_file() else None
+
+    def _delta(self, source_version: str, target_version: str, source: bytes, target: bytes) -> bytes:
+        key = (source_version, target_version)
+        if key in self._deltas:
+            return self._deltas[key]
+
+        cache_path = self.firmware_dir / "deltas" / f"{source_version}_to_{target_version}.delta"
+        delta = cache_path.read_bytes() if cache_path.is_file() else None
+        try:
+            stale = delta is None or apply_delta(source, delta) != target
+        except DeltaError:
+            stale = True
+        if stale:
+            delta = compute_delta(source, target)
+            # Never hand out a delta that does not rebuild the image
+            if apply_delta(source, delta) != target:
+                raise DeltaError(f"Delta {source_version} -> {target_version} does not rebuild the image")
+            cache_path.parent.mkdir(parents=True, exist_ok=True)
+            cache_path.write_bytes(delta)
+            logger.info(f"Computed delta {source_version} -> {target_version}: "
+                        f"{len(delta)} bytes for a {len(target)} byte image")
+
+        self._deltas[key] = delta
+        return delta
+
+    def update_for(self, source_version: Optional[str], target_version: str) -> FirmwareUpdate:
+        """Pick the smallest transfer that moves a device from source_version to target_version"""
+        target = self.image(target_version)
+        if target is None:
+            raise ValueError(f"No firmware image for version {target_version}")
+
+        update = FirmwareUpdate(version=target_version, mode="full", data=target, image_size=len(target),
+                                sha256=hashlib.sha256(target).hexdigest())
+
+        source = self.image(source_version) if source_version else None
+        if source is not None:
+            delta = self._delta(source_version, target_version, source, target)
+            if len(delta) < len(target):
+                update.mode = "delta"
+                update.data = delta
+                update.source_version = source_version
+                update.source_size = len(source)
+                update.source_sha256 = hashlib.sha256(source).hexdigest()
+        return update
@@ -31,7 +31,10 @@ class MCPServerManager:
             "get_alerts": self.get_alerts,
             "get_system_status": self.get_system_status,
             "get_device_metrics": self.get_device_metrics,
-            "ping_device": self.ping_device
+            "ping_device": self.ping_device,
+            "set_device_config": self.set_device_config,
+            "set_device_rules": self.set_device_rules,
+            "update_device_firmware": self.update_device_firmware
         }
     
     async def handle_tool_call(self, tool_name: str, arguments: Dict[str, Any]) -> Dict[str, Any]:
@@ -58,6 +61,7 @@ class MCPServerManager:
             device_info = {
                 "device_id": device.device_id,
                 "is_online": device.online,
+                "gateway_id": device.gateway_id,
                 "last_seen": device.last_seen.isoformat() if device.last_seen else None,
                 "sensors": list(device.sensor_readings.keys()),
                 "actuators": list(device.actuator_states.keys()),
@@ -68,12 +72,23 @@ class MCPServerManager:
         return device_list
     
     async def read_sensor(self, device_id: str, sensor_type: str, 
-                         history_minutes: int = 0) -> Dict[str, Any]:
-        """Read current sensor data with optional history"""
+                         history_minutes: int = 0, fresh: bool = False,
+                         timeout_seconds: float = 2.0) -> Dict[str, Any]:
+        """Read current sensor data with optional history
+        
+        With fresh=True the device reads the sensor immediately instead of
+        returning the last scheduled reading; if it does not answer within
+        timeout_seconds the cached value is returned with "fresh": False.
+        """
         device = self.device_manager.get_device(device_id)
         if not device:
             raise ValueError(f"Device {device_id} not found")
         
+        # Ask the device for a reading now; its response replaces the cached one
+        fresh_response = None
+        if fresh and self.bridge and hasattr(self.bridge, 'request_sensor_read'):
+            fresh_response = await self.bridge.request_sensor_read(device_id, sensor_type, timeout_seconds)
+        
         # Get current reading
         current_reading = device.sensor_readings.get(sensor_type)
         if not current_reading:
@@ -87,6 +102,13 @@ class MCPServerManager:
             "timestamp": current_reading.timestamp.isoformat(),
             "quality": current_reading.quality
         }
+        if current_reading.channels is not None:
+            result["channels"] = current_reading.channels
+        
+        if fresh:
+            result["fresh"] = bool(fresh_response and fresh_response.get("status") == "ok")
+            if not result["fresh"]:
+                result["fresh_error"] = (fresh_response or {}).get("error", "no response from device")
         
         # Add historical data if requested
         if history_minutes > 0:
@@ -97,7 +119,8 @@ class MCPServerManager:
                 {
                     "value": reading["value"],
                     "timestamp": reading["timestamp"],
-                    "unit": reading["unit"]
+                    "unit": reading["unit"],
+                    **({"channels": reading["channels"]} if reading.get("channels") else {})
                 }
                 for reading in history
             ]
@@ -213,29 +236,35 @@ class MCPServerManager:
         if not metrics:
             return {"device_id": device_id, "error": "No metrics available"}
         
-        return {
+        result = {
             "device_id": device_id,
             "messages_sent": metrics.messages_sent,
             "messages_received": metrics.messages_received,
             "connection_failures": metrics.connection_failures,
             "sensor_read_errors": metrics.sensor_read_errors,
             "last_activity": metrics.last_activity.isoformat(),
-            "uptime_seconds": metrics.uptime_seconds
+            "uptime_seconds": metrics.uptime_seconds,
+            "latency": metrics.latency_stats(),
+            "sequence": metrics.sequence_stats()
         }
+        if device.health:
+            # What the device itself reported in its last health record
+            result["device_health"] = {key: device.health.get(key) 
+                                       for key in ("uptime_s", "heap", "counters", "rssi")}
+        return result
     
     async def ping_device(self, device_id: str, timeout_seconds: int = 5) -> Dict[str, Any]:
-        """Ping a device to check if it's responsive
+        """Ping a device to measure its round-trip latency
         
         Args:
             device_id: ID of the device to ping
             timeout_seconds: How long to wait for response (default: 5 seconds)
             
         Returns:
-            Dict with ping results including response time and status
+            Dict with the ping status, round-trip time, the device clock offset
+            (once the device time is synchronized) and latency statistics
         """
-        import asyncio
-        import time
-        from .timezone_utils import utc_now, utc_isoformat
+        from .timezone_utils import utc_isoformat
         
         # Check if device exists
         device = self.device_manager.get_device(device_id)
@@ -247,19 +276,7 @@ class MCPServerManager:
                 "timestamp": utc_isoformat()
             }
         
-        # Generate unique ping ID for tracking response
-        ping_id = f"ping_{int(time.time() * 1000)}"
-        start_time = time.time()
-        
-        # Prepare ping command
-        ping_command = {
-            "action": "ping",
-            "ping_id": ping_id,
-            "timestamp": utc_now().timestamp()
-        }
-        
-        # Check if bridge is available for MQTT communication
-        if not self.bridge or not hasattr(self.bridge, 'mqtt'):
+        if not self.bridge or not hasattr(self.bridge, 'ping_device'):
             return {
                 "device_id": device_id,
                 "status": "error",
@@ -267,62 +284,160 @@ class MCPServerManager:
                 "timestamp": utc_isoformat()
             }
         
-        # Record device state before ping
-        last_seen_before = device.last_seen
-        
         try:
-            # Send ping command via MQTT
-            command_topic = f"devices/{device_id}/cmd"
-            success = await self.bridge.mqtt.publish(command_topic, ping_command)
-            
-            if not success:
-                return {
-                    "device_id": device_id,
-                    "status": "send_failed",
-                    "message": "Failed to send ping command to device",
-                    "timestamp": utc_isoformat()
-                }
-            
-            # Wait a moment and check if device responded
-            await asyncio.sleep(min(timeout_seconds, 3))  # Wait up to 3 seconds
-            
-            # Check if device's last_seen was updated (indicating it responded)
-            device_after = self.device_manager.get_device(device_id)
-            if device_after and device_after.last_seen > last_seen_before:
-                response_time = (time.time() - start_time) * 1000  # Convert to milliseconds
-                
-                return {
-                    "device_id": device_id,
-                    "status": "online",
-                    "response_time_ms": round(response_time, 2),
-                    "message": f"Device responded to ping (detected via activity)",
-                    "ping_id": ping_id,
-                    "last_seen": utc_isoformat(device_after.last_seen),
-                    "timestamp": utc_isoformat()
-                }
-            else:
-                # Check current online status
-                if device.online:
-                    return {
-                        "device_id": device_id,
-                        "status": "assumed_online",
-                        "message": "Device marked as online but no ping response detected",
-                        "last_seen": utc_isoformat(device.last_seen) if device.last_seen else None,
-                        "timestamp": utc_isoformat()
-                    }
-                else:
-                    return {
-                        "device_id": device_id,
-                        "status": "offline",
-                        "message": "Device appears to be offline",
-                        "last_seen": utc_isoformat(device.last_seen) if device.last_seen else None,
-                        "timestamp": utc_isoformat()
-                    }
-                
+            result = await self.bridge.ping_device(device_id, timeout_seconds)
         except Exception as e:
             return {
                 "device_id": device_id,
                 "status": "error",
                 "message": f"Ping failed: {str(e)}",
                 "timestamp": utc_isoformat()
-            } 
\ No newline at end of file
+            }
+        
+        if result["status"] == "timeout":
+            result["status"] = "no_response" if device.online else "offline"
+            result["last_seen"] = utc_isoformat(device.last_seen) if device.last_seen else None
+        
+        metrics = self.device_manager.device_metrics.get(device_id)
+        return {
+            "device_id": device_id,
+            **result,
+            "latency": metrics.latency_stats() if metrics else None,
+            "timestamp": utc_isoformat()
+        }
+    
+    async def set_device_config(self, device_ids: Optional[List[str]] = None,
+                                device_id: Optional[str] = None,
+                                sensor_publish_interval_ms: Optional[int] = None,
+                                deadband: Optional[float] = None,
+                                sensor_deadbands: Optional[Dict[str, float]] = None,
+                                log_level: Optional[int] = None,
+                                qos: Optional[Dict[str, int]] = None,
+                                timeout_seconds: int = 10) -> Dict[str, Any]:
+        """Push live configuration to one or more devices without a reconnect
+        
+        Args:
+            device_ids: Devices to configure (or device_id for a single one)
+            sensor_publish_interval_ms: Sensor publish interval (100 - 86400000)
+            deadband: Skip readings closer than this to the last published value
+            sensor_deadbands: Per sensor type deadbands, replacing any earlier ones
+            log_level: ESP log level (0=None ... 5=Verbose)
+            qos: QoS per message class, e.g. {"sensor": 0, "actuator": 1}
+            timeout_seconds: How long to wait for the devices to acknowledge
+            
+        Returns:
+            Dict with the pushed config and the per-device result
+            (applied, rejected, stale, unchanged, timeout, send_failed, not_found)
+        """
+        targets = device_ids or ([device_id] if device_id else [])
+        if not targets:
+            raise ValueError("device_ids or device_id is required")
+        
+        config = {
+            key: value for key, value in {
+                "sensor_publish_interval_ms": sensor_publish_interval_ms,
+                "deadband": deadband,
+                "sensor_deadbands": sensor_deadbands,
+                "log_level": log_level,
+                "qos": qos
+            }.items() if value is not None
+        }
+        if not config:
+            raise ValueError("No configuration fields given")
+        
+        if not self.bridge or not hasattr(self.bridge, 'push_device_config'):
+            raise ValueError("MQTT bridge not available for configuration")
+        
+        known = [d for d in targets if self.device_manager.get_device(d)]
+        results = await self.bridge.push_device_config(known, config, timeout_seconds)
+        for missing in (d for d in targets if d not in results):
+            results[missing] = {"status": "not_found"}
+        
+        return {
+            "config": config,
+            "devices": results,
+            "applied": sum(1 for r in results.values() if r["status"] in ("applied", "unchanged")),
+            "total_devices": len(targets)
+        }
+    
+    async def set_device_rules(self, rules: List[Dict[str, Any]],
+                               device_ids: Optional[List[str]] = None,
+                               device_id: Optional[str] = None,
+                               timeout_seconds: int = 10) -> Dict[str, Any]:
+        """Replace the device-side rule table of one or more devices
+        
+        Rules run on the device right after each read of their sensor, so the
+        actuator reacts without a round trip and keeps reacting while the
+        device is offline. Each rule is
+        {"id", "sensor", "op": ">" or "<", "threshold", "hysteresis",
+         "actuator", "action", "value", "clear_action", "clear_value"};
+        "channel" picks a channel of a multi-channel sensor. The action runs
+        when the condition starts to hold, the clear action once the reading
+        is back past the threshold by the hysteresis.
+        
+        Args:
+            rules: Complete rule table (an empty list removes all rules)
+            device_ids: Devices to program (or device_id for a single one)
+            timeout_seconds: How long to wait for the devices to acknowledge
+            
+        Returns:
+            Dict with the per-device result
+            (applied, rejected, stale, unchanged, timeout, send_failed, not_found)
+        """
+        targets = device_ids or ([device_id] if device_id else [])
+        if not targets:
+            raise ValueError("device_ids or device_id is required")
+        if not isinstance(rules, list):
+            raise ValueError("rules must be a list")
+        
+        if not self.bridge or not hasattr(self.bridge, 'push_device_rules'):
+            raise ValueError("MQTT bridge not available for rules")
+        
+        known = [d for d in targets if self.device_manager.get_device(d)]
+        results = await self.bridge.push_device_rules(known, rules, timeout_seconds)
+        for missing in (d for d in targets if d not in results):
+            results[missing] = {"status": "not_found"}
+        
+        return {
+            "rules": len(rules),
+            "devices": results,
+            "applied": sum(1 for r in results.values() if r["status"] in ("applied", "unchanged")),
+            "total_devices": len(targets)
+        }
+    
+    async def update_device_firmware(self, version: str,
+                                     device_ids: Optional[List[str]] = None,
+                                     device_id: Optional[str] = None,
+                                     timeout_seconds: int = 900) -> Dict[str, Any]:
+        """Update the firmware of one or more devices over MQTT
+        
+        Each device receives a delta against the firmware version it runs
+        when that image is in the firmware store, the full image otherwise.
+        The device checks the image digest before switching to it and
+        restarts into the new version.
+        
+        Args:
+            version: Target firmware version ({version}.bin in the firmware directory)
+            device_ids: Devices to update (or device_id for a single one)
+            timeout_seconds: How long a single device update may take
+            
+        Returns:
+            Dict with the per-device result (done, failed, up_to_date, timeout,
+            send_failed, not_found, error), transfer mode, bytes and duration
+        """
+        targets = device_ids or ([device_id] if device_id else [])
+        if not targets:
+            raise ValueError("device_ids or device_id is required")
+        
+        if not self.bridge or not hasattr(self.bridge, 'update_firmware'):
+            raise ValueError("MQTT bridge not available for firmware updates")
+        
+        results = await self.bridge.update_firmware(targets, version, timeout_seconds)
+        
+        return {
+            "version": version,
+            "devices": results,
+            "updated": sum(1 for r in results.values() if r["status"] in ("done", "up_to_date")),
+            "transfer_bytes": sum(r.get("transfer_bytes", 0) for r in results.values()),
+            "total_devices": len(targets)
+        }
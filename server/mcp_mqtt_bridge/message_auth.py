@@ -0,0 +1,229 @@
+"""
+Per-message authentication of device messages (enable_device_auth).
+
+Authenticated devices append a trailer to every payload:
+  payload, u32 counter (little-endian), tag[tag_len]
+where tag = HMAC-SHA256(key, topic || 0x00 || payload || counter), truncated.
+The counter increases with every message, across reboots too, so replays
+are rejected with a sliding window that still accepts messages reordered
+between QoS levels. The newest counter of every key is saved to a counter
+store (the database) at most once per flush interval and on shutdown, so a
+restarted server still rejects messages captured before the restart.
+
+Keys are per device. A gateway signs its children's messages with its own
+key and counter, so children are listed with the gateway's key; replay
+state is kept per key, not per device ID.
+"""
+
+import hashlib
+import hmac
+import json
+import logging
+import struct
+import threading
+import time
+from dataclasses import dataclass, field
+from pathlib import Path
+from typing import Dict, List, Optional, Protocol, Sequence, Set, Tuple, Union
+
+logger = logging.getLogger(__name__)
+
+AUTH_KEY_LEN = 32
+AUTH_TAG_LEN = 12                   # CONFIG_MCP_BRIDGE_AUTH_TAG_LEN
+REPLAY_WINDOW = 64                  # Counters this far behind the newest are still accepted once
+COUNTER_FLUSH_INTERVAL = 1.0        # Seconds between saves of the newest counters
+
+_COUNTER = struct.Struct("<I")
+
+
+class AuthError(ValueError):
+    """Raised when a message fails authentication"""
+
+
+class CounterStore(Protocol):
+    """Persists the newest accepted counter per device ID"""
+
+    def load_auth_counters(self) -> Dict[str, int]: ...
+
+    def store_auth_counters(self, counters: Dict[str, int]) -> None: ...
+
+
+@dataclass
+class _KeyState:
+    """Keyed HMAC state and replay window of one key"""
+    inner: "hashlib._Hash"          # SHA-256 after the key's ipad block, copied per message
+    outer: "hashlib._Hash"          # SHA-256 after the key's opad block
+    highest: int = 0                # Newest counter accepted
+    seen: int = 0                   # Bit n: highest - n was accepted
+    accepted: int = 0
+    rejected: int = 0
+    replayed: int = 0
+    devices: List[str] = field(default_factory=list)
+
+
+def sign_message(key: bytes, topic: str, payload: bytes, counter: int,
+                 tag_len: int = AUTH_TAG_LEN) -> bytes:
+    """Append counter and tag to a payload (same layout as the firmware)"""
+    body = payload + _COUNTER.pack(counter)
+    tag = hmac.new(key, topic.encode() + b"\0" + body, hashlib.sha256).digest()[:tag_len]
+    return body + tag
+
+
+class MessageAuthenticator:
+    """Verifies and strips the authentication trailer of device messages"""
+
+    def __init__(self, keys: Optional[Dict[str, bytes]] = None, tag_len: int = AUTH_TAG_LEN,
+                 window: int = REPLAY_WINDOW, counter_store: Optional[CounterStore] = None,
+                 flush_interval: float = COUNTER_FLUSH_INTERVAL):
+        if not 8 <= tag_len <= 32:
+            raise ValueError(f"Invalid tag length: {tag_len}")
+        self.tag_len = tag_len
+        self.window = window
+        self._window_mask = (1 << window) - 1
+        self._trailer_len = _COUNTER.size + tag_len
+        self._devices: Dict[str, _KeyState] = {}
+        self._states: Dict[bytes, _KeyState] = {}
+        self._lock = threading.Lock()
+        self._counter_store = counter_store
+        self._saved_counters = counter_store.load_auth_counters() if counter_store else {}
+        self._flush_interval = flush_interval
+        self._last_flush = time.monotonic()
+        self._dirty: Set[int] = set()
+        for device_id, key in (keys or {}).items():
+            self.add_key(device_id, key)
+
+    @classmethod
+    def from_file(cls, path: str, tag_len: int = AUTH_TAG_LEN,
+                  counter_store: Optional[CounterStore] = None) -> "MessageAuthenticator":
+        """Load keys from a JSON object mapping device IDs to hex keys"""
+        keys = json.loads(Path(path).read_text())
+        return cls({device_id: bytes.fromhex(key) for device_id, key in keys.items()}, tag_len,
+                   counter_store=counter_store)
+
+    def add_key(self, device_id: str, key: bytes):
+        """Set a device's key; a new key starts with the window saved for the device, if any"""
+        if len(key) != AUTH_KEY_LEN:
+            raise ValueError(f"Key for {device_id} must be {AUTH_KEY_LEN} bytes")
+        with self._lock:
+            state = self._states.get(key)
+            if state is None:
+                # HMAC with the pad blocks hashed once; per message only C-level hash copies remain
+                block = key.ljust(64, b"\0")
+                state = self._states[key] = _KeyState(hashlib.sha256(bytes(b ^ 0x36 for b in block)),
+                                                      hashlib.sha256(bytes(b ^ 0x5c for b in block)))
+            saved = self._saved_counters.get(device_id, 0)
+            if saved > state.highest:
+                # Which counters just below the saved one arrived is not known; treat all as seen
+                state.highest = saved
+                state.seen = self._window_mask
+            state.devices.append(device_id)
+            self._devices[device_id] = state
+
+    def has_key(self, device_id: str) -> bool:
+        return device_id in self._devices
+
+    def _accept_counter(self, state: _KeyState, counter: int) -> bool:
+        """Sliding window replay check (caller holds the lock)"""
+        if counter > state.highest:
+            shift = counter - state.highest
+            state.seen = ((state.seen << shift) | 1) & self._window_mask if shift < self.window else 1
+            state.highest = counter
+            self._dirty.add(id(state))
+            return True
+        offset = state.highest - counter
+        if offset >= self.window or state.seen & (1 << offset):
+            return False
+        state.seen |= 1 << offset
+        return True
+
+    def verify(self, device_id: str, topic: str, payload: bytes, check_replay: bool = True) -> bytes:
+        """Verify one message and return its payload without the trailer
+
+        check_replay=False is for retained messages, which the broker
+        legitimately delivers again with their original counter.
+        """
+        result, = self.verify_batch([(device_id, topic, payload, check_replay)])
+        if isinstance(result, AuthError):
+            raise result
+        return result
+
+    def verify_batch(self, messages: Sequence[Tuple[str, str, bytes, bool]]) -> List[Union[bytes, AuthError]]:
+        """Verify (device_id, topic, payload, check_replay) messages in order
+
+        Returns each payload without its trailer, or the AuthError that
+        rejects it. Tags are checked in one pass; the replay window is
+        updated under a single lock acquisition and the counter store
+        flushed at most once per batch, so the per-message cost is little
+        more than the two hash copies.
+        """
+        tag_len = self.tag_len
+        trailer_len = self._trailer_len
+        counter_end = _COUNTER.size + tag_len
+        devices = self._devices
+        compare_digest = hmac.compare_digest
+        unpack_counter = _COUNTER.unpack_from
+        results: List[Union[bytes, AuthError]] = []
+        fresh: List[Tuple[int, _KeyState, int]] = []
+        for device_id, topic, payload, check_replay in messages:
+            state = devices.get(device_id)
+            if state is None:
+                results.append(AuthError(f"No key for {device_id}"))
+                continue
+            if len(payload) < trailer_len:
+                state.rejected += 1
+                results.append(AuthError("Missing authentication trailer"))
+                continue
+            inner = state.inner.copy()
+            inner.update(topic.encode() + b"\0" + payload[:-tag_len])
+            outer = state.outer.copy()
+            outer.update(inner.digest())
+            if not compare_digest(outer.digest()[:tag_len], payload[-tag_len:]):
+                state.rejected += 1
+                results.append(AuthError("Invalid authentication tag"))
+                continue
+            if check_replay:
+                fresh.append((len(results), state, unpack_counter(payload, len(payload) - counter_end)[0]))
+            else:
+                state.accepted += 1
+            results.append(payload[:-counter_end])
+
+        if fresh:
+            accept_counter = self._accept_counter
+            with self._lock:
+                for index, state, counter in fresh:
+                    if accept_counter(state, counter):
+                        state.accepted += 1
+                    else:
+                        state.replayed += 1
+                        results[index] = AuthError(f"Replayed message (counter {counter})")
+            if self._counter_store and time.monotonic() - self._last_flush >= self._flush_interval:
+                self.flush()
+        return results
+
+    def flush(self):
+        """Save the newest counter of every key that accepted messages since the last flush
+
+        Messages accepted after the last flush are the only ones a restart
+        can let through again.
+        """
+        if not self._counter_store:
+            return
+        with self._lock:
+            self._last_flush = time.monotonic()
+            counters = {device_id: state.highest for state in self._states.values()
+                        if id(state) in self._dirty for device_id in state.devices}
+            self._dirty.clear()
+        if counters:
+            self._counter_store.store_auth_counters(counters)
+
+    def stats(self, device_id: str) -> Optional[Dict[str, int]]:
+        """Counters of the key the device signs with (shared by a gateway's children)"""
+        state = self._devices.get(device_id)
+        if state is None:
+            return None
+        return {
+            "accepted": state.accepted,
+            "rejected": state.rejected,
+            "replayed": state.replayed,
+            "last_counter": state.highest
+        }
@@ -4,11 +4,33 @@ MQTT client management for the MCP-MQTT bridge.
 
 import json
 import logging
-from typing import Dict, Callable, Any, Optional, List
+import queue
+import threading
+from typing import Dict, Callable, Any, Optional, List, Union
 import paho.mqtt.client as mqtt
 
+from .payload_codec import decode_payload, PayloadDecodeError
+from .message_auth import AuthError, MessageAuthenticator
+
 logger = logging.getLogger(__name__)
 
+PROTOCOL_VERSIONS = {
+    "5": mqtt.MQTTv5,
+    "3.1.1": mqtt.MQTTv311,
+}
+
+# CONNACK reason code for "Unsupported protocol version" (v5); paho maps a
+# v3.1.1 broker's return code 1 onto it as well
+_UNSUPPORTED_PROTOCOL_VERSION = 132
+
+# Messages the ingest worker authenticates, decodes and routes per batch
+INGEST_BATCH_MAX = 256
+# Messages waiting for the worker beyond this are dropped (and counted)
+INGEST_QUEUE_MAX = 100000
+
+# The broker sends the last will on the device's behalf, so it cannot carry a fresh counter
+_LAST_WILL_PAYLOAD = b'{"value":"offline"}'
+
 
 class MQTTManager:
     """Manages MQTT client and message handling"""
@@ -16,24 +38,61 @@ class MQTTManager:
     def __init__(self, broker: str, port: int = 1883, 
                  username: Optional[str] = None, 
                  password: Optional[str] = None,
-                 client_id: str = "mcp_bridge_server"):
+                 client_id: str = "mcp_bridge_server",
+                 protocol: str = "5",
+                 authenticator: Optional[MessageAuthenticator] = None,
+                 require_auth: bool = False):
+        if protocol not in PROTOCOL_VERSIONS:
+            raise ValueError(f"Unsupported MQTT protocol version: {protocol}")
+        
         self.broker = broker
         self.port = port
         self.client_id = client_id
-        self.client = mqtt.Client(mqtt.CallbackAPIVersion.VERSION2, client_id=client_id)
-        
-        if username and password:
-            self.client.username_pw_set(username, password)
-        
-        self.client.on_connect = self._on_connect
-        self.client.on_message = self._on_message
-        self.client.on_disconnect = self._on_disconnect
-        self.client.on_log = self._on_log
+        self.username = username
+        self.password = password
+        self.protocol = protocol
+        self.authenticator = authenticator
+        self.require_auth = require_auth
+        self.client = self._create_client()
         
         self.message_handlers: Dict[str, Callable] = {}
         self.connected = False
         self._connection_callbacks: List[Callable] = []
         self._disconnection_callbacks: List[Callable] = []
+        
+        # paho's network thread only queues messages; a worker handles them in batches
+        self._ingest_queue: "queue.SimpleQueue[Optional[tuple]]" = queue.SimpleQueue()
+        self._ingest_stop = threading.Event()
+        self._ingest_thread: Optional[threading.Thread] = None
+        self.ingest_dropped = 0
+    
+    def _create_client(self) -> mqtt.Client:
+        """Create a paho client for the configured protocol version"""
+        client = mqtt.Client(mqtt.CallbackAPIVersion.VERSION2, client_id=self.client_id,
+                             protocol=PROTOCOL_VERSIONS[self.protocol])
+        
+        if self.username and self.password:
+            client.username_pw_set(self.username, self.password)
+        
+        client.on_connect = self._on_connect
+        client.on_message = self._on_message
+        client.on_disconnect = self._on_disconnect
+        client.on_log = self._on_log
+        return client
+    
+    def _fallback_to_v311(self):
+        """Reconnect with MQTT v3.1.1 after the broker refused v5"""
+        old_client = self.client
+        old_client.loop_stop()
+        old_client.disconnect()
+        
+        self.protocol = "3.1.1"
+        self.client = self._create_client()
+        try:
+            self.client.connect(self.broker, self.port, 60)
+            self.client.loop_start()
+        except Exception as e:
+            logger.error(f"Failed to reconnect with MQTT v3.1.1: {e}")
     
     def add_connection_callback(self, callback: Callable[[bool], None]):
         """Add callback for connection state changes"""
@@ -45,10 +104,11 @@ class MQTTManager:
     
     async def connect(self):
         """Connect to MQTT broker"""
+        self._start_ingest()
         try:
             self.client.connect(self.broker, self.port, 60)
             self.client.loop_start()
-            logger.info(f"Connecting to MQTT broker at {self.broker}:{self.port}")
+            logger.info(f"Connecting to MQTT broker at {self.broker}:{self.port} (MQTT {self.protocol})")
         except Exception as e:
             logger.error(f"Failed to connect to MQTT broker: {e}")
             raise
@@ -57,6 +117,46 @@ class MQTTManager:
         """Disconnect from MQTT broker"""
         self.client.loop_stop()
         self.client.disconnect()
+        self._stop_ingest()
+    
+    def _start_ingest(self):
+        """Start the worker that handles received MQTT messages"""
+        if self._ingest_thread and self._ingest_thread.is_alive():
+            return
+        self._ingest_stop.clear()
+        self._ingest_thread = threading.Thread(target=self._ingest_loop, name="mqtt-ingest", daemon=True)
+        self._ingest_thread.start()
+    
+    def _stop_ingest(self):
+        """Handle the messages still queued, then stop the worker"""
+        if not self._ingest_thread:
+            return
+        self._ingest_stop.set()
+        self._ingest_queue.put(None)
+        self._ingest_thread.join(timeout=5)
+        self._ingest_thread = None
+    
+    def _ingest_loop(self):
+        """Worker: wait for a message, then handle everything queued behind it"""
+        while not self._ingest_stop.is_set():
+            self._drain_ingest([self._ingest_queue.get()])
+    
+    def _drain_ingest(self, batch: Optional[list] = None):
+        """Handle every queued message, INGEST_BATCH_MAX at a time"""
+        batch = batch or []
+        get = self._ingest_queue.get_nowait
+        while True:
+            try:
+                while len(batch) < INGEST_BATCH_MAX:
+                    batch.append(get())
+            except queue.Empty:
+                pass
+            messages = [message for message in batch if message is not None]
+            if messages:
+                self.handle_messages(messages)
+            if len(batch) < INGEST_BATCH_MAX:
+                return
+            batch = []
     
     def _on_log(self, client, userdata, level, buf):
         """MQTT client logging callback"""
@@ -71,10 +171,19 @@ class MQTTManager:
             # Subscribe to all device topics
             subscriptions = [
                 ("devices/+/capabilities", 1),
+                ("devices/+/capabilities/announce", 1),
                 ("devices/+/sensors/+/data", 0),
+                ("devices/+/batch", 0),
+                ("devices/+/sensors/+/response", 1),
                 ("devices/+/actuators/+/status", 1),
                 ("devices/+/status", 1),
-                ("devices/+/error", 1)
+                ("devices/+/error", 1),
+                ("devices/+/health", 0),
+                ("devices/+/pong", 0),
+                ("devices/+/config/ack", 1),
+                ("devices/+/rules/ack", 1),
+                ("devices/+/rules/fired", 1),
+                ("devices/+/ota/status", 1)
             ]
             
             for topic, qos in subscriptions:
@@ -88,6 +197,10 @@ class MQTTManager:
                 except Exception as e:
                     logger.error(f"Error in connection callback: {e}")
                     
+        elif self.protocol == "5" and rc == _UNSUPPORTED_PROTOCOL_VERSION:
+            # Paho's loop thread cannot stop itself, so switch clients from another thread
+            logger.warning("Broker does not support MQTT v5, falling back to v3.1.1")
+            threading.Thread(target=self._fallback_to_v311, daemon=True).start()
         else:
             logger.error(f"Connection failed with code {rc}")
             for callback in self._connection_callbacks:
@@ -111,11 +224,67 @@ class MQTTManager:
             except Exception as e:
                 logger.error(f"Error in disconnection callback: {e}")
     
+    def _authenticate(self, messages: List[tuple]) -> List[Optional[bytes]]:
+        """Verify and strip the authentication trailers of a batch; None drops a message
+        
+        Devices without a key pass unchanged unless require_auth is set.
+        """
+        results: List[Optional[bytes]] = []
+        signed = []
+        for topic, data, _, retain in messages:
+            parts = topic.split('/')
+            device_id = parts[1] if len(parts) >= 3 and parts[0] == "devices" else None
+            if device_id is None or not self.authenticator.has_key(device_id):
+                if self.require_auth:
+                    logger.warning(f"Dropped unauthenticated message on {topic}")
+                    data = None
+            elif not (parts[2] == "status" and data == _LAST_WILL_PAYLOAD):
+                # Retained messages are legitimately delivered again with their old counter
+                signed.append((len(results), (device_id, topic, data, not retain)))
+            results.append(data)
+        
+        if signed:
+            verified = self.authenticator.verify_batch([message for _, message in signed])
+            for (index, (_, topic, _, _)), data in zip(signed, verified):
+                if isinstance(data, AuthError):
+                    logger.warning(f"Dropped message on {topic}: {data}")
+                    data = None
+                results[index] = data
+        return results
+    
     def _on_message(self, client, userdata, msg):
         """MQTT message callback"""
+        if self._ingest_queue.qsize() >= INGEST_QUEUE_MAX:
+            self.ingest_dropped += 1
+            if self.ingest_dropped % 1000 == 1:
+                logger.warning(f"Ingest queue full, dropped {self.ingest_dropped} messages so far")
+            return
+        content_type = getattr(msg.properties, "ContentType", None) if msg.properties else None
+        self._ingest_queue.put((msg.topic, msg.payload, content_type, getattr(msg, "retain", False)))
+    
+    def handle_message(self, topic: str, data: bytes, content_type: Optional[str] = None,
+                       retain: bool = False):
+        """Authenticate, decode and route one device message (the CoAP listener's entry point)"""
+        self.handle_messages([(topic, data, content_type, retain)])
+    
+    def handle_messages(self, messages: List[tuple]):
+        """Authenticate, decode and route (topic, data, content_type, retain) messages in order
+        
+        Authentication runs once over the whole batch.
+        """
+        try:
+            verified = self._authenticate(messages) if self.authenticator else [data for _, data, _, _ in messages]
+        except Exception as e:
+            logger.error(f"Error authenticating {len(messages)} messages: {e}")
+            return
+        for (topic, _, content_type, _), data in zip(messages, verified):
+            if data is not None:
+                self._route(topic, data, content_type)
+    
+    def _route(self, topic: str, data: bytes, content_type: Optional[str]):
+        """Decode one message and hand it to the handler of its topic pattern"""
         try:
-            topic = msg.topic
-            payload = json.loads(msg.payload.decode())
+            payload = decode_payload(data, content_type)
             
             logger.debug(f"Received message on {topic}: {payload}")
             
@@ -127,16 +296,32 @@ class MQTTManager:
                 message_type = topic_parts[2]
                 
                 # Create handler key for routing
-                if message_type == "sensors" and len(topic_parts) >= 5:
+                if message_type == "sensors" and len(topic_parts) == 5 and topic_parts[4] == "response":
+                    handler_key = "devices/+/sensors/+/response"
+                elif message_type == "sensors" and len(topic_parts) >= 5:
                     handler_key = "devices/+/sensors/+/data"
                 elif message_type == "actuators" and len(topic_parts) >= 5:
                     handler_key = "devices/+/actuators/+/status"
-                elif message_type == "capabilities":
+                elif message_type == "capabilities" and len(topic_parts) == 4 and topic_parts[3] == "announce":
+                    handler_key = "devices/+/capabilities/announce"
+                elif message_type == "capabilities" and len(topic_parts) == 3:
                     handler_key = "devices/+/capabilities"
+                elif message_type == "batch" and len(topic_parts) == 3:
+                    handler_key = "devices/+/batch"
                 elif message_type == "status":
                     handler_key = "devices/+/status"
                 elif message_type == "error":
                     handler_key = "devices/+/error"
+                elif message_type == "health" and len(topic_parts) == 3:
+                    handler_key = "devices/+/health"
+                elif message_type == "pong" and len(topic_parts) == 3:
+                    handler_key = "devices/+/pong"
+                elif message_type == "config" and len(topic_parts) == 4 and topic_parts[3] == "ack":
+                    handler_key = "devices/+/config/ack"
+                elif message_type == "rules" and len(topic_parts) == 4 and topic_parts[3] in ("ack", "fired"):
+                    handler_key = f"devices/+/rules/{topic_parts[3]}"
+                elif message_type == "ota" and len(topic_parts) == 4 and topic_parts[3] == "status":
+                    handler_key = "devices/+/ota/status"
                 else:
                     handler_key = None
                 
@@ -148,8 +333,8 @@ class MQTTManager:
                 else:
                     logger.debug(f"No handler for topic pattern: {topic}")
                     
-        except json.JSONDecodeError:
-            logger.error(f"Invalid JSON in message from {msg.topic}")
+        except PayloadDecodeError as e:
+            logger.error(f"Invalid payload in message from {topic}: {e}")
         except Exception as e:
             logger.error(f"Error processing message: {e}")
     
@@ -160,13 +345,21 @@ class MQTTManager:
     
     async def publish(self, topic: str, payload: Dict[str, Any], qos: int = 0, retain: bool = False) -> bool:
         """Publish a message to MQTT"""
+        return self.publish_nowait(topic, payload, qos, retain)
+    
+    def publish_nowait(self, topic: str, payload: Union[Dict[str, Any], bytes], qos: int = 0,
+                       retain: bool = False) -> bool:
+        """Publish a message to MQTT from synchronous code (e.g. message handlers)
+        
+        Dicts are sent as JSON, bytes as they are (e.g. firmware chunks).
+        """
         if not self.connected:
             logger.warning("Cannot publish - not connected to broker")
             return False
         
         try:
-            json_payload = json.dumps(payload)
-            result = self.client.publish(topic, json_payload, qos, retain)
+            data = bytes(payload) if isinstance(payload, (bytes, bytearray)) else json.dumps(payload)
+            result = self.client.publish(topic, data, qos, retain)
             
             if result.rc == mqtt.MQTT_ERR_SUCCESS:
                 logger.debug(f"Published to {topic}")
@@ -0,0 +1,136 @@
+"""
+Payload encoding for MQTT messages exchanged with ESP32 devices.
+
+Devices connected with MQTT v5 tag messages with a content-type property.
+JSON is the default; sensor data may also be sent as a compact binary record.
+"""
+
+import json
+import struct
+from typing import Any, Dict, List, Optional
+
+CONTENT_TYPE_JSON = "application/json"
+CONTENT_TYPE_SENSOR_BINARY = "application/x-mcp-sensor"
+CONTENT_TYPE_SENSOR_MULTI_BINARY = "application/x-mcp-sensor-multi"
+
+# Sensor record v1 (little-endian): u8 version, f32 reading, u32 timestamp (ms since boot), u8 quality
+# Sensor record v2 (little-endian): u8 version, f32 reading, i64 timestamp (us), u8 flags, u8 quality
+#   flags bit 0: timestamp is Unix epoch time (SNTP synced), otherwise time since boot
+#   flags bit 1: timestamp is the aligned sampling slot the reading was taken on
+# Sensor record v3: v2 followed by u32 boot epoch, u32 per-sensor sequence number
+SENSOR_BINARY_VERSION = 3
+SENSOR_FLAG_TIME_SYNCED = 0x01
+SENSOR_FLAG_ALIGNED = 0x02
+_SENSOR_BINARY_V1 = struct.Struct("<BfIB")
+_SENSOR_BINARY_V2 = struct.Struct("<BfqBB")
+_SENSOR_BINARY_V3 = struct.Struct("<BfqBBII")
+
+# Multi-channel record v1 (little-endian): u8 version, i64 timestamp (us), u8 flags, u8 quality,
+#   u8 count, f32 reading[count]; channel names come from the capabilities document
+# Multi-channel record v2: u32 boot epoch and u32 sequence number after count
+SENSOR_MULTI_BINARY_VERSION = 2
+_SENSOR_MULTI_HEADER_V1 = struct.Struct("<BqBBB")
+_SENSOR_MULTI_HEADER = struct.Struct("<BqBBBII")
+
+
+class PayloadDecodeError(ValueError):
+    """Raised when a message payload cannot be decoded"""
+
+
+def _encode_flags(time_synced: bool, aligned: bool) -> int:
+    return (SENSOR_FLAG_TIME_SYNCED if time_synced else 0) | (SENSOR_FLAG_ALIGNED if aligned else 0)
+
+
+def _timestamp_fields(timestamp_us: int, flags: int) -> Dict[str, Any]:
+    """Timestamp fields of the JSON layout for a v2 or multi-channel record"""
+    synced = bool(flags & SENSOR_FLAG_TIME_SYNCED)
+    message = {"ts_us": timestamp_us, "time_synced": synced}
+    if not synced:
+        message["timestamp"] = timestamp_us // 1000
+    if flags & SENSOR_FLAG_ALIGNED:
+        message["aligned"] = True
+    return message
+
+
+def encode_sensor_binary(reading: float, timestamp_us: int, time_synced: bool = True,
+                         quality: int = 100, aligned: bool = False, boot: int = 0, seq: int = 0) -> bytes:
+    """Encode a sensor reading as a binary record (same layout as the firmware)"""
+    flags = _encode_flags(time_synced, aligned)
+    return _SENSOR_BINARY_V3.pack(SENSOR_BINARY_VERSION, reading, timestamp_us, flags, quality, boot, seq)
+
+
+def decode_sensor_binary(data: bytes) -> Dict[str, Any]:
+    """Decode a binary sensor record into the JSON sensor message layout"""
+    version = data[0] if data else None
+    layouts = {1: _SENSOR_BINARY_V1, 2: _SENSOR_BINARY_V2, 3: _SENSOR_BINARY_V3}
+    if version not in layouts:
+        raise PayloadDecodeError(f"Unsupported sensor record version: {data[:1].hex() or 'empty'}")
+    if len(data) != layouts[version].size:
+        raise PayloadDecodeError(f"Invalid sensor record length: {len(data)}")
+
+    if version == 1:
+        _, reading, timestamp, quality = _SENSOR_BINARY_V1.unpack(data)
+        message = {"timestamp": timestamp}
+    elif version == 2:
+        _, reading, timestamp_us, flags, quality = _SENSOR_BINARY_V2.unpack(data)
+        message = _timestamp_fields(timestamp_us, flags)
+    else:
+        _, reading, timestamp_us, flags, quality, boot, seq = _SENSOR_BINARY_V3.unpack(data)
+        message = _timestamp_fields(timestamp_us, flags)
+        message.update({"boot": boot, "seq": seq})
+
+    message.update({
+        "type": "sensor",
+        "value": {
+            # float32 on the wire; drop the float64 widening noise
+            "reading": float(f"{reading:.7g}"),
+            "quality": quality
+        }
+    })
+    return message
+
+
+def encode_sensor_multi_binary(readings: List[float], timestamp_us: int, time_synced: bool = True,
+                               quality: int = 100, aligned: bool = False, boot: int = 0, seq: int = 0) -> bytes:
+    """Encode a multi-channel reading as a binary record (same layout as the firmware)"""
+    flags = _encode_flags(time_synced, aligned)
+    header = _SENSOR_MULTI_HEADER.pack(SENSOR_MULTI_BINARY_VERSION, timestamp_us, flags, quality, len(readings),
+                                       boot, seq)
+    return header + struct.pack(f"<{len(readings)}f", *readings)
+
+
+def decode_sensor_multi_binary(data: bytes) -> Dict[str, Any]:
+    """Decode a multi-channel record; readings stay a list in channel order"""
+    version = data[0] if data else None
+    header = {1: _SENSOR_MULTI_HEADER_V1, 2: _SENSOR_MULTI_HEADER}.get(version)
+    if header is None or len(data) < header.size:
+        raise PayloadDecodeError(f"Unsupported multi-channel record: {data[:1].hex() or 'empty'}")
+    _, timestamp_us, flags, quality, count, *sequence = header.unpack_from(data)
+    if len(data) != header.size + 4 * count:
+        raise PayloadDecodeError(f"Invalid multi-channel record length: {len(data)}")
+
+    message = _timestamp_fields(timestamp_us, flags)
+    if sequence:
+        message.update({"boot": sequence[0], "seq": sequence[1]})
+    readings = struct.unpack_from(f"<{count}f", data, header.size)
+    message.update({
+        "type": "sensor",
+        "value": {
+            "readings": [float(f"{r:.7g}") for r in readings],
+            "quality": quality
+        }
+    })
+    return message
+
+
+def decode_payload(data: bytes, content_type: Optional[str] = None) -> Dict[str, Any]:
+    """Decode a message payload according to its MQTT v5 content type (JSON if absent)"""
+    if content_type == CONTENT_TYPE_SENSOR_BINARY:
+        return decode_sensor_binary(data)
+    if content_type == CONTENT_TYPE_SENSOR_MULTI_BINARY:
+        return decode_sensor_multi_binary(data)
+
+    try:
+        return json.loads(data.decode())
+    except (UnicodeDecodeError, json.JSONDecodeError) as e:
+        raise PayloadDecodeError(f"Invalid JSON payload: {e}") from e
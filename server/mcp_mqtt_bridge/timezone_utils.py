@@ -6,7 +6,9 @@ across different timezones and server locations.
 """
 
 from datetime import datetime, timezone, timedelta
-from typing import Union, Optional
+from typing import Any, Dict, Union, Optional
+
+_EPOCH = datetime(1970, 1, 1, tzinfo=timezone.utc)
 
 
 def utc_now() -> datetime:
@@ -128,6 +130,52 @@ def ensure_utc(dt: Union[datetime, str, float, int, None], device_boot_time: Opt
         return utc_now()
 
 
+def from_epoch_us(timestamp_us: int) -> datetime:
+    """Convert Unix epoch microseconds to a UTC datetime (exact integer arithmetic)."""
+    return _EPOCH + timedelta(microseconds=int(timestamp_us))
+
+
+def message_timestamp(message: Dict[str, Any], device_boot_time: Optional[datetime] = None) -> datetime:
+    """Get the UTC time a device message was produced.
+    
+    Devices with an SNTP-synchronized clock send epoch microseconds ("ts_us")
+    flagged with "time_synced"; those are converted directly. Anything else
+    falls back to ensure_utc() on the legacy "timestamp" field.
+    
+    Args:
+        message: Decoded device message
+        device_boot_time: Device boot time for milliseconds-since-boot timestamps
+        
+    Returns:
+        UTC datetime object
+    """
+    if message.get("time_synced") is True:
+        timestamp_us = message.get("ts_us")
+        if isinstance(timestamp_us, (int, float)):
+            return from_epoch_us(timestamp_us)
+    return ensure_utc(message.get("timestamp"), device_boot_time)
+
+
+def message_bucket_us(message: Dict[str, Any]) -> Optional[int]:
+    """Get the aligned sampling slot of a device reading, if it has one.
+    
+    Devices with clock-aligned sampling stamp readings taken on a slot with
+    the slot itself ("ts_us", flagged "aligned"), so readings of the same
+    slot from different devices carry the same key.
+    
+    Args:
+        message: Decoded device message
+        
+    Returns:
+        Slot in Unix epoch microseconds, or None for unaligned readings
+    """
+    timestamp_us = message.get("ts_us")
+    if message.get("aligned") is True and message.get("time_synced") is True and \
+            isinstance(timestamp_us, (int, float)):
+        return int(timestamp_us)
+    return None
+
+
 def utc_isoformat(dt: Optional[datetime] = None) -> str:
     """Get UTC ISO format string.
     
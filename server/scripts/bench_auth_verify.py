@@ -0,0 +1,120 @@
+#!/usr/bin/env python3
+"""
+Ingest cost of per-message authentication.
+Runs the server's per-message work on signed sensor messages the way an
+ESP32 bridge device sends them (enable_device_auth) and reports messages per
+second for:
+
+  decode        payload decoding only (no authentication)
+  naive         decode, HMAC keyed from scratch for every message
+  verify        decode, MessageAuthenticator.verify (pre-keyed HMAC state)
+  batch         decode, MessageAuthenticator.verify_batch over batches of
+                --batch messages, as the MQTT ingest worker calls it
+  ingest        MQTTManager receive path without authentication: paho
+                callback, ingest queue, decode, routing to a handler
+  ingest-auth   the same path with authentication (verified in batches)
+
+The authenticated modes are compared with the unauthenticated mode of the
+same path. Needs no broker; socket receive cost is the same in every mode.
+"""
+import sys
+import hmac
+import time
+import hashlib
+import argparse
+from pathlib import Path
+from types import SimpleNamespace
+
+# Add the parent directory to Python path for imports
+sys.path.insert(0, str(Path(__file__).parent.parent))
+
+from mcp_mqtt_bridge.payload_codec import decode_payload
+from mcp_mqtt_bridge.message_auth import AUTH_TAG_LEN, MessageAuthenticator, sign_message
+from mcp_mqtt_bridge.mqtt_manager import INGEST_BATCH_MAX, MQTTManager
+
+# Mode: the unauthenticated mode it is compared with
+MODES = {"decode": "decode", "naive": "decode", "verify": "decode", "batch": "decode",
+         "ingest": "ingest", "ingest-auth": "ingest"}
+
+
+def device_key(device_id: str) -> bytes:
+    return hashlib.sha256(device_id.encode()).digest()
+
+
+def build_messages(args):
+    """Signed JSON sensor messages from --devices devices"""
+    messages = []
+    for i in range(args.messages):
+        device_id = f"esp32_{i % args.devices:06x}"
+        topic = f"devices/{device_id}/sensors/temperature/data"
+        payload = (f'{{"device_id":"{device_id}","timestamp":{i},"ts_us":{1760000000000000 + i},'
+                   f'"time_synced":true,"type":"sensor","component":"temperature","action":"read",'
+                   f'"value":{{"reading":{20 + i % 10},"unit":"C","quality":100}}}}').encode()
+        signed = sign_message(device_key(device_id), topic, payload, i // args.devices + 1)
+        messages.append((device_id, topic, payload, signed))
+    return messages
+
+
+def run_mode(args, mode, messages) -> float:
+    device_ids = [f"esp32_{d:06x}" for d in range(args.devices)]
+    keys = {device_id: device_key(device_id) for device_id in device_ids}
+    auth = MessageAuthenticator(keys)
+    trailer = 4 + AUTH_TAG_LEN
+    start = time.perf_counter()
+    if mode == "decode":
+        for _, _, payload, _ in messages:
+            decode_payload(payload)
+    elif mode == "naive":
+        for device_id, topic, _, signed in messages:
+            tag = hmac.new(keys[device_id], topic.encode() + b"\0" + signed[:-AUTH_TAG_LEN],
+                           hashlib.sha256).digest()
+            if hmac.compare_digest(tag[:AUTH_TAG_LEN], signed[-AUTH_TAG_LEN:]):
+                decode_payload(signed[:-trailer])
+    elif mode.startswith("ingest"):
+        manager = MQTTManager("bench", authenticator=auth if mode == "ingest-auth" else None)
+        manager.add_message_handler("devices/+/sensors/+/data", lambda topic, payload: None)
+        received = [SimpleNamespace(topic=topic, payload=signed if manager.authenticator else payload,
+                                    properties=None, retain=False)
+                    for _, topic, payload, signed in messages]
+        start = time.perf_counter()
+        # The worker's turn: it finds a batch queued behind the message it woke up for
+        for i in range(0, len(received), args.batch):
+            for msg in received[i:i + args.batch]:
+                manager._on_message(None, None, msg)
+            manager._drain_ingest()
+    elif mode == "verify":
+        for device_id, topic, _, signed in messages:
+            decode_payload(auth.verify(device_id, topic, signed))
+    else:
+        batches = [[(device_id, topic, signed, True) for device_id, topic, _, signed in messages[i:i + args.batch]]
+                   for i in range(0, len(messages), args.batch)]
+        start = time.perf_counter()
+        for batch in batches:
+            for body in auth.verify_batch(batch):
+                decode_payload(body)
+    return len(messages) / (time.perf_counter() - start)
+
+
+def main():
+    """Main entry point"""
+    parser = argparse.ArgumentParser(description="Messages per second with and without authentication")
+    parser.add_argument("--messages", type=int, default=200000, help="Messages per mode")
+    parser.add_argument("--devices", type=int, default=100, help="Devices the messages come from")
+    parser.add_argument("--batch", type=int, default=INGEST_BATCH_MAX, help="Messages per batch")
+    parser.add_argument("--repeat", type=int, default=5, help="Rounds; the best round of each mode counts")
+    args = parser.parse_args()
+
+    messages = build_messages(args)
+    results = {mode: 0.0 for mode in MODES}
+    for _ in range(args.repeat):
+        for mode in MODES:
+            results[mode] = max(results[mode], run_mode(args, mode, messages))
+
+    print(f"{'mode':<12}{'msg/s':>12}{'vs no auth':>12}")
+    for mode, baseline in MODES.items():
+        print(f"{mode:<12}{results[mode]:>12.0f}{results[mode] / results[baseline]:>11.0%}")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,127 @@
+#!/usr/bin/env python3
+"""
+TLS handshake benchmark for mqtts reconnects.
+Connects to a broker the way a reconnecting ESP32 bridge device does (TLS,
+MQTT CONNECT, wait for CONNACK) and compares full handshakes against ones
+resuming the previous session:
+
+  full      no session offered: certificate chain and ECDHE key exchange
+  resumed   session ID / ticket from the previous connection offered
+
+Latency and client CPU time are measured here; peak heap is only meaningful
+on the device and is reported in its metrics (tls_*_handshake_heap).
+Defaults to TLS 1.2 with the ECDHE AES-GCM suites the firmware offers.
+"""
+import sys
+import ssl
+import time
+import socket
+import struct
+import argparse
+import statistics
+from typing import List, Optional, Tuple
+
+# Matches s_tls_ciphersuites in the firmware (CONFIG_MCP_BRIDGE_TLS_ECDHE_SUITES)
+FIRMWARE_CIPHERS = ("ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-ECDSA-AES256-GCM-SHA384:"
+                    "ECDHE-RSA-AES128-GCM-SHA256:ECDHE-RSA-AES256-GCM-SHA384")
+
+
+def mqtt_connect_packet(client_id: str) -> bytes:
+    """Minimal MQTT v3.1.1 CONNECT with a clean session"""
+    client_id_bytes = client_id.encode()
+    variable_header = b"\x00\x04MQTT\x04\x02\x00\x3c"
+    payload = struct.pack("!H", len(client_id_bytes)) + client_id_bytes
+    remaining = len(variable_header) + len(payload)
+    return bytes([0x10, remaining]) + variable_header + payload
+
+
+def connect_once(args, context: ssl.SSLContext,
+                 session: Optional[ssl.SSLSession]) -> Tuple[float, float, float, bool, ssl.SSLSession]:
+    """One reconnect: returns (handshake ms, CONNACK ms, client CPU ms, reused, session)"""
+    cpu_start = time.process_time()
+    start = time.perf_counter()
+    raw = socket.create_connection((args.broker, args.port), timeout=10)
+    # Otherwise CONNECT can wait for a delayed ACK after the abbreviated handshake
+    raw.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+    tls = context.wrap_socket(raw, server_hostname=args.broker, session=session)
+    handshake_ms = (time.perf_counter() - start) * 1000
+
+    tls.sendall(mqtt_connect_packet(args.client_id))
+    connack = tls.recv(4)
+    connack_ms = (time.perf_counter() - start) * 1000
+    cpu_ms = (time.process_time() - cpu_start) * 1000
+    if len(connack) < 4 or connack[0] != 0x20 or connack[3] != 0:
+        tls.close()
+        raise ConnectionError(f"Broker refused CONNECT: {connack.hex()}")
+
+    # TLS 1.3 tickets arrive after the handshake, so read the session last
+    reused = tls.session_reused
+    new_session = tls.session
+    tls.sendall(b"\xe0\x00")    # DISCONNECT
+    tls.close()
+    return handshake_ms, connack_ms, cpu_ms, reused, new_session
+
+
+def summarize(label: str, samples: List[Tuple[float, float, float]]):
+    handshakes = sorted(sample[0] for sample in samples)
+    connacks = [sample[1] for sample in samples]
+    cpu = [sample[2] for sample in samples]
+    p95 = handshakes[min(len(handshakes) - 1, int(len(handshakes) * 0.95))]
+    print(f"{label:<9}{len(samples):>6}{statistics.median(handshakes):>12.1f}{p95:>10.1f}"
+          f"{statistics.median(connacks):>12.1f}{statistics.median(cpu):>10.1f}")
+
+
+def main():
+    """Main entry point"""
+    parser = argparse.ArgumentParser(description="Full vs resumed TLS handshakes for mqtts reconnects")
+    parser.add_argument("--broker", default="localhost", help="MQTT broker host")
+    parser.add_argument("--port", type=int, default=8883, help="MQTT broker TLS port")
+    parser.add_argument("--cafile", help="CA certificate of the broker")
+    parser.add_argument("--insecure", action="store_true", help="Skip broker certificate verification")
+    parser.add_argument("--tls13", action="store_true", help="Allow TLS 1.3 (the firmware defaults to 1.2)")
+    parser.add_argument("--client-id", default="bench_tls_resume", help="MQTT client ID")
+    parser.add_argument("--reconnects", type=int, default=50, help="Reconnects per mode")
+    args = parser.parse_args()
+
+    context = ssl.create_default_context(cafile=args.cafile)
+    if args.insecure:
+        context.check_hostname = False
+        context.verify_mode = ssl.CERT_NONE
+    if not args.tls13:
+        context.maximum_version = ssl.TLSVersion.TLSv1_2
+        context.set_ciphers(FIRMWARE_CIPHERS)
+
+    full, resumed = [], []
+    refused = 0
+    try:
+        for _ in range(args.reconnects):
+            handshake_ms, connack_ms, cpu_ms, _, _ = connect_once(args, context, None)
+            full.append((handshake_ms, connack_ms, cpu_ms))
+
+        # Each reconnect offers the session of the one before, like the firmware
+        _, _, _, _, session = connect_once(args, context, None)
+        for _ in range(args.reconnects):
+            handshake_ms, connack_ms, cpu_ms, reused, session = connect_once(args, context, session)
+            if reused:
+                resumed.append((handshake_ms, connack_ms, cpu_ms))
+            else:
+                refused += 1
+    except (OSError, ConnectionError) as e:
+        print(f"Benchmark failed: {e}")
+        return 1
+
+    print(f"{'mode':<9}{'n':>6}{'hs med ms':>12}{'hs p95':>10}{'connack ms':>12}{'cpu ms':>10}")
+    summarize("full", full)
+    if resumed:
+        summarize("resumed", resumed)
+    if refused:
+        print(f"Broker did not resume {refused} of {args.reconnects} sessions "
+              f"(check session cache / ticket settings)")
+    if resumed:
+        speedup = statistics.median(s[0] for s in full) / statistics.median(s[0] for s in resumed)
+        print(f"Resumed handshakes are {speedup:.1f}x faster (median)")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,160 @@
+#!/usr/bin/env python3
+"""
+Wire-size benchmark for sensor data publishes.
+Publishes the same readings an ESP32 bridge device would send against a real
+broker (default: the mosquitto from deployment/) and reports bytes written to
+the socket per reading for each encoding:
+
+  baseline      v3.1.1, full topic and cJSON_Print-formatted JSON (previous firmware)
+  v3.1.1 json   v3.1.1 fallback, full topic and unformatted JSON
+  v5 json       topic alias, content-type and message-expiry properties
+  v5 binary     topic alias and the 15-byte binary sensor record
+"""
+import sys
+import json
+import time
+import argparse
+from pathlib import Path
+from typing import Dict, Any
+
+# Add the parent directory to Python path for imports
+sys.path.insert(0, str(Path(__file__).parent.parent))
+
+try:
+    import paho.mqtt.client as mqtt
+    from paho.mqtt.properties import Properties
+    from paho.mqtt.packettypes import PacketTypes
+    from mcp_mqtt_bridge.payload_codec import (
+        CONTENT_TYPE_JSON, CONTENT_TYPE_SENSOR_BINARY, encode_sensor_binary
+    )
+except ImportError as e:
+    print(f"Import error: {e}")
+    print("Please ensure all dependencies are installed")
+    sys.exit(1)
+
+# Matches CONFIG_MCP_BRIDGE_SENSOR_MESSAGE_EXPIRY default
+MESSAGE_EXPIRY_S = 60
+TOPIC_ALIAS = 1
+# SNTP-synced epoch time of the first reading
+EPOCH_US = 1760000000000000
+BOOT_EPOCH = 42
+
+
+class CountingClient(mqtt.Client):
+    """Paho client that counts bytes written to the socket"""
+
+    def __init__(self, *args, **kwargs):
+        super().__init__(*args, **kwargs)
+        self.bytes_sent = 0
+
+    def _sock_send(self, buf: bytes) -> int:
+        sent = super()._sock_send(buf)
+        self.bytes_sent += sent
+        return sent
+
+
+def firmware_json_payload(device_id: str, sensor_type: str, reading: float, timestamp: int,
+                          formatted: bool = False) -> bytes:
+    """Sensor message as built by the firmware (cJSON_Print or cJSON_PrintUnformatted)"""
+    message: Dict[str, Any] = {
+        "device_id": device_id,
+        "timestamp": timestamp,
+    }
+    if not formatted:
+        # Current firmware only; the formatted baseline predates SNTP timestamps and sequence numbers
+        message.update({"ts_us": EPOCH_US + timestamp * 1000, "time_synced": True,
+                        "boot": BOOT_EPOCH, "seq": timestamp // 1000 + 1})
+    message.update({
+        "type": "sensor",
+        "component": sensor_type,
+        "action": "read",
+        "value": {"reading": reading, "unit": "°C", "quality": 100},
+    })
+    if formatted:
+        # Heap and uptime moved to the health record (CONFIG_MCP_BRIDGE_SENSOR_MESSAGE_METRICS)
+        message["metrics"] = {"free_heap": 182340, "uptime": timestamp}
+    if formatted:
+        return json.dumps(message, indent="\t", separators=(",", ":\t"), ensure_ascii=False).encode()
+    return json.dumps(message, separators=(",", ":"), ensure_ascii=False).encode()
+
+
+def run_mode(args, mode: str) -> float:
+    """Publish args.readings messages in one mode and return bytes per reading"""
+    protocol = mqtt.MQTTv5 if mode.startswith("v5") else mqtt.MQTTv311
+    client = CountingClient(mqtt.CallbackAPIVersion.VERSION2,
+                            client_id=f"bench_{args.device_id}", protocol=protocol)
+    if args.username and args.password:
+        client.username_pw_set(args.username, args.password)
+
+    client.connect(args.broker, args.port, 60)
+    client.loop_start()
+    deadline = time.time() + 5
+    while not client.is_connected() and time.time() < deadline:
+        time.sleep(0.01)
+    if not client.is_connected():
+        client.loop_stop()
+        raise ConnectionError(f"Could not connect to {args.broker}:{args.port}")
+
+    topic = f"devices/{args.device_id}/sensors/temperature/data"
+    baseline = client.bytes_sent
+
+    for i in range(args.readings):
+        reading = 20.0 + (i % 100) / 10.0
+        timestamp = 1000 * i
+        properties = None
+
+        if protocol == mqtt.MQTTv311:
+            wire_topic = topic
+            payload = firmware_json_payload(args.device_id, "temperature", reading, timestamp,
+                                            formatted=(mode == "baseline"))
+        else:
+            properties = Properties(PacketTypes.PUBLISH)
+            properties.TopicAlias = TOPIC_ALIAS
+            properties.MessageExpiryInterval = MESSAGE_EXPIRY_S
+            # First publish maps the alias, later ones send an empty topic
+            wire_topic = topic if i == 0 else ""
+            if mode == "v5 binary":
+                properties.ContentType = CONTENT_TYPE_SENSOR_BINARY
+                payload = encode_sensor_binary(reading, EPOCH_US + timestamp * 1000, boot=BOOT_EPOCH, seq=i + 1)
+            else:
+                properties.ContentType = CONTENT_TYPE_JSON
+                properties.PayloadFormatIndicator = 1
+                payload = firmware_json_payload(args.device_id, "temperature", reading, timestamp)
+
+        client.publish(wire_topic, payload, qos=0, properties=properties).wait_for_publish(5)
+
+    sent = client.bytes_sent - baseline
+    client.disconnect()
+    client.loop_stop()
+    return sent / args.readings
+
+
+def main():
+    """Main entry point"""
+    parser = argparse.ArgumentParser(description="MQTT wire bytes per sensor reading")
+    parser.add_argument("--broker", default="localhost", help="MQTT broker host")
+    parser.add_argument("--port", type=int, default=1883, help="MQTT broker port")
+    parser.add_argument("--username", help="MQTT username")
+    parser.add_argument("--password", help="MQTT password")
+    parser.add_argument("--device-id", default="esp32_a1b2c3", help="Device ID used in topics")
+    parser.add_argument("--readings", type=int, default=1000, help="Readings per mode")
+    args = parser.parse_args()
+
+    modes = ["baseline", "v3.1.1 json", "v5 json", "v5 binary"]
+    results = {}
+    for mode in modes:
+        try:
+            results[mode] = run_mode(args, mode)
+        except Exception as e:
+            print(f"{mode}: failed ({e})")
+            return 1
+
+    baseline = results[modes[0]]
+    print(f"{'mode':<14}{'bytes/reading':>15}{'vs baseline':>14}")
+    for mode in modes:
+        print(f"{mode:<14}{results[mode]:>15.1f}{results[mode] / baseline:>13.0%}")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
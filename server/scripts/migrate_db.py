@@ -140,11 +140,40 @@ def apply_migration_v3(db_path: str, logger: logging.Logger):
         conn.commit()
 
 
+def apply_migration_v4(db_path: str, logger: logging.Logger):
+    """Apply migration to version 4: Add capabilities hash/version."""
+    logger.info("Applying migration v4: Adding capabilities hash and version")
+    with sqlite3.connect(db_path) as conn:
+        cursor = conn.cursor()
+        
+        # Capabilities are deduplicated by content hash on reconnect; the
+        # server adds these columns itself at startup, so they may exist
+        existing = {row[1] for row in cursor.execute("PRAGMA table_info(device_capabilities)")}
+        if "caps_hash" not in existing:
+            cursor.execute("""
+                ALTER TABLE device_capabilities 
+                ADD COLUMN caps_hash TEXT
+            """)
+        if "caps_version" not in existing:
+            cursor.execute("""
+                ALTER TABLE device_capabilities 
+                ADD COLUMN caps_version INTEGER
+            """)
+        
+        # Record migration
+        cursor.execute("""
+            INSERT INTO schema_version (version, description) 
+            VALUES (4, 'Add capabilities hash and version')
+        """)
+        conn.commit()
+
+
 # Migration registry
 MIGRATIONS = {
     1: apply_migration_v1,
     2: apply_migration_v2,
     3: apply_migration_v3,
+    4: apply_migration_v4,
 }
 
 LATEST_VERSION = max(MIGRATIONS.keys()) if MIGRATIONS else 0
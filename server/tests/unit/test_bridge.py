@@ -0,0 +1,393 @@
+"""
+Unit tests for MCPMQTTBridge message handling.
+"""
+import asyncio
+import os
+import struct
+import threading
+import time
+import pytest
+from datetime import datetime, timezone
+from unittest.mock import MagicMock
+
+from mcp_mqtt_bridge.bridge import MCPMQTTBridge
+from mcp_mqtt_bridge.data_models import DeviceCapabilities, IoTDevice
+from mcp_mqtt_bridge.firmware_update import FirmwareStore, apply_delta
+
+
+class TestBridgeMessageHandling:
+    """Test cases for MQTT message handlers on the bridge."""
+
+    @pytest.fixture
+    def bridge(self, temp_db_path):
+        """Create a bridge with a mocked MQTT publish path."""
+        bridge = MCPMQTTBridge(
+            mqtt_broker="test_broker",
+            db_path=temp_db_path,
+            use_fastmcp=False
+        )
+        bridge.mqtt.publish_nowait = MagicMock(return_value=True)
+        return bridge
+
+    @pytest.fixture
+    def capabilities_payload(self):
+        """Sample full capabilities document."""
+        return {
+            "device_id": "esp32_caps",
+            "firmware_version": "1.0.0",
+            "sensors": ["temperature"],
+            "actuators": ["led"],
+            "metadata": {"temperature": {"unit": "°C"}},
+            "caps_hash": "0011223344556677",
+            "caps_version": 3
+        }
+
+    def test_announce_hash_miss_requests_full_document(self, bridge):
+        """Test that an unknown capabilities hash triggers a capabilities/get."""
+        bridge._handle_capabilities_announce(
+            "devices/esp32_caps/capabilities/announce",
+            {"caps_hash": "0011223344556677", "caps_version": 3}
+        )
+
+        bridge.mqtt.publish_nowait.assert_called_once()
+        topic = bridge.mqtt.publish_nowait.call_args[0][0]
+        assert topic == "devices/esp32_caps/capabilities/get"
+
+    def test_announce_hash_hit_uses_cached_copy(self, bridge, capabilities_payload):
+        """Test that a matching hash is served from the in-memory cache."""
+        bridge._handle_device_capabilities("devices/esp32_caps/capabilities", capabilities_payload)
+
+        bridge._handle_capabilities_announce(
+            "devices/esp32_caps/capabilities/announce",
+            {"caps_hash": "0011223344556677", "caps_version": 3}
+        )
+
+        bridge.mqtt.publish_nowait.assert_not_called()
+        device = bridge.device_manager.get_device("esp32_caps")
+        assert device.online
+        assert device.capabilities.sensors == ["temperature"]
+
+    def test_announce_restores_from_database(self, bridge, capabilities_payload):
+        """Test that a server restart restores capabilities from the stored copy."""
+        bridge.database.update_device_capabilities("esp32_caps", capabilities_payload)
+
+        bridge._handle_capabilities_announce(
+            "devices/esp32_caps/capabilities/announce",
+            {"caps_hash": "0011223344556677", "caps_version": 3}
+        )
+
+        bridge.mqtt.publish_nowait.assert_not_called()
+        device = bridge.device_manager.get_device("esp32_caps")
+        assert device.capabilities.actuators == ["led"]
+        assert device.capabilities.caps_version == 3
+
+    def test_unchanged_capabilities_skip_rewrite(self, bridge, capabilities_payload):
+        """Test that a re-delivered document with the same hash is not rewritten."""
+        bridge._handle_device_capabilities("devices/esp32_caps/capabilities", capabilities_payload)
+        bridge.database.update_device_capabilities = MagicMock()
+
+        bridge._handle_device_capabilities("devices/esp32_caps/capabilities", capabilities_payload)
+
+        bridge.database.update_device_capabilities.assert_not_called()
+
+    def test_synced_timestamp_fast_path(self, bridge):
+        """Test that SNTP-synced epoch microseconds are stored exactly."""
+        bridge.database.store_sensor_data = MagicMock()
+
+        bridge._handle_sensor_data(
+            "devices/esp32_time/sensors/temperature/data",
+            {"timestamp": 4200, "ts_us": 1760000000123456, "time_synced": True,
+             "value": {"reading": 21.5, "unit": "C"}}
+        )
+
+        expected = datetime(2025, 10, 9, 8, 53, 20, 123456, tzinfo=timezone.utc)
+        reading = bridge.device_manager.get_device("esp32_time").sensor_readings["temperature"]
+        assert reading.timestamp == expected
+        stored = bridge.database.store_sensor_data.call_args[0][0]
+        assert stored["timestamp"] == "2025-10-09T08:53:20.123456Z"
+
+    def test_push_config_waits_for_acks(self, bridge):
+        """Test that a config push resolves per device from acks on the MQTT thread."""
+        for device_id in ("esp32_a", "esp32_b"):
+            bridge.device_manager.update_device_status(device_id, {"value": "online"})
+
+        def device_acks(topic, payload, qos=0, retain=False):
+            # esp32_a applies the update, esp32_b never answers
+            device_id = topic.split('/')[1]
+            if device_id == "esp32_a":
+                ack = {"device_id": device_id, "version": payload["version"], "status": "applied",
+                       "config": {"version": payload["version"], "sensor_publish_interval_ms": 5000}}
+                threading.Thread(target=bridge._handle_config_ack,
+                                 args=(f"devices/{device_id}/config/ack", ack)).start()
+            return True
+
+        bridge.mqtt.publish_nowait = MagicMock(side_effect=device_acks)
+
+        results = asyncio.run(bridge.push_device_config(
+            ["esp32_a", "esp32_b"], {"sensor_publish_interval_ms": 5000}, timeout_seconds=0.5))
+
+        assert results["esp32_a"]["status"] == "applied"
+        assert results["esp32_b"]["status"] == "timeout"
+        topic, payload = bridge.mqtt.publish_nowait.call_args_list[0][0][:2]
+        assert topic == "devices/esp32_a/config"
+        assert payload["sensor_publish_interval_ms"] == 5000
+        assert bridge.mqtt.publish_nowait.call_args_list[0][1] == {"qos": 1, "retain": True}
+        device = bridge.device_manager.get_device("esp32_a")
+        assert device.config_version == payload["version"]
+        assert not bridge._config_waiters
+
+    def test_push_rules_and_fired_report(self, bridge):
+        """Test that a rule push resolves from the ack and fired reports are recorded."""
+        bridge.device_manager.update_device_status("esp32_a", {"value": "online"})
+        bridge.database.store_device_event = MagicMock()
+        rules = [{"id": "fan_hot", "sensor": "temperature", "op": ">", "threshold": 30,
+                  "hysteresis": 1.5, "actuator": "fan", "action": "on", "clear_action": "off"}]
+
+        def device_acks(topic, payload, qos=0, retain=False):
+            ack = {"device_id": "esp32_a", "version": payload["version"], "status": "applied",
+                   "rules_version": payload["version"], "rules": len(payload["rules"])}
+            threading.Thread(target=bridge._handle_rules_ack,
+                             args=("devices/esp32_a/rules/ack", ack)).start()
+            return True
+
+        bridge.mqtt.publish_nowait = MagicMock(side_effect=device_acks)
+
+        results = asyncio.run(bridge.push_device_rules(["esp32_a"], rules, timeout_seconds=0.5))
+
+        assert results["esp32_a"]["status"] == "applied"
+        assert results["esp32_a"]["rules"] == 1
+        topic, payload = bridge.mqtt.publish_nowait.call_args[0][:2]
+        assert topic == "devices/esp32_a/rules"
+        assert payload["rules"] == rules
+        assert bridge.mqtt.publish_nowait.call_args[1] == {"qos": 1, "retain": True}
+        device = bridge.device_manager.get_device("esp32_a")
+        assert device.rules_version == payload["version"]
+        assert device.rules == rules
+        assert not bridge._rules_waiters
+
+        bridge._handle_rule_fired("devices/esp32_a/rules/fired", {
+            "device_id": "esp32_a", "rule": "fan_hot", "actuator": "fan", "action": "on",
+            "reading": 30.4, "status": "ok", "timestamp": 5000})
+
+        event = device.rule_events[-1]
+        assert (event["rule"], event["actuator"], event["action"]) == ("fan_hot", "fan", "on")
+        assert event["reading"] == 30.4
+        assert bridge.database.store_device_event.call_args[1]["event_type"] == "rule_fired"
+
+    def test_on_demand_read_returns_correlated_response(self, bridge):
+        """Test that a fresh read is matched by request ID and updates the cache."""
+        bridge.database.store_sensor_data = MagicMock()
+
+        def device_reads(topic, payload, qos=0, retain=False):
+            response = {"device_id": "esp32_read", "request_id": payload["request_id"],
+                        "status": "ok", "value": {"reading": 22.75, "unit": "C"}}
+            threading.Thread(target=bridge._handle_sensor_read_response,
+                             args=("devices/esp32_read/sensors/temperature/response", response)).start()
+            return True
+
+        bridge.mqtt.publish_nowait = MagicMock(side_effect=device_reads)
+
+        response = asyncio.run(bridge.request_sensor_read("esp32_read", "temperature", timeout_seconds=1))
+
+        assert response["status"] == "ok"
+        assert bridge.mqtt.publish_nowait.call_args[0][0] == "devices/esp32_read/sensors/temperature/read"
+        reading = bridge.device_manager.get_device("esp32_read").sensor_readings["temperature"]
+        assert reading.value == 22.75
+        assert bridge.database.store_sensor_data.call_args[0][0]["value"] == 22.75
+        assert not bridge._read_waiters
+
+    def test_on_demand_read_times_out(self, bridge):
+        """Test that an unanswered read returns None and leaves no waiter behind."""
+        response = asyncio.run(bridge.request_sensor_read("esp32_silent", "temperature", timeout_seconds=0.05))
+
+        assert response is None
+        assert not bridge._read_waiters
+
+    def test_ping_measures_rtt_and_clock_offset(self, bridge):
+        """Test that a pong yields RTT without device hold time and the device clock offset."""
+        def device_answers(topic, payload, qos=0, retain=False):
+            # Device clock runs 2 s ahead and holds the ping for 1 ms
+            rx_us = time.time_ns() // 1000 + 2_000_000
+            pong = {"ping_id": payload["ping_id"], "rx_us": rx_us, "tx_us": rx_us + 1000, "time_synced": True}
+            threading.Thread(target=bridge._handle_pong, args=("devices/esp32_ping/pong", pong)).start()
+            return True
+
+        bridge.mqtt.publish_nowait = MagicMock(side_effect=device_answers)
+
+        result = asyncio.run(bridge.ping_device("esp32_ping", timeout_seconds=1))
+
+        assert result["status"] == "online"
+        assert bridge.mqtt.publish_nowait.call_args[0][0] == "devices/esp32_ping/ping"
+        assert result["device_processing_ms"] == 1.0
+        assert 0 <= result["rtt_ms"] < 500
+        assert abs(result["clock_offset_ms"] - 2000) < 250
+        assert not bridge._ping_waiters
+
+        bridge.mqtt.publish_nowait = MagicMock(return_value=True)
+        assert asyncio.run(bridge.ping_device("esp32_ping", timeout_seconds=0.05))["status"] == "timeout"
+
+        stats = bridge.device_manager.device_metrics["esp32_ping"].latency_stats()
+        assert stats["pings_sent"] == 2
+        assert stats["pings_lost"] == 1
+        assert stats["samples"] == 1
+        assert stats["clock_offset_ms"] == result["clock_offset_ms"]
+
+    def test_firmware_update_streams_delta_and_rewinds(self, bridge, tmp_path):
+        """Test that an OTA update is sent as a delta and resumes after a lost chunk."""
+        source = os.urandom(16 * 1024)
+        target = source[:4000] + os.urandom(5000) + source[4000:]
+        (tmp_path / "1.0.0.bin").write_bytes(source)
+        (tmp_path / "1.1.0.bin").write_bytes(target)
+        bridge.firmware = FirmwareStore(str(tmp_path))
+        bridge.database.store_device_event = MagicMock()
+        bridge.device_manager.devices["esp32_ota"] = IoTDevice(
+            device_id="esp32_ota", capabilities=DeviceCapabilities(firmware_version="1.0.0"))
+
+        stream = bytearray()
+        size = []
+        lost = []
+
+        def device(topic, payload, qos=0, retain=False):
+            status = {"version": "1.1.0", "state": "receiving", "chunk_size": 1024}
+            if topic == "devices/esp32_ota/ota":
+                size.append(payload["size"])
+                status.update({"offset": len(stream), "rewind": True})
+            else:
+                offset, data = struct.unpack_from("<I", payload)[0], payload[4:]
+                if not lost:
+                    lost.append(offset)
+                    return True
+                if offset != len(stream):
+                    # Device flags one rewind per gap and ignores the rest of the window
+                    if lost[-1] == "rewound":
+                        return True
+                    lost.append("rewound")
+                    status.update({"offset": len(stream), "rewind": True})
+                else:
+                    stream.extend(data)
+                    status["offset"] = len(stream)
+                    if len(stream) == size[0] and apply_delta(source, bytes(stream)) == target:
+                        status = {"version": "1.1.0", "state": "done", "duration_ms": 1234}
+            bridge._handle_ota_status("devices/esp32_ota/ota/status", status)
+            return True
+
+        bridge.mqtt.publish_nowait = MagicMock(side_effect=device)
+
+        results = asyncio.run(bridge.update_firmware(["esp32_ota"], "1.1.0", timeout_seconds=5))
+
+        result = results["esp32_ota"]
+        assert result["status"] == "done"
+        assert result["mode"] == "delta"
+        assert result["update_bytes"] < result["image_bytes"]
+        assert result["transfer_bytes"] > result["update_bytes"]
+        assert result["device_duration_ms"] == 1234
+        assert bridge.device_manager.get_device("esp32_ota").ota_results[-1]["status"] == "done"
+        assert bridge.database.store_device_event.call_args[1]["event_type"] == "ota_update"
+        assert not bridge._ota_sessions
+
+    def test_gateway_batch_creates_child_devices(self, bridge):
+        """Test that one gateway batch lands as readings of first-class child devices."""
+        bridge.database.store_sensor_data = MagicMock()
+        bridge._handle_device_capabilities(
+            "devices/esp32_gw/capabilities",
+            {"device_id": "esp32_gw", "sensors": [], "actuators": [], "metadata": {},
+             "children": ["ble_01", "rs485_07"], "caps_hash": "aabbccddeeff0011"}
+        )
+
+        bridge._handle_gateway_batch(
+            "devices/esp32_gw/batch",
+            {"device_id": "esp32_gw", "timestamp": 9000, "readings": [
+                {"device_id": "ble_01", "component": "temperature", "timestamp": 8800,
+                 "ts_us": 1760000000000000, "time_synced": True,
+                 "value": {"reading": 19.5, "unit": "C", "quality": 100}},
+                {"device_id": "rs485_07", "component": "flow", "timestamp": 8900,
+                 "ts_us": 1760000000100000, "time_synced": True,
+                 "value": {"reading": 3.2, "unit": "l/min", "quality": 100}},
+                {"device_id": "ble_01", "component": "humidity", "timestamp": 8950,
+                 "ts_us": 1760000000150000, "time_synced": True,
+                 "value": {"reading": 48.0, "unit": "%", "quality": 100}},
+            ]}
+        )
+
+        ble = bridge.device_manager.get_device("ble_01")
+        assert ble.gateway_id == "esp32_gw"
+        assert ble.online
+        assert ble.sensor_readings["temperature"].value == 19.5
+        assert ble.sensor_readings["humidity"].value == 48.0
+        assert bridge.device_manager.get_device("rs485_07").sensor_readings["flow"].unit == "l/min"
+        assert bridge.device_manager.get_device("esp32_gw").sensor_readings == {}
+        assert bridge.device_manager.get_device_summary("esp32_gw")["children"] == ["ble_01", "rs485_07"]
+        stored = [call[0][0] for call in bridge.database.store_sensor_data.call_args_list]
+        assert [(s["device_id"], s["sensor_type"]) for s in stored] == [
+            ("ble_01", "temperature"), ("rs485_07", "flow"), ("ble_01", "humidity")]
+
+    def test_sequence_gaps_duplicates_and_reorder(self, bridge):
+        """Test that sequence numbers give loss, duplicate and reorder counts, and duplicates can be dropped."""
+        bridge.database.store_sensor_data = MagicMock()
+        bridge.drop_duplicate_readings = True
+        topic = "devices/esp32_a/sensors/temperature/data"
+
+        # 3 arrives late, 2 twice, 5 never; then the device reboots and 2 of the new boot is lost
+        for boot, seq in [(4, 1), (4, 2), (4, 4), (4, 2), (4, 3), (4, 6), (5, 1), (5, 3)]:
+            bridge._handle_sensor_data(topic, {"ts_us": 1760000000000000 + seq, "time_synced": True,
+                                               "boot": boot, "seq": seq, "value": {"reading": 20.0}})
+
+        stats = bridge.device_manager.device_metrics["esp32_a"].sequence_stats()
+        assert bridge.database.store_sensor_data.call_count == 7
+        assert (stats["received"], stats["lost"], stats["duplicates"]) == (7, 2, 1)
+        assert (stats["reordered"], stats["restarts"]) == (1, 1)
+        assert stats["loss_rate"] == round(2 / 9, 6)
+        assert stats["streams"]["temperature"]["boot"] == 5
+
+    def test_same_type_sensors_share_a_sequence(self, bridge):
+        """Test that sensors sharing a data topic, direct or behind a gateway, are not taken for duplicates."""
+        bridge.database.store_sensor_data = MagicMock()
+        bridge.drop_duplicate_readings = True
+
+        # temp_1 and temp_2 alternate on one topic and number it together
+        for seq, value in enumerate([20.0, 21.5, 20.1, 21.4], start=1):
+            bridge._handle_sensor_data("devices/esp32_a/sensors/temperature/data",
+                                       {"ts_us": 1760000000000000 + seq, "time_synced": True,
+                                        "boot": 4, "seq": seq, "value": {"reading": value}})
+        bridge._handle_gateway_batch("devices/esp32_gw/batch", {"boot": 2, "seq": 1, "readings": [
+            {"device_id": "ble_01", "component": "temperature", "seq": 1, "value": {"reading": 19.5}},
+            {"device_id": "ble_01", "component": "temperature", "seq": 2, "value": {"reading": 18.0}},
+        ]})
+
+        assert bridge.database.store_sensor_data.call_count == 6
+        for device_id in ("esp32_a", "ble_01"):
+            stats = bridge.device_manager.device_metrics[device_id].sequence_stats()
+            assert (stats["duplicates"], stats["lost"], stats["reordered"]) == (0, 0, 0)
+
+    def test_gateway_offline_takes_children_offline(self, bridge):
+        """Test that children go offline with their gateway."""
+        bridge._handle_device_status("devices/esp32_gw/status", {"value": "online"})
+        bridge._handle_device_status("devices/ble_01/status", {"value": "online", "gateway": "esp32_gw"})
+        assert bridge.device_manager.get_device("ble_01").online
+
+        bridge._handle_device_status("devices/esp32_gw/status", {"value": "offline"})
+
+        assert not bridge.device_manager.get_device("esp32_gw").online
+        child = bridge.device_manager.get_device("ble_01")
+        assert not child.online
+        assert child.gateway_id == "esp32_gw"
+
+    def test_health_record_updates_device(self, bridge):
+        """Test that health records are kept per device and low memory is logged as an event."""
+        bridge.database.store_device_event = MagicMock()
+        health = {"device_id": "esp32_a", "timestamp": 60000, "uptime_s": 60, "low_memory": False,
+                  "heap": {"free": 120000, "min_free": 98000, "largest_block": 65536, "frag_pct": 46},
+                  "tasks": [{"name": "mcp_sensor", "stack_free": 1800, "cpu_pct": 0.4}]}
+
+        bridge._handle_device_health("devices/esp32_a/health", health)
+
+        device = bridge.device_manager.get_device("esp32_a")
+        assert device.health["heap"]["frag_pct"] == 46
+        assert device.health["tasks"][0]["stack_free"] == 1800
+        assert bridge.database.get_device_metrics("esp32_a")["min_free_heap"] == 98000
+        bridge.database.store_device_event.assert_not_called()
+
+        bridge._handle_device_health("devices/esp32_a/health", {**health, "low_memory": True})
+
+        assert device.health["low_memory"]
+        assert bridge.database.store_device_event.call_args[1]["event_type"] == "low_memory"
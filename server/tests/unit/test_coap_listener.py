@@ -0,0 +1,95 @@
+"""
+Unit tests for the CoAP/UDP telemetry listener.
+"""
+import pytest
+import struct
+from unittest.mock import MagicMock
+
+from mcp_mqtt_bridge.mqtt_manager import MQTTManager
+from mcp_mqtt_bridge.coap_listener import CoapDecodeError, CoapListener, parse_coap_message
+from mcp_mqtt_bridge.payload_codec import CONTENT_TYPE_SENSOR_BINARY, encode_sensor_binary
+
+TOPIC = "devices/esp32_test/sensors/temperature/data"
+
+
+def coap_post(topic: str, payload: bytes, content_format=None, msg_type=1, token=b"") -> bytes:
+    """Build a CoAP POST the way mcp_transport_udp_create() does"""
+    data = bytearray(struct.pack("!BBH", 0x40 | msg_type << 4 | len(token), 0x02, 0x1234) + token)
+    option = 0
+
+    def put(number, value):
+        nonlocal option
+        delta, option = number - option, number
+        nibbles, ext = [], b""
+        for field in (delta, len(value)):
+            if field < 13:
+                nibbles.append(field)
+            elif field < 269:
+                nibbles.append(13)
+                ext += bytes([field - 13])
+            else:
+                nibbles.append(14)
+                ext += struct.pack("!H", field - 269)
+        data.extend(bytes([nibbles[0] << 4 | nibbles[1]]) + ext + value)
+
+    for segment in topic.split("/"):
+        put(11, segment.encode())
+    if content_format is not None:
+        put(12, content_format.to_bytes(2 if content_format > 0xFF else 1, "big"))
+    if payload:
+        data.extend(b"\xff" + payload)
+    return bytes(data)
+
+
+class TestCoapListener:
+    """Test cases for CoAP parsing and delivery into the MQTT message path."""
+
+    def test_parse_non_post(self):
+        """Test that Uri-Path becomes the topic and Content-Format the content type."""
+        record = encode_sensor_binary(21.5, 1760000000000000)
+        msg_type, _, _, topic, content_type, payload = parse_coap_message(coap_post(TOPIC, record, 65001))
+
+        assert msg_type == 1
+        assert topic == TOPIC
+        assert content_type == CONTENT_TYPE_SENSOR_BINARY
+        assert payload == record
+
+    def test_long_segment_and_no_payload(self):
+        """Test extended option lengths and an empty payload."""
+        topic = "devices/" + "x" * 300 + "/health"
+        _, _, _, parsed, content_type, payload = parse_coap_message(coap_post(topic, b""))
+
+        assert parsed == topic
+        assert content_type is None
+        assert payload == b""
+
+    def test_invalid_datagrams_rejected(self):
+        """Test that non-POST, truncated and unknown-format messages are rejected."""
+        message = coap_post(TOPIC, b"{}", 50)
+
+        with pytest.raises(CoapDecodeError):
+            parse_coap_message(message[:1] + b"\x01" + message[2:])     # GET
+        with pytest.raises(CoapDecodeError):
+            parse_coap_message(message[:8])
+        with pytest.raises(CoapDecodeError):
+            parse_coap_message(coap_post(TOPIC, b"{}", 42))
+
+    def test_delivery_and_ack(self):
+        """Test that messages reach the MQTT handlers and confirmable ones are acknowledged."""
+        manager = MQTTManager("test_broker")
+        handler = MagicMock()
+        manager.add_message_handler("devices/+/sensors/+/data", handler)
+        listener = CoapListener(manager.handle_message)
+        listener.connection_made(MagicMock())
+
+        listener.datagram_received(coap_post(TOPIC, encode_sensor_binary(21.5, 0), 65001), ("10.0.0.2", 5683))
+        listener.datagram_received(coap_post(TOPIC, b'{"value":{"reading":22}}', 50, msg_type=0, token=b"\x07"),
+                                   ("10.0.0.2", 5683))
+        listener.datagram_received(b"\x00", ("10.0.0.2", 5683))
+
+        assert handler.call_count == 2
+        assert handler.call_args_list[0][0][1]["value"]["reading"] == 21.5
+        assert handler.call_args_list[1][0][1]["value"]["reading"] == 22
+        assert listener.received == 2 and listener.rejected == 1
+        ack = listener.transport.sendto.call_args[0][0]
+        assert ack == struct.pack("!BBH", 0x61, 0x44, 0x1234) + b"\x07"
@@ -106,6 +106,39 @@ class TestDatabaseManager:
         assert readings[0]["value"] == 23.5
         assert readings[0]["unit"] == "°C"
     
+    def test_store_multi_channel_sensor_data(self, db_manager):
+        """Test that a multi-channel reading is stored as one row with its channels."""
+        db_manager.store_sensor_data({
+            "device_id": "test_device_imu",
+            "sensor_type": "accelerometer",
+            "value": 0.01,
+            "channels": {"x": 0.01, "y": -0.02, "z": 0.98},
+            "timestamp": datetime.now().isoformat()
+        })
+        
+        readings = db_manager.get_sensor_data("test_device_imu", "accelerometer", 60)
+        assert len(readings) == 1
+        assert readings[0]["channels"] == {"x": 0.01, "y": -0.02, "z": 0.98}
+    
+    def test_sensor_snapshot_by_aligned_slot(self, db_manager):
+        """Test that readings of one aligned slot are found across devices by exact key."""
+        slot_us = 1760000010000000
+        for device_id, value, bucket_us in (("dev_a", 21.0, slot_us), ("dev_b", 22.5, slot_us),
+                                            ("dev_c", 23.0, slot_us + 10000000), ("dev_d", 24.0, None)):
+            sensor_data = {
+                "device_id": device_id,
+                "sensor_type": "temperature",
+                "value": value,
+                "timestamp": datetime.now().isoformat()
+            }
+            if bucket_us is not None:
+                sensor_data["bucket_us"] = bucket_us
+            db_manager.store_sensor_data(sensor_data)
+        
+        snapshot = db_manager.get_sensor_snapshot("temperature", slot_us)
+        assert [(r["device_id"], r["value"]) for r in snapshot] == [("dev_a", 21.0), ("dev_b", 22.5)]
+        assert db_manager.get_sensor_snapshot("humidity", slot_us) == []
+    
     def test_get_sensor_data_with_history(self, db_manager):
         """Test retrieving sensor data with history."""
         device_id = "test_device_004"
@@ -136,6 +169,50 @@ class TestDatabaseManager:
         readings = db_manager.get_sensor_data(device_id, "temperature", 180)
         assert len(readings) == 3  # Should get 3 readings within 3 hours
     
+    def test_health_record_kept_next_to_counters(self, db_manager):
+        """Test that health records and server counters update one device_metrics row."""
+        from mcp_mqtt_bridge.data_models import DeviceMetrics
+        
+        db_manager.store_device_health("esp32_h", {
+            "uptime_s": 3600, "low_memory": False, "rssi": -61,
+            "heap": {"free": 118400, "min_free": 96120, "largest_block": 65524, "frag_pct": 45},
+            "counters": {"messages_sent": 1214, "sensor_read_errors": 2}
+        })
+        db_manager.update_device_metrics("esp32_h", DeviceMetrics(messages_received=1300))
+        
+        metrics = db_manager.get_device_metrics("esp32_h")
+        assert metrics["messages_received"] == 1300
+        assert metrics["free_heap"] == 118400
+        assert metrics["heap_frag_pct"] == 45
+        assert metrics["rssi"] == -61
+        assert metrics["device_counters"]["messages_sent"] == 1214
+        assert not metrics["low_memory"]
+    
+    def test_capabilities_columns_added_on_upgrade(self, temp_db_path):
+        """Test that a database from before capability hashing gains the columns at startup."""
+        with sqlite3.connect(temp_db_path) as conn:
+            conn.execute("""
+                CREATE TABLE device_capabilities (
+                    device_id TEXT PRIMARY KEY,
+                    sensors TEXT,
+                    actuators TEXT,
+                    metadata TEXT,
+                    firmware_version TEXT,
+                    hardware_version TEXT,
+                    last_updated DATETIME DEFAULT CURRENT_TIMESTAMP
+                )
+            """)
+        
+        manager = DatabaseManager(db_path=temp_db_path)
+        manager.update_device_capabilities("esp32_old", {
+            "sensors": ["temperature"], "caps_hash": "9f1c2a7e", "caps_version": 3
+        })
+        
+        caps = manager.get_device_capabilities("esp32_old")
+        assert caps["caps_hash"] == "9f1c2a7e"
+        assert caps["caps_version"] == 3
+        manager.close()
+    
     def test_log_device_error(self, db_manager):
         """Test logging device errors."""
         device_id = "test_device_005"
@@ -0,0 +1,70 @@
+"""
+Unit tests for firmware delta encoding and the firmware store.
+"""
+import hashlib
+import os
+import pytest
+
+from mcp_mqtt_bridge.firmware_update import (
+    DELTA_MAX_COPY, DELTA_OP_COPY, DeltaError, FirmwareStore, apply_delta, compute_delta
+)
+
+
+class TestFirmwareDelta:
+    """Test cases for delta updates between firmware images."""
+
+    def test_delta_finds_moved_code(self):
+        """Test that inserted code and shifted blocks cost little more than the new bytes."""
+        source = os.urandom(64 * 1024)
+        target = source[:10000] + b"\x5a" * 300 + source[10000:40000] + source[50000:] + source[:777]
+
+        delta = compute_delta(source, target)
+
+        assert apply_delta(source, delta) == target
+        assert len(delta) < 400
+
+    def test_unchanged_image_copies_are_bounded(self):
+        """Test that a match spanning the whole image is sent as COPYs of bounded length."""
+        source = os.urandom(1024 * 1024 + 123)
+
+        delta = compute_delta(source, source)
+
+        copies = len(source) // DELTA_MAX_COPY + 1
+        assert len(delta) == copies * 9
+        assert all(delta[op * 9] == DELTA_OP_COPY for op in range(copies))
+        assert apply_delta(source, delta) == source
+
+    def test_unrelated_image_is_one_insert(self):
+        """Test that a delta never grows much beyond the image itself."""
+        source, target = os.urandom(8192), os.urandom(8192)
+
+        delta = compute_delta(source, target)
+
+        assert len(delta) == len(target) + 5
+        assert apply_delta(source, delta) == target
+
+    def test_malformed_delta_is_rejected(self):
+        """Test that a delta copying past its source is refused."""
+        delta = compute_delta(b"a" * 64, b"a" * 64)
+
+        with pytest.raises(DeltaError):
+            apply_delta(b"a" * 32, delta)
+
+    def test_store_prefers_cached_delta(self, tmp_path):
+        """Test that the store sends a delta when it knows the running image and caches it."""
+        source = os.urandom(32 * 1024)
+        target = source[:5000] + b"patch" + source[5000:]
+        (tmp_path / "1.0.0.bin").write_bytes(source)
+        (tmp_path / "1.1.0.bin").write_bytes(target)
+        store = FirmwareStore(str(tmp_path))
+
+        update = store.update_for("1.0.0", "1.1.0")
+
+        assert update.mode == "delta"
+        assert update.sha256 == hashlib.sha256(target).hexdigest()
+        assert update.source_sha256 == hashlib.sha256(source).hexdigest()
+        assert (tmp_path / "deltas" / "1.0.0_to_1.1.0.delta").read_bytes() == update.data
+        assert store.update_for("0.9.0", "1.1.0").mode == "full"
+        assert store.list_versions() == ["1.0.0", "1.1.0"]
+        with pytest.raises(ValueError):
+            store.update_for("1.0.0", "../1.1.0")
@@ -0,0 +1,142 @@
+"""
+Unit tests for per-message authentication.
+"""
+import pytest
+from types import SimpleNamespace
+from unittest.mock import MagicMock
+
+from mcp_mqtt_bridge.mqtt_manager import MQTTManager
+from mcp_mqtt_bridge.message_auth import AuthError, MessageAuthenticator, sign_message
+
+KEY = bytes(range(32))
+TOPIC = "devices/esp32_test/sensors/temperature/data"
+PAYLOAD = b'{"value": {"reading": 21.5}}'
+
+
+class TestMessageAuth:
+    """Test cases for tag verification and replay protection."""
+
+    def test_signed_message_verifies(self):
+        """Test that a signed message verifies and comes back without its trailer."""
+        auth = MessageAuthenticator({"esp32_test": KEY})
+        signed = sign_message(KEY, TOPIC, PAYLOAD, 1)
+
+        assert len(signed) == len(PAYLOAD) + 4 + 12
+        assert auth.verify("esp32_test", TOPIC, signed) == PAYLOAD
+
+    def test_tampering_rejected(self):
+        """Test that a changed payload, another topic or another key fails."""
+        auth = MessageAuthenticator({"esp32_test": KEY})
+        signed = sign_message(KEY, TOPIC, PAYLOAD, 1)
+
+        with pytest.raises(AuthError):
+            auth.verify("esp32_test", TOPIC, signed.replace(b"21.5", b"99.9"))
+        with pytest.raises(AuthError):
+            auth.verify("esp32_test", "devices/esp32_test/status", signed)
+        with pytest.raises(AuthError):
+            auth.verify("esp32_test", TOPIC, sign_message(bytes(32), TOPIC, PAYLOAD, 2))
+        assert auth.stats("esp32_test")["rejected"] == 3
+
+    def test_replay_window(self):
+        """Test that replays are rejected while reordered messages in the window pass."""
+        auth = MessageAuthenticator({"esp32_test": KEY}, window=8)
+
+        auth.verify("esp32_test", TOPIC, sign_message(KEY, TOPIC, PAYLOAD, 5))
+        auth.verify("esp32_test", TOPIC, sign_message(KEY, TOPIC, PAYLOAD, 3))
+        with pytest.raises(AuthError):
+            auth.verify("esp32_test", TOPIC, sign_message(KEY, TOPIC, PAYLOAD, 3))
+        auth.verify("esp32_test", TOPIC, sign_message(KEY, TOPIC, PAYLOAD, 20))
+        with pytest.raises(AuthError):
+            auth.verify("esp32_test", TOPIC, sign_message(KEY, TOPIC, PAYLOAD, 12))
+
+        # Retained messages come back with their original counter
+        assert auth.verify("esp32_test", TOPIC, sign_message(KEY, TOPIC, PAYLOAD, 5),
+                           check_replay=False) == PAYLOAD
+        assert auth.stats("esp32_test") == {"accepted": 4, "rejected": 0, "replayed": 2, "last_counter": 20}
+
+    def test_gateway_children_share_counter(self):
+        """Test that children signed by their gateway share its replay window."""
+        auth = MessageAuthenticator({"esp32_gw": KEY, "child_1": KEY})
+        child_topic = "devices/child_1/status"
+
+        auth.verify("esp32_gw", TOPIC, sign_message(KEY, TOPIC, PAYLOAD, 1))
+        auth.verify("child_1", child_topic, sign_message(KEY, child_topic, PAYLOAD, 2))
+        with pytest.raises(AuthError):
+            auth.verify("esp32_gw", child_topic, sign_message(KEY, child_topic, PAYLOAD, 2))
+
+    def test_batch_verification(self):
+        """Test that a batch rejects only its bad messages, checking replays in order."""
+        auth = MessageAuthenticator({"esp32_test": KEY})
+        first = sign_message(KEY, TOPIC, PAYLOAD, 1)
+
+        results = auth.verify_batch([
+            ("esp32_test", TOPIC, first, True),
+            ("esp32_test", TOPIC, sign_message(KEY, TOPIC, PAYLOAD, 2).replace(b"21.5", b"99.9"), True),
+            ("esp32_test", TOPIC, first, True),
+            ("esp32_other", TOPIC, first, True),
+            ("esp32_test", TOPIC, first, False),
+            ("esp32_test", TOPIC, b"{}", True),
+            ("esp32_test", TOPIC, sign_message(KEY, TOPIC, PAYLOAD, 3), True),
+        ])
+
+        assert [result if isinstance(result, bytes) else type(result) for result in results] == [
+            PAYLOAD, AuthError, AuthError, AuthError, PAYLOAD, AuthError, PAYLOAD]
+        assert "Replayed" in str(results[2])
+        assert auth.stats("esp32_test") == {"accepted": 3, "rejected": 2, "replayed": 1, "last_counter": 3}
+
+    def test_replay_window_survives_restart(self, temp_db_path):
+        """Test that messages accepted before a restart are rejected after it."""
+        from mcp_mqtt_bridge.database import DatabaseManager
+        database = DatabaseManager(db_path=temp_db_path)
+        auth = MessageAuthenticator({"esp32_test": KEY}, counter_store=database, flush_interval=3600)
+        captured = sign_message(KEY, TOPIC, PAYLOAD, 7)
+        auth.verify("esp32_test", TOPIC, captured)
+        auth.flush()
+
+        restarted = MessageAuthenticator({"esp32_test": KEY}, counter_store=database)
+        with pytest.raises(AuthError):
+            restarted.verify("esp32_test", TOPIC, captured)
+        with pytest.raises(AuthError):
+            restarted.verify("esp32_test", TOPIC, sign_message(KEY, TOPIC, PAYLOAD, 6))
+        assert restarted.verify("esp32_test", TOPIC, sign_message(KEY, TOPIC, PAYLOAD, 8)) == PAYLOAD
+        database.close()
+
+    def test_manager_drops_unauthenticated(self):
+        """Test that MQTTManager strips valid trailers and drops forged or unsigned messages."""
+        manager = MQTTManager("test_broker", authenticator=MessageAuthenticator({"esp32_test": KEY}),
+                              require_auth=True)
+        handler = MagicMock()
+        status_handler = MagicMock()
+        manager.add_message_handler("devices/+/sensors/+/data", handler)
+        manager.add_message_handler("devices/+/status", status_handler)
+
+        def deliver(topic, payload):
+            manager._on_message(None, None, SimpleNamespace(topic=topic, payload=payload,
+                                                            properties=None, retain=False))
+
+        deliver(TOPIC, sign_message(KEY, TOPIC, PAYLOAD, 1))
+        deliver(TOPIC, sign_message(KEY, TOPIC, PAYLOAD, 1))
+        deliver(TOPIC, PAYLOAD)
+        deliver("devices/other/sensors/temperature/data", PAYLOAD)
+        deliver("devices/esp32_test/status", b'{"value":"offline"}')
+        manager._drain_ingest()
+
+        assert handler.call_count == 1
+        assert handler.call_args[0][1]["value"]["reading"] == 21.5
+        assert status_handler.call_count == 1
+
+    def test_manager_verifies_off_network_thread(self):
+        """Test that the ingest worker verifies and routes queued messages in order."""
+        manager = MQTTManager("test_broker", authenticator=MessageAuthenticator({"esp32_test": KEY}))
+        readings = []
+        manager.add_message_handler("devices/+/sensors/+/data",
+                                    lambda topic, payload: readings.append(payload["value"]["reading"]))
+
+        manager._start_ingest()
+        for counter in range(1, 601):
+            signed = sign_message(KEY, TOPIC, b'{"value": {"reading": %d}}' % counter, counter)
+            manager._on_message(None, None, SimpleNamespace(topic=TOPIC, payload=signed,
+                                                            properties=None, retain=False))
+        manager._stop_ingest()
+
+        assert readings == list(range(1, 601))
@@ -0,0 +1,119 @@
+"""
+Unit tests for MQTT payload encoding.
+"""
+import pytest
+import struct
+from types import SimpleNamespace
+from unittest.mock import MagicMock
+
+from mcp_mqtt_bridge.mqtt_manager import MQTTManager
+from mcp_mqtt_bridge.device_manager import DeviceManager
+from mcp_mqtt_bridge.payload_codec import (
+    CONTENT_TYPE_SENSOR_BINARY, CONTENT_TYPE_SENSOR_MULTI_BINARY, PayloadDecodeError,
+    decode_payload, encode_sensor_binary, encode_sensor_multi_binary
+)
+
+
+class TestPayloadCodec:
+    """Test cases for JSON and binary sensor payloads."""
+
+    def test_binary_sensor_round_trip(self):
+        """Test that a binary record decodes into the JSON sensor layout."""
+        record = encode_sensor_binary(23.4, 1760000000123456, quality=90, boot=7, seq=1041)
+
+        assert len(record) == 23
+        payload = decode_payload(record, CONTENT_TYPE_SENSOR_BINARY)
+        assert payload["ts_us"] == 1760000000123456
+        assert payload["time_synced"] is True
+        assert payload["value"] == {"reading": 23.4, "quality": 90}
+        assert (payload["boot"], payload["seq"]) == (7, 1041)
+
+    def test_binary_sensor_unsynced_and_v1(self):
+        """Test that boot-relative v2 records and legacy v1 records keep a ms timestamp."""
+        unsynced = decode_payload(encode_sensor_binary(1.0, 5000000, time_synced=False),
+                                  CONTENT_TYPE_SENSOR_BINARY)
+        legacy = decode_payload(struct.pack("<BfIB", 1, 2.0, 123456, 100),
+                                CONTENT_TYPE_SENSOR_BINARY)
+        unsequenced = decode_payload(struct.pack("<BfqBB", 2, 3.0, 1760000000000000, 1, 100),
+                                     CONTENT_TYPE_SENSOR_BINARY)
+
+        assert unsynced["time_synced"] is False
+        assert unsynced["timestamp"] == 5000
+        assert legacy["timestamp"] == 123456
+        assert "time_synced" not in legacy
+        assert unsequenced["ts_us"] == 1760000000000000 and "seq" not in unsequenced
+
+    def test_aligned_flag(self):
+        """Test that readings taken on an aligned slot are flagged and keyed by the slot."""
+        from mcp_mqtt_bridge.timezone_utils import message_bucket_us
+
+        single = decode_payload(encode_sensor_binary(21.0, 1760000010000000, aligned=True),
+                                CONTENT_TYPE_SENSOR_BINARY)
+        multi = decode_payload(encode_sensor_multi_binary([1.0, 2.0], 1760000010000000, aligned=True),
+                               CONTENT_TYPE_SENSOR_MULTI_BINARY)
+        plain = decode_payload(encode_sensor_binary(21.0, 1760000010001234), CONTENT_TYPE_SENSOR_BINARY)
+
+        assert single["aligned"] is True and multi["aligned"] is True
+        assert message_bucket_us(single) == message_bucket_us(multi) == 1760000010000000
+        assert "aligned" not in plain and message_bucket_us(plain) is None
+        assert message_bucket_us({"ts_us": 10000000, "time_synced": False, "aligned": True}) is None
+
+    def test_invalid_binary_record_rejected(self):
+        """Test that unknown record versions and truncated records are rejected."""
+        record = encode_sensor_binary(1.0, 0)
+
+        with pytest.raises(PayloadDecodeError):
+            decode_payload(b"\x09" + record[1:], CONTENT_TYPE_SENSOR_BINARY)
+        with pytest.raises(PayloadDecodeError):
+            decode_payload(record[:-1], CONTENT_TYPE_SENSOR_BINARY)
+
+    def test_multi_channel_record_is_one_reading(self):
+        """Test that a multi-channel record decodes into one reading named from the capabilities."""
+        record = encode_sensor_multi_binary([0.01, -0.02, 0.98], 1760000000123456, boot=3, seq=12)
+        payload = decode_payload(record, CONTENT_TYPE_SENSOR_MULTI_BINARY)
+        legacy = decode_payload(struct.pack("<BqBBB2f", 1, 1760000000123456, 1, 100, 2, 1.0, 2.0),
+                                CONTENT_TYPE_SENSOR_MULTI_BINARY)
+
+        assert len(record) == 20 + 3 * 4
+        assert payload["value"] == {"readings": [0.01, -0.02, 0.98], "quality": 100}
+        assert (payload["boot"], payload["seq"]) == (3, 12)
+        assert legacy["value"]["readings"] == [1.0, 2.0] and "seq" not in legacy
+        with pytest.raises(PayloadDecodeError):
+            decode_payload(record[:-1], CONTENT_TYPE_SENSOR_MULTI_BINARY)
+
+        manager = DeviceManager()
+        manager.update_device_capabilities("esp32_imu", {
+            "sensors": ["accelerometer"],
+            "metadata": {"accelerometer": {"channels": [
+                {"name": "x", "unit": "g"}, {"name": "y", "unit": "g"}, {"name": "z", "unit": "g"}
+            ]}}
+        })
+        reading = manager.update_sensor_reading("esp32_imu", "accelerometer", payload)
+
+        assert reading.channels == {"x": 0.01, "y": -0.02, "z": 0.98}
+        assert reading.value == 0.01
+
+    def test_manager_routes_by_content_type(self):
+        """Test that MQTTManager decodes v5 binary and v3.1.1 JSON messages alike."""
+        manager = MQTTManager("test_broker")
+        handler = MagicMock()
+        manager.add_message_handler("devices/+/sensors/+/data", handler)
+        topic = "devices/esp32_test/sensors/temperature/data"
+
+        binary_msg = SimpleNamespace(
+            topic=topic,
+            payload=encode_sensor_binary(21.5, 1000),
+            properties=SimpleNamespace(ContentType=CONTENT_TYPE_SENSOR_BINARY)
+        )
+        json_msg = SimpleNamespace(
+            topic=topic,
+            payload=b'{"timestamp": 2000, "value": {"reading": 22.0, "unit": "C"}}',
+            properties=None
+        )
+        manager._on_message(None, None, binary_msg)
+        manager._on_message(None, None, json_msg)
+        manager._drain_ingest()
+
+        assert handler.call_count == 2
+        assert handler.call_args_list[0][0][1]["value"]["reading"] == 21.5
+        assert handler.call_args_list[1][0][1]["value"]["unit"] == "C"